@@ -66,12 +66,140 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include <malloc.h>
 #include <math.h>
+#include <ctype.h>
+#include <limits.h>
+#include <float.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <sys/inotify.h>
+#define HAVE_EGL                                      // Headless rendering through EGL (--headless)
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only emit SSE/AVX instructions in functions compiled for them; MSVC always does
+#if defined(HAVE_X86_SIMD) && defined(__GNUC__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_SSSE3
+#define TARGET_AVX2
+#endif
 
 #include <gmtl/gmtl.h>
 
 #include <GL/glut.h>
+#include <GL/freeglut_ext.h>
+
+#ifdef HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+#endif
+
+// Tokens missing from the OpenGL 1.1 headers shipped with Windows
+#ifndef GL_TEXTURE_MAX_LEVEL
+#define GL_TEXTURE_MAX_LEVEL 0x813D
+#endif
+#ifndef GL_CLAMP_TO_EDGE
+#define GL_CLAMP_TO_EDGE 0x812F
+#endif
+#ifndef GL_TEXTURE_WRAP_R
+#define GL_TEXTURE_WRAP_R 0x8072
+#endif
+#ifndef GL_TEXTURE_CUBE_MAP
+#define GL_TEXTURE_CUBE_MAP 0x8513
+#define GL_TEXTURE_CUBE_MAP_POSITIVE_X 0x8515
+#endif
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#ifndef GL_FRAMEBUFFER
+#define GL_FRAMEBUFFER 0x8D40
+#define GL_RENDERBUFFER 0x8D41
+#define GL_COLOR_ATTACHMENT0 0x8CE0
+#define GL_DEPTH_ATTACHMENT 0x8D00
+#define GL_FRAMEBUFFER_COMPLETE 0x8CD5
+#endif
+#ifndef GL_DEPTH_COMPONENT24
+#define GL_DEPTH_COMPONENT24 0x81A6
+#endif
+#ifndef GL_ARRAY_BUFFER
+#define GL_ARRAY_BUFFER 0x8892
+#define GL_ELEMENT_ARRAY_BUFFER 0x8893
+#define GL_STATIC_DRAW 0x88E4
+#endif
+#ifndef GL_STREAM_DRAW
+#define GL_STREAM_DRAW 0x88E0
+#endif
+#ifndef GL_TEXTURE0
+#define GL_TEXTURE0 0x84C0
+#endif
+#ifndef GL_TEXTURE_COMPARE_MODE
+#define GL_TEXTURE_COMPARE_MODE 0x884C
+#define GL_TEXTURE_COMPARE_FUNC 0x884D
+#define GL_COMPARE_R_TO_TEXTURE 0x884E
+#endif
+#ifndef GL_CLAMP_TO_BORDER
+#define GL_CLAMP_TO_BORDER 0x812D
+#endif
+#ifndef GL_FRAMEBUFFER_BINDING
+#define GL_FRAMEBUFFER_BINDING 0x8CA6
+#endif
+#ifndef GL_RG32F
+#define GL_RG 0x8227
+#define GL_R32F 0x822E
+#define GL_RG32F 0x8230
+#endif
+#ifndef GL_UNIFORM_BUFFER
+#define GL_UNIFORM_BUFFER 0x8A11
+#endif
+#ifndef GL_VERTEX_SHADER
+#define GL_FRAGMENT_SHADER 0x8B30
+#define GL_VERTEX_SHADER 0x8B31
+#define GL_COMPILE_STATUS 0x8B81
+#define GL_LINK_STATUS 0x8B82
+#define GL_INFO_LOG_LENGTH 0x8B84
+#endif
 
 //|___________________
 //|
@@ -88,7 +216,9 @@ const float colour_light_lime_green[4] = { 0.20f, 0.57f, 0.45f, 1.0f };
 const float colour_dark_gray[4] = { 0.25f, 0.25f, 0.25f, 1.0f };
 const float colour_darker_gray[4] = { 0.17f, 0.17f, 0.17f, 1.0f };
 const float colour_light_red[4] = { 1.0f, 0.0f, 0.0f, 1.0f };
-const float colour_seaweed0[4] = { 0.8f, 0.9f, 0.9f, 0.5f };
+const float colour_seaweed0[4] = { 0.8f, 0.9f, 0.9f, 1.0f };
+const float colour_rock[4] = { 0.8f, 0.9f, 0.9f, 1.0f };
+const float colour_sandfloor[4] = { 0.3f, 0.5f, 0.8f, 1.0f };
 
 
 // Propeller dimensions (subpart)
@@ -104,11 +234,13 @@ const float P_HEIGHT = 1.5f;
 
 // Propeller transforms
 const gmtl::Point3f WING_POS(P_WIDTH * 3 / 4, -P_HEIGHT * 0.5, P_LENGTH / 2.5);     // Propeller position on the plane (w.r.t. plane's frame)
+const gmtl::Vec3f HEAD_POS(0, -0.1f * P_HEIGHT, 0.7f * P_LENGTH);                    // Head position on the shell
+const gmtl::Vec3f EYE_POS(0.8f, -0.20f, 1.15f);                                     // Right eye position on the head, mirrored for the left
 const float DELTA_ROTATION = 5.0f;                  // Propeller rotated by 5 degs per input
 
 // Plane transforms
-const gmtl::Vec3f PLANE_FORWARD(0, 0, 1.0f);            // Plane's forward translation vector (w.r.t. local frame)
-const float PLANE_ROTATION = 5.0f;                      // Plane rotated by 5 degs per input
+const gmtl::Vec3f PLANE_FORWARD(0, 0, 1.0f);            // Plane's forward translation vector (w.r.t. local frame), per key press
+const float PLANE_ROTATION = 5.0f;                      // Plane rotated by 5 degs per key press
 
 // Propeller dimensions (subpart)
 const float PP_WIDTH = 0.25f;
@@ -116,25 +248,474 @@ const float PP_LENGTH = 1.5f;
 
 // Propeller transforms
 const gmtl::Point3f PROPELLER_POS(P_WIDTH / 4, 0, 0);     // Propeller position on the plane (w.r.t. plane's frame)
-const float PROPELLER_ROTATION = 5.0f;                  // Propeller rotated by 5 degs per input
+const float PROPELLER_ROTATION = 5.0f;                  // Propeller rotated by 5 degs per key press
+
+// Simulation: the turtle, the light and the fleet move in fixed ticks on a thread of their own, and
+// frames draw them between the last two. Held keys count as presses at HELD_KEY_RATE, about the OS
+// key repeat they replace, and a tap released between two ticks as one press.
+const int SIM_RATE = 60;                                // Ticks per second
+const float SIM_TICK = 1.0f / SIM_RATE;                 // In seconds
+const int SIM_MAX_TICKS = 15;                           // Ticks caught up at once at most, so a stall does not snowball
+const float HELD_KEY_RATE = 30.0f;                      // Key presses a second a held key is worth
+const int SNAPSHOT_NEW = 4;                             // Flags the middle snapshot as not read yet
 
 // Camera's view frustum 
 const float CAM_FOV = 90.0f;                     // Field of view in degs
+const float CAM_NEAR = 0.1f;                     // Near and far clipping planes
+const float CAM_FAR = 1000.0f;
+
+const char* const WINDOW_TITLE = "Plane Episode 3";
 
 // Keyboard modifiers
 enum KeyModifier { KM_SHIFT = 0, KM_CTRL, KM_ALT };
 
 // Textures
 enum TextureID {
-	TID_SKYBACK = 0, TID_SKYLEFT, TID_SKYBOTTOM,
-	TID_SKYRIGHT, TID_SKYFRONT, TID_SKYTOP,
-	TID_SEAWEED, TID_ROCK, TID_SANDFLOOR,
+	TID_SKYBOX = 0,
+	TID_SCENERY,
 	TEXTURE_NB
 };  // Texture IDs, with the last ID indicating the total number of textures
 
+// Regions of the scenery atlas (TID_SCENERY)
+enum AtlasRegion { AR_SEAWEED = 0, AR_ROCK, AR_SANDFLOOR, ATLAS_REGION_NB };
+
+// How a texture is built from its source images
+enum TextureKind {
+	TK_IMAGE = 0,                       // A single image
+	TK_ATLAS,                           // Source images packed side by side, one region each
+	TK_CUBE                             // Cube map, one source image per face (+X, -X, +Y, -Y, +Z, -Z)
+};
+
+const int MAX_TEXTURE_SOURCES = 6;
+
+// Texture flags
+enum TextureFlag {
+	TF_COMPRESS = 1,                    // Compressed to BC1 by the bake step
+	TF_SRGB = 2                         // Colours are sRGB encoded: mip levels are filtered in linear light
+};
+
+// What the drawing code expects of each texture; the texture manifest supplies its source images,
+// flags and sampler settings
+struct TextureSlot {
+	const char* name;                   // Texture ID in the manifest; the texture cache is <name>.tex (cube maps: one per face)
+	TextureKind kind;
+	int source_nb;                      // Number of source images
+};
+
+// Indexed by TextureID
+const TextureSlot TEXTURE_SLOTS[TEXTURE_NB] = {
+	{ "skybox",  TK_CUBE,  6 },
+	{ "scenery", TK_ATLAS, ATLAS_REGION_NB }
+};
+
+const char* const TEXTURE_MANIFEST = "textures.txt";
+const int ASSET_POLL_MS = 250;                                  // Interval for checking the manifest and images for changes
+
+const unsigned char PLACEHOLDER_TEXEL[4] = { 51, 102, 179, 255 };  // Shown until a texture has been decoded
+const int TEXTURE_POLL_MS = 16;                                 // Interval for uploading finished decodes
+
+// Atlas packing: each region is surrounded by a gutter that repeats its edge pixels, so filtering
+// does not bleed neighbouring regions in. The mip chain stops once the gutter is down to one pixel.
+const int ATLAS_GUTTER = 8;
+const int ATLAS_MIP_LEVELS = 4;
+
+// Texture cache
+const char TEXCACHE_MAGIC[4] = { 'A', '4', 'T', 'X' };
+const uint32_t TEXCACHE_VERSION = 5;                            // Bump whenever the cache layout or contents change
+const int TEXCACHE_ALIGN = 64;                                  // Alignment of each mip level in the file
+const int MAX_MIP_LEVELS = 16;                                  // Enough for 32768x32768
+
+// Pixel conversion. Texels whose RGB channels are all within ALPHA_KEY_TOLERANCE of ALPHA_KEY become
+// transparent: this cuts the dark gaps (about 16% of the texels) out of the seaweed.
+const unsigned char ALPHA_KEY[3] = { 0, 0, 0 };
+const int ALPHA_KEY_TOLERANCE = 32;
+const GLfloat ALPHA_TEST_REF = 0.5f;                            // Alpha-keyed texels are drawn above this alpha
+const int LINEAR_BITS = 14;                                     // Precision of the linear channels mips are filtered in,
+const int LINEAR_MAX = (1 << LINEAR_BITS) - 1;                  // so the sum of a 2x2 box still fits 16 bits
+const unsigned int BENCH_CONVERT_SIZE = 2048;                   // --bench-convert image dimension
+const int BENCH_CONVERT_RUNS = 5;                               // Best of
+
+// Scenery index (bounding volume hierarchy, see BuildBVH())
+const int BVH_BINS = 16;                                        // Split candidates per axis
+const int BVH_LEAF_SIZE = 4;                                    // Nodes this small are never split
+const int BVH_MAX_LEAF_SIZE = 32;                               // Nodes larger than this are always split
+const float BVH_NODE_COST = 1.0f;                               // Cost of visiting a node, relative to testing an item
+const int BVH_MAX_DEPTH = 64;                                   // Deeper nodes become leaves, which bounds the traversal stacks
+const int BENCH_BVH_COUNT = 1000000;                            // --bench-bvh default object count
+const int BENCH_BVH_QUERIES = 200;                              // Queries of each kind
+const float BENCH_BVH_SIZE = 10000.0f;                          // Side of the cube the objects are spread over
+const int BENCH_QUAT_COUNT = 4096;                              // --bench-quat default pose count
+const int BENCH_QUAT_CALLS = 200;                               // Kernel calls timed together
+const float BENCH_QUAT_TOLERANCE = 1e-5f;                       // Largest difference from gmtl, poses being unit sized
+const int BENCH_FLEET_COUNT = 100000;                           // --bench-fleet default turtle count
+const int BENCH_FLEET_FRAMES = 20;                              // Frames timed together
+const int BENCH_FLOCK_COUNT = 50000;                            // --bench-flock default turtle count
+const int BENCH_FLOCK_TICKS = 60;                               // Ticks of 1/60 s timed, a second of schooling
+const int BENCH_FLOCK_CHECKS = 1000;                            // Turtles whose neighbours are checked against brute force
+
 // Skybox
 const float SB_SIZE = 1000.0f;                     // Skybox dimension
 
+// Meshes, built once by BuildMeshes() and scaled into place by the Draw functions
+enum MeshID {
+	MESH_CUBE = 0,                      // Unit cube, each face mapping a whole texture image
+	MESH_SEAWEED,                       // Unit quad in the XY plane
+	MESH_SANDFLOOR,                     // Unit quad in the XZ plane
+	MESH_CYLINDER,                      // Radius 1, height 1 along Y, open ended
+	MESH_CYLINDER_MEDIUM,               // The same with fewer slices, for levels of detail
+	MESH_CYLINDER_LOW,
+	MESH_SPHERE,                        // Radius 1
+	MESH_SPHERE_MEDIUM,                 // The same with fewer slices and stacks
+	MESH_SPHERE_LOW,
+	MESH_SKYBOX,                        // Cube from -1 to 1 with cube map directions and face colours
+	MESH_FRAME,                         // Unit X, Y and Z axes as coloured lines
+	MESH_STATIC_ROCKS,                  // Static world batches, in world space (BuildStaticWorld())
+	MESH_STATIC_SANDFLOORS,
+	MESH_ROCK_IMPOSTORS,                // Camera-facing quads of the distant rocks, rebuilt every frame
+	MESH_NB
+};
+
+// Mesh flags: vertex attributes beyond position, normal and 2D texture coordinates
+enum MeshFlag {
+	MF_UV3 = 1,                         // 3-component texture coordinates (cube map directions)
+	MF_COLOUR = 2                       // Per-vertex colours
+};
+
+// Levels of detail: the variant an object is drawn with, from the projected size of its bounding
+// sphere (see SelectLod())
+const int LOD_LEVELS = 3;
+const float LOD_HYSTERESIS = 0.2f;                 // Fraction of a threshold an object must cross it by to change level
+
+enum LodChainID { LOD_CANNON = 0, LOD_LIGHT, LOD_ROCKS, LOD_SEAWEEDS, LOD_CHAIN_NB };
+
+struct LodChain {
+	const char* name;
+	MeshID meshes[LOD_LEVELS];          // Mesh of each level, MESH_NB to skip drawing
+	float min_pixels[LOD_LEVELS];       // Projected diameter each level is used down to
+};
+
+// Indexed by LodChainID. Far seaweeds keep their quad but turn to face the camera
+const LodChain LOD_CHAINS[LOD_CHAIN_NB] = {
+	{ "cannon",   { MESH_CYLINDER, MESH_CYLINDER_MEDIUM, MESH_CYLINDER_LOW }, { 96.0f, 32.0f, 0.0f } },
+	{ "light",    { MESH_SPHERE, MESH_SPHERE_MEDIUM, MESH_SPHERE_LOW },       { 96.0f, 32.0f, 0.0f } },
+	{ "rocks",    { MESH_CUBE, MESH_ROCK_IMPOSTORS, MESH_NB },                { 64.0f, 1.0f, 0.0f } },
+	{ "seaweeds", { MESH_SEAWEED, MESH_SEAWEED, MESH_NB },                    { 96.0f, 1.0f, 0.0f } }
+};
+
+const int CYLINDER_SLICES[LOD_LEVELS] = { 10, 6, 4 };
+const int SPHERE_SLICES[LOD_LEVELS] = { 7, 5, 4 };
+const int SPHERE_STACKS[LOD_LEVELS] = { 7, 5, 3 };
+
+// Static world: scenery that never moves, merged into one mesh per material and texture
+enum StaticBatchID { BATCH_ROCKS = 0, BATCH_SANDFLOORS, STATIC_BATCH_NB };
+
+struct StaticBatch {
+	MeshID mesh;
+	AtlasRegion region;                 // Scenery atlas region the batch samples
+	const float* colour;                // Material (lit) or vertex (unlit) colour
+	GLfloat shininess;
+	bool lit;
+	LodChainID lod;                     // LOD_CHAIN_NB to always draw the full mesh
+};
+
+// Indexed by StaticBatchID
+const StaticBatch STATIC_BATCHES[STATIC_BATCH_NB] = {
+	{ MESH_STATIC_ROCKS,      AR_ROCK,      colour_rock,      10.0f, true,  LOD_ROCKS },
+	{ MESH_STATIC_SANDFLOORS, AR_SANDFLOOR, colour_sandfloor, 20.0f, false, LOD_CHAIN_NB }
+};
+
+const gmtl::Vec3f SCENERY_ORIGIN(-500.0f, 0.0f, -500.0f);       // Skybox corner the scenery is laid out from
+
+// Per-pixel lighting, for the lit draws of the render queue. The light and the materials of a frame
+// are uniform blocks, each filled once a frame (see SetLight() and SubmitRenderQueue()).
+enum UniformBinding { UB_LIGHT = 0, UB_MATERIALS, UB_POINT_LIGHTS };
+const int LIGHT_MAX_MATERIALS = 256;               // Materials block size, defined into the shaders by LightingSource()
+
+// Point lights: bioluminescent creatures drifting over the scenery, lit per pixel only. They are
+// binned every frame into clusters, the tiles of a screen grid cut into depth slices, so a fragment
+// only loops over the lights that reach its own cluster (see UpdatePointLights()).
+const int MAX_POINT_LIGHTS = 512;                  // PointLights block size, likewise
+const int DEFAULT_POINT_LIGHTS = 64;
+const float POINT_LIGHT_RADIUS = 40.0f;            // Average reach
+const float POINT_LIGHT_DRIFT = 20.0f;             // Distance the lights wander from their home
+const float POINT_LIGHT_SPEED = 0.5f;              // In radians per second
+const int CLUSTER_TILES_X = 32;
+const int CLUSTER_TILES_Y = 18;
+const int CLUSTER_SLICES = 32;
+const int CLUSTER_INDEX_WIDTH = 1024;              // Light index texture, so at most 256K indices a frame
+const int CLUSTER_INDEX_ROWS = 256;
+const int CLUSTER_RANGE_UNIT = 1;                  // Texture units of the cluster textures
+const int CLUSTER_INDEX_UNIT = 2;
+
+// Shadows of the movable light, per pixel only. The rocks and sandfloors never move, so their shadow
+// map is kept until the light moves; the turtle has a small overlay map of its own, fitted around it
+// and re-rendered when it moves. Fragments take the darker of the two (see UpdateShadowMaps()).
+enum ShadowMapID { SHADOW_STATIC = 0, SHADOW_TURTLE, SHADOW_MAP_NB };
+const int SHADOW_MAP_SIZES[SHADOW_MAP_NB] = { 2048, 512 };
+const int SHADOW_MAP_UNITS[SHADOW_MAP_NB] = { 3, 4 };      // Texture units of the shadow maps
+const float TURTLE_SHADOW_RADIUS = 8.0f;           // Around the turtle's origin, wings and cannon included
+const float SHADOW_NEAR = 0.5f;                    // Closest near plane of the light's frusta
+const float SHADOW_MAX_TAN = 4.0f;                 // Tangent of the widest half field of view of the light's frusta
+const float SHADOW_OFFSET_FACTOR = 2.0f;           // Depth offset of the casters, against shadow acne
+const float SHADOW_OFFSET_UNITS = 4.0f;
+
+// Prepended to the fragment shaders that light per pixel, after the version and the defines (see
+// LightingSource()). Without CLUSTERED, the point lights and their clusters are left out.
+const char* const LIGHT_SHADER = R"(
+layout(std140) uniform Light {
+	vec4 light_position;                // Eye space
+	vec4 light_ambient;
+	vec4 light_diffuse;
+	vec4 light_specular;
+	mat4 shadow_matrices[2];            // Eye space to the static and turtle shadow maps
+};
+
+#if CLUSTERED
+layout(std140) uniform PointLights {
+	vec4 point_lights[2 * MAX_POINT_LIGHTS];    // Eye space position and radius, then colour, of each light
+};
+
+uniform sampler2D light_clusters;       // First index and count of each cluster: a row of tiles per slice
+uniform sampler2D light_indices;        // Point lights of the clusters, back to back
+uniform vec4 cluster_grid;              // Tiles across and down, slices, light_indices width
+uniform vec4 cluster_scale;             // Tiles per pixel across and down, slices per log depth, slice of unit depth
+uniform float light_index_rows;         // light_indices height
+#endif
+uniform sampler2DShadow static_shadow;
+uniform sampler2DShadow turtle_shadow;
+
+// Light reaching an eye space position past the casters of a shadow map: 1 when lit, 0 in shadow.
+// Positions off the map are lit.
+float ShadowTerm(sampler2DShadow map, mat4 matrix, vec3 eye)
+{
+	vec4 coord = matrix * vec4(eye, 1.0);
+
+	if (coord.w <= 0.0) {
+		return 1.0;
+	}
+	coord.xyz /= coord.w;
+	return shadow2D(map, vec3(coord.xy, min(coord.z, 1.0))).r;
+}
+
+// Blinn-Phong terms of a light: diffuse factor, and highlight scaled by the material specular
+vec2 LightTerms(vec3 n, vec3 l, vec3 v, float shininess)
+{
+	float diffuse = max(dot(n, l), 0.0);
+
+	return vec2(diffuse, diffuse > 0.0 ? pow(max(dot(n, normalize(l + v)), 0.0), shininess) : 0.0);
+}
+
+// Lights a fragment the way the fixed-function pipeline lights a vertex with GL_LIGHT0: local
+// viewer, two-sided, without attenuation or global ambient, and shadowed. The point lights of the
+// fragment's cluster are added, fading out to their radius.
+vec3 ShadeFragment(vec3 eye, vec3 normal, vec3 colour, vec4 specular)
+{
+	vec3 n = normalize(gl_FrontFacing ? normal : -normal);
+	vec3 v = normalize(-eye);
+	float shadow = min(ShadowTerm(static_shadow, shadow_matrices[0], eye), ShadowTerm(turtle_shadow, shadow_matrices[1], eye));
+	vec2 terms = LightTerms(n, normalize(light_position.xyz - eye * light_position.w), v, specular.w) * shadow;
+	vec3 diffuse = terms.x * light_diffuse.rgb;
+	vec3 highlight = terms.y * light_specular.rgb;
+
+#if CLUSTERED
+	vec2 tile = min(floor(gl_FragCoord.xy * cluster_scale.xy), cluster_grid.xy - 1.0);
+	float slice = clamp(floor(log(-eye.z) * cluster_scale.z + cluster_scale.w), 0.0, cluster_grid.z - 1.0);
+	vec2 range = texture2D(light_clusters, vec2((tile.y * cluster_grid.x + tile.x + 0.5) / (cluster_grid.x * cluster_grid.y),
+		(slice + 0.5) / cluster_grid.z)).rg;
+
+	for (float i = range.x; i < range.x + range.y; ++i) {
+		int light = int(texture2D(light_indices, vec2((mod(i, cluster_grid.w) + 0.5) / cluster_grid.w,
+			(floor(i / cluster_grid.w) + 0.5) / light_index_rows)).r);
+		vec4 position = point_lights[light * 2];
+		vec3 to_light = position.xyz - eye;
+		float fade = max(1.0 - dot(to_light, to_light) / (position.w * position.w), 0.0);
+
+		terms = LightTerms(n, normalize(to_light), v, specular.w) * fade * fade;
+		diffuse += terms.x * point_lights[light * 2 + 1].rgb;
+		highlight += terms.y * point_lights[light * 2 + 1].rgb;
+	}
+#endif
+
+	return colour * (light_ambient.rgb + diffuse) + highlight * specular.rgb;
+}
+)";
+
+const char* const LIT_VERTEX_SHADER = R"(
+#version 120
+varying vec3 eye;                       // Eye space position
+varying vec3 normal;                    // Eye space, unnormalized
+varying vec2 uv;
+
+void main()
+{
+	vec4 position = gl_ModelViewMatrix * gl_Vertex;
+
+	eye = position.xyz;
+	normal = gl_NormalMatrix * gl_Normal;
+	uv = (gl_TextureMatrix[0] * gl_MultiTexCoord0).xy;
+	gl_Position = gl_ProjectionMatrix * position;
+}
+)";
+
+const char* const LIT_FRAGMENT_SHADER = R"(
+struct Material {
+	vec4 colour;                        // Ambient and diffuse
+	vec4 specular;                      // Shininess in w
+};
+
+layout(std140) uniform Materials {
+	Material materials[LIGHT_MAX_MATERIALS];
+};
+
+uniform int material;                   // Index in materials
+uniform bool textured;
+uniform sampler2D diffuse_map;
+varying vec3 eye;
+varying vec3 normal;
+varying vec2 uv;
+
+void main()
+{
+	vec4 colour = materials[material].colour;
+
+	colour.rgb = ShadeFragment(eye, normal, colour.rgb, materials[material].specular);
+	gl_FragColor = textured ? colour * texture2D(diffuse_map, uv) : colour;
+}
+)";
+
+// Some drivers alias the conventional vertex arrays onto generic attribute locations: gl_Vertex 0,
+// gl_Normal 2, gl_Color 3, gl_MultiTexCoord0 8. The instance attributes start past all of them.
+const GLuint INSTANCE_ATTRIB_FIRST = 9;
+
+// Seaweed field, drawn with a single instanced draw call where the context supports it. The shader
+// lights each fragment as LIT_FRAGMENT_SHADER does, and cuts the blades out along the texture's
+// alpha key.
+const float SEAWEED_WIDTH = 15.0f;
+enum SeaweedAttrib {                    // Vertex attribute locations, clear of the conventional arrays
+	SA_POS_YAW = INSTANCE_ATTRIB_FIRST,
+	SA_SIZE,
+	SA_TINT
+};
+
+const char* const SEAWEED_VERTEX_SHADER = R"(
+#version 120
+attribute vec4 pos_yaw;                 // Base position, yaw about Y in radians
+attribute vec2 size;                    // Width and length
+attribute vec4 tint;                    // Ambient and diffuse material colour
+uniform vec4 region;                    // Atlas region: u0, v0, width, height
+varying vec3 eye;
+varying vec3 normal;
+varying vec2 uv;
+varying vec4 colour;
+
+void main()
+{
+	float c = cos(pos_yaw.w), s = sin(pos_yaw.w);
+	vec3 local = gl_Vertex.xyz * vec3(size, 1.0);
+	vec3 local_normal = gl_Normal / vec3(size, 1.0);
+	vec4 position = gl_ModelViewMatrix * vec4(c * local.x + s * local.z + pos_yaw.x, local.y + pos_yaw.y,
+		c * local.z - s * local.x + pos_yaw.z, 1.0);
+
+	eye = position.xyz;
+	normal = gl_NormalMatrix * vec3(c * local_normal.x + s * local_normal.z, local_normal.y, c * local_normal.z - s * local_normal.x);
+	colour = tint;
+	uv = region.xy + gl_MultiTexCoord0.xy * region.zw;
+	gl_Position = gl_ProjectionMatrix * position;
+}
+)";
+
+const char* const SEAWEED_FRAGMENT_SHADER = R"(
+uniform sampler2D scenery;
+uniform float alpha_ref;
+uniform vec4 specular;                  // Shininess in w
+varying vec3 eye;
+varying vec3 normal;
+varying vec2 uv;
+varying vec4 colour;
+
+void main()
+{
+	vec4 texel = texture2D(scenery, uv);
+
+	if (texel.a <= alpha_ref) {
+		discard;
+	}
+	gl_FragColor = vec4(ShadeFragment(eye, normal, colour.rgb, specular), colour.a) * texel;
+}
+)";
+
+// Turtle fleet: autonomous turtles schooling over the scenery, held in an entity store (see
+// TurtleFleet). Their parts are drawn with one instanced draw per mesh where the context supports
+// it; the shader lights them as LIT_FRAGMENT_SHADER does.
+const int DEFAULT_FLEET_TURTLES = 1000;
+const int FLEET_SLOT_BITS = 22;                    // Handle bits naming the slot, so at most 4M turtles
+const float FLEET_SPEED = 10.0f;                   // Average swimming speed, in units per second
+const float FLEET_TURN = 0.3f;                     // Fastest yaw rate, in radians per second
+const float FLEET_WING_BEAT = 3.0f;                // In radians per second
+const float FLEET_WING_SWING = 25.0f;              // Wing beat amplitude, in degrees
+const float FLEET_CANNON_TURN = 20.0f;             // Cannon swivel, in degrees per second
+const float FLEET_CULL_RADIUS = 8.0f;              // Bounding sphere of a turtle around its origin, wings and cannon included
+const int FLEET_JOB_TURTLES = 512;                 // Turtles per job of UpdateFleet() and ExtractFleet()
+const int FLEET_WORK_FLOATS = 14;                  // Work floats per turtle of UpdateFleet(): turn, step, heading, steer
+const int FLEET_SCHOOLS = 4;                       // Turtles align with and close in on their own school only
+
+// Flocking of the fleet: each turtle steers away from those too close, along with its school and
+// towards its middle, and back into the scenery when it strays out
+const float FLOCK_RADIUS = 20.0f;                  // Turtles further apart ignore each other; also the hash cell size
+const float FLOCK_SEPARATION = 6.0f;               // Turtles closer than this swim apart
+const int FLOCK_MAX_NEIGHBOURS = 24;               // Neighbours a turtle heeds, so crowds cost no more than schools
+const float FLOCK_TURN = 1.5f;                     // Fastest steering, in radians per second
+const float FLOCK_SEPARATE = 1.5f;                 // Weights of the steering rules, against the heading's 1
+const float FLOCK_ALIGN = 0.5f;
+const float FLOCK_COHERE = 0.3f;
+const float FLOCK_CONTAIN = 2.0f;
+const int SPATIAL_HASH_LOAD = 2;                   // Spatial hash buckets per point, at least
+const int SPATIAL_HASH_CELL_BITS = 10;             // Bits of each cell coordinate kept to tell cells in a bucket apart
+enum FleetAttrib {                      // Vertex attribute locations, clear of the conventional arrays
+	FA_ROW0 = INSTANCE_ATTRIB_FIRST,
+	FA_ROW1,
+	FA_ROW2,
+	FA_TINT
+};
+
+const char* const FLEET_VERTEX_SHADER = R"(
+#version 120
+attribute vec4 row0;                    // Model matrix of the part, less its last row
+attribute vec4 row1;
+attribute vec4 row2;
+attribute vec4 tint;                    // Ambient and diffuse material colour
+varying vec3 eye;
+varying vec3 normal;
+varying vec4 colour;
+
+void main()
+{
+	vec4 position = gl_ModelViewMatrix * vec4(dot(row0, gl_Vertex), dot(row1, gl_Vertex), dot(row2, gl_Vertex), 1.0);
+
+	// The model matrix is a rotation times a scale along each axis: dividing by the squared scales
+	// makes it the inverse transpose
+	vec3 scale2 = row0.xyz * row0.xyz + row1.xyz * row1.xyz + row2.xyz * row2.xyz;
+	vec3 local_normal = gl_Normal / scale2;
+
+	eye = position.xyz;
+	normal = gl_NormalMatrix * vec3(dot(row0.xyz, local_normal), dot(row1.xyz, local_normal), dot(row2.xyz, local_normal));
+	colour = tint;
+	gl_Position = gl_ProjectionMatrix * position;
+}
+)";
+
+const char* const FLEET_FRAGMENT_SHADER = R"(
+uniform vec4 specular;                  // Shininess in w
+varying vec3 eye;
+varying vec3 normal;
+varying vec4 colour;
+
+void main()
+{
+	gl_FragColor = vec4(ShadeFragment(eye, normal, colour.rgb, specular), colour.a);
+}
+)";
+
 // Lighting
 const GLfloat NO_LIGHT[] = { 0.0, 0.0, 0.0, 1.0 };
 const GLfloat AMBIENT_LIGHT[] = { 0.3, 0.4, 0.5, 1.0 };
@@ -150,31 +731,582 @@ const GLfloat DARK_COL[] = { 0.1, 0.1, 0.1, 1.0 };
 const GLfloat MEDIUMWHITE_COL[] = { 0.7, 0.7, 0.7, 1.0 };
 const GLfloat SPECULAR_COL[] = { 0.3, 0.6, 1.0, 1.0 };
 
+//|___________________
+//|
+//| Types
+//|___________________
+
+// Texture as described by the texture manifest (see LoadTextureManifest())
+struct TextureDesc {
+	std::string name;                   // TextureSlot::name
+	TextureKind kind;                   // TextureSlot::kind
+	int source_nb;
+	std::string sources[MAX_TEXTURE_SOURCES];
+	unsigned int flags;                 // TextureFlag bits
+	unsigned int keyed_sources;         // Bit i set: sources[i] gets its alpha from ALPHA_KEY
+	GLenum filter;                      // GL_LINEAR or GL_NEAREST, mipmapped the same way
+	GLenum wrap;                        // GL_REPEAT or GL_CLAMP_TO_EDGE
+};
+
+// Vertex of every mesh: all attributes interleaved in a single buffer
+struct MeshVertex {
+	GLfloat pos[3];
+	GLfloat normal[3];
+	GLfloat uv[3];                      // Third component only used with MF_UV3
+	GLubyte colour[4];                  // Only used with MF_COLOUR
+};
+
+// Indexed mesh. The vertices and indices are kept in system memory too: they are drawn from there
+// when the context has no vertex buffer objects.
+struct Mesh {
+	GLenum mode;                        // GL_TRIANGLES or GL_LINES
+	unsigned int flags;                 // MeshFlag bits
+	std::vector<MeshVertex> vertices;
+	std::vector<GLushort> indices;
+	GLuint vbo;                         // Vertex and index buffers, 0 without vertex buffer objects
+	GLuint ibo;
+	GLuint vao;                         // Vertex array object capturing the arrays, 0 when not supported
+};
+
+// View frustum: six planes whose normals point inwards (see ExtractFrustum())
+struct Frustum {
+	gmtl::Planef planes[6];             // Left, right, bottom, top, near, far
+};
+
+// Scenery objects drawn and culled in a frame
+struct CullStats {
+	int visible;
+	int culled;
+};
+
+// Level of detail selections and vertices drawn in a frame
+struct LodStats {
+	int objects[LOD_CHAIN_NB][LOD_LEVELS];
+	int vertices;                       // Indices drawn, instances included
+};
+
+// Fixed-function state of a queued draw (see QueueMesh())
+struct DrawState {
+	GLuint texture;                     // 2D texture, 0 for none
+	int region;                         // AtlasRegion of the texture drawn, -1 for all of it
+	GLfloat colour[4];                  // Ambient and diffuse material when lit, current colour otherwise
+	GLfloat shininess;
+	bool lit;
+	bool alpha_test;                    // Cut out texels at or below ALPHA_TEST_REF
+};
+
+// Draw waiting in the render queue
+struct DrawCommand {
+	uint64_t key;                       // Sort key, see QueueMeshRange()
+	MeshID mesh;
+	GLuint first_index;
+	GLsizei index_count;
+	DrawState state;
+	GLfloat modelview[16];              // At the time of queueing
+	int material;                       // In render_materials
+};
+
+// GL state cache fields, bits of StateCache::known
+enum StateCacheField {
+	SC_LIGHTING = 1, SC_ALPHA_TEST = 2, SC_TEXTURE_2D = 4, SC_TEXTURE = 8, SC_REGION = 16,
+	SC_MATERIAL = 32, SC_SHININESS = 64, SC_SPECULAR = 128, SC_COLOUR = 256, SC_MESH = 512, SC_PROGRAM = 1024,
+	SC_MATERIAL_ID = 2048, SC_TEXTURED = 4096
+};
+
+// Shadow copy of the GL state the render queue sets, so that it only makes the calls that change it
+struct StateCache {
+	bool issue;                         // Make the GL calls, false to only count them
+	unsigned int known;                 // StateCacheField bits of the fields that hold the GL state
+	bool lighting;
+	bool alpha_test;
+	bool texture_2d;
+	GLuint texture;
+	int region;
+	GLfloat material[4];
+	GLfloat shininess;
+	GLfloat colour[4];
+	MeshID mesh;                        // Whose vertex arrays are bound
+	bool per_pixel;                     // lit_program is in use
+	int material_id;                    // Its uniforms
+	bool textured;
+	int requested;                      // State calls asked for
+	int issued;                         // Of which changed the state
+};
+
+// Render queue work in a frame
+struct RenderStats {
+	int draws;
+	int requested;                      // State calls the draws make setting their whole state
+	int unsorted;                       // Of which the state cache makes, in the order they are queued
+	int issued;                         // Of which it makes, sorted
+	int materials;                      // Distinct materials of the draws
+};
+
+// Light uniform block, in the std140 layout LIGHT_SHADER declares it with
+struct LightBlock {
+	GLfloat position[4];                // Eye space
+	GLfloat ambient[4];
+	GLfloat diffuse[4];
+	GLfloat specular[4];
+	GLfloat shadow_matrices[SHADOW_MAP_NB][16];     // Eye space to shadow map coordinates, column major
+};
+
+// Point light, drifting around its home position
+struct PointLight {
+	gmtl::Point3f home;                 // World space
+	float radius;                       // Reach, faded out to
+	GLfloat colour[4];
+	float phase;                        // Of the drift, in radians
+};
+
+// Point light in view this frame, to bin into clusters
+struct LightBounds {
+	int light;                          // In point_lights
+	float centre[3];                    // Eye space
+	float radius;
+	int first_slice;                    // Cluster slices it reaches
+	int last_slice;
+};
+
+// Shadow map of the movable light, and the light frustum it was last rendered with
+struct ShadowMap {
+	GLuint texture;                     // Depth texture, compared against in the shaders
+	GLuint fbo;
+	gmtl::Point3f light;                // Light position
+	gmtl::Matrix44f view;               // World to light space
+	gmtl::Matrix44f projection;
+	float tan_half;                     // Of the field of view
+	bool valid;                         // Rendered at least once
+};
+
+// Shadow map renders since startup
+struct ShadowStats {
+	int frames;
+	int renders[SHADOW_MAP_NB];
+	double render_ms;                   // Time spent issuing them
+};
+
+// Point light binning in a frame
+struct ClusterStats {
+	int lights;                         // In view
+	int indices;                        // Cluster and light pairs
+	int dropped;                        // Of which did not fit in the index texture
+	int most;                           // Lights in the busiest cluster
+	double bin_ms;                      // Time to move and bin the lights, uploads aside
+};
+
+// Material of a queued draw, in the std140 layout of the Materials uniform block in LIT_FRAGMENT_SHADER
+struct Material {
+	GLfloat colour[4];                  // Ambient and diffuse when lit, current colour otherwise
+	GLfloat specular[4];                // Shininess in the last element
+};
+
+// Scene graph: the turtle's parts and the cameras. Parents come before their children
+enum SceneNodeID {
+	NODE_WORLD_CAMERA = 0, NODE_TURTLE, NODE_TURTLE_CAMERA, NODE_HEAD, NODE_LEFT_EYE, NODE_RIGHT_EYE,
+	NODE_RIGHT_FRONT_WING, NODE_LEFT_FRONT_WING, NODE_RIGHT_BACK_WING, NODE_LEFT_BACK_WING, NODE_CANNON_BASE,
+	NODE_CANNON, SCENE_NODE_NB
+};
+
+// Indexed by SceneNodeID, -1 for nodes under the world
+const int SCENE_NODE_PARENTS[SCENE_NODE_NB] = {
+	-1, -1, NODE_TURTLE, NODE_TURTLE, NODE_HEAD, NODE_HEAD,
+	NODE_TURTLE, NODE_TURTLE, NODE_TURTLE, NODE_TURTLE, NODE_TURTLE,
+	NODE_CANNON_BASE
+};
+
+// Scene graph node: a transform relative to its parent, and the world matrix it makes, kept until
+// the transform or one of its ancestors' changes (see UpdateSceneGraph())
+struct SceneNode {
+	int parent;                         // SceneNodeID, -1 under the world
+	gmtl::Matrix44f local;
+	gmtl::Matrix44f world;
+	bool dirty;                         // local changed since world was computed
+	bool updated;                       // world was recomputed by the last UpdateSceneGraph()
+};
+
+// Jobs queued on a worker thread
+struct JobQueue {
+	std::mutex mutex;
+	std::deque<std::function<void()> > jobs;
+};
+
+// Work a thread did in ParallelFor() loops
+struct JobThreadStats {
+	int iterations;
+	int stolen;                         // Iterations taken from another thread's share
+	double busy_ms;                     // Running iterations
+};
+
+// Points bucketed by the cell of a uniform grid they fall in. The cells hash to the buckets, so the
+// grid needs no bounds; a bucket may hold the points of several cells. A row of cells along X hashes
+// to consecutive buckets, so the points of neighbouring cells are close together in points.
+struct SpatialHash {
+	float cell;                         // Cell size
+	uint32_t mask;                      // Number of buckets - 1, a power of two
+	std::vector<uint32_t> keys;         // Bucket of each point
+	std::vector<uint32_t> cells;        // Cell of each point, packed by SpatialHashCell()
+	std::vector<uint32_t> starts;       // First point of each bucket in points, then the point count
+	std::vector<int> points;            // Points sorted by bucket
+	std::vector<uint32_t> sorted_cells; // Their cells, in the same order
+};
+
+// Turtle of the fleet: the slot in the low FLEET_SLOT_BITS, the slot's generation above, so the
+// handle of a removed turtle never names the turtle reusing its slot. 0 names no turtle.
+typedef uint32_t TurtleHandle;
+
+// Components of the fleet's turtles held as floats, each in an array of its own (see TurtleFleet)
+enum FleetFloat {
+	FF_QX = 0, FF_QY, FF_QZ, FF_QW,     // Rotation, laid out as QuatArrays
+	FF_PX, FF_PY, FF_PZ,                // Position, as Vec3Arrays
+	FF_SPEED,                           // Along PLANE_FORWARD, in units per second
+	FF_TURN,                            // Yaw rate, in radians per second
+	FF_WING_PHASE,                      // Wing beat, in radians
+	FF_WING_RIGHT, FF_WING_LEFT,        // Sub-part angles, in degrees as wing_angle_right and co.
+	FF_CANNON_TOP, FF_CANNON,
+	FF_LAST_QX, FF_LAST_QY, FF_LAST_QZ, FF_LAST_QW,     // Rotation and position at the tick before, for
+	FF_LAST_PX, FF_LAST_PY, FF_LAST_PZ,                 // drawing the turtle in between
+	FLEET_FLOAT_NB
+};
+
+// Entity store of the turtle fleet. Every component is a dense array, indexed alike from 0 to the
+// turtle count, so the per-frame passes walk memory front to back. Removing a turtle moves the last
+// one into its place, so the arrays have no holes; they keep their capacity and the slots are
+// reused, so adding and removing turtles stops allocating once the fleet has been at its size.
+struct TurtleFleet {
+	std::vector<float> floats[FLEET_FLOAT_NB];     // Indexed by FleetFloat
+	std::vector<uint32_t> tints;        // Shell colour, as FleetInstance::tint
+	std::vector<unsigned char> schools; // School the turtle flocks with, below FLEET_SCHOOLS
+	std::vector<TurtleHandle> handles;  // Handle of each turtle
+	std::vector<uint32_t> slots;        // Index of the turtle in each slot
+	std::vector<uint32_t> generations;  // Generation of each slot, bumped when its turtle is removed
+	std::vector<uint32_t> free_slots;
+	std::vector<float> steps;           // Per-frame work arrays of UpdateFleet(), FLEET_WORK_FLOATS a turtle
+	SpatialHash hash;                   // Turtles by position, rebuilt by UpdateFleet()
+};
+
+// Part of a fleet turtle: one of the cubes or the cannon DrawTurtle() draws, offset and scaled in
+// the frame of one of the turtle's nodes. The cannon comes last.
+struct FleetPart {
+	SceneNodeID node;
+	GLfloat offset[3];
+	GLfloat scale[3];
+	const float* colour;                // NULL for the turtle's shell colour
+};
+
+const int FLEET_PART_NB = 15;
+const FleetPart FLEET_PARTS[FLEET_PART_NB] = {
+	{ NODE_TURTLE,           { 0, 0, 0 }, { P_WIDTH * 1.5f, P_HEIGHT * 2, P_LENGTH * 1.5f }, NULL },
+	{ NODE_TURTLE,           { 0, 0, 0 }, { P_WIDTH * 1.65f, P_HEIGHT * 2.2f, P_LENGTH * 0.3f }, colour_darker_gray },
+	{ NODE_HEAD,             { 0, 0, 0 }, { 0.7f * P_WIDTH, 0.85f * P_HEIGHT, 0.7f * P_LENGTH }, colour_lime_green },
+	{ NODE_LEFT_EYE,         { 0, 0, 0 }, { 0.11f * P_WIDTH, 0.11f * P_HEIGHT, 0.06f * P_LENGTH }, colour_darker_gray },
+	{ NODE_RIGHT_EYE,        { 0, 0, 0 }, { 0.11f * P_WIDTH, 0.11f * P_HEIGHT, 0.06f * P_LENGTH }, colour_darker_gray },
+	{ NODE_RIGHT_FRONT_WING, { 0, 0, 0 }, { WING_WIDTH, WING_HEIGHT, WING_LENGTH }, colour_lime_green },
+	{ NODE_RIGHT_FRONT_WING, { WING_WIDTH * 0.5f, 0, 0 }, { WING_WIDTH * 0.8f, WING_HEIGHT * 0.8f, WING_LENGTH * 0.8f }, colour_lime_green },
+	{ NODE_LEFT_FRONT_WING,  { 0, 0, 0 }, { WING_WIDTH, WING_HEIGHT, WING_LENGTH }, colour_lime_green },
+	{ NODE_LEFT_FRONT_WING,  { -WING_WIDTH * 0.5f, 0, 0 }, { WING_WIDTH * 0.8f, WING_HEIGHT * 0.8f, WING_LENGTH * 0.8f }, colour_lime_green },
+	{ NODE_RIGHT_BACK_WING,  { 0, 0, 0 }, { WING_WIDTH_SMALL, WING_HEIGHT, WING_LENGTH }, colour_lime_green },
+	{ NODE_RIGHT_BACK_WING,  { WING_WIDTH_SMALL * 0.5f, 0, 0 }, { WING_WIDTH_SMALL * 0.8f, WING_HEIGHT * 0.8f, WING_LENGTH * 0.8f }, colour_lime_green },
+	{ NODE_LEFT_BACK_WING,   { 0, 0, 0 }, { WING_WIDTH_SMALL, WING_HEIGHT, WING_LENGTH }, colour_lime_green },
+	{ NODE_LEFT_BACK_WING,   { -WING_WIDTH_SMALL * 0.5f, 0, 0 }, { WING_WIDTH_SMALL * 0.8f, WING_HEIGHT * 0.8f, WING_LENGTH * 0.8f }, colour_lime_green },
+	{ NODE_CANNON_BASE,      { 0, 0, 0 }, { P_WIDTH, P_HEIGHT * 2, P_LENGTH }, colour_dark_gray },
+	{ NODE_CANNON,           { 0, -WING_HEIGHT * 3, -WING_LENGTH * 0.5f }, { WING_WIDTH * 0.14f, WING_HEIGHT * 7, WING_WIDTH * 0.14f }, colour_dark_gray }
+};
+
+// Instanced draws of the fleet: the cubes, then the cannons at each level of detail
+const int FLEET_BATCH_NB = 1 + LOD_LEVELS;
+
+// Part of a fleet turtle, as one instance of its batch
+struct FleetInstance {
+	GLfloat rows[3][4];                 // Model matrix, less its last row
+	GLubyte tint[4];                    // Material colour
+};
+
+// Fleet turtle in view this frame
+struct FleetVisible {
+	int turtle;                         // Index in the fleet's components
+	int cannon;                         // Index of its cannon in the batch of its level, -1 when not drawn
+};
+
+// Fleet work in a frame
+struct FleetStats {
+	int drawn;                          // Turtles in view
+	double update_ms;                   // UpdateFleet()
+	double hash_ms;                     // Its spatial hash rebuild
+	double steer_ms;                    // Its flocking
+	int neighbours;                     // Turtles heeded by its flocking, summed over the fleet
+	std::vector<JobThreadStats> threads;    // Its work on each thread, by job_thread
+	double extract_ms;                  // ExtractFleet()
+};
+
+// Object baked into a static world batch
+struct StaticObject {
+	gmtl::AABoxf bounds;                // World space
+	GLuint first_index;                 // Range of the batch's indices that draws the object
+	GLsizei index_count;
+};
+
+// Bounding volume hierarchy node. A node and its descendants cover a contiguous range of BVH::items
+struct BVHNode {
+	gmtl::AABoxf bounds;
+	int first;                          // Range of BVH::items under the node
+	int count;
+	int right;                          // Right child, 0 for a leaf. The left child directly follows its parent
+};
+
+// Bounding volume hierarchy over a list of boxes (see BuildBVH())
+struct BVH {
+	std::vector<BVHNode> nodes;         // Root first, in depth first order
+	std::vector<int> items;             // Box indices
+};
+
+// Scenery object held by the scenery index
+struct SceneryItem {
+	int batch;                          // StaticBatchID, -1 for a seaweed
+	int index;                          // In static_objects[batch], or seaweed_instances
+};
+
+// Seaweed instance, relative to the corner of the skybox
+struct SeaweedInstance {
+	GLfloat pos_yaw[4];                 // Base position, yaw about Y in radians
+	GLfloat size[2];                    // Width and length
+	GLubyte tint[4];                    // Material colour
+};
+
+// Version of a file, or of all the source images of a texture image; zero when missing
+struct AssetStamp {
+	uint64_t size;
+	int64_t mtime;
+};
+
+// Read-only file mapping
+struct MappedFile {
+	const unsigned char* data;          // Start of the mapping
+	size_t size;                        // Number of bytes mapped
+};
+
+// P6 image viewed in place: pixels point into a read-only file mapping, so they can be handed to
+// glTexImage2D without an intermediate copy. Release with UnmapPPM().
+struct MappedPPM {
+	const unsigned char* pixels;        // First byte of the RGB raster (inside the mapping)
+	unsigned int width;                 // Width in pixels
+	unsigned int height;                // Height in pixels
+	MappedFile file;
+};
+
+// Texture cache file layout: TexCacheHeader, one TexCacheLevel per mip level, one TexCacheRegion per
+// atlas region, then the level data, each level starting on a TEXCACHE_ALIGN boundary
+struct TexCacheHeader {
+	char magic[4];                      // TEXCACHE_MAGIC
+	uint32_t version;                   // TEXCACHE_VERSION
+	uint32_t format;                    // GL pixel format of the levels
+	uint32_t width;                     // Level 0 dimensions
+	uint32_t height;
+	uint32_t levels;                    // Number of mip levels
+	uint32_t regions;                   // Number of atlas regions
+	uint32_t settings;                  // TextureSettingsHash() when baked
+	uint64_t source_size;               // Source images' total size and latest modification time when baked
+	int64_t source_mtime;
+};
+
+struct TexCacheLevel {
+	uint32_t width;
+	uint32_t height;
+	uint64_t offset;                    // From the start of the file
+	uint64_t size;                      // In bytes
+};
+
+struct TexCacheRegion {
+	uint32_t x;                         // Level 0 pixel rectangle, gutter excluded
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+};
+
+// One mip level of a decoded texture
+struct TexLevel {
+	unsigned int width;
+	unsigned int height;
+	const unsigned char* pixels;
+	size_t size;                        // In bytes
+};
+
+// Texture image (a cube map face, or the whole texture otherwise) decoded by a worker thread,
+// waiting for the GL thread to upload it
+struct DecodedTexture {
+	TextureID id;
+	int layer;                          // Cube map face
+	int generation;                     // texture_generation when the decode was requested
+	bool ok;                            // false if the texture could not be loaded
+	bool from_cache;                    // Loaded from the texture cache rather than the source image
+	GLenum format;                      // GL pixel format of the levels
+	int levels;                         // Number of mip levels
+	TexLevel level[MAX_MIP_LEVELS];
+	int regions;                        // Number of atlas regions
+	TexCacheRegion region[MAX_TEXTURE_SOURCES];
+	MappedFile file;                    // Cache mapping that the levels point into
+	size_t mapped_bytes;                // Bytes mapped to load it: the cache, or else its source images
+	unsigned char* image;               // Level 0 (malloc'd) when decoded from the source images
+	unsigned char* mips;                // Generated mip levels (malloc'd) when not loaded from the cache
+	double decode_ms;                   // Time spent decoding on the worker
+};
+
+// Pixel conversion kernels for one instruction set. Every kernel handles any pixel count and gives the
+// same result as the scalar one.
+struct PixelKernels {
+	const char* name;
+	void (*expand_rgba)(const unsigned char* rgb, unsigned char* rgba, size_t count);
+	void (*alpha_key)(unsigned char* rgba, size_t count);
+	void (*downsample)(const uint16_t* src, unsigned int sw, unsigned int sh, uint16_t* dst);
+};
+
+// Quaternions and vectors for the pose kernels, one array per component, so a vector register holds
+// the same component of 4 or 8 poses
+struct QuatArrays {
+	float* x;
+	float* y;
+	float* z;
+	float* w;
+};
+struct Vec3Arrays {
+	float* x;
+	float* y;
+	float* z;
+};
+
+// Pose kernels for one instruction set: the quaternion and transform math of many poses per call.
+// Every kernel handles any count and gives the scalar kernel's result, within rounding.
+struct PoseKernels {
+	const char* name;
+	void (*quat_mul)(const QuatArrays& a, const QuatArrays& b, const QuatArrays& out, size_t count);
+	void (*rotate)(const QuatArrays& q, const Vec3Arrays& v, const Vec3Arrays& out, size_t count);
+	void (*to_matrix)(const QuatArrays& q, const Vec3Arrays& t, float* matrices, size_t count);
+	void (*normalize)(const QuatArrays& q, size_t count);
+};
+
+// Component and work arrays of UpdateFleet(), from one turtle on
+struct FleetArrays {
+	QuatArrays q;                       // Rotation
+	Vec3Arrays p;                       // Position
+	QuatArrays turn;                    // Wander this frame, in the turtle's frame
+	QuatArrays steer;                   // Flocking this frame, in the world frame
+	Vec3Arrays step;                    // Swim this frame
+	Vec3Arrays heading;                 // PLANE_FORWARD in the world frame
+};
+
+// State of the simulation after a tick, as the simulation thread hands it to the renderer. Filled
+// while only the simulation thread holds it, and read while only the render thread does.
+struct SimSnapshot {
+	long tick;                          // Ticks run
+	double time_ms;                     // Real time the tick was due, by GetTimeMs()
+	long key_events;                    // Key presses and releases the tick had seen
+	bool moving;                        // Anything moved in the tick
+	gmtl::Point4f plane_p, plane_p_last;    // Turtle pose after the tick, and before
+	gmtl::Quatf plane_q, plane_q_last;
+	float pp_angle;
+	float wing_angle_right, wing_angle_left, cannon_angle_top, cannon_angle_subsubpart;
+	gmtl::Point4f light_pos;
+	std::vector<float> fleet[FLEET_FLOAT_NB];  // Components of the fleet's turtles, as fleet.floats
+	std::vector<uint32_t> fleet_tints;
+};
+
 //|___________________
 //|
 //| Global Variables
 //|___________________
 
+// OpenGL entry points beyond 1.1, loaded by LoadGLExtensions()
+typedef void (APIENTRY* CompressedTexImage2DProc)(GLenum target, GLint level, GLenum internalformat, GLsizei width,
+	GLsizei height, GLint border, GLsizei imageSize, const void* data);
+typedef void (APIENTRY* GenObjectsProc)(GLsizei n, GLuint* ids);
+typedef void (APIENTRY* BindObjectProc)(GLenum target, GLuint id);
+typedef void (APIENTRY* RenderbufferStorageProc)(GLenum target, GLenum internalformat, GLsizei width, GLsizei height);
+typedef void (APIENTRY* FramebufferRenderbufferProc)(GLenum target, GLenum attachment, GLenum rb_target, GLuint rb);
+typedef void (APIENTRY* FramebufferTexture2DProc)(GLenum target, GLenum attachment, GLenum tex_target, GLuint texture, GLint level);
+typedef GLenum (APIENTRY* CheckFramebufferStatusProc)(GLenum target);
+typedef void (APIENTRY* BufferDataProc)(GLenum target, ptrdiff_t size, const void* data, GLenum usage);
+typedef void (APIENTRY* BindVertexArrayProc)(GLuint id);
+typedef void (APIENTRY* ObjectProc)(GLuint id);
+typedef GLuint (APIENTRY* CreateShaderProc)(GLenum type);
+typedef GLuint (APIENTRY* CreateProgramProc)(void);
+typedef void (APIENTRY* ShaderSourceProc)(GLuint shader, GLsizei count, const char* const* strings, const GLint* lengths);
+typedef void (APIENTRY* GetObjectivProc)(GLuint id, GLenum pname, GLint* params);
+typedef void (APIENTRY* GetInfoLogProc)(GLuint id, GLsizei size, GLsizei* length, char* log);
+typedef void (APIENTRY* AttachObjectProc)(GLuint program, GLuint id);
+typedef void (APIENTRY* BindAttribLocationProc)(GLuint program, GLuint index, const char* name);
+typedef GLint (APIENTRY* GetUniformLocationProc)(GLuint program, const char* name);
+typedef void (APIENTRY* Uniform1iProc)(GLint location, GLint v0);
+typedef void (APIENTRY* Uniform1fProc)(GLint location, GLfloat v0);
+typedef void (APIENTRY* Uniform4fProc)(GLint location, GLfloat v0, GLfloat v1, GLfloat v2, GLfloat v3);
+typedef void (APIENTRY* VertexAttribPointerProc)(GLuint index, GLint size, GLenum type, GLboolean normalized,
+	GLsizei stride, const void* pointer);
+typedef void (APIENTRY* ActiveTextureProc)(GLenum texture);
+typedef void (APIENTRY* BufferSubDataProc)(GLenum target, ptrdiff_t offset, ptrdiff_t size, const void* data);
+typedef void (APIENTRY* BindBufferBaseProc)(GLenum target, GLuint index, GLuint buffer);
+typedef GLuint (APIENTRY* GetUniformBlockIndexProc)(GLuint program, const char* name);
+typedef void (APIENTRY* UniformBlockBindingProc)(GLuint program, GLuint block, GLuint binding);
+typedef void (APIENTRY* DrawElementsInstancedProc)(GLenum mode, GLsizei count, GLenum type, const void* indices,
+	GLsizei instances);
+CompressedTexImage2DProc pglCompressedTexImage2D = NULL;
+GenObjectsProc pglGenFramebuffers = NULL;
+BindObjectProc pglBindFramebuffer = NULL;
+GenObjectsProc pglGenRenderbuffers = NULL;
+BindObjectProc pglBindRenderbuffer = NULL;
+RenderbufferStorageProc pglRenderbufferStorage = NULL;
+FramebufferRenderbufferProc pglFramebufferRenderbuffer = NULL;
+FramebufferTexture2DProc pglFramebufferTexture2D = NULL;
+CheckFramebufferStatusProc pglCheckFramebufferStatus = NULL;
+GenObjectsProc pglGenBuffers = NULL;
+BindObjectProc pglBindBuffer = NULL;
+BufferDataProc pglBufferData = NULL;
+GenObjectsProc pglGenVertexArrays = NULL;
+BindVertexArrayProc pglBindVertexArray = NULL;
+CreateShaderProc pglCreateShader = NULL;
+ShaderSourceProc pglShaderSource = NULL;
+ObjectProc pglCompileShader = NULL;
+GetObjectivProc pglGetShaderiv = NULL;
+GetInfoLogProc pglGetShaderInfoLog = NULL;
+ObjectProc pglDeleteShader = NULL;
+CreateProgramProc pglCreateProgram = NULL;
+AttachObjectProc pglAttachShader = NULL;
+BindAttribLocationProc pglBindAttribLocation = NULL;
+ObjectProc pglLinkProgram = NULL;
+GetObjectivProc pglGetProgramiv = NULL;
+GetInfoLogProc pglGetProgramInfoLog = NULL;
+ObjectProc pglUseProgram = NULL;
+GetUniformLocationProc pglGetUniformLocation = NULL;
+Uniform1iProc pglUniform1i = NULL;
+Uniform1fProc pglUniform1f = NULL;
+Uniform4fProc pglUniform4f = NULL;
+ObjectProc pglEnableVertexAttribArray = NULL;
+VertexAttribPointerProc pglVertexAttribPointer = NULL;
+AttachObjectProc pglVertexAttribDivisor = NULL;
+ActiveTextureProc pglActiveTexture = NULL;
+BufferSubDataProc pglBufferSubData = NULL;
+BindBufferBaseProc pglBindBufferBase = NULL;
+GetUniformBlockIndexProc pglGetUniformBlockIndex = NULL;
+UniformBlockBindingProc pglUniformBlockBinding = NULL;
+DrawElementsInstancedProc pglDrawElementsInstanced = NULL;
+bool has_s3tc = false;                                 // BC1 textures can be uploaded
+bool has_fbo = false;                                  // Framebuffer objects (headless rendering, shadow maps)
+bool has_vbo = false;                                  // Vertex buffer objects (OpenGL 1.5)
+bool has_vao = false;                                  // Vertex array objects (OpenGL 3.0)
+bool has_glsl = false;                                 // Shaders (OpenGL 2.0)
+bool has_ubo = false;                                  // Uniform buffer objects (OpenGL 3.1)
+bool has_float_textures = false;                       // Float red and red-green textures (OpenGL 3.0), for the light clusters
+bool has_instancing = false;                           // Instanced arrays (OpenGL 3.3)
+bool headless = false;                                 // Rendering offscreen through EGL, without GLUT
+
 // Track window dimensions, initialized to 800x600
 int w_width = 800;
 int w_height = 600;
 
-// Plane pose (position-quaternion pair)
+// Plane pose (position-quaternion pair). The pose, the part angles and the simulation globals below
+// belong to the simulation thread once it runs; the renderer sees them through a SimSnapshot.
 gmtl::Point4f plane_p;      // Position (using explicit homogeneous form; see Quaternion example code)
 gmtl::Quatf plane_q;        // Quaternion
-
-// Plane pose (position-quaternion pair)
-gmtl::Point4f turtle_p2;      // Position for plane 2 (using explicit homogeneous form; see Quaternion example code)
-gmtl::Quatf plane_q2;        // Quaternion for plane 2
-
-// Quaternions to rotate plane
-gmtl::Quatf zrotp_q;        // Positive and negative Z rotations
-gmtl::Quatf zrotn_q;
-
-gmtl::Quatf xrotp_q;
-gmtl::Quatf xrotn_q;
-gmtl::Quatf yrotp_q;
-gmtl::Quatf yrotn_q;
+gmtl::Point4f plane_p_last; // Pose at the tick before, drawn interpolated towards plane_p and plane_q
+gmtl::Quatf plane_q_last;
 
 // Propeller rotation (subpart)
 float pp_angle = 0;         // Rotation angle
@@ -189,6 +1321,25 @@ float cannon_angle_subsubpart = 0; // subsub part propeller
 int mx_prev = 0, my_prev = 0;
 bool mbuttons[3] = { false, false, false };
 bool kmodifiers[3] = { false, false, false };
+std::atomic<bool> keys_down[256];       // Held, from KeyboardFunc() to KeyboardUpFunc()
+std::atomic<bool> keys_pressed[256];    // Pressed since the last tick, so a tap between ticks is a whole press
+std::atomic<long> key_events(0);        // Key presses and releases so far
+
+// Simulation thread, and the snapshots it hands the renderer through a triple buffer: it fills the
+// back snapshot and swaps it with the middle one, while the renderer swaps the middle one with the
+// front one it draws whenever the middle one is newer. Neither ever waits for the other.
+std::thread sim_thread;
+std::atomic<bool> sim_quit(false);
+SimSnapshot sim_snapshots[3];
+std::atomic<int> sim_middle(1);         // Index of the middle snapshot, | SNAPSHOT_NEW until the renderer takes it
+int sim_back = 0;                       // Index of the snapshot being filled, on the simulation thread
+int sim_front = 2;                      // Index of the snapshot being drawn, on the render thread
+long sim_drawn_tick = -1;               // Tick of the last snapshot drawn
+long sim_ticks = 0;                     // Ticks run
+long sim_key_events = 0;                // Key events the last tick had seen
+bool sim_moving = false;                // Anything moved in the last tick
+bool light_moving = false;              // The light moved in the last tick
+gmtl::Point4f sim_light_pos;            // Light position, drawn at light_pos
 
 // Cameras
 int cam_id = 0;                                // Selects which camera to view
@@ -198,13 +1349,138 @@ float elevation[2] = { -45.0f, -45.0f };                 // Elevation of the cam
 float azimuth[2] = { 15.0f,  15.0f };                 // Azimuth of the camera (in degs)
 
 // Lighting
-gmtl::Point4f light_pos(0.0, 5.0, 5.0, 1.0);
+gmtl::Point4f light_pos(0.0, 5.0, 5.0, 1.0);           // Of the snapshot drawn, once the simulation runs
 bool is_diffuse_on = true;
 bool is_ambient_on = true;
 bool is_specular_on = true;
 
+// Meshes
+Mesh meshes[MESH_NB];                                  // Indexed by MeshID
+
+// Static world
+std::vector<StaticObject> static_objects[STATIC_BATCH_NB];     // Objects of each batch, in index order
+
+// Seaweed field
+int seaweed_request = 0;                               // Number of seaweeds asked for with --seaweeds, 0 for the default field
+std::vector<SeaweedInstance> seaweed_instances;
+std::vector<SeaweedInstance> seaweed_visible;          // Instances that passed culling this frame
+GLuint seaweed_program = 0;                            // Instancing shader, 0 when drawn one by one
+GLint seaweed_region_loc = -1;                         // Its atlas region uniform
+GLuint seaweed_vbo = 0;                                // Instance buffer, refilled with the visible instances every frame
+GLuint seaweed_vao = 0;                                // Seaweed mesh and instance arrays
+
+// Turtle fleet
+int fleet_request = DEFAULT_FLEET_TURTLES;             // Number of turtles, set with --turtles
+TurtleFleet fleet;                                     // On the simulation thread once it runs
+std::vector<FleetVisible> fleet_visible;               // Turtles in view this frame, set by ExtractFleet()
+std::vector<float> fleet_matrices;                     // World matrix of each turtle drawn, 16 floats column major, likewise
+std::vector<float> fleet_poses;                        // Work arrays of ExtractFleet(), 7 floats a turtle: rotation, position
+std::vector<unsigned char> fleet_lods;                 // Current level of detail of each turtle's cannon
+std::vector<FleetInstance> fleet_instances[FLEET_BATCH_NB];    // Parts of the turtles in view, likewise
+GLuint fleet_program = 0;                              // Instancing shader, 0 when drawn one part at a time
+GLuint fleet_vbos[FLEET_BATCH_NB];                     // Instance buffer of each batch, refilled every frame
+GLuint fleet_vaos[FLEET_BATCH_NB];                     // Batch mesh and instance arrays
+GLint fleet_cluster_scale_loc = -1;
+FleetStats fleet_stats;                                // Of the last tick and the last frame drawn
+
+// Per-pixel lighting
+GLuint lit_program = 0;                                // 0 to light with the fixed-function pipeline
+bool clustered_lighting = false;                       // The programs shade the point lights, through their clusters
+GLint lit_material_loc = -1;                           // Its material index uniform
+GLint lit_textured_loc = -1;                           // Its textured uniform
+GLuint light_ubo = 0;                                  // Light uniform block, filled by SetLight()
+GLuint material_ubo = 0;                               // Materials uniform block, filled by SubmitRenderQueue()
+GLint lit_cluster_scale_loc = -1;                      // Cluster scale uniforms of lit_program, seaweed_program and fleet_program
+GLint seaweed_cluster_scale_loc = -1;
+
+// Point lights and their clusters
+int point_light_request = DEFAULT_POINT_LIGHTS;        // Number of point lights, set with --lights
+std::vector<PointLight> point_lights;
+std::vector<LightBounds> light_bounds;                 // Lights in view this frame
+GLfloat light_cluster_ranges[CLUSTER_SLICES][CLUSTER_TILES_X * CLUSTER_TILES_Y][2];     // First index and count of each cluster
+std::vector<GLfloat> slice_light_indices[CLUSTER_SLICES];      // Lights of each slice's clusters, filled by BinLightSlice()
+std::vector<GLfloat> light_indices;                    // Lights of all the clusters, as uploaded
+GLuint point_light_ubo = 0;                            // PointLights uniform block
+GLuint cluster_textures[2] = { 0, 0 };                 // Cluster ranges and light indices
+bool clusters_empty = true;                            // No cluster lists a light, as last uploaded
+ClusterStats cluster_stats;                            // Of the last frame drawn
+
+// Shadows
+ShadowMap shadow_maps[SHADOW_MAP_NB];
+ShadowStats shadow_stats;
+
+// Culling
+Frustum view_frustum;                                  // World space frustum of the frame being drawn
+CullStats cull_stats;                                  // Of the last frame drawn
+
+// Levels of detail
+float lod_pixels_per_unit = 1.0f;                      // Projected size of a unit at unit distance
+unsigned char cannon_lod = 0;                          // Current level of the cannon and the light marker
+unsigned char light_lod = 0;
+LodStats lod_stats;                                    // Of the last frame drawn
+
+// Render queue
+std::vector<DrawCommand> render_queue;                 // Draws since the last SubmitRenderQueue()
+std::vector<Material> render_materials;                // Materials of the queued draws, numbered for the sort keys
+RenderStats render_stats;                              // Of the last frame drawn
+
+// Scene graph
+SceneNode scene_nodes[SCENE_NODE_NB];                  // Indexed by SceneNodeID
+gmtl::Matrix44f scene_view;                            // View transform of the frame being drawn
+int scene_updates = 0;                                 // World matrices recomputed for the last frame drawn
+
+// Scenery index: the static objects and the seaweeds, see BuildSceneryIndex()
+std::vector<SceneryItem> scenery_items;
+std::vector<gmtl::AABoxf> scenery_bounds;              // World space, parallel to scenery_items
+BVH scenery_bvh;
+std::vector<int> scenery_visible;                      // Items in view_frustum, set by CullScenery()
+std::vector<char> static_visible[STATIC_BATCH_NB];     // Whether each static object is drawn in full, likewise
+std::vector<unsigned char> scenery_lod;                // Current level of each item
+
 // Textures
+TextureDesc texture_descs[TEXTURE_NB];                 // From the texture manifest; only changes while no decode is pending
 GLuint textures[TEXTURE_NB];                           // Textures
+int texture_levels[TEXTURE_NB];                        // Mip levels last uploaded, 1 for the placeholder
+int texture_generation[TEXTURE_NB][MAX_TEXTURE_SOURCES];   // Bumped by every decode request; older decodes are dropped
+float atlas_uv[ATLAS_REGION_NB][4] = {                 // Texture coordinates (u0, v0, u1, v1) of each atlas region
+	{ 0, 0, 1, 1 }, { 0, 0, 1, 1 }, { 0, 0, 1, 1 } };
+std::deque<DecodedTexture> decoded_textures;           // Decodes waiting for upload, in completion order
+std::mutex decoded_mutex;                              // Guards decoded_textures
+int textures_pending = 0;                              // Texture images still showing their placeholder
+double textures_start_ms = 0;                          // When texture loading started
+double textures_slowest_ms = 0;                        // Slowest single decode
+bool textures_loaded = false;                          // All textures have been through their first decode
+
+// Texture hot reload
+AssetStamp manifest_stamp;                             // Manifest version last loaded
+AssetStamp texture_stamps[TEXTURE_NB][MAX_TEXTURE_SOURCES];    // Source versions last decoded, per texture image
+bool assets_dirty = false;                             // Changes seen, not checked yet
+#if defined(_WIN32)
+HANDLE asset_watch = INVALID_HANDLE_VALUE;             // Change notification on the working directory
+#elif defined(__linux__)
+int asset_watch = -1;                                  // inotify descriptor watching the working directory
+#endif
+
+// Pixel conversion, set up by InitPixelConversion()
+PixelKernels pixel_kernels;                            // Fastest kernels the CPU supports
+PoseKernels pose_kernels;                              // Fastest kernels the CPU supports
+uint16_t srgb_to_linear[256];                          // 8-bit sRGB to LINEAR_BITS linear light
+uint16_t unorm_to_linear[256];                         // 8-bit to LINEAR_BITS, no transfer function
+unsigned char linear_to_srgb[LINEAR_MAX + 1];
+unsigned char linear_to_unorm[LINEAR_MAX + 1];
+
+// Worker threads. Each runs the jobs of its own queue newest first, and once that is empty steals
+// the oldest job of another's.
+std::vector<std::thread> workers;
+std::deque<JobQueue> worker_queues;                    // A queue per worker
+std::atomic<int> worker_pending(0);                    // Jobs queued and not yet taken
+std::atomic<unsigned> worker_next_queue(0);            // Queue of the next job submitted by another thread
+std::mutex worker_mutex;                               // Guards workers_quit, and worker_pending going up
+std::condition_variable worker_cv;                     // Signalled when a job is queued or on shutdown
+bool workers_quit = false;
+thread_local int job_thread = 0;                       // 1 + the index of the worker on the worker threads, 0 on the others
+thread_local std::vector<JobThreadStats> job_stats;    // Of each thread by job_thread, in the loops this thread ran,
+                                                       // reset by whoever reports them
 
 //|___________________
 //|
@@ -213,18 +1489,133 @@ GLuint textures[TEXTURE_NB];                           // Textures
 
 gmtl::Vec3f FindNormal(const gmtl::Point3f& p1, const gmtl::Point3f& p2, const gmtl::Point3f& p3);
 void InitTransforms();
+void InitSceneGraph();
+gmtl::Matrix44f RotationMatrix(float degrees, float x, float y, float z);
+void SetNodeLocal(SceneNodeID id, const gmtl::Matrix44f& local);
+void PoseTurtle(const SimSnapshot& snap, float alpha);
+void PoseTurtleParts(const SimSnapshot& snap);
+void PoseCameras();
+int UpdateSceneGraph();
+gmtl::Matrix44f InvertRigid(const gmtl::Matrix44f& m);
+void LoadNodeMatrix(const gmtl::Matrix44f& view, SceneNodeID id);
 void InitGL(void);
+void DrawScene();
+void DrawTurtle(const gmtl::Matrix44f& view, bool frames);
 void DisplayFunc(void);
+void IdleFunc(void);
+void StartSimulation();
+void StopSimulation();
+void SimulationThread();
+void SimulationTick();
+void FillSnapshot(SimSnapshot* snap);
+void PublishSnapshot(double time_ms);
+const SimSnapshot& LatestSnapshot();
 void KeyboardFunc(unsigned char key, int x, int y);
+void KeyboardUpFunc(unsigned char key, int x, int y);
 void MouseFunc(int button, int state, int x, int y);
 void MotionFunc(int x, int y);
 void ReshapeFunc(int w, int h);
 void DrawCoordinateFrame(const float l);
 void DrawPlaneBody(const float width, const float length, const float height);
 void DrawPropeller(const float width, const float length);
-void DrawSkybox(const float s);
+void DrawSkybox();
 void SetLight(const gmtl::Point4f& pos, const bool is_ambient, const bool is_diffuse, const bool is_specular);
+void InitPixelLighting();
+void InitPointLights(int count);
+GLint BindLightUniforms(GLuint program);
+int ClusterSlice(float depth);
+float ClusterSliceDepth(int slice);
+void BinLightSlice(int slice, float p00, float p11);
+void UpdatePointLights();
+void InitShadowMaps();
+gmtl::Matrix44f LightView(const gmtl::Point3f& light, const gmtl::Point3f& target);
+gmtl::Matrix44f LightProjection(float tan_half, float near, float far);
+void FitStaticShadowMap(const gmtl::Point3f& light);
+void FitTurtleShadowMap(const gmtl::Point3f& light);
+void RenderShadowMap(ShadowMapID id);
+void UpdateShadowMaps();
 void LoadPPM(const char* fname, unsigned int* w, unsigned int* h, unsigned char** data, const int mallocflag);
+bool MapFile(const char* fname, MappedFile* file);
+void UnmapFile(MappedFile* file);
+bool MapPPM(const char* fname, MappedPPM* img);
+void UnmapPPM(MappedPPM* img);
+bool GetFileStamp(const char* fname, uint64_t* size, int64_t* mtime);
+bool LoadTextureManifest(const char* fname, TextureDesc descs[TEXTURE_NB]);
+uint32_t TextureSettingsHash(const TextureDesc& desc);
+int TextureLayers(TextureID id);
+GLenum TextureTarget(TextureID id);
+std::string TextureLayerName(TextureID id, int layer);
+bool GetTextureStamp(TextureID id, int layer, uint64_t* size, int64_t* mtime);
+std::string TextureCachePath(TextureID id, int layer);
+void ExpandRGBA_Scalar(const unsigned char* rgb, unsigned char* rgba, size_t count);
+void AlphaKey_Scalar(unsigned char* rgba, size_t count);
+void Downsample_Scalar(const uint16_t* src, unsigned int sw, unsigned int sh, uint16_t* dst);
+#ifdef HAVE_X86_SIMD
+void ExpandRGBA_SSSE3(const unsigned char* rgb, unsigned char* rgba, size_t count);
+void AlphaKey_SSE2(unsigned char* rgba, size_t count);
+void Downsample_SSE2(const uint16_t* src, unsigned int sw, unsigned int sh, uint16_t* dst);
+void ExpandRGBA_AVX2(const unsigned char* rgb, unsigned char* rgba, size_t count);
+void AlphaKey_AVX2(unsigned char* rgba, size_t count);
+void Downsample_AVX2(const uint16_t* src, unsigned int sw, unsigned int sh, uint16_t* dst);
+#endif
+#ifdef HAVE_X86_SIMD
+void GetCPUFeatures(bool* has_ssse3, bool* has_avx2);
+#endif
+void InitPixelConversion();
+void ToLinear(const unsigned char* rgba, size_t count, const uint16_t* lut, uint16_t* dst);
+void FromLinear(const uint16_t* src, size_t count, const unsigned char* lut, unsigned char* rgba);
+void ConvertSourceImage(const MappedPPM& img, bool keyed, unsigned char* dst, size_t stride);
+int BenchConvert();
+int BenchBVH(int count);
+void QuatMul_Scalar(const QuatArrays& a, const QuatArrays& b, const QuatArrays& out, size_t count);
+void QuatRotate_Scalar(const QuatArrays& q, const Vec3Arrays& v, const Vec3Arrays& out, size_t count);
+void QuatToMatrix_Scalar(const QuatArrays& q, const Vec3Arrays& t, float* matrices, size_t count);
+void QuatNormalize_Scalar(const QuatArrays& q, size_t count);
+#ifdef HAVE_X86_SIMD
+void QuatMul_SSE2(const QuatArrays& a, const QuatArrays& b, const QuatArrays& out, size_t count);
+void QuatRotate_SSE2(const QuatArrays& q, const Vec3Arrays& v, const Vec3Arrays& out, size_t count);
+void QuatToMatrix_SSE2(const QuatArrays& q, const Vec3Arrays& t, float* matrices, size_t count);
+void QuatNormalize_SSE2(const QuatArrays& q, size_t count);
+void QuatMul_AVX2(const QuatArrays& a, const QuatArrays& b, const QuatArrays& out, size_t count);
+void QuatRotate_AVX2(const QuatArrays& q, const Vec3Arrays& v, const Vec3Arrays& out, size_t count);
+void QuatToMatrix_AVX2(const QuatArrays& q, const Vec3Arrays& t, float* matrices, size_t count);
+void QuatNormalize_AVX2(const QuatArrays& q, size_t count);
+#endif
+void InitPoseKernels();
+int BenchQuat(int count);
+void BuildMipChain(DecodedTexture* tex, int max_levels, bool srgb);
+void ReleaseDecodedTexture(DecodedTexture* tex);
+void LayoutAtlas(const MappedPPM* img, int count, TexCacheRegion* regions, unsigned int* w, unsigned int* h);
+bool ComposeAtlas(TextureID id, DecodedTexture* tex);
+bool DecodeSourceTexture(TextureID id, int layer, DecodedTexture* tex);
+bool LoadTextureCache(TextureID id, int layer, DecodedTexture* tex);
+bool WriteTextureCache(TextureID id, int layer, const DecodedTexture& tex);
+int BakeTextures();
+size_t TextureLevelSize(GLenum format, unsigned int w, unsigned int h);
+void DecodeBC1Block(const unsigned char block[8], unsigned char rgb[16][3]);
+void EncodeBC1Block(const unsigned char rgb[16][3], unsigned char block[8]);
+double CompressTextureBC1(DecodedTexture* tex);
+bool HasGLExtension(const char* name);
+void* GetGLProcAddress(const char* name);
+void LoadGLExtensions();
+bool WritePPM(const char* fname, int w, int h, const unsigned char* rgb);
+bool CreateHeadlessContext();
+int RunHeadless(int frames, int width, int height, const char* dump_prefix);
+double GetTimeMs();
+void StartWorkers(int count);
+void StopWorkers();
+void SubmitJob(const std::function<void()>& job);
+bool TakeJob(int worker, std::function<void()>* job);
+void ParallelFor(int count, const std::function<void(int)>& body);
+void DecodeTexture(TextureID id, int layer, int generation);
+void RequestTextureDecode(TextureID id, int layer);
+void ApplyTextureSampler(TextureID id);
+void UploadTexture(DecodedTexture& tex);
+int UploadDecodedTextures();
+void StartAssetWatch();
+bool PollAssetWatch();
+void CheckTextureAssets();
+void TextureTimerFunc(int value);
 
 
 void DrawTurtleShell(const float width, const float length, const float height);
@@ -232,9 +1623,69 @@ void DrawWing(const float width, const float length, const float height, const b
 void DrawCannon(const float width, const float length, const float height);
 void DrawCube(const float width, const float length, const float height, const float colours[4]);
 void DrawSeaweed(const float width, const float length, const float height, const float colours[4]);
-void DrawSandFloor(const float width, const float length);
-void DrawRock(const float s);
 void DrawSphere(float radius);
+void SetAtlasRegion(const float* uv);
+void AddMeshQuad(Mesh* mesh, const GLfloat pos[][3], const GLfloat normal[3], const GLfloat uv[][3], const GLubyte colour[4]);
+void BuildMeshes();
+void BuildCylinder(Mesh* mesh, int slices);
+void BuildSphere(Mesh* mesh, int slices, int stacks);
+void UploadMesh(Mesh* mesh);
+void StreamMesh(Mesh* mesh);
+void SetMeshArrays(const Mesh& mesh);
+void DrawMesh(MeshID id);
+void DrawMeshRange(MeshID id, GLuint first, GLsizei count);
+void BindMeshArrays(MeshID id);
+void DrawBoundMesh(MeshID id, GLuint first, GLsizei count);
+void QueueMesh(MeshID id, const DrawState& state);
+void QueueMeshRange(MeshID id, GLuint first, GLsizei count, const DrawState& state);
+bool StateChanged(StateCache* cache, StateCacheField field, bool differs);
+void ApplyDrawState(StateCache* cache, const DrawCommand& command);
+void SubmitRenderQueue();
+void SubmitRenderQueueDepth();
+void AppendMesh(Mesh* dst, const Mesh& src, const GLfloat offset[3], float yaw, const GLfloat scale[3]);
+void AddStaticObject(StaticBatchID batch, MeshID mesh, const GLfloat offset[3], float yaw, const GLfloat scale[3]);
+void BuildStaticWorld();
+void ExtractFrustum(Frustum* frustum);
+void MakeFrustum(const GLfloat clip[16], Frustum* frustum);
+bool ClassifyBox(const Frustum& frustum, const gmtl::AABoxf& box, unsigned int* planes);
+float BoxArea(const gmtl::AABoxf& box);
+void BuildBVH(BVH* bvh, const std::vector<gmtl::AABoxf>& bounds);
+void RefitBVH(BVH* bvh, const std::vector<gmtl::AABoxf>& bounds);
+void QueryBVHFrustum(const BVH& bvh, const std::vector<gmtl::AABoxf>& bounds, const Frustum& frustum, std::vector<int>* result);
+bool RayHitsBox(const gmtl::AABoxf& box, const gmtl::Rayf& ray, const float inv_dir[3], float max_t, float* t);
+int QueryBVHRay(const BVH& bvh, const std::vector<gmtl::AABoxf>& bounds, const gmtl::Rayf& ray, float max_t, float* t);
+bool SphereHitsBox(const gmtl::AABoxf& box, const gmtl::Spheref& sphere);
+void QueryBVHSphere(const BVH& bvh, const std::vector<gmtl::AABoxf>& bounds, const gmtl::Spheref& sphere, std::vector<int>* result);
+void BuildSceneryIndex();
+void CullScenery();
+float ProjectedSize(float radius);
+int SelectLod(LodChainID chain, float pixels, int current);
+void DrawStaticWorld();
+GLuint CompileShader(GLenum type, const char* source, const char* name);
+GLuint LinkProgram(const char* name, const char* vertex_source, const char* fragment_source, const char* const* attribs,
+	GLuint first_attrib);
+void BuildSeaweedField(int count);
+void DrawSeaweedField();
+void InitFleet(int count);
+TurtleHandle AddTurtle(const gmtl::Point3f& pos, float yaw, float speed, float turn, float phase, int school, const GLubyte tint[4]);
+int FindTurtle(TurtleHandle handle);
+bool RemoveTurtle(TurtleHandle handle);
+void UpdateFleet(float seconds);
+FleetArrays GetFleetArrays(size_t first);
+void ResetSpatialHash(SpatialHash* hash, size_t count, float cell);
+void HashPoint(SpatialHash* hash, size_t point, float x, float y, float z);
+uint32_t SpatialHashBucket(const SpatialHash& hash, int x, int y, int z);
+uint32_t SpatialHashCell(int x, int y, int z);
+void SortSpatialHash(SpatialHash* hash);
+int FindNeighbours(const SpatialHash& hash, const Vec3Arrays& p, int point, float radius, int* found, int max);
+int SteerTurtles(int job, float seconds);
+void TranslateRows(GLfloat m[3][4], float x, float y, float z);
+void RotateRows(GLfloat m[3][4], float c, float s, int axis);
+void PoseFleetParts(const SimSnapshot& snap, int k);
+void ExtractFleet(const SimSnapshot& snap, const Frustum& frustum, const gmtl::Point3f& eye, float alpha);
+void DrawFleet();
+int BenchFleet(int count);
+int BenchFlock(int count);
 
 //|____________________________________________________________________
 //|
@@ -274,27 +1725,217 @@ gmtl::Vec3f FindNormal(const gmtl::Point3f& p1,
 
 void InitTransforms()
 {
-	const float COSTHETA_D2 = cos(gmtl::Math::deg2Rad(PLANE_ROTATION / 2));  // cos() and sin() expect radians 
-	const float SINTHETA_D2 = sin(gmtl::Math::deg2Rad(PLANE_ROTATION / 2));
-
 	// Inits plane pose
 	plane_p.set(1.0f, 0.0f, 4.0f, 1.0f);
 	plane_q.set(0, 0, 0, 1);
+	plane_p_last = plane_p;
+	plane_q_last = plane_q;
+
+	InitSceneGraph();
+}
+
+//|____________________________________________________________________
+//|
+//| Function: InitSceneGraph
+//|
+//! \param None.
+//! \return None.
+//!
+//! Links the scene graph nodes to their parents and poses the head, the eyes and the cameras. The
+//! turtle and its parts are posed by every frame, from the simulation snapshot it draws. Every world
+//! matrix is computed by the next UpdateSceneGraph().
+//|____________________________________________________________________
+
+void InitSceneGraph()
+{
+	for (int id = 0; id < SCENE_NODE_NB; ++id) {
+		scene_nodes[id].parent = SCENE_NODE_PARENTS[id];
+		scene_nodes[id].dirty = true;
+		scene_nodes[id].updated = false;
+	}
+
+	// Head and eyes are fixed on the shell
+	SetNodeLocal(NODE_HEAD, gmtl::makeTrans<gmtl::Matrix44f>(HEAD_POS));
+	SetNodeLocal(NODE_LEFT_EYE, gmtl::makeTrans<gmtl::Matrix44f>(gmtl::Vec3f(-EYE_POS[0], EYE_POS[1], EYE_POS[2])));
+	SetNodeLocal(NODE_RIGHT_EYE, gmtl::makeTrans<gmtl::Matrix44f>(EYE_POS));
+
+	PoseCameras();
+}
+
+//|____________________________________________________________________
+//|
+//| Function: RotationMatrix
+//|
+//! \param degrees  [in] Rotation angle.
+//! \param x        [in] Rotation axis.
+//! \param y
+//! \param z
+//! \return The rotation, as glRotatef() would make it.
+//|____________________________________________________________________
+
+gmtl::Matrix44f RotationMatrix(float degrees, float x, float y, float z)
+{
+	return gmtl::makeRot<gmtl::Matrix44f>(gmtl::AxisAnglef(gmtl::Math::deg2Rad(degrees), x, y, z));
+}
+
+//|____________________________________________________________________
+//|
+//| Function: SetNodeLocal
+//|
+//! \param id     [in] Node to move.
+//! \param local  [in] Its transform relative to its parent.
+//! \return None.
+//!
+//! Marks the node dirty, so UpdateSceneGraph() recomputes its world matrix and its descendants',
+//! unless the transform is the one it had.
+//|____________________________________________________________________
+
+void SetNodeLocal(SceneNodeID id, const gmtl::Matrix44f& local)
+{
+	if (memcmp(local.getData(), scene_nodes[id].local.getData(), sizeof(GLfloat) * 16) != 0) {
+		scene_nodes[id].local = local;
+		scene_nodes[id].dirty = true;
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: PoseTurtle
+//|
+//! \param snap   [in] Simulation state to draw.
+//! \param alpha  [in] How far the frame is from the tick before to the snapshot's, 0 to 1.
+//! \return None.
+//!
+//! Moves the turtle's node alpha of the way from the snapshot's pose before its tick to its pose
+//! after. To be called every frame.
+//|____________________________________________________________________
+
+void PoseTurtle(const SimSnapshot& snap, float alpha)
+{
+	gmtl::Quatf q;
+	gmtl::Vec3f p;
+
+	gmtl::slerp(q, alpha, snap.plane_q_last, snap.plane_q);
+	for (int a = 0; a < 3; ++a) {
+		p[a] = snap.plane_p_last[a] + (snap.plane_p[a] - snap.plane_p_last[a]) * alpha;
+	}
+
+	SetNodeLocal(NODE_TURTLE, gmtl::makeTrans<gmtl::Matrix44f>(p) * gmtl::makeRot<gmtl::Matrix44f>(q));
+}
+
+//|____________________________________________________________________
+//|
+//| Function: PoseTurtleParts
+//|
+//! \param snap  [in] Simulation state to draw.
+//! \return None.
+//!
+//! Moves the wings and the cannon to the snapshot's wing_angle_right, wing_angle_left,
+//! cannon_angle_top and cannon_angle_subsubpart. To be called every frame.
+//|____________________________________________________________________
+
+void PoseTurtleParts(const SimSnapshot& snap)
+{
+	SetNodeLocal(NODE_RIGHT_FRONT_WING, gmtl::makeTrans<gmtl::Matrix44f>(gmtl::Vec3f(WING_POS[0], WING_POS[1], WING_POS[2])) *
+		RotationMatrix(snap.wing_angle_right, 0, 0, 1));
+	SetNodeLocal(NODE_LEFT_FRONT_WING, gmtl::makeTrans<gmtl::Matrix44f>(gmtl::Vec3f(-WING_POS[0], WING_POS[1], WING_POS[2])) *
+		RotationMatrix(snap.wing_angle_left, 0, 0, 1));
+	SetNodeLocal(NODE_RIGHT_BACK_WING, gmtl::makeTrans<gmtl::Matrix44f>(gmtl::Vec3f(WING_POS[0], WING_POS[1], -WING_POS[2])) *
+		RotationMatrix(snap.wing_angle_right, 0, 0, 1));
+	SetNodeLocal(NODE_LEFT_BACK_WING, gmtl::makeTrans<gmtl::Matrix44f>(gmtl::Vec3f(-WING_POS[0], WING_POS[1], -WING_POS[2])) *
+		RotationMatrix(snap.wing_angle_left, 0, 0, 1));
+
+	SetNodeLocal(NODE_CANNON_BASE, gmtl::makeTrans<gmtl::Matrix44f>(gmtl::Vec3f(0, P_HEIGHT, 0)) * RotationMatrix(snap.cannon_angle_top, 0, 1, 0));
+	SetNodeLocal(NODE_CANNON, gmtl::makeTrans<gmtl::Matrix44f>(gmtl::Vec3f(0, WING_LENGTH, 0)) *
+		RotationMatrix(snap.cannon_angle_subsubpart, 0, 1, 0) * RotationMatrix(-90, 1, 0, 0));
+}
+
+//|____________________________________________________________________
+//|
+//| Function: PoseCameras
+//|
+//! \param None.
+//! \return None.
+//!
+//! Moves the camera nodes to their azimuth, elevation and distance. To be called whenever one of
+//! them changes.
+//|____________________________________________________________________
+
+void PoseCameras()
+{
+	const SceneNodeID CAMERA_NODES[2] = { NODE_WORLD_CAMERA, NODE_TURTLE_CAMERA };
+
+	for (int cam = 0; cam < 2; ++cam) {
+		SetNodeLocal(CAMERA_NODES[cam], RotationMatrix(azimuth[cam], 0, 1, 0) * RotationMatrix(elevation[cam], 1, 0, 0) *
+			gmtl::makeTrans<gmtl::Matrix44f>(gmtl::Vec3f(0, 0, distance[cam])));
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: UpdateSceneGraph
+//|
+//! \param None.
+//! \return Number of world matrices recomputed.
+//!
+//! Recomputes the world matrices of the dirty nodes and their descendants, and leaves the others
+//! as they were. Parents come before their children in scene_nodes, so one pass does it.
+//|____________________________________________________________________
 
-	// Z rotations (roll)
-	zrotp_q.set(0, 0, SINTHETA_D2, COSTHETA_D2);      // +Z
-	zrotn_q = gmtl::makeConj(zrotp_q);                // -Z
+int UpdateSceneGraph()
+{
+	int updated = 0;
+
+	for (int id = 0; id < SCENE_NODE_NB; ++id) {
+		SceneNode& node = scene_nodes[id];
+		const SceneNode* parent = node.parent >= 0 ? &scene_nodes[node.parent] : NULL;
+
+		node.updated = node.dirty || (parent != NULL && parent->updated);
+		if (node.updated) {
+			node.world = parent != NULL ? parent->world * node.local : node.local;
+			node.dirty = false;
+			++updated;
+		}
+	}
+	return updated;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: InvertRigid
+//|
+//! \param m  [in] Rotation and translation, without scaling.
+//! \return The inverse transform.
+//|____________________________________________________________________
 
-	// X rotation (pitch)
-	xrotp_q.set(SINTHETA_D2, 0, 0, COSTHETA_D2);      // +X
+gmtl::Matrix44f InvertRigid(const gmtl::Matrix44f& m)
+{
+	gmtl::Matrix44f inverse;
 
-	// Y rotation (yaw)
-	yrotp_q.set(0, SINTHETA_D2, 0, COSTHETA_D2);      // +Y
+	// Transposed rotation, and the translation rotated back and negated
+	for (int r = 0; r < 3; ++r) {
+		for (int c = 0; c < 3; ++c) {
+			inverse(r, c) = m(c, r);
+		}
+		inverse(r, 3) = -(m(0, r) * m(0, 3) + m(1, r) * m(1, 3) + m(2, r) * m(2, 3));
+	}
+	return inverse;
+}
 
-	// TODO: Initializes the remaining transforms
+//|____________________________________________________________________
+//|
+//| Function: LoadNodeMatrix
+//|
+//! \param view  [in] View transform: scene_view, or a light's.
+//! \param id    [in] Node to draw in.
+//! \return None.
+//!
+//! Loads the view transform times the node's cached world matrix into the modelview matrix.
+//|____________________________________________________________________
 
-	xrotn_q = gmtl::makeConj(xrotp_q); // -
-	yrotn_q = gmtl::makeConj(yrotp_q); // -Y
+void LoadNodeMatrix(const gmtl::Matrix44f& view, SceneNodeID id)
+{
+	glLoadMatrixf((view * scene_nodes[id].world).getData());
 }
 
 //|____________________________________________________________________
@@ -309,9 +1950,7 @@ void InitTransforms()
 
 void InitGL(void)
 {
-	unsigned char* img_data;               // Texture image data
-	unsigned int  width;                   // Texture width
-	unsigned int  height;                  // Texture height
+	LoadGLExtensions();
 
 	glClearColor(0.7f, 0.7f, 0.7f, 1.0f);
 	glEnable(GL_DEPTH_TEST);
@@ -337,149 +1976,116 @@ void InitGL(void)
 	glEnable(GL_LIGHTING);
 	glEnable(GL_LIGHT0);
 
+	// Meshes are unit sized and scaled into place, so their normals need renormalizing
+	glEnable(GL_NORMALIZE);
+
+	// Alpha-keyed texels, for the draws that enable the alpha test
+	glAlphaFunc(GL_GREATER, ALPHA_TEST_REF);
+
+	//|___________________________________________________________________
+	//|
+	//| Setup meshes
+	//|___________________________________________________________________
+
+	InitPixelLighting();
+	InitPointLights(point_light_request);
+	InitShadowMaps();
+	BuildMeshes();
+	BuildSeaweedField(seaweed_request);
+	BuildSceneryIndex();
+	InitFleet(fleet_request);
+
 	//|___________________________________________________________________
 	//|
 	//| Setup texturing
 	//|___________________________________________________________________
 
-	  // Describe how data will be stored in memory
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	  // Describe how data will be stored in memory: RGBA texels keep every row 4-byte aligned
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
 	// Select the method for combining texture color with the lighting equation
 	  // (look up the third parameter)
 	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
 
-	// Generate and setup texture objects
+	// Generate texture objects with 1x1 placeholders so the window can render right away; the images
+	// are decoded in parallel on the worker threads and uploaded as they complete (UploadDecodedTextures)
+	textures_start_ms = GetTimeMs();
 	glGenTextures(TEXTURE_NB, textures);  // two colours: colour from texture, and colour from light eq
 	// can ask opengl to ignore light
 
-	// Skybox back wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_SKYBACK]);
-	LoadPPM("uw_back.ppm", &width, &height, &img_data, 1);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, img_data);
-	free(img_data);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-
-	// Skybox left wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_SKYLEFT]);
-	LoadPPM("uw_left.ppm", &width, &height, &img_data, 1);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, img_data);
-	free(img_data);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-
-	// Skybox top wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_SKYBOTTOM]);
-	LoadPPM("uw_bottom.ppm", &width, &height, &img_data, 1);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, img_data);
-	free(img_data);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-
-	// TODO: Initializes the remaining textures
-	// Skybox right wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_SKYRIGHT]);
-	LoadPPM("uw_right.ppm", &width, &height, &img_data, 1);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, img_data);
-	free(img_data);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-
-	// Skybox front wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_SKYFRONT]);
-	LoadPPM("uw_front.ppm", &width, &height, &img_data, 1);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, img_data);
-	free(img_data);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-
-	// Skybox top wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_SKYTOP]);
-	LoadPPM("uw_top.ppm", &width, &height, &img_data, 1);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, img_data);
-	free(img_data);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-
-	// Seaweed 0
-	glBindTexture(GL_TEXTURE_2D, textures[TID_SEAWEED]);
-	LoadPPM("seaweed0.ppm", &width, &height, &img_data, 1);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, img_data);
-	free(img_data);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-
-	// Rock
-	glBindTexture(GL_TEXTURE_2D, textures[TID_ROCK]);
-	LoadPPM("rock.ppm", &width, &height, &img_data, 1);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, img_data);
-	free(img_data);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-
-	//Sand floor texture
-	glBindTexture(GL_TEXTURE_2D, textures[TID_SANDFLOOR]);
-	LoadPPM("sand.ppm", &width, &height, &img_data, 1);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, img_data);
-	free(img_data);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	for (int id = 0; id < TEXTURE_NB; ++id) {
+		GLenum target = TextureTarget((TextureID)id);
+
+		glBindTexture(target, textures[id]);
+		texture_levels[id] = 1;
+		ApplyTextureSampler((TextureID)id);
+
+		for (int layer = 0; layer < TextureLayers((TextureID)id); ++layer) {
+			GLenum image_target = target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + layer : target;
+			glTexImage2D(image_target, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, PLACEHOLDER_TEXEL);
+
+			RequestTextureDecode((TextureID)id, layer);
+		}
+	}
 }
 
 //|____________________________________________________________________
 //|
-//| Function: DisplayFunc
+//| Function: DrawScene
 //|
 //! \param None.
 //! \return None.
 //!
-//! GLUT display callback function: called for every redraw event.
+//! Renders a frame into the current framebuffer: the window's back buffer, or the offscreen
+//! framebuffer when headless.
 //|____________________________________________________________________
 
-void DisplayFunc(void)
+void DrawScene()
 {
-	gmtl::AxisAnglef aa;    // Converts plane's quaternion to axis-angle form to be used by glRotatef()
-	gmtl::Vec3f axis;       // Axis component of axis-angle representation
-	float angle;            // Angle component of axis-angle representation
-
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	glMatrixMode(GL_PROJECTION);
 	glLoadIdentity();
-	gluPerspective(CAM_FOV, (float)w_width / w_height, 0.1f, 1000.0f);     // Check MSDN: google "gluPerspective msdn"
+	gluPerspective(CAM_FOV, (float)w_width / w_height, CAM_NEAR, CAM_FAR);     // Check MSDN: google "gluPerspective msdn"
 
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
 
+	// The frame draws the latest state the simulation thread has published, the turtles in between
+	// its tick and the one before, by the time since the tick was due
+	const SimSnapshot& snap = LatestSnapshot();
+	float alpha = (float)std::min(std::max((GetTimeMs() - snap.time_ms) / (SIM_TICK * 1000.0), 0.0), 1.0);
+	PoseTurtle(snap, alpha);
+	PoseTurtleParts(snap);
+	light_pos = snap.light_pos;
+	sim_drawn_tick = snap.tick;
+
 	//|____________________________________________________________________
 	//|
 	//| Setting up view transform by:
 	//| "move up to the world frame by composing all of the (inverse) transforms from the camera up to the world node"
+	//| The camera node's cached world matrix is that composition, inverted
 	//|____________________________________________________________________
 
-	switch (cam_id) {
-	case 0:
-		// For the world-relative camera
-		glTranslatef(0, 0, -distance[0]);
-		glRotatef(-elevation[0], 1, 0, 0);
-		glRotatef(-azimuth[0], 0, 1, 0);
-		break;
+	scene_updates = UpdateSceneGraph();
+	scene_view = InvertRigid(scene_nodes[cam_id == 0 ? NODE_WORLD_CAMERA : NODE_TURTLE_CAMERA].world);
 
-	case 1:
-		// For plane2's camera
-		glTranslatef(0, 0, -distance[1]);
-		glRotatef(-elevation[1], 1, 0, 0);
-		glRotatef(-azimuth[1], 0, 1, 0);
-
-		gmtl::set(aa, plane_q);                    // Converts plane's quaternion to axis-angle form to be used by glRotatef()
-		axis = aa.getAxis();
-		angle = aa.getAngle();
-		glRotatef(-gmtl::Math::rad2Deg(angle), axis[0], axis[1], axis[2]);
-		glTranslatef(-plane_p[0], -plane_p[1], -plane_p[2]);
-		break;
+	// Shadow maps of whatever moved since the last frame
+	UpdateShadowMaps();
+	glLoadMatrixf(scene_view.getData());
 
-	}
+	// Scenery outside the view is culled against the frustum of the world frame. Levels of detail
+	// are picked from projected sizes in pixels.
+	lod_pixels_per_unit = w_height / (2.0f * tanf(gmtl::Math::deg2Rad(CAM_FOV) / 2));
+	memset(&lod_stats, 0, sizeof(lod_stats));
+	memset(&render_stats, 0, sizeof(render_stats));
+	ExtractFrustum(&view_frustum);
+	CullScenery();
+	UpdatePointLights();
+
+	// The turtles of the fleet in view are posed
+	const gmtl::Matrix44f& camera = scene_nodes[cam_id == 0 ? NODE_WORLD_CAMERA : NODE_TURTLE_CAMERA].world;
+	ExtractFleet(snap, view_frustum, gmtl::Point3f(camera(0, 3), camera(1, 3), camera(2, 3)), alpha);
 
 	//|____________________________________________________________________
 	//|
@@ -497,262 +2103,446 @@ void DisplayFunc(void)
 
 	// World node: draws world coordinate frame
 	DrawCoordinateFrame(10);
-	DrawSkybox(SB_SIZE);
 
 	// World-relative camera:
 	if (cam_id != 0) {
-		glPushMatrix();
-		glRotatef(azimuth[0], 0, 1, 0);
-		glRotatef(elevation[0], 1, 0, 0);
-		glTranslatef(0, 0, distance[0]);
+		LoadNodeMatrix(scene_view, NODE_WORLD_CAMERA);
 		DrawCoordinateFrame(1);
-		glPopMatrix();
 	}
 
-	// Turtle 2 body:
-	glPushMatrix();
-		gmtl::set(aa, plane_q);                    // Converts plane's quaternion to axis-angle form to be used by glRotatef()
-		axis = aa.getAxis();
-		angle = aa.getAngle();
-		glTranslatef(plane_p[0], plane_p[1], plane_p[2]);
-		glRotatef(gmtl::Math::rad2Deg(angle), axis[0], axis[1], axis[2]);
-		DrawTurtleShell(P_WIDTH * 1.5, P_LENGTH * 1.5, P_HEIGHT * 2); // turtle plane base
-		DrawCoordinateFrame(3);
+	// Turtle 2 and its parts, each drawn with their node's cached world matrix
+	DrawTurtle(scene_view, true);
 
-		// Turtle 2's camera:
-		glPushMatrix();
-			glRotatef(azimuth[1], 0, 1, 0);
-			glRotatef(elevation[1], 1, 0, 0);
-			glTranslatef(0, 0, distance[1]);
-			DrawCoordinateFrame(1);
-		glPopMatrix();
-
-		//// head
-		glPushMatrix();
-			glTranslatef(0, -0.1f * P_HEIGHT, 0.7f * P_LENGTH);
-			DrawCube(0.7f * P_WIDTH, 0.7f * P_LENGTH, 0.85f * P_HEIGHT, colour_lime_green);
-
-			// left eye
-			glPushMatrix();
-				glTranslatef(-0.8f, -0.20f, 1.15f);
-				DrawCube(0.11f * P_WIDTH, 0.06f * P_LENGTH, 0.11f * P_HEIGHT, colour_darker_gray);
-			glPopMatrix();
+	// Back to the world frame
+	glLoadMatrixf(scene_view.getData());
 
-			// right eye
-			glPushMatrix();
-				glTranslatef(0.8f, -0.20f, 1.15f);
-				DrawCube(0.11f * P_WIDTH, 0.06f * P_LENGTH, 0.11f * P_HEIGHT, colour_darker_gray);
-			glPopMatrix();
-		glPopMatrix();
-
-		// Right front wing (subpart A):
-		glPushMatrix();
-			glTranslatef(WING_POS[0], WING_POS[1], WING_POS[2]);     // Positions propeller on the plane
-			glRotatef(wing_angle_right, 0, 0, 1);                    // Rotates propeller
-			DrawWing(WING_WIDTH, WING_LENGTH, WING_HEIGHT, true);
-			DrawCoordinateFrame(1);
-		glPopMatrix();
-
-		// Left front wing (subpart B):
-		glPushMatrix();
-			glTranslatef(-WING_POS[0], WING_POS[1], WING_POS[2]);     // Positions propeller on the plane
-			glRotatef(wing_angle_left, 0, 0, 1);                      // Rotates propeller
-			DrawWing(WING_WIDTH, WING_LENGTH, WING_HEIGHT, false);
-			DrawCoordinateFrame(1);
-		glPopMatrix();
-
-		// Right back wing (subpart A):
-		glPushMatrix();
-			glTranslatef(WING_POS[0], WING_POS[1], -WING_POS[2]);     // Positions propeller on the plane
-			glRotatef(wing_angle_right, 0, 0, 1);                     // Rotates propeller
-			DrawWing(WING_WIDTH_SMALL, WING_LENGTH, WING_HEIGHT, true);
-			DrawCoordinateFrame(1);
-		glPopMatrix();
-
-		// Left back wing (subpart B):
-		glPushMatrix();
-			glTranslatef(-WING_POS[0], WING_POS[1], -WING_POS[2]);     // Positions propeller on the plane
-			glRotatef(wing_angle_left, 0, 0, 1);                      // Rotates propeller
-			DrawWing(WING_WIDTH_SMALL, WING_LENGTH, WING_HEIGHT, false);
-			DrawCoordinateFrame(1);
-		glPopMatrix();
-
-		// Cannon base (subpart C):
-		glPushMatrix();
-			glTranslatef(0, P_HEIGHT, 0);     // Positions propeller on the plane
-			glRotatef(cannon_angle_top, 0, 1, 0);         // Rotates propeller   
-			DrawCube(P_WIDTH, P_LENGTH, P_HEIGHT * 2, colour_dark_gray);
-			DrawCoordinateFrame(1);
-
-			// Cannon (subpart C):
-			glPushMatrix();
-				glTranslatef(0, WING_LENGTH, 0);     // Positions propeller at the top
-				glRotatef(cannon_angle_subsubpart, 0, 1, 0);         // Rotates propeller   
-				glRotatef(-90, 1, 0, 0);         // Rotates propeller   
-				DrawCannon(WING_WIDTH, WING_LENGTH, WING_HEIGHT);
-				DrawCoordinateFrame(1);
-			glPopMatrix();
-		glPopMatrix();
-	glPopMatrix();
+	// Turtle fleet, a draw call per batch of parts
+	DrawFleet();
 
-	// Initialize position to be at the edge of the skybox
-	glTranslatef(-500.0f, 0.0f, -500.0f);
+	// Draw the rocks and sandfloors, baked in world space
+	DrawStaticWorld();
 
-	// Draw extra seaweeds with different textures
-	for (int i = 1; i < num_seaweeds; ++i) {
-		for (int j = 1; j < num_seaweeds; ++j) {
-			if (j*i % 5 != 0) { // semi-random
-				glPushMatrix();
-					glTranslatef(SB_SIZE / num_seaweeds * i + 50, -500, SB_SIZE / num_seaweeds * j + 50);
-					glRotatef(20.0f * i * j, 0.0f, 1.0f, 0.0f);
-				DrawSeaweed(15.0f, float((200 * i * j) % 700 + 100), 0.0f, colour_seaweed0);
-			glPopMatrix();
-			}
+	// Initialize position to be at the edge of the skybox
+	glTranslatef(SCENERY_ORIGIN[0], SCENERY_ORIGIN[1], SCENERY_ORIGIN[2]);
 
-		}
-	}
+	// Instanced seaweeds sample the scenery atlas, bound here as the render queue does not draw them
+	glBindTexture(GL_TEXTURE_2D, textures[TID_SCENERY]);
 
-	// Draw extra rocks with different textures
-	for (int i = 1; i < num_seaweeds; i += i * 2) {
-		for (int j = 1; j < num_seaweeds; j += i + 1) {
-			glPushMatrix();
-				glTranslatef(SB_SIZE / num_seaweeds * j, -475, SB_SIZE / num_seaweeds * i + j * SB_SIZE / num_seaweeds);
-				glRotatef(20.0f * i * j, 0.0f, 1.0f, 0.0f);
-				DrawRock(float(50 * j % 200));
-			glPopMatrix();
-		}
-	}
+	// Draw extra seaweeds with different textures, cut out along their alpha key
+	DrawSeaweedField();
 
-	// Draw sandfloors
-	for (int i = 1; i < num_seaweeds; i += i * 2) {
-		for (int j = 1; j < num_seaweeds; j += i + 1) {
-			glPushMatrix();
-			// Not sure what I'm doing, trying to do a semi-random position
-			glTranslatef(i * SB_SIZE / num_seaweeds, -SB_SIZE / 2 + 2, SB_SIZE / num_seaweeds * j);
-			glRotatef(20.0f * i * j, 0.0f, 1.0f, 0.0f);
-			DrawSandFloor(float(60 * i % 200), float(60 * i % 200));
-			glPopMatrix();
-		}
-	}
+	// Everything queued so far, sorted by state
+	SubmitRenderQueue();
 
-	glutSwapBuffers();                          // Replaces glFlush() to use double buffering
+	// Skybox last, behind everything drawn so far
+	DrawSkybox();
 }
 
 //|____________________________________________________________________
 //|
-//| Function: KeyboardFunc
+//| Function: DrawTurtle
 //|
-//! \param key    [in] Key code.
-//! \param x      [in] X-coordinate of mouse when key is pressed.
-//! \param y      [in] Y-coordinate of mouse when key is pressed.
+//! \param view    [in] View transform: scene_view, or a light's.
+//! \param frames  [in] Whether to draw the coordinate frames of the parts and of the turtle camera.
 //! \return None.
 //!
-//! GLUT keyboard callback function: called for every key press event.
+//! Queues turtle 2 and its parts for SubmitRenderQueue(), each drawn with their node's cached world
+//! matrix.
 //|____________________________________________________________________
 
-void KeyboardFunc(unsigned char key, int x, int y)
+void DrawTurtle(const gmtl::Matrix44f& view, bool frames)
 {
-	switch (key) {
-		//|____________________________________________________________________
-		//|
-		//| Camera switch
-		//|____________________________________________________________________
+	// Turtle 2 body:
+	LoadNodeMatrix(view, NODE_TURTLE);
+	DrawTurtleShell(P_WIDTH * 1.5, P_LENGTH * 1.5, P_HEIGHT * 2); // turtle plane base
+	if (frames) {
+		DrawCoordinateFrame(3);
 
-	case 'v': // Select camera to view
-		cam_id = (cam_id + 1) % 2;
-		printf("View camera = %d\n", cam_id);
-		break;
-	case 'b': // Select camera to control
-		camctrl_id = (camctrl_id + 1) % 2;
-		printf("Control camera = %d\n", camctrl_id);
-		break;
+		// Turtle 2's camera:
+		LoadNodeMatrix(view, NODE_TURTLE_CAMERA);
+		DrawCoordinateFrame(1);
+	}
 
-		//|____________________________________________________________________
-		//|
-		//| Plane controls
-		//|____________________________________________________________________
+	//// head
+	LoadNodeMatrix(view, NODE_HEAD);
+	DrawCube(0.7f * P_WIDTH, 0.7f * P_LENGTH, 0.85f * P_HEIGHT, colour_lime_green);
 
-	case 's': { // Forward translation of the plane (+Z translation)  
-		gmtl::Quatf v_q = plane_q * gmtl::Quatf(PLANE_FORWARD[0], PLANE_FORWARD[1], PLANE_FORWARD[2], 0) * gmtl::makeConj(plane_q);
-		plane_p = plane_p + v_q.mData;
-	} break;
-	case 'f': { // Backward translation of the plane (-Z translation)
-		gmtl::Quatf v_q = plane_q * gmtl::Quatf(-PLANE_FORWARD[0], -PLANE_FORWARD[1], -PLANE_FORWARD[2], 0) * gmtl::makeConj(plane_q);
-		plane_p = plane_p + v_q.mData;
-	} break;
+	// left eye
+	LoadNodeMatrix(view, NODE_LEFT_EYE);
+	DrawCube(0.11f * P_WIDTH, 0.06f * P_LENGTH, 0.11f * P_HEIGHT, colour_darker_gray);
 
-		// roll /////////////////
-	case 'e': // Rolls the plane (+Z rot)
-		plane_q = plane_q * zrotp_q;
-		break;
-	case 'q': // Rolls the plane (-Z rot)
-		plane_q = plane_q * zrotn_q;
-		break;
+	// right eye
+	LoadNodeMatrix(view, NODE_RIGHT_EYE);
+	DrawCube(0.11f * P_WIDTH, 0.06f * P_LENGTH, 0.11f * P_HEIGHT, colour_darker_gray);
 
-		// yaw /////////////////
-	case 'a': // Yaws the plane (+Y rot)
-		plane_q = plane_q * yrotp_q;
-		break;
-	case 'd': // Yaws the plane (-Y rot)
-		plane_q = plane_q * yrotn_q;
-		break;
+	// Right front wing (subpart A):
+	LoadNodeMatrix(view, NODE_RIGHT_FRONT_WING);
+	DrawWing(WING_WIDTH, WING_LENGTH, WING_HEIGHT, true);
+	if (frames) {
+		DrawCoordinateFrame(1);
+	}
 
-		// pitch /////////////////
-	case 'z': // Pitches the plane (+X rot)
-		plane_q = plane_q * xrotp_q;
-		break;
-	case 'c': // Pitches the plane (-X rot)
-		plane_q = plane_q * xrotn_q;
-		break;
+	// Left front wing (subpart B):
+	LoadNodeMatrix(view, NODE_LEFT_FRONT_WING);
+	DrawWing(WING_WIDTH, WING_LENGTH, WING_HEIGHT, false);
+	if (frames) {
+		DrawCoordinateFrame(1);
+	}
 
-		//|____________________________________________________________________
-		//|
-		//| Propeller controls (subpart)
-		//|____________________________________________________________________
+	// Right back wing (subpart A):
+	LoadNodeMatrix(view, NODE_RIGHT_BACK_WING);
+	DrawWing(WING_WIDTH_SMALL, WING_LENGTH, WING_HEIGHT, true);
+	if (frames) {
+		DrawCoordinateFrame(1);
+	}
 
-	case 'r': // Rotates propeller 
-		pp_angle += PROPELLER_ROTATION;
-		break;
+	// Left back wing (subpart B):
+	LoadNodeMatrix(view, NODE_LEFT_BACK_WING);
+	DrawWing(WING_WIDTH_SMALL, WING_LENGTH, WING_HEIGHT, false);
+	if (frames) {
+		DrawCoordinateFrame(1);
+	}
 
-		//|____________________________________________________________________
-		//|
-		//| Lighting controls
-		//|____________________________________________________________________
+	// Cannon base (subpart C):
+	LoadNodeMatrix(view, NODE_CANNON_BASE);
+	DrawCube(P_WIDTH, P_LENGTH, P_HEIGHT * 2, colour_dark_gray);
+	if (frames) {
+		DrawCoordinateFrame(1);
+	}
 
-	case 'i': // Light up (+Y translation)
-		light_pos[1]++;
-		printf("Light-Y = %.2f\n", light_pos[1]);
-		break;
-	case 'k': // Light down (-Y translation)
-		light_pos[1]--;
-		printf("Light-Y = %.2f\n", light_pos[1]);
-		break;
+	// Cannon (subpart C):
+	LoadNodeMatrix(view, NODE_CANNON);
+	DrawCannon(WING_WIDTH, WING_LENGTH, WING_HEIGHT);
+	if (frames) {
+		DrawCoordinateFrame(1);
+	}
+}
 
-	case '9': // Toggles diffuse light ON/OFF
-		is_diffuse_on = !is_diffuse_on;
-		printf("Light-diffuse = %s\n", is_diffuse_on ? "ON" : "OFF");
-		break;
+//|____________________________________________________________________
+//|
+//| Function: DisplayFunc
+//|
+//! \param None.
+//! \return None.
+//!
+//! GLUT display callback function: called for every redraw event.
+//|____________________________________________________________________
 
-		// TODO: Add the remaining controls/transforms
+void DisplayFunc(void)
+{
+	DrawScene();
+	glutSwapBuffers();                          // Replaces glFlush() to use double buffering
 
-	case 'o': // Light right (+X translation)
-		light_pos[0]++;
-		printf("Light-X = %.2f\n", light_pos[0]);
-		break;
+	// Culling statistics in the title bar
+	char title[128];
+	snprintf(title, sizeof(title), "%s - %d objects drawn, %d culled, %d vertices", WINDOW_TITLE, cull_stats.visible,
+		cull_stats.culled, lod_stats.vertices);
+	glutSetWindowTitle(title);
+}
 
-	case 'u': // Light left (-X translation)
-		light_pos[0]--;
-		printf("Light-X = %.2f\n", light_pos[0]);
-		break;
+//|____________________________________________________________________
+//|
+//| Function: IdleFunc
+//|
+//! \param None.
+//! \return None.
+//!
+//! GLUT idle callback function: redraws whenever the simulation has published a snapshot not drawn
+//! yet, and keeps redrawing while anything in it moves. Stops being called once nothing moves and
+//! no key is held or waits for a tick; KeyboardFunc() registers it again.
+//|____________________________________________________________________
+
+void IdleFunc(void)
+{
+	const SimSnapshot& snap = LatestSnapshot();
+	bool held = false;
+
+	if (snap.moving || snap.tick != sim_drawn_tick) {
+		glutPostRedisplay();
+		return;
+	}
+	for (int k = 0; k < 256; ++k) {
+		held = held || keys_down[k];
+	}
+	if (!held && snap.key_events == key_events) {
+		glutIdleFunc(NULL);
+		return;
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(1));      // Till the next tick
+}
+
+//|____________________________________________________________________
+//|
+//| Function: StartSimulation
+//|
+//! \param None.
+//! \return None.
+//!
+//! Publishes the state as it is, so the first frame has a snapshot to draw, and starts the
+//! simulation thread. From then on only that thread touches the simulation state.
+//|____________________________________________________________________
+
+void StartSimulation()
+{
+	static bool stop_registered = false;
+
+	sim_light_pos = light_pos;
+	PublishSnapshot(GetTimeMs());
+
+	sim_quit = false;
+	sim_thread = std::thread(SimulationThread);
+
+	// Run before StopWorkers(), registered earlier, whichever way the program ends
+	if (!stop_registered) {
+		atexit(StopSimulation);
+		stop_registered = true;
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: StopSimulation
+//|
+//! \param None.
+//! \return None.
+//!
+//! Lets the simulation thread finish its tick and joins it. StartSimulation() registers it with
+//! atexit(), since glutMainLoop() never returns and the headless run can give up halfway.
+//|____________________________________________________________________
+
+void StopSimulation()
+{
+	if (sim_thread.joinable()) {
+		sim_quit = true;
+		sim_thread.join();
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: SimulationThread
+//|
+//! \param None.
+//! \return None.
+//!
+//! Body of the simulation thread: runs a SimulationTick() every SIM_TICK of real time, and
+//! publishes a snapshot after each run of ticks. Ticks missed while the thread was held up are run
+//! back to back, SIM_MAX_TICKS at most, and the rest is dropped, so the simulation slows down after
+//! a stall rather than falling ever further behind. However long the frames take, the ticks keep
+//! their pace, and however long the ticks take, the frames keep drawing the last snapshot.
+//|____________________________________________________________________
+
+void SimulationThread()
+{
+	const double TICK_MS = SIM_TICK * 1000.0;
+	double next_ms = GetTimeMs() + TICK_MS;
+
+	while (!sim_quit) {
+		double now_ms = GetTimeMs();
+		int ticks = 0;
+
+		while (next_ms <= now_ms && ticks < SIM_MAX_TICKS) {
+			SimulationTick();
+			next_ms += TICK_MS;
+			++ticks;
+		}
+		if (ticks > 0) {
+			PublishSnapshot(next_ms - TICK_MS);
+		}
+		if (next_ms <= now_ms) {
+			next_ms = now_ms + TICK_MS;
+		}
+		std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(next_ms - GetTimeMs()));
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: SimulationTick
+//|
+//! \param None.
+//! \return None.
+//!
+//! Moves the world on by SIM_TICK: the turtle, its propeller and the light by the keys held or
+//! tapped since the last tick, a tap a whole press, and the turtle fleet. A key pressed just after
+//! a tick is seen by the next one, so input lags a tick behind at most, and the same keys over the
+//! same ticks always end in the same place whatever the frame rate. Runs on the simulation thread.
+//|____________________________________________________________________
+
+void SimulationTick()
+{
+	const float PRESSES = HELD_KEY_RATE * SIM_TICK;         // Key presses a tick of holding a key is worth
+	float presses[256];
+
+	// Events counted before the keys are read, so a snapshot never claims one it has not seen
+	sim_key_events = key_events;
+	for (int k = 0; k < 256; ++k) {
+		bool pressed = keys_pressed[k].exchange(false);
+		// A tap released before the tick is a whole press, as it was when each press moved a step
+		presses[k] = keys_down[k] ? PRESSES : pressed ? 1.0f : 0.0f;
+	}
+
+	plane_p_last = plane_p;
+	plane_q_last = plane_q;
+
+	// Roll (Z), yaw (Y) and pitch (X), in that order, each pair cancelling out when both are held
+	const int TURN_KEYS[3][3] = { { 2, 'e', 'q' }, { 1, 'a', 'd' }, { 0, 'z', 'c' } };     // Axis, + and - keys
+	for (int t = 0; t < 3; ++t) {
+		float theta = PLANE_ROTATION * (presses[TURN_KEYS[t][1]] - presses[TURN_KEYS[t][2]]);
+		if (theta != 0) {
+			float half = gmtl::Math::deg2Rad(theta / 2);
+			gmtl::Quatf turn_q(0, 0, 0, cos(half));
+			turn_q[TURN_KEYS[t][0]] = sin(half);
+			plane_q = plane_q * turn_q;
+		}
+	}
+	gmtl::normalize(plane_q);
+
+	// Forward ('s') and backward ('f') translation along the plane's +Z
+	float forward = presses['s'] - presses['f'];
+	if (forward != 0) {
+		gmtl::Quatf v_q = plane_q * gmtl::Quatf(PLANE_FORWARD[0] * forward, PLANE_FORWARD[1] * forward,
+			PLANE_FORWARD[2] * forward, 0) * gmtl::makeConj(plane_q);
+		plane_p = plane_p + v_q.mData;
+	}
+
+	pp_angle += PROPELLER_ROTATION * presses['r'];
+
+	// The light moves a unit a press: 'o'/'u' along X, 'i'/'k' along Y, 'l'/'j' along Z
+	float light_step[3] = { presses['o'] - presses['u'], presses['i'] - presses['k'], presses['l'] - presses['j'] };
+	bool moving = light_step[0] != 0 || light_step[1] != 0 || light_step[2] != 0;
+	for (int a = 0; a < 3; ++a) {
+		sim_light_pos[a] += light_step[a];
+	}
+	if (light_moving && !moving) {
+		printf("Light = (%.2f, %.2f, %.2f)\n", sim_light_pos[0], sim_light_pos[1], sim_light_pos[2]);
+	}
+	light_moving = moving;
+
+	UpdateFleet(SIM_TICK);
+
+	sim_moving = moving || presses['r'] != 0 || !fleet.handles.empty() || !(plane_p_last == plane_p) || !(plane_q_last == plane_q);
+	++sim_ticks;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: FillSnapshot
+//|
+//! \param snap  [out] Snapshot to fill.
+//! \return None.
+//!
+//! Copies the simulation state the renderer draws into a snapshot, all but its time. The fleet's
+//! arrays keep their capacity from one fill to the next, so filling stops allocating once the
+//! fleet has been at its size.
+//|____________________________________________________________________
+
+void FillSnapshot(SimSnapshot* snap)
+{
+	snap->tick = sim_ticks;
+	snap->key_events = sim_key_events;
+	snap->moving = sim_moving;
+	snap->plane_p = plane_p;
+	snap->plane_p_last = plane_p_last;
+	snap->plane_q = plane_q;
+	snap->plane_q_last = plane_q_last;
+	snap->pp_angle = pp_angle;
+	snap->wing_angle_right = wing_angle_right;
+	snap->wing_angle_left = wing_angle_left;
+	snap->cannon_angle_top = cannon_angle_top;
+	snap->cannon_angle_subsubpart = cannon_angle_subsubpart;
+	snap->light_pos = sim_light_pos;
+	for (int c = 0; c < FLEET_FLOAT_NB; ++c) {
+		snap->fleet[c].assign(fleet.floats[c].begin(), fleet.floats[c].end());
+	}
+	snap->fleet_tints.assign(fleet.tints.begin(), fleet.tints.end());
+}
+
+//|____________________________________________________________________
+//|
+//| Function: PublishSnapshot
+//|
+//! \param time_ms  [in] Real time the last tick was due.
+//! \return None.
+//!
+//! Fills the back snapshot and swaps it with the middle one, flagged as new. The renderer never
+//! holds the back snapshot, so filling it needs no lock. Runs on the simulation thread.
+//|____________________________________________________________________
+
+void PublishSnapshot(double time_ms)
+{
+	SimSnapshot& snap = sim_snapshots[sim_back];
+
+	FillSnapshot(&snap);
+	snap.time_ms = time_ms;
+	sim_back = sim_middle.exchange(sim_back | SNAPSHOT_NEW) & ~SNAPSHOT_NEW;
+}
 
-	case 'l': // Light forward (+Z translation)
-		light_pos[2]++;
-		printf("Light-X = %.2f\n", light_pos[2]);
+//|____________________________________________________________________
+//|
+//| Function: LatestSnapshot
+//|
+//! \param None.
+//! \return The newest snapshot the simulation has published.
+//!
+//! Swaps the front snapshot with the middle one when the middle one is new, without waiting. The
+//! snapshot returned stays as it is until the next call. Runs on the render thread.
+//|____________________________________________________________________
+
+const SimSnapshot& LatestSnapshot()
+{
+	if (sim_middle & SNAPSHOT_NEW) {
+		sim_front = sim_middle.exchange(sim_front) & ~SNAPSHOT_NEW;
+	}
+	return sim_snapshots[sim_front];
+}
+
+//|____________________________________________________________________
+//|
+//| Function: KeyboardFunc
+//|
+//! \param key    [in] Key code.
+//! \param x      [in] X-coordinate of mouse when key is pressed.
+//! \param y      [in] Y-coordinate of mouse when key is pressed.
+//! \return None.
+//!
+//! GLUT keyboard callback function: called for every key press event.
+//|____________________________________________________________________
+
+void KeyboardFunc(unsigned char key, int x, int y)
+{
+	// Shift may go down or up while a key is held, so keys are tracked in lower case
+	key = (unsigned char)tolower(key);
+	keys_down[key] = true;
+	keys_pressed[key] = true;
+	key_events++;
+
+	switch (key) {
+		//|____________________________________________________________________
+		//|
+		//| Camera switch
+		//|____________________________________________________________________
+
+	case 'v': // Select camera to view
+		cam_id = (cam_id + 1) % 2;
+		printf("View camera = %d\n", cam_id);
+		break;
+	case 'b': // Select camera to control
+		camctrl_id = (camctrl_id + 1) % 2;
+		printf("Control camera = %d\n", camctrl_id);
 		break;
 
-	case 'j': // Light backward (-Z translation)
-		light_pos[2]--;
-		printf("Light-X = %.2f\n", light_pos[2]);
+		// Plane (s/f, e/q, a/d, z/c), propeller (r) and light (o/u, i/k, l/j) keys are applied by
+		// SimulationTick() for as long as they are held
+
+		//|____________________________________________________________________
+		//|
+		//| Lighting controls
+		//|____________________________________________________________________
+
+	case '9': // Toggles diffuse light ON/OFF
+		is_diffuse_on = !is_diffuse_on;
+		printf("Light-diffuse = %s\n", is_diffuse_on ? "ON" : "OFF");
 		break;
 
 	case '8': // Toggles ambient light ON/OFF
@@ -766,9 +2556,28 @@ void KeyboardFunc(unsigned char key, int x, int y)
 		break;
 	}
 
+	glutIdleFunc(IdleFunc);                 // Redraws until whatever the key set moving stops
 	glutPostRedisplay();                    // Asks GLUT to redraw the screen
 }
 
+//|____________________________________________________________________
+//|
+//| Function: KeyboardUpFunc
+//|
+//! \param key    [in] Key code.
+//! \param x      [in] X-coordinate of mouse when key is released.
+//! \param y      [in] Y-coordinate of mouse when key is released.
+//! \return None.
+//!
+//! GLUT keyboard up callback function: called for every key release event.
+//|____________________________________________________________________
+
+void KeyboardUpFunc(unsigned char key, int x, int y)
+{
+	keys_down[(unsigned char)tolower(key)] = false;
+	key_events++;
+}
+
 //|____________________________________________________________________
 //|
 //| Function: MouseFunc
@@ -849,6 +2658,7 @@ void MotionFunc(int x, int y)
 			}
 			distance[camctrl_id] += d;
 		}
+		PoseCameras();
 
 		glutPostRedisplay();      // Asks GLUT to redraw the screen
 	}
@@ -884,86 +2694,23 @@ void ReshapeFunc(int w, int h)
 
 void DrawCoordinateFrame(const float l)
 {
-	glDisable(GL_LIGHTING);
+	static const DrawState UNLIT = { 0, -1, { 1, 1, 1, 1 }, 0.0f, false, false };
 
-	glBegin(GL_LINES);
-	// X axis is red
-	glColor3f(1.0f, 0.0f, 0.0f);
-	glVertex3f(0.0f, 0.0f, 0.0f);
-	glVertex3f(l, 0.0f, 0.0f);
-
-	// Y axis is green
-	glColor3f(0.0f, 1.0f, 0.0f);
-	glVertex3f(0.0f, 0.0f, 0.0f);
-	glVertex3f(0.0f, l, 0.0f);
-
-	// Z axis is blue
-	glColor3f(0.0f, 0.0f, 1.0f);
-	glVertex3f(0.0f, 0.0f, 0.0f);
-	glVertex3f(0.0f, 0.0f, l);
-	glEnd();
-
-	glEnable(GL_LIGHTING);
+	// X axis is red, Y axis is green, Z axis is blue
+	glPushMatrix();
+	glScalef(l, l, l);
+	QueueMesh(MESH_FRAME, UNLIT);
+	glPopMatrix();
 }
 
 void DrawCube(const float width, const float length, const float height, const float colours[4]) {
-	float w2 = width / 2;
-	float h2 = height / 2;
-	float l2 = length / 2;
+	// Sets materials and colour
+	DrawState state = { 0, -1, { colours[0], colours[1], colours[2], colours[3] }, 20.0f, true, false };
 
-	// Sets materials
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 20.0);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, SPECULAR_COL);
-
-
-	glBegin(GL_QUADS);
-
-	// Sets colour
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, colours);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, colours);
-
-	// front face
-	glColor3f(colours[0], colours[1], colours[2]);
-	glVertex3f(w2, h2, -l2);
-	glVertex3f(-w2, h2, -l2);
-	glVertex3f(-w2, -h2, -l2);
-	glVertex3f(w2, -h2, -l2);
-
-	// right face
-	glColor3f(colours[0], colours[1], colours[2]);
-	glVertex3f(w2, h2, -l2);
-	glVertex3f(w2, h2, l2);
-	glVertex3f(w2, -h2, l2);
-	glVertex3f(w2, -h2, -l2);
-
-	// top face
-	glColor3f(colours[0], colours[1], colours[2]);
-	glVertex3f(w2, h2, l2);
-	glVertex3f(-w2, h2, l2);
-	glVertex3f(-w2, h2, -l2);
-	glVertex3f(w2, h2, -l2);
-
-	// bottom face
-	glColor3f(colours[0], colours[1], colours[2]);
-	glVertex3f(w2, -h2, -l2);
-	glVertex3f(-w2, -h2, -l2);
-	glVertex3f(-w2, -h2, l2);
-	glVertex3f(w2, -h2, l2);
-
-	// back face
-	glColor3f(colours[0], colours[1], colours[2]);
-	glVertex3f(-w2, h2, l2);
-	glVertex3f(w2, h2, l2);
-	glVertex3f(w2, -h2, l2);
-	glVertex3f(-w2, -h2, l2);
-
-	// left face
-	glColor3f(colours[0], colours[1], colours[2]);
-	glVertex3f(-w2, h2, -l2);
-	glVertex3f(-w2, h2, l2);
-	glVertex3f(-w2, -h2, l2);
-	glVertex3f(-w2, -h2, -l2);
-	glEnd();
+	glPushMatrix();
+	glScalef(width, height, length);
+	QueueMesh(MESH_CUBE, state);
+	glPopMatrix();
 }
 
 void DrawTurtleShell(const float width, const float length, const float height)
@@ -976,164 +2723,15 @@ void DrawTurtleShell(const float width, const float length, const float height)
 }
 
 void DrawSeaweed(const float width, const float length, const float height, const float colours[4]) {
-	float w2 = width / 2;
-	float h2 = height / 2;
-	float l2 = length / 2;
-
-	// Sets materials
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 20.0);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, SPECULAR_COL);
-
-	// Turn on texture mapping and disable lighting
-	glEnable(GL_TEXTURE_2D);
-	glEnable(GL_LIGHTING);
-
-	// Sets colour
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, colours);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, colours);
-
-	glRotatef(90.0f, 1.0f, 0.0f, 0.0f);
-
-	// front face
-	glBindTexture(GL_TEXTURE_2D, textures[TID_SEAWEED]);
-	glBegin(GL_QUADS);
-	glColor3f(colours[0], colours[1], colours[2]);
-	glTexCoord2f(0.0, 1.0);
-	glVertex3f(w2, h2, l2);
-	glTexCoord2f(1.0, 1.0);
-	glVertex3f(-w2, h2, l2);
-	glTexCoord2f(1.0, 0.0);
-	glVertex3f(-w2, h2, -l2);
-	glTexCoord2f(0.0, 0.0);
-	glVertex3f(w2, h2, -l2);
-	glEnd();
-}
-
-void DrawRock(const float s)
-{
-	float s2 = s / 2;
-
-	// Sets materials
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 10.0);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, SPECULAR_COL);
-
-	// Turn on texture mapping and disable lighting
-	glEnable(GL_TEXTURE_2D);
-	glEnable(GL_LIGHTING);
-
-	// Back wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_ROCK]);  // Specify which texture will be used   
-	glBegin(GL_QUADS);
-	glColor3f(0.2f, 0.4f, 0.7f);
-	glTexCoord2f(0.0, 1.0);
-	glVertex3f(-s2, -s2, -s2);
-	glTexCoord2f(1.0, 1.0);
-	glVertex3f(s2, -s2, -s2);
-	glTexCoord2f(1.0, 0.0);
-	glVertex3f(s2, s2, -s2);
-	glTexCoord2f(0.0, 0.0);
-	glVertex3f(-s2, s2, -s2);
-	glEnd();
-
-	// Left wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_ROCK]);
-	glBegin(GL_QUADS);
-	glColor3f(0.2f, 0.4f, 0.7f);
-	glTexCoord2f(0.0, 1.0);
-	glVertex3f(-s2, -s2, s2);
-	glTexCoord2f(1.0, 1.0);
-	glVertex3f(-s2, -s2, -s2);
-	glTexCoord2f(1.0, 0.0);
-	glVertex3f(-s2, s2, -s2);
-	glTexCoord2f(0.0, 0.0);
-	glVertex3f(-s2, s2, s2);
-	glEnd();
-
-	// Bottom wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_ROCK]);
-	glBegin(GL_QUADS);
-	glColor3f(0.15f, 0.35f, 0.65f);
-	glTexCoord2f(0.0, 1.0);
-	glVertex3f(-s2, -s2, s2);
-	glTexCoord2f(1.0, 1.0);
-	glVertex3f(s2, -s2, s2);
-	glTexCoord2f(1.0, 0.0);
-	glVertex3f(s2, -s2, -s2);
-	glTexCoord2f(0.0, 0.0);
-	glVertex3f(-s2, -s2, -s2);
-	glEnd();
-
-	// Right wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_ROCK]);
-	glBegin(GL_QUADS);
-	glColor3f(0.2f, 0.4f, 0.7f);
-	glTexCoord2f(0.0, 1.0);
-	glVertex3f(s2, -s2, s2);
-	glTexCoord2f(1.0, 1.0);
-	glVertex3f(s2, -s2, -s2);
-	glTexCoord2f(1.0, 0.0);
-	glVertex3f(s2, s2, -s2);
-	glTexCoord2f(0.0, 0.0);
-	glVertex3f(s2, s2, s2);
-	glEnd();
-
-	// Front wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_ROCK]);
-	glBegin(GL_QUADS);
-	glColor3f(0.2f, 0.4f, 0.7f);
-	glTexCoord2f(0.0, 1.0);
-	glVertex3f(-s2, -s2, s2);
-	glTexCoord2f(1.0, 1.0);
-	glVertex3f(s2, -s2, s2);
-	glTexCoord2f(1.0, 0.0);
-	glVertex3f(s2, s2, s2);
-	glTexCoord2f(0.0, 0.0);
-	glVertex3f(-s2, s2, s2);
-	glEnd();
-
-	// Top wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_ROCK]);
-	glBegin(GL_QUADS);
-	glColor3f(0.3f, 0.5f, 0.8f);
-	glTexCoord2f(0.0, 1.0);
-	glVertex3f(-s2, s2, s2);
-	glTexCoord2f(1.0, 1.0);
-	glVertex3f(s2, s2, s2);
-	glTexCoord2f(1.0, 0.0);
-	glVertex3f(s2, s2, -s2);
-	glTexCoord2f(0.0, 0.0);
-	glVertex3f(-s2, s2, -s2);
-	glEnd();
-
-	// Turn off texture mapping and enable lighting
-	glDisable(GL_TEXTURE_2D);
-}
-
-
-void DrawSandFloor(const float width, const float length) {
+	// Sets materials and colour; textured and cut out along the alpha key
+	DrawState state = { textures[TID_SCENERY], AR_SEAWEED, { colours[0], colours[1], colours[2], colours[3] }, 20.0f, true, true };
 
-	float w2 = width / 2;
-	float l2 = length / 2;
-
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 20.0);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, SPECULAR_COL);
-
-	// Turn on texture mapping and disable lighting
-	glEnable(GL_TEXTURE_2D);
-	glDisable(GL_LIGHTING);
-
-	glBindTexture(GL_TEXTURE_2D, textures[TID_SANDFLOOR]);
-	glBegin(GL_QUADS);
-	glColor3f(0.3f, 0.5f, 0.8f);
-	glTexCoord2f(0.0, 1.0);
-	glVertex3f(w2, 0.0, l2);
-	glTexCoord2f(1.0, 1.0);
-	glVertex3f(-w2, 0.0, l2);
-	glTexCoord2f(1.0, 0.0);
-	glVertex3f(-w2, 0.0, -l2);
-	glTexCoord2f(0.0, 0.0);
-	glVertex3f(w2, 0.0, -l2);
-	glEnd();
+	// Front face
+	glPushMatrix();
+	glTranslatef(0.0f, 0.0f, height / 2);
+	glScalef(width, length, 1.0f);
+	QueueMesh(MESH_SEAWEED, state);
+	glPopMatrix();
 }
 
 void DrawCannon(const float width, const float length, const float height)
@@ -1141,40 +2739,17 @@ void DrawCannon(const float width, const float length, const float height)
 	// Define cylinder properties
 	float radius = width * 0.14f;  // Adjust radius based on desired width
 	float cylHeight = height * 7.0f; // How short/long the cylinder is
-	int numSlices = 10;
-	static float pi = 3.141;
+
+	// Sets materials
+	DrawState state = { 0, -1, { colour_dark_gray[0], colour_dark_gray[1], colour_dark_gray[2], colour_dark_gray[3] },
+		20.0f, true, false };
 
 	// Push matrix to isolate cannon transformations
 	glPushMatrix();
 	glTranslatef(0.0f, -height * 3, -length * 0.5);  // Adjust for centered placement
-
-	// Draw cylinder
-	// reference: https://community.khronos.org/t/gl-quad-strip/68258
-	// https://www.mbsoftworks.sk/tutorials/opengl4/022-cylinder-and-sphere/
-	glBegin(GL_QUAD_STRIP);
-
-	// Sets materials
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 20.0);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, SPECULAR_COL);
-
-	// Sets ambient and diffuse
-	glMaterialfv(GL_FRONT, GL_AMBIENT, colour_dark_gray);
-	glMaterialfv(GL_FRONT, GL_DIFFUSE, colour_dark_gray);
-
-	for (int i = 0; i <= numSlices; i++) {
-		float angle = i / float(numSlices) * (2.0f * pi);
-		float x = radius * cosf(angle);
-		float z = radius * sinf(angle);
-
-		// Draw top ring
-		glNormal3f(x / radius, 0.0f, z / radius);
-		glVertex3f(x, cylHeight / 2.0f, z);
-
-		// Draw bottom ring
-		glNormal3f(x / radius, 0.0f, z / radius);
-		glVertex3f(x, -cylHeight / 2.0f, z);
-	}
-	glEnd();
+	cannon_lod = (unsigned char)SelectLod(LOD_CANNON, ProjectedSize(radius), cannon_lod);
+	glScalef(radius, cylHeight, radius);
+	QueueMesh(LOD_CHAINS[LOD_CANNON].meshes[cannon_lod], state);
 	glPopMatrix();
 }
 
@@ -1195,161 +2770,6779 @@ void DrawWing(const float width, const float length, const float height, const b
 //|
 //| Function: DrawSkybox
 //|
-//! \param s      [in] Skybox size.
+//! \param None.
 //! \return None.
 //!
-//! Draws a skybox.
+//! Draws the skybox as a unit cube around the camera, sampling the skybox cube map. Meant to be
+//! drawn after everything else: it is forced onto the far plane, so the depth test rejects every
+//! fragment already covered by the scene instead of shading a full screen of sky underneath it.
 //|____________________________________________________________________
 
-void DrawSkybox(const float s)
+void DrawSkybox()
 {
-	float s2 = s / 2;
+	GLfloat view[16];
+
+	// Keep only the rotation of the view transform: the skybox is centred on the camera
+	glPushMatrix();
+	glGetFloatv(GL_MODELVIEW_MATRIX, view);
+	view[12] = view[13] = view[14] = 0.0f;
+	glLoadMatrixf(view);
+
+	// Far plane only, and only where nothing has been drawn yet
+	glDepthRange(1.0, 1.0);
+	glDepthFunc(GL_LEQUAL);
+	glDepthMask(GL_FALSE);
 
-	// Turn on texture mapping and disable lighting
-	glEnable(GL_TEXTURE_2D);
+	// Turn on cube mapping and disable lighting
 	glDisable(GL_LIGHTING);
+	glDisable(GL_TEXTURE_2D);
+	glEnable(GL_TEXTURE_CUBE_MAP);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, textures[TID_SKYBOX]);
+	DrawMesh(MESH_SKYBOX);
 
-	// Back wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_SKYBACK]);  // Specify which texture will be used   
-	glBegin(GL_QUADS);
-	glColor3f(0.2f, 0.4f, 0.7f);
-	glTexCoord2f(0.0, 1.0);
-	glVertex3f(-s2, -s2, -s2);
-	glTexCoord2f(1.0, 1.0);
-	glVertex3f(s2, -s2, -s2);
-	glTexCoord2f(1.0, 0.0);
-	glVertex3f(s2, s2, -s2);
-	glTexCoord2f(0.0, 0.0);
-	glVertex3f(-s2, s2, -s2);
-	glEnd();
-
-	// Left wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_SKYLEFT]);
-	glBegin(GL_QUADS);
-	glColor3f(0.2f, 0.4f, 0.7f);
-	glTexCoord2f(0.0, 1.0);
-	glVertex3f(-s2, -s2, s2);
-	glTexCoord2f(1.0, 1.0);
-	glVertex3f(-s2, -s2, -s2);
-	glTexCoord2f(1.0, 0.0);
-	glVertex3f(-s2, s2, -s2);
-	glTexCoord2f(0.0, 0.0);
-	glVertex3f(-s2, s2, s2);
-	glEnd();
-
-	// Bottom wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_SKYBOTTOM]);
-	glBegin(GL_QUADS);
-	glColor3f(0.15f, 0.35f, 0.65f);
-	glTexCoord2f(0.0, 1.0);
-	glVertex3f(-s2, -s2, s2);
-	glTexCoord2f(1.0, 1.0);
-	glVertex3f(s2, -s2, s2);
-	glTexCoord2f(1.0, 0.0);
-	glVertex3f(s2, -s2, -s2);
-	glTexCoord2f(0.0, 0.0);
-	glVertex3f(-s2, -s2, -s2);
-	glEnd();
-
-	// Right wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_SKYRIGHT]);
-	glBegin(GL_QUADS);
-	glColor3f(0.2f, 0.4f, 0.7f);
-	glTexCoord2f(0.0, 1.0);
-	glVertex3f(s2, -s2, s2);
-	glTexCoord2f(1.0, 1.0);
-	glVertex3f(s2, -s2, -s2);
-	glTexCoord2f(1.0, 0.0);
-	glVertex3f(s2, s2, -s2);
-	glTexCoord2f(0.0, 0.0);
-	glVertex3f(s2, s2, s2);
-	glEnd();
-
-	// Front wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_SKYFRONT]);
-	glBegin(GL_QUADS);
-	glColor3f(0.2f, 0.4f, 0.7f);
-	glTexCoord2f(0.0, 1.0);
-	glVertex3f(-s2, -s2, s2);
-	glTexCoord2f(1.0, 1.0);
-	glVertex3f(s2, -s2, s2);
-	glTexCoord2f(1.0, 0.0);
-	glVertex3f(s2, s2, s2);
-	glTexCoord2f(0.0, 0.0);
-	glVertex3f(-s2, s2, s2);
-	glEnd();
-
-	//Top wall
-	glBindTexture(GL_TEXTURE_2D, textures[TID_SKYTOP]);
-	glBegin(GL_QUADS);
-	glColor3f(0.3f, 0.5f, 0.8f);
-	glTexCoord2f(0.0, 1.0);
-	glVertex3f(-s2, s2, s2);
-	glTexCoord2f(1.0, 1.0);
-	glVertex3f(s2, s2, s2);
-	glTexCoord2f(1.0, 0.0);
-	glVertex3f(s2, s2, -s2);
-	glTexCoord2f(0.0, 0.0);
-	glVertex3f(-s2, s2, -s2);
-	glEnd();
-
-	// Turn off texture mapping and enable lighting
+	// Restore the default state
+	glDisable(GL_TEXTURE_CUBE_MAP);
 	glEnable(GL_LIGHTING);
-	glDisable(GL_TEXTURE_2D);
+	glDepthMask(GL_TRUE);
+	glDepthFunc(GL_LESS);
+	glDepthRange(0.0, 1.0);
+	glPopMatrix();
 }
 
 void DrawSphere(float radius)
 {
-	static const int SPHERE_SLICES = 7;
-	static const int SPHERE_STACKS = 7;
-
 	glPushMatrix();
 
 	// Set material properties for the sphere
-	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 20.0f);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, SPECULAR_COL);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, BRIGHTRED_COL);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, BRIGHTRED_COL);
+	DrawState state = { 0, -1, { BRIGHTRED_COL[0], BRIGHTRED_COL[1], BRIGHTRED_COL[2], BRIGHTRED_COL[3] }, 20.0f, true, false };
 
-	glutSolidSphere(radius, SPHERE_SLICES, SPHERE_STACKS);
+	light_lod = (unsigned char)SelectLod(LOD_LIGHT, ProjectedSize(radius), light_lod);
+	glScalef(radius, radius, radius);
+	QueueMesh(LOD_CHAINS[LOD_LIGHT].meshes[light_lod], state);
 
 	glPopMatrix();
 }
 
 //|____________________________________________________________________
 //|
-//| Function: SetLight
+//| Function: SetAtlasRegion
 //|
-//! \param pos          [in] Light position.
-//! \param is_ambient   [in] Is ambient enabled?
-//! \param is_diffuse   [in] Is diffuse enabled?
-//! \param is_specular  [in] Is specular enabled?
+//! \param uv  [in] Texture coordinates (u0, v0, u1, v1) of a scenery atlas region, or NULL.
 //! \return None.
 //!
-//! Set light properties.
+//! Maps the [0, 1] texture coordinates of the meshes onto a region of the scenery atlas through the
+//! texture matrix, so the meshes need no rebuilding when the atlas is repacked. NULL restores the
+//! identity.
 //|____________________________________________________________________
 
-void SetLight(const gmtl::Point4f& pos, const bool is_ambient, const bool is_diffuse, const bool is_specular)
+void SetAtlasRegion(const float* uv)
 {
-	glLightfv(GL_LIGHT0, GL_POSITION, pos.mData);
-	if (is_ambient) {
-		glLightfv(GL_LIGHT0, GL_AMBIENT, AMBIENT_LIGHT);
-	}
-	else {
-		glLightfv(GL_LIGHT0, GL_AMBIENT, NO_LIGHT);
-	}
-	if (is_diffuse) {
-		glLightfv(GL_LIGHT0, GL_DIFFUSE, DIFFUSE_LIGHT);
-	}
-	else {
-		glLightfv(GL_LIGHT0, GL_DIFFUSE, NO_LIGHT);
-	}
-	if (is_specular) {
-		glLightfv(GL_LIGHT0, GL_SPECULAR, SPECULAR_LIGHT);
-	}
-	else {
-		glLightfv(GL_LIGHT0, GL_SPECULAR, NO_LIGHT);
+	glMatrixMode(GL_TEXTURE);
+	glLoadIdentity();
+	if (uv != NULL) {
+		glTranslatef(uv[0], uv[1], 0.0f);
+		glScalef(uv[2] - uv[0], uv[3] - uv[1], 1.0f);
 	}
+	glMatrixMode(GL_MODELVIEW);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: AddMeshQuad
+//|
+//! \param mesh    [in,out] Mesh to add to.
+//! \param pos     [in] Corners, in drawing order.
+//! \param normal  [in] Normal shared by the four corners.
+//! \param uv      [in] Texture coordinates of each corner.
+//! \param colour  [in] Colour shared by the four corners.
+//! \return None.
+//!
+//! Adds a quad to a triangle mesh as two triangles, wound counter-clockwise around the normal
+//! whatever the order of the corners: two-sided lighting takes the normal of the side facing the
+//! viewer from the winding.
+//|____________________________________________________________________
+
+void AddMeshQuad(Mesh* mesh, const GLfloat pos[][3], const GLfloat normal[3], const GLfloat uv[][3], const GLubyte colour[4])
+{
+	static const GLushort QUAD_INDICES[2][6] = { { 0, 1, 2, 0, 2, 3 }, { 0, 2, 1, 0, 3, 2 } };
+	GLushort base = (GLushort)mesh->vertices.size();
+	gmtl::Vec3f winding = FindNormal(gmtl::Point3f(pos[0][0], pos[0][1], pos[0][2]),
+		gmtl::Point3f(pos[1][0], pos[1][1], pos[1][2]), gmtl::Point3f(pos[2][0], pos[2][1], pos[2][2]));
+	int clockwise = winding[0] * normal[0] + winding[1] * normal[1] + winding[2] * normal[2] < 0.0f;
+
+	for (int c = 0; c < 4; ++c) {
+		MeshVertex v;
+
+		memcpy(v.pos, pos[c], sizeof(v.pos));
+		memcpy(v.normal, normal, sizeof(v.normal));
+		memcpy(v.uv, uv[c], sizeof(v.uv));
+		memcpy(v.colour, colour, sizeof(v.colour));
+		mesh->vertices.push_back(v);
+	}
+	for (int i = 0; i < 6; ++i) {
+		mesh->indices.push_back(base + QUAD_INDICES[clockwise][i]);
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BuildMeshes
+//|
+//! \param None.
+//! \return None.
+//!
+//! Builds every mesh and uploads it to the GL. Drawing a mesh afterwards costs a handful of GL calls
+//! whatever its vertex count. Needs LoadGLExtensions() to have run.
+//|____________________________________________________________________
+
+void BuildMeshes()
+{
+	static const GLfloat QUAD_UV[4][3] = { { 0, 1, 0 }, { 1, 1, 0 }, { 1, 0, 0 }, { 0, 0, 0 } };
+	static const GLubyte WHITE[4] = { 255, 255, 255, 255 };
+
+	// Cube faces: normal, then the corners. The texture mapping is the one of the former rock.
+	static const GLfloat CUBE_FACES[6][5][3] = {
+		{ { 0, 0, -1 }, { -0.5f, -0.5f, -0.5f }, { 0.5f, -0.5f, -0.5f }, { 0.5f, 0.5f, -0.5f }, { -0.5f, 0.5f, -0.5f } },  // Back
+		{ { -1, 0, 0 }, { -0.5f, -0.5f, 0.5f }, { -0.5f, -0.5f, -0.5f }, { -0.5f, 0.5f, -0.5f }, { -0.5f, 0.5f, 0.5f } },  // Left
+		{ { 0, -1, 0 }, { -0.5f, -0.5f, 0.5f }, { 0.5f, -0.5f, 0.5f }, { 0.5f, -0.5f, -0.5f }, { -0.5f, -0.5f, -0.5f } },  // Bottom
+		{ { 1, 0, 0 }, { 0.5f, -0.5f, 0.5f }, { 0.5f, -0.5f, -0.5f }, { 0.5f, 0.5f, -0.5f }, { 0.5f, 0.5f, 0.5f } },      // Right
+		{ { 0, 0, 1 }, { -0.5f, -0.5f, 0.5f }, { 0.5f, -0.5f, 0.5f }, { 0.5f, 0.5f, 0.5f }, { -0.5f, 0.5f, 0.5f } },      // Front
+		{ { 0, 1, 0 }, { -0.5f, 0.5f, 0.5f }, { 0.5f, 0.5f, 0.5f }, { 0.5f, 0.5f, -0.5f }, { -0.5f, 0.5f, -0.5f } } };    // Top
+
+	// Seaweed and sand floor quads: normal, then the corners
+	static const GLfloat SEAWEED_QUAD[5][3] = {
+		{ 0, 0, 1 }, { 0.5f, -0.5f, 0 }, { -0.5f, -0.5f, 0 }, { -0.5f, 0.5f, 0 }, { 0.5f, 0.5f, 0 } };
+	static const GLfloat SANDFLOOR_QUAD[5][3] = {
+		{ 0, 1, 0 }, { 0.5f, 0, 0.5f }, { -0.5f, 0, 0.5f }, { -0.5f, 0, -0.5f }, { 0.5f, 0, -0.5f } };
+
+	// Skybox face colours (modulating the texture) and, per corner, the cube map direction. Directions
+	// that differ from the corner position mirror the face image to keep the orientation of the
+	// former six-quad skybox.
+	static const GLfloat SKYBOX_COLOURS[6][3] = {
+		{ 0.2f, 0.4f, 0.7f }, { 0.2f, 0.4f, 0.7f }, { 0.15f, 0.35f, 0.65f },
+		{ 0.2f, 0.4f, 0.7f }, { 0.2f, 0.4f, 0.7f }, { 0.3f, 0.5f, 0.8f } };
+	static const GLfloat SKYBOX_CORNERS[6][4][3] = {
+		{ { -1, -1, -1 }, { 1, -1, -1 }, { 1, 1, -1 }, { -1, 1, -1 } },     // Back wall
+		{ { -1, -1, 1 }, { -1, -1, -1 }, { -1, 1, -1 }, { -1, 1, 1 } },     // Left wall
+		{ { -1, -1, 1 }, { 1, -1, 1 }, { 1, -1, -1 }, { -1, -1, -1 } },     // Bottom wall
+		{ { 1, -1, 1 }, { 1, -1, -1 }, { 1, 1, -1 }, { 1, 1, 1 } },         // Right wall
+		{ { -1, -1, 1 }, { 1, -1, 1 }, { 1, 1, 1 }, { -1, 1, 1 } },         // Front wall
+		{ { -1, 1, 1 }, { 1, 1, 1 }, { 1, 1, -1 }, { -1, 1, -1 } } };       // Top wall
+	static const GLfloat SKYBOX_DIRECTIONS[6][4][3] = {
+		{ { 1, -1, -1 }, { -1, -1, -1 }, { -1, 1, -1 }, { 1, 1, -1 } },
+		{ { -1, -1, -1 }, { -1, -1, 1 }, { -1, 1, 1 }, { -1, 1, -1 } },
+		{ { -1, -1, -1 }, { 1, -1, -1 }, { 1, -1, 1 }, { -1, -1, 1 } },
+		{ { 1, -1, 1 }, { 1, -1, -1 }, { 1, 1, -1 }, { 1, 1, 1 } },
+		{ { -1, -1, 1 }, { 1, -1, 1 }, { 1, 1, 1 }, { -1, 1, 1 } },
+		{ { -1, 1, 1 }, { 1, 1, 1 }, { 1, 1, -1 }, { -1, 1, -1 } } };
+
+	for (int id = 0; id < MESH_NB; ++id) {
+		meshes[id].mode = GL_TRIANGLES;
+		meshes[id].flags = 0;
+	}
+
+	for (int f = 0; f < 6; ++f) {
+		AddMeshQuad(&meshes[MESH_CUBE], CUBE_FACES[f] + 1, CUBE_FACES[f][0], QUAD_UV, WHITE);
+	}
+	AddMeshQuad(&meshes[MESH_SEAWEED], SEAWEED_QUAD + 1, SEAWEED_QUAD[0], QUAD_UV, WHITE);
+	AddMeshQuad(&meshes[MESH_SANDFLOOR], SANDFLOOR_QUAD + 1, SANDFLOOR_QUAD[0], QUAD_UV, WHITE);
+
+	for (int level = 0; level < LOD_LEVELS; ++level) {
+		BuildCylinder(&meshes[LOD_CHAINS[LOD_CANNON].meshes[level]], CYLINDER_SLICES[level]);
+		BuildSphere(&meshes[LOD_CHAINS[LOD_LIGHT].meshes[level]], SPHERE_SLICES[level], SPHERE_STACKS[level]);
+	}
+
+	// Skybox: one quad per face, facing inwards
+	Mesh& skybox = meshes[MESH_SKYBOX];
+	skybox.flags = MF_UV3 | MF_COLOUR;
+	for (int f = 0; f < 6; ++f) {
+		GLfloat normal[3];
+		GLubyte colour[4] = { 0, 0, 0, 255 };
+
+		for (int k = 0; k < 3; ++k) {
+			normal[k] = -(SKYBOX_CORNERS[f][0][k] + SKYBOX_CORNERS[f][2][k]) / 2;   // Opposite corners average to the face centre
+			colour[k] = GLubyte(SKYBOX_COLOURS[f][k] * 255.0f + 0.5f);
+		}
+		AddMeshQuad(&skybox, SKYBOX_CORNERS[f], normal, SKYBOX_DIRECTIONS[f], colour);
+	}
+
+	// Coordinate frame: X axis is red, Y axis is green, Z axis is blue
+	Mesh& frame = meshes[MESH_FRAME];
+	frame.mode = GL_LINES;
+	frame.flags = MF_COLOUR;
+	for (int axis = 0; axis < 3; ++axis) {
+		MeshVertex v = { { 0, 0, 0 }, { 0, 0, 1 }, { 0, 0, 0 }, { 0, 0, 0, 255 } };
+
+		v.colour[axis] = 255;
+		frame.vertices.push_back(v);
+		v.pos[axis] = 1.0f;
+		frame.vertices.push_back(v);
+		frame.indices.push_back(GLushort(2 * axis));
+		frame.indices.push_back(GLushort(2 * axis + 1));
+	}
+
+	BuildStaticWorld();
+
+	for (int id = 0; id < MESH_NB; ++id) {
+		UploadMesh(&meshes[id]);
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BuildCylinder
+//|
+//! \param mesh    [in,out] Empty triangle mesh.
+//! \param slices  [in] Number of sides.
+//! \return None.
+//!
+//! Builds an open ended cylinder of radius 1 and height 1 along Y.
+//|____________________________________________________________________
+
+void BuildCylinder(Mesh* mesh, int slices)
+{
+	const float pi = gmtl::Math::PI;
+
+	// A top and a bottom vertex per slice boundary, the seam duplicated for the texture coordinates
+	for (int i = 0; i <= slices; ++i) {
+		float angle = i / float(slices) * (2.0f * pi);
+		MeshVertex v = { { cosf(angle), 0.5f, sinf(angle) }, { cosf(angle), 0.0f, sinf(angle) },
+			{ i / float(slices), 1.0f, 0.0f }, { 255, 255, 255, 255 } };
+
+		mesh->vertices.push_back(v);
+		v.pos[1] = -0.5f;
+		v.uv[1] = 0.0f;
+		mesh->vertices.push_back(v);
+
+		if (i < slices) {
+			GLushort top = GLushort(2 * i), bottom = GLushort(2 * i + 1);
+			GLushort quad[6] = { top, GLushort(top + 2), bottom, GLushort(top + 2), GLushort(bottom + 2), bottom };
+			mesh->indices.insert(mesh->indices.end(), quad, quad + 6);
+		}
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BuildSphere
+//|
+//! \param mesh    [in,out] Empty triangle mesh.
+//! \param slices  [in] Number of divisions around the axis.
+//! \param stacks  [in] Number of divisions from pole to pole.
+//! \return None.
+//!
+//! Builds a sphere of radius 1 around Z.
+//|____________________________________________________________________
+
+void BuildSphere(Mesh* mesh, int slices, int stacks)
+{
+	const float pi = gmtl::Math::PI;
+
+	// Rings of latitude from pole to pole, skipping the triangles that collapse at the poles
+	for (int i = 0; i <= stacks; ++i) {
+		float phi = i / float(stacks) * pi;
+
+		for (int j = 0; j <= slices; ++j) {
+			float theta = j / float(slices) * (2.0f * pi);
+			float x = sinf(phi) * cosf(theta), y = sinf(phi) * sinf(theta), z = cosf(phi);
+			MeshVertex v = { { x, y, z }, { x, y, z },
+				{ j / float(slices), 1.0f - i / float(stacks), 0.0f }, { 255, 255, 255, 255 } };
+
+			mesh->vertices.push_back(v);
+			if (i < stacks && j < slices) {
+				GLushort a = GLushort(i * (slices + 1) + j), b = GLushort(a + slices + 1);
+				if (i > 0) {
+					GLushort tri[3] = { a, b, GLushort(a + 1) };
+					mesh->indices.insert(mesh->indices.end(), tri, tri + 3);
+				}
+				if (i < stacks - 1) {
+					GLushort tri[3] = { GLushort(a + 1), b, GLushort(b + 1) };
+					mesh->indices.insert(mesh->indices.end(), tri, tri + 3);
+				}
+			}
+		}
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: UploadMesh
+//|
+//! \param mesh  [in,out] Mesh whose vertices and indices are filled in.
+//! \return None.
+//!
+//! Copies a mesh into vertex and index buffers and records its vertex arrays in a vertex array
+//! object, as far as the context supports them.
+//|____________________________________________________________________
+
+void UploadMesh(Mesh* mesh)
+{
+	mesh->vbo = mesh->ibo = mesh->vao = 0;
+	if (!has_vbo) {
+		return;
+	}
+
+	pglGenBuffers(1, &mesh->vbo);
+	pglGenBuffers(1, &mesh->ibo);
+	pglBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+	pglBufferData(GL_ARRAY_BUFFER, mesh->vertices.size() * sizeof(MeshVertex), mesh->vertices.data(), GL_STATIC_DRAW);
+	pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+	pglBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh->indices.size() * sizeof(GLushort), mesh->indices.data(), GL_STATIC_DRAW);
+
+	if (has_vao) {
+		pglGenVertexArrays(1, &mesh->vao);
+		pglBindVertexArray(mesh->vao);
+		SetMeshArrays(*mesh);
+		pglBindVertexArray(0);
+	}
+
+	pglBindBuffer(GL_ARRAY_BUFFER, 0);
+	pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: StreamMesh
+//|
+//! \param mesh  [in] Mesh uploaded by UploadMesh() whose vertices and indices have changed.
+//! \return None.
+//!
+//! Refills a mesh's buffers, for meshes rebuilt every frame. Without vertex buffer objects the
+//! meshes are drawn straight from their vertices, so there is nothing to do.
+//|____________________________________________________________________
+
+void StreamMesh(Mesh* mesh)
+{
+	if (mesh->vbo == 0) {
+		return;
+	}
+
+	// The element array binding belongs to the bound vertex array object
+	if (has_vao) {
+		pglBindVertexArray(0);
+	}
+	pglBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+	pglBufferData(GL_ARRAY_BUFFER, mesh->vertices.size() * sizeof(MeshVertex), mesh->vertices.data(), GL_STREAM_DRAW);
+	pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+	pglBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh->indices.size() * sizeof(GLushort), mesh->indices.data(), GL_STREAM_DRAW);
+	pglBindBuffer(GL_ARRAY_BUFFER, 0);
+	pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: SetMeshArrays
+//|
+//! \param mesh  [in] Mesh to draw next.
+//! \return None.
+//!
+//! Points the fixed-function vertex arrays at a mesh's buffers, or at its vertices in system memory
+//! without vertex buffer objects.
+//|____________________________________________________________________
+
+void SetMeshArrays(const Mesh& mesh)
+{
+	uintptr_t base = 0;             // Buffer offsets are passed as pointers
+
+	if (mesh.vbo != 0) {
+		pglBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+		pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo);
+	} else {
+		base = (uintptr_t)mesh.vertices.data();
+	}
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, sizeof(MeshVertex), (const void*)(base + offsetof(MeshVertex, pos)));
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glNormalPointer(GL_FLOAT, sizeof(MeshVertex), (const void*)(base + offsetof(MeshVertex, normal)));
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glTexCoordPointer((mesh.flags & MF_UV3) ? 3 : 2, GL_FLOAT, sizeof(MeshVertex), (const void*)(base + offsetof(MeshVertex, uv)));
+	if (mesh.flags & MF_COLOUR) {
+		glEnableClientState(GL_COLOR_ARRAY);
+		glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(MeshVertex), (const void*)(base + offsetof(MeshVertex, colour)));
+	} else {
+		glDisableClientState(GL_COLOR_ARRAY);
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: DrawMesh
+//|
+//! \param id  [in] Mesh to draw.
+//! \return None.
+//!
+//! Draws a mesh with the current transform and material in a single draw call, and unbinds its
+//! vertex array object or buffers again. The current colour is undefined afterwards for meshes with
+//! MF_COLOUR.
+//|____________________________________________________________________
+
+void DrawMesh(MeshID id)
+{
+	DrawMeshRange(id, 0, (GLsizei)meshes[id].indices.size());
+}
+
+//|____________________________________________________________________
+//|
+//| Function: DrawMeshRange
+//|
+//! \param id     [in] Mesh to draw.
+//! \param first  [in] First index to draw.
+//! \param count  [in] Number of indices to draw.
+//! \return None.
+//!
+//! Draws part of a mesh, as DrawMesh() does.
+//|____________________________________________________________________
+
+void DrawMeshRange(MeshID id, GLuint first, GLsizei count)
+{
+	BindMeshArrays(id);
+	DrawBoundMesh(id, first, count);
+
+	if (meshes[id].vao != 0) {
+		pglBindVertexArray(0);
+	} else if (meshes[id].vbo != 0) {
+		pglBindBuffer(GL_ARRAY_BUFFER, 0);
+		pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BindMeshArrays
+//|
+//! \param id  [in] Mesh to draw next.
+//! \return None.
+//!
+//! Binds a mesh's vertex array object, or sets its vertex arrays without one.
+//|____________________________________________________________________
+
+void BindMeshArrays(MeshID id)
+{
+	if (meshes[id].vao != 0) {
+		pglBindVertexArray(meshes[id].vao);
+	} else {
+		SetMeshArrays(meshes[id]);
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: DrawBoundMesh
+//|
+//! \param id     [in] Mesh whose arrays are bound (see BindMeshArrays()).
+//! \param first  [in] First index to draw.
+//! \param count  [in] Number of indices to draw.
+//! \return None.
+//|____________________________________________________________________
+
+void DrawBoundMesh(MeshID id, GLuint first, GLsizei count)
+{
+	const Mesh& mesh = meshes[id];
+
+	lod_stats.vertices += count;
+	if (mesh.ibo != 0) {
+		glDrawElements(mesh.mode, count, GL_UNSIGNED_SHORT, (const void*)(first * sizeof(GLushort)));
+	} else {
+		glDrawElements(mesh.mode, count, GL_UNSIGNED_SHORT, mesh.indices.data() + first);
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: QueueMesh
+//|
+//! \param id     [in] Mesh to draw.
+//! \param state  [in] State to draw it with.
+//! \return None.
+//!
+//! Queues a mesh to be drawn with the current modelview matrix by SubmitRenderQueue().
+//|____________________________________________________________________
+
+void QueueMesh(MeshID id, const DrawState& state)
+{
+	QueueMeshRange(id, 0, (GLsizei)meshes[id].indices.size(), state);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: QueueMeshRange
+//|
+//! \param id     [in] Mesh to draw.
+//! \param first  [in] First index to draw.
+//! \param count  [in] Number of indices to draw.
+//! \param state  [in] State to draw it with.
+//! \return None.
+//!
+//! Queues part of a mesh, as QueueMesh() does. The sort key orders the draws by alpha testing,
+//! texture, lighting, atlas region, material and mesh, the states costliest to change first, then
+//! front to back so the depth test rejects more of the later fragments. Draws with the same colour
+//! and shininess share a material, numbered in the order they are first queued.
+//|____________________________________________________________________
+
+void QueueMeshRange(MeshID id, GLuint first, GLsizei count, const DrawState& state)
+{
+	DrawCommand command;
+	Material material = { { state.colour[0], state.colour[1], state.colour[2], state.colour[3] },
+		{ SPECULAR_COL[0], SPECULAR_COL[1], SPECULAR_COL[2], state.shininess } };
+	size_t material_id = 0;
+
+	command.mesh = id;
+	command.first_index = first;
+	command.index_count = count;
+	command.state = state;
+	glGetFloatv(GL_MODELVIEW_MATRIX, command.modelview);
+
+	while (material_id < render_materials.size() && memcmp(&render_materials[material_id], &material, sizeof(material)) != 0) {
+		++material_id;
+	}
+	if (material_id == render_materials.size()) {
+		render_materials.push_back(material);
+	}
+	command.material = (int)material_id;
+
+	// Bits: alpha test 63, texture 51-62, lighting 50, region 46-49, shininess 38-45, material 26-37,
+	// mesh 20-25, depth 0-19
+	float depth = std::min(std::max(-command.modelview[14] / CAM_FAR, 0.0f), 1.0f);
+	command.key = (uint64_t)state.alpha_test << 63 | (uint64_t)(state.texture & 0xfff) << 51 | (uint64_t)state.lit << 50 |
+		(uint64_t)((state.region + 1) & 0xf) << 46 | (uint64_t)((int)state.shininess & 0xff) << 38 |
+		(uint64_t)(material_id & 0xfff) << 26 | (uint64_t)(id & 0x3f) << 20 | (uint64_t)(depth * 0xfffff);
+	render_queue.push_back(command);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: StateChanged
+//|
+//! \param cache    [in/out] State cache.
+//! \param field    [in] State about to be set.
+//! \param differs  [in] Whether the cached value differs from the one to set.
+//! \return true if the GL call setting the state should be made.
+//!
+//! Counts a state call, and whether the state cache lets it through. The first call to each field
+//! always goes through, since the cache starts out not knowing the GL state.
+//|____________________________________________________________________
+
+bool StateChanged(StateCache* cache, StateCacheField field, bool differs)
+{
+	cache->requested++;
+	if ((cache->known & field) && !differs) {
+		return false;
+	}
+	cache->known |= field;
+	cache->issued++;
+	return cache->issue;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: ApplyDrawState
+//|
+//! \param cache    [in/out] State cache.
+//! \param command  [in] Draw to set the state of.
+//! \return None.
+//!
+//! Sets the state of a draw, through the state cache, and binds its mesh. Lit draws are lit per
+//! pixel by lit_program, when there is one and their material fits in the Materials block.
+//|____________________________________________________________________
+
+void ApplyDrawState(StateCache* cache, const DrawCommand& command)
+{
+	const DrawState& state = command.state;
+	bool textured = state.texture != 0;
+	bool per_pixel = state.lit && lit_program != 0 && command.material < LIGHT_MAX_MATERIALS;
+
+	if (StateChanged(cache, SC_PROGRAM, cache->per_pixel != per_pixel)) {
+		pglUseProgram(per_pixel ? lit_program : 0);
+	}
+	cache->per_pixel = per_pixel;
+
+	if (StateChanged(cache, SC_LIGHTING, cache->lighting != state.lit)) {
+		state.lit ? glEnable(GL_LIGHTING) : glDisable(GL_LIGHTING);
+	}
+	cache->lighting = state.lit;
+	if (StateChanged(cache, SC_ALPHA_TEST, cache->alpha_test != state.alpha_test)) {
+		state.alpha_test ? glEnable(GL_ALPHA_TEST) : glDisable(GL_ALPHA_TEST);
+	}
+	cache->alpha_test = state.alpha_test;
+	if (StateChanged(cache, SC_TEXTURE_2D, cache->texture_2d != textured)) {
+		textured ? glEnable(GL_TEXTURE_2D) : glDisable(GL_TEXTURE_2D);
+	}
+	cache->texture_2d = textured;
+
+	if (textured) {
+		if (StateChanged(cache, SC_TEXTURE, cache->texture != state.texture)) {
+			glBindTexture(GL_TEXTURE_2D, state.texture);
+		}
+		cache->texture = state.texture;
+		if (StateChanged(cache, SC_REGION, cache->region != state.region)) {
+			SetAtlasRegion(state.region >= 0 ? atlas_uv[state.region] : NULL);
+		}
+		cache->region = state.region;
+	}
+
+	// Lit draws take their colour from the material, unlit ones from the current colour
+	if (per_pixel) {
+		if (StateChanged(cache, SC_MATERIAL_ID, cache->material_id != command.material)) {
+			pglUniform1i(lit_material_loc, command.material);
+		}
+		cache->material_id = command.material;
+		if (StateChanged(cache, SC_TEXTURED, cache->textured != textured)) {
+			pglUniform1i(lit_textured_loc, textured);
+		}
+		cache->textured = textured;
+	} else if (state.lit) {
+		if (StateChanged(cache, SC_MATERIAL, memcmp(cache->material, state.colour, sizeof(cache->material)) != 0)) {
+			glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, state.colour);
+		}
+		memcpy(cache->material, state.colour, sizeof(cache->material));
+		if (StateChanged(cache, SC_SHININESS, cache->shininess != state.shininess)) {
+			glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, state.shininess);
+		}
+		cache->shininess = state.shininess;
+		if (StateChanged(cache, SC_SPECULAR, false)) {
+			glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, SPECULAR_COL);
+		}
+	} else if (!(meshes[command.mesh].flags & MF_COLOUR)) {
+		if (StateChanged(cache, SC_COLOUR, memcmp(cache->colour, state.colour, sizeof(cache->colour)) != 0)) {
+			glColor4fv(state.colour);
+		}
+		memcpy(cache->colour, state.colour, sizeof(cache->colour));
+	}
+
+	if (StateChanged(cache, SC_MESH, cache->mesh != command.mesh)) {
+		BindMeshArrays(command.mesh);
+	}
+	cache->mesh = command.mesh;
+
+	// Per-vertex colours leave the current colour undefined
+	if (meshes[command.mesh].flags & MF_COLOUR) {
+		cache->known &= ~SC_COLOUR;
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: SubmitRenderQueue
+//|
+//! \param None.
+//! \return None.
+//!
+//! Draws the queued draws sorted by their keys, setting their state through a state cache, and
+//! empties the queue. The materials of the draws are uploaded to the Materials uniform block first,
+//! in one go. Leaves lighting on, no program in use, 2D texturing and the alpha test off and the
+//! texture matrix reset, as the rest of the frame expects.
+//|____________________________________________________________________
+
+void SubmitRenderQueue()
+{
+	StateCache cache, unsorted;
+	std::vector<std::pair<uint64_t, int> > order(render_queue.size());
+	const GLfloat* modelview = NULL;
+
+	memset(&cache, 0, sizeof(cache));
+	memset(&unsorted, 0, sizeof(unsorted));
+	cache.issue = true;
+
+	// Reallocated, then filled with as many materials as the block holds
+	if (lit_program != 0 && !render_materials.empty()) {
+		pglBindBuffer(GL_UNIFORM_BUFFER, material_ubo);
+		pglBufferData(GL_UNIFORM_BUFFER, sizeof(Material) * LIGHT_MAX_MATERIALS, NULL, GL_STREAM_DRAW);
+		pglBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Material) * std::min((int)render_materials.size(), LIGHT_MAX_MATERIALS),
+			render_materials.data());
+		pglBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+
+	// What the state calls would have been without sorting, for the statistics
+	for (size_t i = 0; i < render_queue.size(); ++i) {
+		ApplyDrawState(&unsorted, render_queue[i]);
+		order[i] = std::make_pair(render_queue[i].key, (int)i);
+	}
+	std::sort(order.begin(), order.end());
+
+	glPushMatrix();
+	for (size_t i = 0; i < order.size(); ++i) {
+		const DrawCommand& command = render_queue[order[i].second];
+
+		ApplyDrawState(&cache, command);
+		if (modelview == NULL || memcmp(modelview, command.modelview, sizeof(command.modelview)) != 0) {
+			glLoadMatrixf(command.modelview);
+			modelview = command.modelview;
+		}
+		DrawBoundMesh(command.mesh, command.first_index, command.index_count);
+	}
+	glPopMatrix();
+
+	// Restore the default state
+	if ((cache.known & SC_REGION) && cache.region >= 0) {
+		SetAtlasRegion(NULL);
+	}
+	if (cache.per_pixel) {
+		pglUseProgram(0);
+	}
+	glEnable(GL_LIGHTING);
+	glDisable(GL_TEXTURE_2D);
+	glDisable(GL_ALPHA_TEST);
+
+	render_stats.draws += (int)render_queue.size();
+	render_stats.requested += cache.requested;
+	render_stats.unsorted += unsorted.issued;
+	render_stats.issued += cache.issued;
+	render_stats.materials += (int)render_materials.size();
+	render_queue.clear();
+	render_materials.clear();
+}
+
+//|____________________________________________________________________
+//|
+//| Function: SubmitRenderQueueDepth
+//|
+//! \param None.
+//! \return None.
+//!
+//! Draws the queued draws into the depth buffer only, unsorted and ignoring their state, and
+//! empties the queue. For the shadow maps; the caller masks colour writes.
+//|____________________________________________________________________
+
+void SubmitRenderQueueDepth()
+{
+	glPushMatrix();
+	for (size_t i = 0; i < render_queue.size(); ++i) {
+		const DrawCommand& command = render_queue[i];
+
+		glLoadMatrixf(command.modelview);
+		DrawMeshRange(command.mesh, command.first_index, command.index_count);
+	}
+	glPopMatrix();
+
+	render_queue.clear();
+	render_materials.clear();
+}
+
+//|____________________________________________________________________
+//|
+//| Function: AppendMesh
+//|
+//! \param dst     [in,out] Mesh to append to.
+//! \param src     [in] Mesh to append, with the same mode and flags.
+//! \param offset  [in] Translation.
+//! \param yaw     [in] Rotation about Y, in degrees.
+//! \param scale   [in] Scale along X, Y and Z.
+//! \return None.
+//!
+//! Appends a copy of a mesh transformed as by glTranslatef(offset), glRotatef(yaw, 0, 1, 0) and
+//! glScalef(scale), in that order.
+//|____________________________________________________________________
+
+void AppendMesh(Mesh* dst, const Mesh& src, const GLfloat offset[3], float yaw, const GLfloat scale[3])
+{
+	float c = cosf(gmtl::Math::deg2Rad(yaw)), s = sinf(gmtl::Math::deg2Rad(yaw));
+	GLushort base = (GLushort)dst->vertices.size();
+
+	for (size_t k = 0; k < src.vertices.size(); ++k) {
+		MeshVertex v = src.vertices[k];
+		GLfloat p[3], n[3];
+
+		for (int a = 0; a < 3; ++a) {
+			p[a] = v.pos[a] * scale[a];
+			n[a] = v.normal[a] / scale[a];          // Normals take the inverse transpose of the scale
+		}
+		float len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+		v.pos[0] = c * p[0] + s * p[2] + offset[0];
+		v.pos[1] = p[1] + offset[1];
+		v.pos[2] = c * p[2] - s * p[0] + offset[2];
+		v.normal[0] = (c * n[0] + s * n[2]) / len;
+		v.normal[1] = n[1] / len;
+		v.normal[2] = (c * n[2] - s * n[0]) / len;
+		dst->vertices.push_back(v);
+	}
+	for (size_t k = 0; k < src.indices.size(); ++k) {
+		dst->indices.push_back(base + src.indices[k]);
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BuildStaticWorld
+//|
+//! \param None.
+//! \return None.
+//!
+//! Bakes the rocks and sandfloors into world space, one mesh per StaticBatch, from the unit cube
+//! and sandfloor meshes. Their layout only depends on num_seaweeds and SB_SIZE, so this runs once
+//! from BuildMeshes() and the whole static world then draws in STATIC_BATCH_NB calls.
+//|____________________________________________________________________
+
+void BuildStaticWorld()
+{
+	for (int b = 0; b < STATIC_BATCH_NB; ++b) {
+		Mesh& mesh = meshes[STATIC_BATCHES[b].mesh];
+
+		mesh.mode = GL_TRIANGLES;
+		mesh.flags = 0;
+		mesh.vertices.clear();
+		mesh.indices.clear();
+		static_objects[b].clear();
+	}
+
+	// Rocks
+	for (int i = 1; i < num_seaweeds; i += i * 2) {
+		for (int j = 1; j < num_seaweeds; j += i + 1) {
+			GLfloat size = float(50 * j % 200);
+			GLfloat offset[3] = { SCENERY_ORIGIN[0] + SB_SIZE / num_seaweeds * j, SCENERY_ORIGIN[1] - 475,
+				SCENERY_ORIGIN[2] + SB_SIZE / num_seaweeds * i + j * SB_SIZE / num_seaweeds };
+			GLfloat scale[3] = { size, size, size };
+
+			if (size > 0.0f) {
+				AddStaticObject(BATCH_ROCKS, MESH_CUBE, offset, 20.0f * i * j, scale);
+			}
+		}
+	}
+
+	// Sandfloors
+	for (int i = 1; i < num_seaweeds; i += i * 2) {
+		for (int j = 1; j < num_seaweeds; j += i + 1) {
+			// Not sure what I'm doing, trying to do a semi-random position
+			GLfloat size = float(60 * i % 200);
+			GLfloat offset[3] = { SCENERY_ORIGIN[0] + i * SB_SIZE / num_seaweeds, SCENERY_ORIGIN[1] - SB_SIZE / 2 + 2,
+				SCENERY_ORIGIN[2] + SB_SIZE / num_seaweeds * j };
+			GLfloat scale[3] = { size, 1.0f, size };
+
+			if (size > 0.0f) {
+				AddStaticObject(BATCH_SANDFLOORS, MESH_SANDFLOOR, offset, 20.0f * i * j, scale);
+			}
+		}
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: AddStaticObject
+//|
+//! \param batch   [in] Static world batch to add to.
+//! \param mesh    [in] Unit mesh of the object.
+//! \param offset  [in] Translation.
+//! \param yaw     [in] Rotation about Y, in degrees.
+//! \param scale   [in] Scale along X, Y and Z.
+//! \return None.
+//!
+//! Bakes an object into a static world batch (see AppendMesh()) and records its index range and
+//! world space bounding box for culling.
+//|____________________________________________________________________
+
+void AddStaticObject(StaticBatchID batch, MeshID mesh, const GLfloat offset[3], float yaw, const GLfloat scale[3])
+{
+	Mesh& dst = meshes[STATIC_BATCHES[batch].mesh];
+	size_t first_vertex = dst.vertices.size();
+	StaticObject object;
+
+	object.first_index = (GLuint)dst.indices.size();
+	AppendMesh(&dst, meshes[mesh], offset, yaw, scale);
+	object.index_count = (GLsizei)(dst.indices.size() - object.first_index);
+
+	gmtl::Point3f lo(dst.vertices[first_vertex].pos[0], dst.vertices[first_vertex].pos[1], dst.vertices[first_vertex].pos[2]);
+	gmtl::Point3f hi = lo;
+	for (size_t k = first_vertex; k < dst.vertices.size(); ++k) {
+		for (int a = 0; a < 3; ++a) {
+			lo[a] = std::min(lo[a], dst.vertices[k].pos[a]);
+			hi[a] = std::max(hi[a], dst.vertices[k].pos[a]);
+		}
+	}
+	object.bounds = gmtl::AABoxf(lo, hi);
+	static_objects[batch].push_back(object);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: DrawStaticWorld
+//|
+//! \param None.
+//! \return None.
+//!
+//! Draws the objects of the static world batches that CullScenery() found in view. Each run of
+//! consecutive visible objects of a batch takes a single draw call, so a batch in full view is still
+//! drawn in one. Rocks too small for their mesh are drawn as impostors instead. The draws are queued
+//! for SubmitRenderQueue().
+//|____________________________________________________________________
+
+void DrawStaticWorld()
+{
+	for (int b = 0; b < STATIC_BATCH_NB; ++b) {
+		const StaticBatch& batch = STATIC_BATCHES[b];
+		const std::vector<StaticObject>& objects = static_objects[b];
+		std::vector<StaticObject> runs;         // Index ranges to draw
+		bool merge = false;                     // Previous object was visible too
+
+		for (size_t k = 0; k < objects.size(); ++k) {
+			if (!static_visible[b][k]) {
+				merge = false;
+				continue;
+			}
+			if (merge) {
+				runs.back().index_count += objects[k].index_count;
+			} else {
+				runs.push_back(objects[k]);
+			}
+			merge = true;
+		}
+
+		bool impostors = b == BATCH_ROCKS && !meshes[MESH_ROCK_IMPOSTORS].indices.empty();
+		if (runs.empty() && !impostors) {
+			continue;
+		}
+
+		DrawState state = { textures[TID_SCENERY], batch.region, { batch.colour[0], batch.colour[1], batch.colour[2], batch.colour[3] },
+			batch.shininess, batch.lit, false };
+
+		for (size_t r = 0; r < runs.size(); ++r) {
+			QueueMeshRange(batch.mesh, runs[r].first_index, runs[r].index_count, state);
+		}
+		if (impostors) {
+			QueueMesh(MESH_ROCK_IMPOSTORS, state);
+		}
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: ExtractFrustum
+//|
+//! \param frustum  [out] View frustum.
+//! \return None.
+//!
+//! Extracts the view frustum in the frame of the current modelview matrix (see MakeFrustum()).
+//|____________________________________________________________________
+
+void ExtractFrustum(Frustum* frustum)
+{
+	GLfloat proj[16], view[16], clip[16];
+
+	glGetFloatv(GL_PROJECTION_MATRIX, proj);
+	glGetFloatv(GL_MODELVIEW_MATRIX, view);
+
+	// Column-major, like the GL matrices
+	for (int c = 0; c < 4; ++c) {
+		for (int r = 0; r < 4; ++r) {
+			clip[c * 4 + r] = proj[r] * view[c * 4] + proj[4 + r] * view[c * 4 + 1] + proj[8 + r] * view[c * 4 + 2] +
+				proj[12 + r] * view[c * 4 + 3];
+		}
+	}
+	MakeFrustum(clip, frustum);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: MakeFrustum
+//|
+//! \param clip     [in] Projection times view matrix, column-major.
+//! \param frustum  [out] View frustum.
+//! \return None.
+//!
+//! Extracts the frustum planes from the rows of the clip matrix (Gribb and Hartmann): a point is
+//! inside when it is on the positive side of all six planes.
+//|____________________________________________________________________
+
+void MakeFrustum(const GLfloat clip[16], Frustum* frustum)
+{
+	// Row 3 plus or minus rows 0 (left, right), 1 (bottom, top) and 2 (near, far)
+	for (int p = 0; p < 6; ++p) {
+		int row = p / 2;
+		float sign = (p % 2 == 0) ? 1.0f : -1.0f;
+		gmtl::Vec3f normal(clip[3] + sign * clip[row], clip[7] + sign * clip[4 + row], clip[11] + sign * clip[8 + row]);
+		float d = clip[15] + sign * clip[12 + row];
+		float len = gmtl::length(normal);
+
+		frustum->planes[p] = gmtl::Planef(gmtl::Vec3f(normal[0] / len, normal[1] / len, normal[2] / len), -d / len);
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: ClassifyBox
+//|
+//! \param frustum  [in] View frustum.
+//! \param box      [in] Bounding box, in the frame of the frustum.
+//! \param planes   [in/out] Bit mask of the planes to test; the planes the box is entirely inside
+//!                 of are cleared.
+//! \return false if the box is entirely outside the frustum.
+//!
+//! Tests the corners of the box furthest along and against each plane's normal. Boxes that
+//! straddle two planes just outside a frustum corner count as visible. Once planes is 0 the box,
+//! and anything it contains, is entirely inside.
+//|____________________________________________________________________
+
+bool ClassifyBox(const Frustum& frustum, const gmtl::AABoxf& box, unsigned int* planes)
+{
+	for (int p = 0; p < 6; ++p) {
+		if (!(*planes & (1u << p))) {
+			continue;
+		}
+
+		const gmtl::Vec3f& normal = frustum.planes[p].getNormal();
+		gmtl::Point3f far_corner, near_corner;
+
+		for (int a = 0; a < 3; ++a) {
+			far_corner[a] = normal[a] >= 0.0f ? box.getMax()[a] : box.getMin()[a];
+			near_corner[a] = normal[a] >= 0.0f ? box.getMin()[a] : box.getMax()[a];
+		}
+		if (gmtl::distance(frustum.planes[p], far_corner) < 0.0f) {
+			return false;
+		}
+		if (gmtl::distance(frustum.planes[p], near_corner) >= 0.0f) {
+			*planes &= ~(1u << p);
+		}
+	}
+	return true;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BoxArea
+//|
+//! \param box  [in] Box.
+//! \return Half the surface area of the box, 0 when it is empty.
+//|____________________________________________________________________
+
+float BoxArea(const gmtl::AABoxf& box)
+{
+	if (box.isEmpty()) {
+		return 0.0f;
+	}
+
+	gmtl::Vec3f size = box.getMax() - box.getMin();
+	return size[0] * size[1] + size[1] * size[2] + size[2] * size[0];
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BuildBVH
+//|
+//! \param bvh     [out] Hierarchy.
+//! \param bounds  [in] Boxes to index.
+//! \return None.
+//!
+//! Builds a bounding volume hierarchy top down. Each node is split where the surface area
+//! heuristic is lowest among BVH_BINS planes per axis, evenly spaced over the centroids of its
+//! boxes; a node becomes a leaf when no split is cheaper than testing its boxes directly. Binning
+//! keeps the build O(n log n), so rebuilding after large changes stays affordable.
+//|____________________________________________________________________
+
+void BuildBVH(BVH* bvh, const std::vector<gmtl::AABoxf>& bounds)
+{
+	struct Bin {
+		gmtl::AABoxf bounds;
+		int count;
+	};
+	struct Task {
+		int first;
+		int count;
+		int depth;
+		int parent;                     // Node whose right child this is, -1 for a left child or the root
+	};
+	std::vector<gmtl::Point3f> centroids(bounds.size());
+	std::vector<Task> tasks;
+
+	bvh->nodes.clear();
+	bvh->items.resize(bounds.size());
+	if (bounds.empty()) {
+		return;
+	}
+	for (size_t i = 0; i < bounds.size(); ++i) {
+		bvh->items[i] = (int)i;
+		centroids[i] = (bounds[i].getMin() + bounds[i].getMax()) * 0.5f;
+	}
+	bvh->nodes.reserve(bounds.size() / BVH_LEAF_SIZE * 2 + 1);
+
+	// Depth first, left child first, so that a left child directly follows its parent
+	tasks.push_back({ 0, (int)bounds.size(), 0, -1 });
+	while (!tasks.empty()) {
+		Task task = tasks.back();
+		int* items = &bvh->items[task.first];
+		int index = (int)bvh->nodes.size();
+		BVHNode node = { gmtl::AABoxf(), task.first, task.count, 0 };
+		gmtl::Point3f lo = centroids[items[0]], hi = lo;       // Bounds of the centroids
+
+		tasks.pop_back();
+		if (task.parent >= 0) {
+			bvh->nodes[task.parent].right = index;
+		}
+		for (int i = 0; i < task.count; ++i) {
+			const gmtl::Point3f& centroid = centroids[items[i]];
+
+			gmtl::extendVolume(node.bounds, bounds[items[i]]);
+			for (int a = 0; a < 3; ++a) {
+				lo[a] = std::min(lo[a], centroid[a]);
+				hi[a] = std::max(hi[a], centroid[a]);
+			}
+		}
+		bvh->nodes.push_back(node);
+		if (task.count <= BVH_LEAF_SIZE || task.depth >= BVH_MAX_DEPTH) {
+			continue;
+		}
+
+		// Cheapest split: cost of the boxes on each side weighted by the area of their bounds
+		gmtl::Vec3f extent = hi - lo;
+		float best_cost = FLT_MAX;
+		int best_axis = -1, best_bin = 0;
+
+		for (int a = 0; a < 3; ++a) {
+			if (extent[a] <= 0.0f) {
+				continue;
+			}
+
+			Bin bins[BVH_BINS];
+			float right_area[BVH_BINS];
+			int right_count[BVH_BINS];
+			float scale = BVH_BINS / extent[a];
+			gmtl::AABoxf side;
+			int count = 0;
+
+			for (int b = 0; b < BVH_BINS; ++b) {
+				bins[b].count = 0;
+			}
+			for (int i = 0; i < task.count; ++i) {
+				int b = std::min((int)((centroids[items[i]][a] - lo[a]) * scale), BVH_BINS - 1);
+				gmtl::extendVolume(bins[b].bounds, bounds[items[i]]);
+				bins[b].count++;
+			}
+			for (int b = BVH_BINS - 1; b > 0; --b) {
+				gmtl::extendVolume(side, bins[b].bounds);
+				count += bins[b].count;
+				right_area[b] = BoxArea(side);
+				right_count[b] = count;
+			}
+			side.setEmpty(true);
+			count = 0;
+			for (int b = 0; b < BVH_BINS - 1; ++b) {
+				gmtl::extendVolume(side, bins[b].bounds);
+				count += bins[b].count;
+
+				float cost = BoxArea(side) * count + right_area[b + 1] * right_count[b + 1];
+				if (count > 0 && right_count[b + 1] > 0 && cost < best_cost) {
+					best_cost = cost;
+					best_axis = a;
+					best_bin = b;
+				}
+			}
+		}
+
+		int mid;
+		if (best_axis < 0) {
+			// All centroids coincide: only worth splitting, anyhow, when the leaf would be too large
+			if (task.count <= BVH_MAX_LEAF_SIZE) {
+				continue;
+			}
+			mid = task.count / 2;
+		} else {
+			float area = BoxArea(node.bounds);
+			if (area > 0.0f && BVH_NODE_COST + best_cost / area >= task.count && task.count <= BVH_MAX_LEAF_SIZE) {
+				continue;
+			}
+
+			float scale = BVH_BINS / extent[best_axis];
+			mid = (int)(std::partition(items, items + task.count, [&](int i) {
+				return std::min((int)((centroids[i][best_axis] - lo[best_axis]) * scale), BVH_BINS - 1) <= best_bin;
+			}) - items);
+		}
+
+		tasks.push_back({ task.first + mid, task.count - mid, task.depth + 1, index });
+		tasks.push_back({ task.first, mid, task.depth + 1, -1 });
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: RefitBVH
+//|
+//! \param bvh     [in/out] Hierarchy built over bounds.
+//! \param bounds  [in] The same boxes, moved.
+//! \return None.
+//!
+//! Recomputes the node bounds for boxes that have moved, keeping the tree. Much faster than a
+//! rebuild, but queries slow down as the boxes drift from where the tree was built for.
+//|____________________________________________________________________
+
+void RefitBVH(BVH* bvh, const std::vector<gmtl::AABoxf>& bounds)
+{
+	// Children follow their parents, so going backwards refits them first
+	for (int n = (int)bvh->nodes.size() - 1; n >= 0; --n) {
+		BVHNode& node = bvh->nodes[n];
+
+		if (node.right == 0) {
+			node.bounds = bounds[bvh->items[node.first]];
+			for (int i = 1; i < node.count; ++i) {
+				gmtl::extendVolume(node.bounds, bounds[bvh->items[node.first + i]]);
+			}
+		} else {
+			node.bounds = bvh->nodes[n + 1].bounds;
+			gmtl::extendVolume(node.bounds, bvh->nodes[node.right].bounds);
+		}
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: QueryBVHFrustum
+//|
+//! \param bvh      [in] Hierarchy built over bounds.
+//! \param bounds   [in] Indexed boxes.
+//! \param frustum  [in] View frustum.
+//! \param result   [out] Indices of the boxes that are not entirely outside the frustum.
+//! \return None.
+//!
+//! Finds the boxes ClassifyBox() does not cull. The planes a node is entirely inside of are not
+//! tested again below it, and nodes entirely inside the frustum are taken whole.
+//|____________________________________________________________________
+
+void QueryBVHFrustum(const BVH& bvh, const std::vector<gmtl::AABoxf>& bounds, const Frustum& frustum, std::vector<int>* result)
+{
+	struct Entry {
+		int node;
+		unsigned int planes;            // Planes left to test
+	};
+	Entry stack[BVH_MAX_DEPTH + 1];
+	int top = 0;
+
+	result->clear();
+	if (bvh.nodes.empty()) {
+		return;
+	}
+	stack[top++] = { 0, 0x3f };
+	while (top > 0) {
+		Entry entry = stack[--top];
+		const BVHNode& node = bvh.nodes[entry.node];
+
+		if (!ClassifyBox(frustum, node.bounds, &entry.planes)) {
+			continue;
+		}
+		if (entry.planes == 0) {
+			result->insert(result->end(), bvh.items.begin() + node.first, bvh.items.begin() + node.first + node.count);
+		} else if (node.right == 0) {
+			for (int i = node.first; i < node.first + node.count; ++i) {
+				unsigned int planes = entry.planes;
+				if (ClassifyBox(frustum, bounds[bvh.items[i]], &planes)) {
+					result->push_back(bvh.items[i]);
+				}
+			}
+		} else {
+			stack[top++] = { node.right, entry.planes };
+			stack[top++] = { entry.node + 1, entry.planes };
+		}
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: RayHitsBox
+//|
+//! \param box      [in] Box.
+//! \param ray      [in] Ray.
+//! \param inv_dir  [in] Reciprocal of the ray direction.
+//! \param max_t    [in] Distance along the ray beyond which hits do not count.
+//! \param t        [out] Distance along the ray where it enters the box, 0 when it starts inside.
+//! \return true if the ray hits the box.
+//|____________________________________________________________________
+
+bool RayHitsBox(const gmtl::AABoxf& box, const gmtl::Rayf& ray, const float inv_dir[3], float max_t, float* t)
+{
+	float t_in = 0.0f, t_out = max_t;
+
+	// Distances to the two slabs along each axis
+	for (int a = 0; a < 3; ++a) {
+		float t0 = (box.getMin()[a] - ray.getOrigin()[a]) * inv_dir[a];
+		float t1 = (box.getMax()[a] - ray.getOrigin()[a]) * inv_dir[a];
+
+		t_in = std::max(t_in, std::min(t0, t1));
+		t_out = std::min(t_out, std::max(t0, t1));
+	}
+	*t = t_in;
+	return t_in <= t_out;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: QueryBVHRay
+//|
+//! \param bvh     [in] Hierarchy built over bounds.
+//! \param bounds  [in] Indexed boxes.
+//! \param ray     [in] Ray.
+//! \param max_t   [in] Distance along the ray beyond which hits do not count.
+//! \param t       [out] Distance along the ray to the box hit.
+//! \return Index of the first box along the ray, -1 if none is hit.
+//!
+//! Picking query. Nodes are visited nearest first, and skipped once they are further than the
+//! nearest hit so far.
+//|____________________________________________________________________
+
+int QueryBVHRay(const BVH& bvh, const std::vector<gmtl::AABoxf>& bounds, const gmtl::Rayf& ray, float max_t, float* t)
+{
+	int stack[BVH_MAX_DEPTH + 1];
+	int top = 0;
+	float inv_dir[3];
+	float hit_t;
+	int hit = -1;
+
+	if (bvh.nodes.empty()) {
+		return -1;
+	}
+	for (int a = 0; a < 3; ++a) {
+		inv_dir[a] = 1.0f / ray.getDir()[a];
+	}
+	stack[top++] = 0;
+	while (top > 0) {
+		const BVHNode& node = bvh.nodes[stack[--top]];
+
+		if (!RayHitsBox(node.bounds, ray, inv_dir, max_t, &hit_t)) {
+			continue;
+		}
+		if (node.right == 0) {
+			for (int i = node.first; i < node.first + node.count; ++i) {
+				// Ties go to the lowest index, so the result does not depend on the tree
+				if (RayHitsBox(bounds[bvh.items[i]], ray, inv_dir, max_t, &hit_t) && (hit < 0 || hit_t < max_t || bvh.items[i] < hit)) {
+					max_t = hit_t;
+					hit = bvh.items[i];
+				}
+			}
+			continue;
+		}
+
+		// The nearer child goes on top
+		int left = (int)(&node - bvh.nodes.data()) + 1;
+		float left_t, right_t;
+		bool left_hit = RayHitsBox(bvh.nodes[left].bounds, ray, inv_dir, max_t, &left_t);
+		bool right_hit = RayHitsBox(bvh.nodes[node.right].bounds, ray, inv_dir, max_t, &right_t);
+
+		if (left_hit && right_hit && left_t > right_t) {
+			stack[top++] = left;
+			stack[top++] = node.right;
+		} else {
+			if (right_hit) {
+				stack[top++] = node.right;
+			}
+			if (left_hit) {
+				stack[top++] = left;
+			}
+		}
+	}
+	*t = max_t;
+	return hit;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: SphereHitsBox
+//|
+//! \param box     [in] Box.
+//! \param sphere  [in] Sphere.
+//! \return true if the sphere and the box overlap.
+//|____________________________________________________________________
+
+bool SphereHitsBox(const gmtl::AABoxf& box, const gmtl::Spheref& sphere)
+{
+	float dist2 = 0.0f;
+
+	// Squared distance from the centre to the nearest point of the box
+	for (int a = 0; a < 3; ++a) {
+		float c = sphere.getCenter()[a];
+		float d = std::max(box.getMin()[a] - c, 0.0f) + std::max(c - box.getMax()[a], 0.0f);
+
+		dist2 += d * d;
+	}
+	return dist2 <= sphere.getRadius() * sphere.getRadius();
+}
+
+//|____________________________________________________________________
+//|
+//| Function: QueryBVHSphere
+//|
+//! \param bvh     [in] Hierarchy built over bounds.
+//! \param bounds  [in] Indexed boxes.
+//! \param sphere  [in] Sphere.
+//! \param result  [out] Indices of the boxes that overlap the sphere.
+//! \return None.
+//!
+//! Proximity query.
+//|____________________________________________________________________
+
+void QueryBVHSphere(const BVH& bvh, const std::vector<gmtl::AABoxf>& bounds, const gmtl::Spheref& sphere, std::vector<int>* result)
+{
+	int stack[BVH_MAX_DEPTH + 1];
+	int top = 0;
+
+	result->clear();
+	if (bvh.nodes.empty()) {
+		return;
+	}
+	stack[top++] = 0;
+	while (top > 0) {
+		int index = stack[--top];
+		const BVHNode& node = bvh.nodes[index];
+
+		if (!SphereHitsBox(node.bounds, sphere)) {
+			continue;
+		}
+		if (node.right == 0) {
+			for (int i = node.first; i < node.first + node.count; ++i) {
+				if (SphereHitsBox(bounds[bvh.items[i]], sphere)) {
+					result->push_back(bvh.items[i]);
+				}
+			}
+		} else {
+			stack[top++] = node.right;
+			stack[top++] = index + 1;
+		}
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BuildSceneryIndex
+//|
+//! \param None.
+//! \return None.
+//!
+//! Indexes the static objects and the seaweeds in scenery_bvh. Needs BuildMeshes() and
+//! BuildSeaweedField() to have run.
+//|____________________________________________________________________
+
+void BuildSceneryIndex()
+{
+	scenery_items.clear();
+	scenery_bounds.clear();
+
+	for (int b = 0; b < STATIC_BATCH_NB; ++b) {
+		for (size_t k = 0; k < static_objects[b].size(); ++k) {
+			scenery_items.push_back({ b, (int)k });
+			scenery_bounds.push_back(static_objects[b][k].bounds);
+		}
+		static_visible[b].resize(static_objects[b].size());
+	}
+
+	// A blade turns about its base, to any yaw once it faces the camera, so its box only widens
+	// along X and Z
+	for (size_t k = 0; k < seaweed_instances.size(); ++k) {
+		const SeaweedInstance& seaweed = seaweed_instances[k];
+		gmtl::Vec3f base = SCENERY_ORIGIN + gmtl::Vec3f(seaweed.pos_yaw[0], seaweed.pos_yaw[1], seaweed.pos_yaw[2]);
+		gmtl::Vec3f half(seaweed.size[0] / 2, seaweed.size[1] / 2, seaweed.size[0] / 2);
+
+		scenery_items.push_back({ -1, (int)k });
+		scenery_bounds.push_back(gmtl::AABoxf(gmtl::Point3f(base - half), gmtl::Point3f(base + half)));
+	}
+
+	BuildBVH(&scenery_bvh, scenery_bounds);
+	scenery_lod.assign(scenery_items.size(), 0);
+	seaweed_visible.reserve(seaweed_instances.size());
+	scenery_visible.reserve(scenery_items.size());
+}
+
+//|____________________________________________________________________
+//|
+//| Function: CullScenery
+//|
+//! \param None.
+//! \return None.
+//!
+//! Finds the scenery in view_frustum for DrawStaticWorld() and DrawSeaweedField(), and picks the
+//! level of detail of each item: rocks below full detail become impostors in MESH_ROCK_IMPOSTORS,
+//! seaweeds turn to face the camera, and items under a pixel are skipped. Expects the modelview
+//! matrix to hold the view transform.
+//|____________________________________________________________________
+
+void CullScenery()
+{
+	static const GLfloat QUAD_UV[4][3] = { { 0, 1, 0 }, { 1, 1, 0 }, { 1, 0, 0 }, { 0, 0, 0 } };
+	static const GLubyte WHITE[4] = { 255, 255, 255, 255 };
+	Mesh& impostors = meshes[MESH_ROCK_IMPOSTORS];
+	GLfloat view[16];
+	gmtl::Point3f eye;
+
+	// Camera position and axes in world space
+	glGetFloatv(GL_MODELVIEW_MATRIX, view);
+	gmtl::Vec3f right(view[0], view[4], view[8]), up(view[1], view[5], view[9]), back(view[2], view[6], view[10]);
+	for (int a = 0; a < 3; ++a) {
+		eye[a] = -(view[a * 4] * view[12] + view[a * 4 + 1] * view[13] + view[a * 4 + 2] * view[14]);
+	}
+
+	QueryBVHFrustum(scenery_bvh, scenery_bounds, view_frustum, &scenery_visible);
+
+	for (int b = 0; b < STATIC_BATCH_NB; ++b) {
+		std::fill(static_visible[b].begin(), static_visible[b].end(), 0);
+	}
+	seaweed_visible.clear();
+	impostors.vertices.clear();
+	impostors.indices.clear();
+	for (size_t i = 0; i < scenery_visible.size(); ++i) {
+		int id = scenery_visible[i];
+		const SceneryItem& item = scenery_items[id];
+		const gmtl::AABoxf& box = scenery_bounds[id];
+		gmtl::Point3f centre = (box.getMin() + box.getMax()) * 0.5f;
+		gmtl::Vec3f half = (box.getMax() - box.getMin()) * 0.5f;
+		LodChainID chain = item.batch < 0 ? LOD_SEAWEEDS : STATIC_BATCHES[item.batch].lod;
+		int level = 0;
+
+		if (chain != LOD_CHAIN_NB) {
+			float dist = gmtl::length(gmtl::Vec3f(centre - eye));
+
+			level = SelectLod(chain, 2.0f * gmtl::length(half) * lod_pixels_per_unit / std::max(dist, CAM_NEAR), scenery_lod[id]);
+			scenery_lod[id] = (unsigned char)level;
+			if (LOD_CHAINS[chain].meshes[level] == MESH_NB) {
+				continue;
+			}
+		}
+
+		if (item.batch < 0) {
+			SeaweedInstance seaweed = seaweed_instances[item.index];
+
+			if (level > 0) {
+				seaweed.pos_yaw[3] = atan2f(eye[0] - centre[0], eye[2] - centre[2]);
+			}
+			seaweed_visible.push_back(seaweed);
+		} else if (level == 0 || impostors.vertices.size() + 4 > USHRT_MAX + 1) {
+			static_visible[item.batch][item.index] = 1;
+		} else {
+			// A square facing the camera, about as wide on screen as the rock
+			float size = (half[0] + half[1] + half[2]) / 3;
+			GLfloat pos[4][3];
+
+			for (int a = 0; a < 3; ++a) {
+				pos[0][a] = centre[a] - (right[a] + up[a]) * size;
+				pos[1][a] = centre[a] + (right[a] - up[a]) * size;
+				pos[2][a] = centre[a] + (right[a] + up[a]) * size;
+				pos[3][a] = centre[a] - (right[a] - up[a]) * size;
+			}
+			AddMeshQuad(&impostors, pos, back.getData(), QUAD_UV, WHITE);
+		}
+	}
+	StreamMesh(&impostors);
+
+	cull_stats.visible = (int)scenery_visible.size();
+	cull_stats.culled = (int)(scenery_items.size() - scenery_visible.size());
+}
+
+//|____________________________________________________________________
+//|
+//| Function: ProjectedSize
+//|
+//! \param radius  [in] Radius of a sphere around the origin of the current modelview frame.
+//! \return Diameter of the sphere on screen, in pixels.
+//!
+//! Assumes the modelview matrix scales uniformly.
+//|____________________________________________________________________
+
+float ProjectedSize(float radius)
+{
+	GLfloat m[16];
+
+	glGetFloatv(GL_MODELVIEW_MATRIX, m);
+	float scale = sqrtf(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+	float dist = sqrtf(m[12] * m[12] + m[13] * m[13] + m[14] * m[14]);
+
+	return 2.0f * radius * scale * lod_pixels_per_unit / std::max(dist, CAM_NEAR);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: SelectLod
+//|
+//! \param chain    [in] Levels of detail of the object.
+//! \param pixels   [in] Projected diameter of the object.
+//! \param current  [in] Level the object was drawn at last.
+//! \return Level to draw the object at.
+//!
+//! Picks the level of detail of an object and counts it in lod_stats. An object only moves to a
+//! coarser level once it is LOD_HYSTERESIS below the threshold of its current level, and back once
+//! it is as far above, so one hovering around a threshold does not pop between the two.
+//|____________________________________________________________________
+
+int SelectLod(LodChainID chain, float pixels, int current)
+{
+	const float* min_pixels = LOD_CHAINS[chain].min_pixels;
+	int level = current;
+
+	while (level < LOD_LEVELS - 1 && pixels < min_pixels[level] * (1.0f - LOD_HYSTERESIS)) {
+		++level;
+	}
+	while (level > 0 && pixels > min_pixels[level - 1] * (1.0f + LOD_HYSTERESIS)) {
+		--level;
+	}
+	lod_stats.objects[chain][level]++;
+	return level;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: CompileShader
+//|
+//! \param type    [in] GL_VERTEX_SHADER or GL_FRAGMENT_SHADER.
+//! \param source  [in] GLSL source.
+//! \param name    [in] Name for the error messages.
+//! \return Shader object, 0 on failure.
+//!
+//! Compiles a shader, printing the info log when compilation fails.
+//|____________________________________________________________________
+
+GLuint CompileShader(GLenum type, const char* source, const char* name)
+{
+	GLuint shader = pglCreateShader(type);
+	GLint status = GL_FALSE;
+
+	pglShaderSource(shader, 1, &source, NULL);
+	pglCompileShader(shader);
+	pglGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (status != GL_TRUE) {
+		char log[1024] = "";
+
+		pglGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		fprintf(stderr, "%s: %s shader does not compile:\n%s\n", name, type == GL_VERTEX_SHADER ? "vertex" : "fragment", log);
+		pglDeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: LinkProgram
+//|
+//! \param name             [in] Name for the error messages.
+//! \param vertex_source    [in] GLSL source of the vertex shader.
+//! \param fragment_source  [in] GLSL source of the fragment shader.
+//! \param attribs          [in] NULL-terminated vertex attribute names.
+//! \param first_attrib     [in] Location of the first, the others following in order.
+//! \return Program object, 0 on failure.
+//!
+//! Compiles and links a shader program, printing the info logs when something fails.
+//|____________________________________________________________________
+
+GLuint LinkProgram(const char* name, const char* vertex_source, const char* fragment_source, const char* const* attribs,
+	GLuint first_attrib)
+{
+	GLuint vertex = CompileShader(GL_VERTEX_SHADER, vertex_source, name);
+	GLuint fragment = CompileShader(GL_FRAGMENT_SHADER, fragment_source, name);
+	GLint status = GL_FALSE;
+
+	if (vertex == 0 || fragment == 0) {
+		return 0;
+	}
+
+	GLuint program = pglCreateProgram();
+	pglAttachShader(program, vertex);
+	pglAttachShader(program, fragment);
+	for (int i = 0; attribs[i] != NULL; ++i) {
+		pglBindAttribLocation(program, first_attrib + i, attribs[i]);
+	}
+	pglLinkProgram(program);
+
+	// The program keeps the shaders alive as long as they are attached
+	pglDeleteShader(vertex);
+	pglDeleteShader(fragment);
+
+	pglGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status != GL_TRUE) {
+		char log[1024] = "";
+
+		pglGetProgramInfoLog(program, sizeof(log), NULL, log);
+		fprintf(stderr, "%s: program does not link:\n%s\n", name, log);
+		return 0;
+	}
+	return program;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: LightingSource
+//|
+//! \param fragment_source  [in] Fragment shader calling ShadeFragment().
+//! \return Source of the whole fragment shader: version, defines, LIGHT_SHADER, then fragment_source.
+//|____________________________________________________________________
+
+std::string LightingSource(const char* fragment_source)
+{
+	return std::string("#version 120\n#extension GL_ARB_uniform_buffer_object : require\n") +
+		"#define CLUSTERED " + (clustered_lighting ? "1" : "0") + "\n" +
+		"#define LIGHT_MAX_MATERIALS " + std::to_string(LIGHT_MAX_MATERIALS) + "\n" +
+		"#define MAX_POINT_LIGHTS " + std::to_string(MAX_POINT_LIGHTS) + "\n" + LIGHT_SHADER + fragment_source;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: InitPixelLighting
+//|
+//! \param None.
+//! \return None.
+//!
+//! Builds the per-pixel lighting program and its light and material uniform buffers. Without
+//! uniform buffers and framebuffer objects, or if the program does not build, lit_program stays 0
+//! and the render queue lights with the fixed-function pipeline. The point lights are only shaded
+//! with float textures to hold their clusters, and when some are asked for.
+//|____________________________________________________________________
+
+void InitPixelLighting()
+{
+	static const char* const ATTRIBS[] = { NULL };
+
+	if (!has_ubo || !has_fbo || pglActiveTexture == NULL) {
+		return;
+	}
+	clustered_lighting = has_float_textures && point_light_request > 0;
+	lit_program = LinkProgram("lit", LIT_VERTEX_SHADER, LightingSource(LIT_FRAGMENT_SHADER).c_str(), ATTRIBS, 0);
+	if (lit_program == 0) {
+		clustered_lighting = false;
+		return;
+	}
+	pglUseProgram(lit_program);
+	pglUniform1i(pglGetUniformLocation(lit_program, "diffuse_map"), 0);
+	lit_material_loc = pglGetUniformLocation(lit_program, "material");
+	lit_textured_loc = pglGetUniformLocation(lit_program, "textured");
+	pglUseProgram(0);
+	pglUniformBlockBinding(lit_program, pglGetUniformBlockIndex(lit_program, "Materials"), UB_MATERIALS);
+	lit_cluster_scale_loc = BindLightUniforms(lit_program);
+
+	// The buffers stay bound to their binding points; only their contents change
+	pglGenBuffers(1, &light_ubo);
+	pglBindBuffer(GL_UNIFORM_BUFFER, light_ubo);
+	pglBufferData(GL_UNIFORM_BUFFER, sizeof(LightBlock), NULL, GL_STREAM_DRAW);
+	pglBindBufferBase(GL_UNIFORM_BUFFER, UB_LIGHT, light_ubo);
+	pglGenBuffers(1, &material_ubo);
+	pglBindBuffer(GL_UNIFORM_BUFFER, material_ubo);
+	pglBufferData(GL_UNIFORM_BUFFER, sizeof(Material) * LIGHT_MAX_MATERIALS, NULL, GL_STREAM_DRAW);
+	pglBindBufferBase(GL_UNIFORM_BUFFER, UB_MATERIALS, material_ubo);
+	pglBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: InitPointLights
+//|
+//! \param count  [in] Number of point lights, at most MAX_POINT_LIGHTS.
+//! \return None.
+//!
+//! Scatters the point lights over the scenery, and makes their uniform buffer and the cluster
+//! textures. Leaves no lights unless the programs shade them: needs InitPixelLighting() to have run.
+//|____________________________________________________________________
+
+void InitPointLights(int count)
+{
+	static const GLfloat HUES[3][4] = { { 0.1f, 0.9f, 0.8f, 1.0f }, { 0.4f, 1.0f, 0.3f, 1.0f }, { 0.8f, 0.3f, 1.0f, 1.0f } };
+	uint32_t seed = 0x2545f491;
+
+	// Uniform in [0, 1), fixed so every run lays the lights out alike
+	auto random = [&seed]() {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		return (seed >> 8) / 16777216.0f;
+	};
+
+	if (!clustered_lighting) {
+		return;
+	}
+
+	point_lights.resize(count);
+	for (int i = 0; i < count; ++i) {
+		PointLight& light = point_lights[i];
+		float intensity = 0.6f + 0.6f * random();
+
+		light.home = gmtl::Point3f(SCENERY_ORIGIN[0] + random() * SB_SIZE, SCENERY_ORIGIN[1] - random() * SB_SIZE / 2,
+			SCENERY_ORIGIN[2] + random() * SB_SIZE);
+		light.radius = POINT_LIGHT_RADIUS * (0.5f + random());
+		for (int c = 0; c < 3; ++c) {
+			light.colour[c] = HUES[i % 3][c] * intensity;
+		}
+		light.colour[3] = 1.0f;
+		light.phase = random() * 2 * gmtl::Math::PI;
+	}
+
+	pglGenBuffers(1, &point_light_ubo);
+	pglBindBuffer(GL_UNIFORM_BUFFER, point_light_ubo);
+	pglBufferData(GL_UNIFORM_BUFFER, sizeof(GLfloat) * 8 * MAX_POINT_LIGHTS, NULL, GL_STREAM_DRAW);
+	pglBindBufferBase(GL_UNIFORM_BUFFER, UB_POINT_LIGHTS, point_light_ubo);
+	pglBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	// The cluster textures keep their own units, which the fixed-function pipeline leaves disabled
+	memset(light_cluster_ranges, 0, sizeof(light_cluster_ranges));
+	glGenTextures(2, cluster_textures);
+	pglActiveTexture(GL_TEXTURE0 + CLUSTER_RANGE_UNIT);
+	glBindTexture(GL_TEXTURE_2D, cluster_textures[0]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, CLUSTER_TILES_X * CLUSTER_TILES_Y, CLUSTER_SLICES, 0, GL_RG, GL_FLOAT, light_cluster_ranges);
+	pglActiveTexture(GL_TEXTURE0 + CLUSTER_INDEX_UNIT);
+	glBindTexture(GL_TEXTURE_2D, cluster_textures[1]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, CLUSTER_INDEX_WIDTH, CLUSTER_INDEX_ROWS, 0, GL_RED, GL_FLOAT, NULL);
+	pglActiveTexture(GL_TEXTURE0);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BindLightUniforms
+//|
+//! \param program  [in] Program built with LIGHT_SHADER.
+//! \return Location of its cluster_scale uniform, set every frame by UpdatePointLights().
+//!
+//! Points a program lighting per pixel at the light uniform blocks, the cluster textures and the
+//! shadow maps. Without clustered_lighting, the program has no point lights to point.
+//|____________________________________________________________________
+
+GLint BindLightUniforms(GLuint program)
+{
+	pglUniformBlockBinding(program, pglGetUniformBlockIndex(program, "Light"), UB_LIGHT);
+	if (clustered_lighting) {
+		pglUniformBlockBinding(program, pglGetUniformBlockIndex(program, "PointLights"), UB_POINT_LIGHTS);
+	}
+
+	pglUseProgram(program);
+	pglUniform1i(pglGetUniformLocation(program, "light_clusters"), CLUSTER_RANGE_UNIT);
+	pglUniform1i(pglGetUniformLocation(program, "light_indices"), CLUSTER_INDEX_UNIT);
+	pglUniform4f(pglGetUniformLocation(program, "cluster_grid"), CLUSTER_TILES_X, CLUSTER_TILES_Y, CLUSTER_SLICES, CLUSTER_INDEX_WIDTH);
+	pglUniform1f(pglGetUniformLocation(program, "light_index_rows"), CLUSTER_INDEX_ROWS);
+	pglUniform1i(pglGetUniformLocation(program, "static_shadow"), SHADOW_MAP_UNITS[SHADOW_STATIC]);
+	pglUniform1i(pglGetUniformLocation(program, "turtle_shadow"), SHADOW_MAP_UNITS[SHADOW_TURTLE]);
+	GLint scale_loc = pglGetUniformLocation(program, "cluster_scale");
+	pglUseProgram(0);
+	return scale_loc;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: ClusterSlice
+//|
+//! \param depth  [in] Distance in front of the camera.
+//! \return Cluster slice holding the depth, clamped to the slices.
+//!
+//! The slices split CAM_NEAR to CAM_FAR exponentially, so clusters stay about as deep as they are
+//! wide.
+//|____________________________________________________________________
+
+int ClusterSlice(float depth)
+{
+	int slice = (int)floorf(logf(depth / CAM_NEAR) / logf(CAM_FAR / CAM_NEAR) * CLUSTER_SLICES);
+
+	return std::min(std::max(slice, 0), CLUSTER_SLICES - 1);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: ClusterSliceDepth
+//|
+//! \param slice  [in] Cluster slice, CLUSTER_SLICES for the far plane.
+//! \return Distance in front of the camera the slice starts at.
+//|____________________________________________________________________
+
+float ClusterSliceDepth(int slice)
+{
+	return CAM_NEAR * powf(CAM_FAR / CAM_NEAR, (float)slice / CLUSTER_SLICES);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BinLightSlice
+//|
+//! \param slice  [in] Cluster slice to fill.
+//! \param p00    [in] Horizontal and vertical scales of the projection.
+//! \param p11
+//! \return None.
+//!
+//! Lists the lights of light_bounds that reach each cluster of a slice, in light_cluster_ranges and
+//! slice_light_indices. A light is taken to reach the tiles its bounding box covers over the depths
+//! the slice and the light share. Slices have no data in common, so they can be binned in parallel.
+//|____________________________________________________________________
+
+void BinLightSlice(int slice, float p00, float p11)
+{
+	struct TileRect {
+		int light;
+		int x0, x1, y0, y1;
+	};
+	GLfloat (*ranges)[2] = light_cluster_ranges[slice];
+	std::vector<GLfloat>& indices = slice_light_indices[slice];
+	std::vector<TileRect> rects;
+	int cursor[CLUSTER_TILES_X * CLUSTER_TILES_Y] = { 0 };
+	float slice_near = ClusterSliceDepth(slice), slice_far = ClusterSliceDepth(slice + 1);
+
+	for (size_t i = 0; i < light_bounds.size(); ++i) {
+		const LightBounds& bounds = light_bounds[i];
+
+		if (slice < bounds.first_slice || slice > bounds.last_slice) {
+			continue;
+		}
+
+		// Over a range of depths, x / depth is furthest out at the nearest or the farthest one
+		const float* c = bounds.centre;
+		float r = bounds.radius;
+		float d0 = std::max(slice_near, -c[2] - r), d1 = std::min(slice_far, -c[2] + r);
+		float x0 = std::min((c[0] - r) / d0, (c[0] - r) / d1) * p00, x1 = std::max((c[0] + r) / d0, (c[0] + r) / d1) * p00;
+		float y0 = std::min((c[1] - r) / d0, (c[1] - r) / d1) * p11, y1 = std::max((c[1] + r) / d0, (c[1] + r) / d1) * p11;
+
+		if (x0 > 1.0f || x1 < -1.0f || y0 > 1.0f || y1 < -1.0f) {
+			continue;
+		}
+
+		TileRect rect = { bounds.light,
+			std::max((int)floorf((x0 * 0.5f + 0.5f) * CLUSTER_TILES_X), 0), std::min((int)floorf((x1 * 0.5f + 0.5f) * CLUSTER_TILES_X), CLUSTER_TILES_X - 1),
+			std::max((int)floorf((y0 * 0.5f + 0.5f) * CLUSTER_TILES_Y), 0), std::min((int)floorf((y1 * 0.5f + 0.5f) * CLUSTER_TILES_Y), CLUSTER_TILES_Y - 1) };
+		rects.push_back(rect);
+		for (int y = rect.y0; y <= rect.y1; ++y) {
+			for (int x = rect.x0; x <= rect.x1; ++x) {
+				cursor[y * CLUSTER_TILES_X + x]++;
+			}
+		}
+	}
+
+	// Counts to ranges, then the lights in place
+	int first = 0;
+	for (int t = 0; t < CLUSTER_TILES_X * CLUSTER_TILES_Y; ++t) {
+		ranges[t][0] = (GLfloat)first;
+		ranges[t][1] = (GLfloat)cursor[t];
+		cursor[t] = first;
+		first += (int)ranges[t][1];
+	}
+	indices.resize(first);
+	for (size_t i = 0; i < rects.size(); ++i) {
+		for (int y = rects[i].y0; y <= rects[i].y1; ++y) {
+			for (int x = rects[i].x0; x <= rects[i].x1; ++x) {
+				indices[cursor[y * CLUSTER_TILES_X + x]++] = (GLfloat)rects[i].light;
+			}
+		}
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: UpdatePointLights
+//|
+//! \param None.
+//! \return None.
+//!
+//! Moves the point lights along their drift, and bins the ones in view into the clusters of the
+//! frame, one slice per job on the worker threads. Uploads the lights and the clusters for
+//! ShadeFragment(), which then only loops over the lights of its own cluster. With no light in view
+//! and the clusters already empty, there is nothing to bin or upload. Expects scene_view,
+//! view_frustum and w_width, w_height to be those of the frame.
+//|____________________________________________________________________
+
+void UpdatePointLights()
+{
+	if (!clustered_lighting) {
+		return;
+	}
+
+	double start_ms = GetTimeMs();
+	float seconds = (float)(start_ms / 1000.0);
+	float p11 = 1.0f / tanf(gmtl::Math::deg2Rad(CAM_FOV) / 2), p00 = p11 * w_height / w_width;
+	std::vector<GLfloat> block(8 * point_lights.size());
+
+	// Eye space positions, and the slices each light reaches
+	light_bounds.clear();
+	for (size_t i = 0; i < point_lights.size(); ++i) {
+		const PointLight& light = point_lights[i];
+		float drift = seconds * POINT_LIGHT_SPEED + light.phase;
+		gmtl::Point3f world(light.home[0] + sinf(drift) * POINT_LIGHT_DRIFT, light.home[1] + sinf(drift * 1.3f) * POINT_LIGHT_DRIFT,
+			light.home[2] + cosf(drift) * POINT_LIGHT_DRIFT);
+		GLfloat* position = &block[i * 8];
+
+		for (int r = 0; r < 3; ++r) {
+			position[r] = scene_view(r, 0) * world[0] + scene_view(r, 1) * world[1] + scene_view(r, 2) * world[2] + scene_view(r, 3);
+		}
+		position[3] = light.radius;
+		memcpy(&block[i * 8 + 4], light.colour, sizeof(light.colour));
+
+		unsigned int planes = 0x3f;
+		gmtl::Vec3f reach(light.radius, light.radius, light.radius);
+		if (!ClassifyBox(view_frustum, gmtl::AABoxf(gmtl::Point3f(world - reach), gmtl::Point3f(world + reach)), &planes)) {
+			continue;
+		}
+		float depth = -position[2];
+		LightBounds bounds = { (int)i, { position[0], position[1], position[2] }, light.radius,
+			ClusterSlice(std::max(depth - light.radius, CAM_NEAR)), ClusterSlice(std::min(depth + light.radius, CAM_FAR)) };
+		light_bounds.push_back(bounds);
+	}
+
+	if (light_bounds.empty() && clusters_empty) {
+		cluster_stats = ClusterStats();
+		cluster_stats.bin_ms = GetTimeMs() - start_ms;
+		return;
+	}
+
+	ParallelFor(CLUSTER_SLICES, [p00, p11](int slice) { BinLightSlice(slice, p00, p11); });
+	cluster_stats.bin_ms = GetTimeMs() - start_ms;
+
+	// Slices back to back, as far as the index texture goes
+	int capacity = CLUSTER_INDEX_WIDTH * CLUSTER_INDEX_ROWS, total = 0, most = 0;
+	light_indices.clear();
+	for (int s = 0; s < CLUSTER_SLICES; ++s) {
+		int base = (int)light_indices.size();
+		int kept = std::min((int)slice_light_indices[s].size(), capacity - base);
+
+		for (int t = 0; t < CLUSTER_TILES_X * CLUSTER_TILES_Y; ++t) {
+			GLfloat* range = light_cluster_ranges[s][t];
+
+			most = std::max(most, (int)range[1]);
+			total += (int)range[1];
+			range[1] = (GLfloat)std::max(std::min((int)range[1], kept - (int)range[0]), 0);
+			range[0] += base;
+		}
+		light_indices.insert(light_indices.end(), slice_light_indices[s].begin(), slice_light_indices[s].begin() + kept);
+	}
+
+	// Uploads: the lights, the ranges, and the rows of indices in use
+	pglBindBuffer(GL_UNIFORM_BUFFER, point_light_ubo);
+	pglBufferData(GL_UNIFORM_BUFFER, sizeof(GLfloat) * 8 * MAX_POINT_LIGHTS, NULL, GL_STREAM_DRAW);
+	if (!block.empty()) {
+		pglBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(GLfloat) * block.size(), block.data());
+	}
+	pglBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	pglActiveTexture(GL_TEXTURE0 + CLUSTER_RANGE_UNIT);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CLUSTER_TILES_X * CLUSTER_TILES_Y, CLUSTER_SLICES, GL_RG, GL_FLOAT, light_cluster_ranges);
+	int rows = ((int)light_indices.size() + CLUSTER_INDEX_WIDTH - 1) / CLUSTER_INDEX_WIDTH;
+	if (rows > 0) {
+		light_indices.resize(rows * CLUSTER_INDEX_WIDTH, 0.0f);
+		pglActiveTexture(GL_TEXTURE0 + CLUSTER_INDEX_UNIT);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CLUSTER_INDEX_WIDTH, rows, GL_RED, GL_FLOAT, light_indices.data());
+	}
+	pglActiveTexture(GL_TEXTURE0);
+
+	// Fragment coordinates and depths to clusters, for the current viewport
+	float slices_per_log = CLUSTER_SLICES / logf(CAM_FAR / CAM_NEAR);
+	GLint scale_locs[3] = { lit_cluster_scale_loc, seaweed_cluster_scale_loc, fleet_cluster_scale_loc };
+	GLuint programs[3] = { lit_program, seaweed_program, fleet_program };
+	for (int p = 0; p < 3; ++p) {
+		if (programs[p] != 0) {
+			pglUseProgram(programs[p]);
+			pglUniform4f(scale_locs[p], (float)CLUSTER_TILES_X / w_width, (float)CLUSTER_TILES_Y / w_height, slices_per_log,
+				-logf(CAM_NEAR) * slices_per_log);
+		}
+	}
+	pglUseProgram(0);
+
+	clusters_empty = total == 0;
+	cluster_stats.lights = (int)light_bounds.size();
+	cluster_stats.indices = total;
+	cluster_stats.dropped = total - std::min(total, capacity);
+	cluster_stats.most = most;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: InitShadowMaps
+//|
+//! \param None.
+//! \return None.
+//!
+//! Makes the depth textures and framebuffers of the shadow maps when lighting per pixel, and binds
+//! the textures to their units for good. They are rendered by the first UpdateShadowMaps().
+//|____________________________________________________________________
+
+void InitShadowMaps()
+{
+	static const GLfloat BORDER[4] = { 1, 1, 1, 1 };
+
+	if (lit_program == 0) {
+		return;
+	}
+
+	for (int id = 0; id < SHADOW_MAP_NB; ++id) {
+		ShadowMap& map = shadow_maps[id];
+
+		// Compared, so a lookup returns the filtered fraction of the texels the fragment is in front of.
+		// Off the map is the far plane, which nothing is behind
+		pglActiveTexture(GL_TEXTURE0 + SHADOW_MAP_UNITS[id]);
+		glGenTextures(1, &map.texture);
+		glBindTexture(GL_TEXTURE_2D, map.texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+		glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, BORDER);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, SHADOW_MAP_SIZES[id], SHADOW_MAP_SIZES[id], 0, GL_DEPTH_COMPONENT,
+			GL_UNSIGNED_INT, NULL);
+
+		pglGenFramebuffers(1, &map.fbo);
+		pglBindFramebuffer(GL_FRAMEBUFFER, map.fbo);
+		pglFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, map.texture, 0);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		if (pglCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			fprintf(stderr, "shadows: cannot render into a %dx%d depth texture\n", SHADOW_MAP_SIZES[id], SHADOW_MAP_SIZES[id]);
+		}
+		pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+		map.valid = false;
+	}
+	pglActiveTexture(GL_TEXTURE0);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: LightView
+//|
+//! \param light   [in] Light position.
+//! \param target  [in] Point to look at.
+//! \return World to light space transform, looking down -Z as a camera does.
+//|____________________________________________________________________
+
+gmtl::Matrix44f LightView(const gmtl::Point3f& light, const gmtl::Point3f& target)
+{
+	gmtl::Vec3f back = light - target, right, up;
+	gmtl::Matrix44f view;
+
+	// Up is whichever world axis is furthest from the line of sight
+	gmtl::normalize(back);
+	int axis = 0;
+	for (int a = 1; a < 3; ++a) {
+		if (fabsf(back[a]) < fabsf(back[axis])) {
+			axis = a;
+		}
+	}
+	up[axis] = 1;
+	gmtl::cross(right, up, back);
+	gmtl::normalize(right);
+	gmtl::cross(up, back, right);
+
+	for (int c = 0; c < 3; ++c) {
+		view(0, c) = right[c];
+		view(1, c) = up[c];
+		view(2, c) = back[c];
+	}
+	for (int r = 0; r < 3; ++r) {
+		view(r, 3) = -(view(r, 0) * light[0] + view(r, 1) * light[1] + view(r, 2) * light[2]);
+	}
+	return view;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: LightProjection
+//|
+//! \param tan_half  [in] Tangent of half the field of view, across and down.
+//! \param near      [in] Near plane distance.
+//! \param far       [in] Far plane distance.
+//! \return Square perspective projection, as gluPerspective() would make it.
+//|____________________________________________________________________
+
+gmtl::Matrix44f LightProjection(float tan_half, float near, float far)
+{
+	gmtl::Matrix44f projection;
+
+	projection(0, 0) = projection(1, 1) = 1.0f / tan_half;
+	projection(2, 2) = (far + near) / (near - far);
+	projection(2, 3) = 2 * far * near / (near - far);
+	projection(3, 2) = -1;
+	projection(3, 3) = 0;
+	return projection;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: FitStaticShadowMap
+//|
+//! \param light  [in] Light position.
+//! \return None.
+//!
+//! Aims the static shadow map from the light at the middle of the static world, wide and deep
+//! enough for all of it. The field of view is capped at SHADOW_MAX_TAN when the light is among the
+//! scenery.
+//|____________________________________________________________________
+
+void FitStaticShadowMap(const gmtl::Point3f& light)
+{
+	ShadowMap& map = shadow_maps[SHADOW_STATIC];
+	gmtl::AABoxf world;
+	float tan_half = 0, near = FLT_MAX, far = SHADOW_NEAR;
+
+	for (int b = 0; b < STATIC_BATCH_NB; ++b) {
+		for (size_t k = 0; k < static_objects[b].size(); ++k) {
+			gmtl::extendVolume(world, static_objects[b][k].bounds);
+		}
+	}
+	map.view = LightView(light, gmtl::Point3f((world.getMin() + world.getMax()) * 0.5f));
+
+	for (int corner = 0; corner < 8; ++corner) {
+		float p[3];
+
+		for (int r = 0; r < 3; ++r) {
+			p[r] = map.view(r, 3);
+			for (int a = 0; a < 3; ++a) {
+				p[r] += map.view(r, a) * ((corner >> a) & 1 ? world.getMax()[a] : world.getMin()[a]);
+			}
+		}
+		tan_half = -p[2] > SHADOW_NEAR ? std::max(tan_half, std::max(fabsf(p[0]), fabsf(p[1])) / -p[2]) : SHADOW_MAX_TAN;
+		near = std::min(near, -p[2]);
+		far = std::max(far, -p[2]);
+	}
+	map.light = light;
+	map.tan_half = std::min(tan_half, SHADOW_MAX_TAN);
+	map.projection = LightProjection(map.tan_half, std::max(near, SHADOW_NEAR), far);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: FitTurtleShadowMap
+//|
+//! \param light  [in] Light position.
+//! \return None.
+//!
+//! Aims the turtle's shadow map from the light at the turtle, just wide enough for its bounding
+//! sphere, so the small map still has fine texels. A light too close for that shares the static
+//! map's frustum. Expects FitStaticShadowMap() to have run for the same light.
+//|____________________________________________________________________
+
+void FitTurtleShadowMap(const gmtl::Point3f& light)
+{
+	const ShadowMap& wide = shadow_maps[SHADOW_STATIC];
+	ShadowMap& map = shadow_maps[SHADOW_TURTLE];
+	const gmtl::Matrix44f& turtle = scene_nodes[NODE_TURTLE].world;
+	gmtl::Point3f centre(turtle(0, 3), turtle(1, 3), turtle(2, 3));
+	float dist = gmtl::length(gmtl::Vec3f(centre - light)), radius = TURTLE_SHADOW_RADIUS;
+	float tan_half = dist > radius ? radius / sqrtf(dist * dist - radius * radius) : FLT_MAX;
+
+	map.light = light;
+	if (tan_half < wide.tan_half) {
+		map.view = LightView(light, centre);
+		map.tan_half = tan_half;
+		map.projection = LightProjection(tan_half, dist - radius, dist + radius);
+	} else {
+		map.view = wide.view;
+		map.tan_half = wide.tan_half;
+		map.projection = LightProjection(wide.tan_half, SHADOW_NEAR, dist + radius);
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: RenderShadowMap
+//|
+//! \param id  [in] Shadow map to render, already fitted.
+//! \return None.
+//!
+//! Renders the depth of the static world, or of the turtle, as seen from the light. Leaves the
+//! framebuffer, viewport and matrices as it found them.
+//|____________________________________________________________________
+
+void RenderShadowMap(ShadowMapID id)
+{
+	const ShadowMap& map = shadow_maps[id];
+	GLint framebuffer, viewport[4];
+
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	pglBindFramebuffer(GL_FRAMEBUFFER, map.fbo);
+	glViewport(0, 0, SHADOW_MAP_SIZES[id], SHADOW_MAP_SIZES[id]);
+	glClear(GL_DEPTH_BUFFER_BIT);
+
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glDisable(GL_LIGHTING);
+	glEnable(GL_POLYGON_OFFSET_FILL);
+	glPolygonOffset(SHADOW_OFFSET_FACTOR, SHADOW_OFFSET_UNITS);
+
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadMatrixf(map.projection.getData());
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glLoadMatrixf(map.view.getData());
+
+	if (id == SHADOW_STATIC) {
+		// Whole batches, baked in world space: the light's frustum holds all of them
+		for (int b = 0; b < STATIC_BATCH_NB; ++b) {
+			DrawMesh(STATIC_BATCHES[b].mesh);
+		}
+	} else {
+		DrawTurtle(map.view, false);
+		SubmitRenderQueueDepth();
+	}
+
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	glPopMatrix();
+
+	glDisable(GL_POLYGON_OFFSET_FILL);
+	glEnable(GL_LIGHTING);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	pglBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+	shadow_stats.renders[id]++;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: UpdateShadowMaps
+//|
+//! \param None.
+//! \return None.
+//!
+//! Re-renders the shadow maps that are out of date: the static map only when light_pos has moved,
+//! and the turtle's when the light or any part of the turtle has. A frame where only the camera
+//! moves renders neither. Expects UpdateSceneGraph() to have run for the frame.
+//|____________________________________________________________________
+
+void UpdateShadowMaps()
+{
+	gmtl::Point3f light(light_pos[0], light_pos[1], light_pos[2]);
+	bool light_moved = !shadow_maps[SHADOW_STATIC].valid || shadow_maps[SHADOW_STATIC].light != light;
+	bool turtle_moved = light_moved || !shadow_maps[SHADOW_TURTLE].valid;
+
+	if (lit_program == 0) {
+		return;
+	}
+	shadow_stats.frames++;
+
+	// The turtle camera hangs off the turtle, but casts nothing
+	for (int id = NODE_TURTLE; id <= NODE_CANNON; ++id) {
+		turtle_moved = turtle_moved || (id != NODE_TURTLE_CAMERA && scene_nodes[id].updated);
+	}
+	if (!turtle_moved) {
+		return;
+	}
+
+	// The cannon picks its level of detail for the camera, not for the light
+	double start_ms = GetTimeMs();
+	unsigned char lod = cannon_lod;
+
+	if (light_moved) {
+		FitStaticShadowMap(light);
+		RenderShadowMap(SHADOW_STATIC);
+		shadow_maps[SHADOW_STATIC].valid = true;
+	}
+	FitTurtleShadowMap(light);
+	RenderShadowMap(SHADOW_TURTLE);
+	shadow_maps[SHADOW_TURTLE].valid = true;
+
+	cannon_lod = lod;
+	shadow_stats.render_ms += GetTimeMs() - start_ms;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BuildSeaweedField
+//|
+//! \param count  [in] Number of seaweeds, 0 for the default field.
+//! \return None.
+//!
+//! Lays out the seaweed field and, when the context supports instancing, uploads it as an instance
+//! buffer. The default field is the original semi-random grid of num_seaweeds per side; larger
+//! counts grow the grid over the same area. Needs BuildMeshes() to have run.
+//|____________________________________________________________________
+
+void BuildSeaweedField(int count)
+{
+	static const char* const ATTRIBS[] = { "pos_yaw", "size", "tint", NULL };     // In SeaweedAttrib order
+	int side = num_seaweeds;
+
+	// About 64% of the grid cells hold a seaweed
+	if (count > 0) {
+		side = std::max(side, (int)sqrt(count / 0.64) + 1);
+	}
+	for (;; ++side) {
+		seaweed_instances.clear();
+		for (int i = 1; i < side; ++i) {
+			for (int j = 1; j < side; ++j) {
+				if (j * i % 5 != 0) { // semi-random
+					float shade = 0.85f + 0.05f * ((i * 7 + j * 13) % 4);
+					SeaweedInstance seaweed = { { SB_SIZE / side * i + 50, -500, SB_SIZE / side * j + 50,
+						gmtl::Math::deg2Rad(20.0f * ((i * j) % 18)) }, { SEAWEED_WIDTH, float((200 * i * j) % 700 + 100) },
+						{ GLubyte(colour_seaweed0[0] * shade * 255), GLubyte(colour_seaweed0[1] * shade * 255),
+						GLubyte(colour_seaweed0[2] * shade * 255), 255 } };
+
+					seaweed_instances.push_back(seaweed);
+				}
+			}
+		}
+		if ((int)seaweed_instances.size() >= count) {
+			break;
+		}
+	}
+	if (count > 0) {
+		seaweed_instances.resize(count);
+	}
+
+	// The shader takes its lights from the light uniform blocks
+	if (!has_instancing || lit_program == 0) {
+		return;
+	}
+	if (seaweed_program == 0) {
+		seaweed_program = LinkProgram("seaweed", SEAWEED_VERTEX_SHADER, LightingSource(SEAWEED_FRAGMENT_SHADER).c_str(), ATTRIBS,
+			SA_POS_YAW);
+		if (seaweed_program == 0) {
+			return;
+		}
+		pglUseProgram(seaweed_program);
+		pglUniform1i(pglGetUniformLocation(seaweed_program, "scenery"), 0);
+		pglUniform1f(pglGetUniformLocation(seaweed_program, "alpha_ref"), ALPHA_TEST_REF);
+		pglUniform4f(pglGetUniformLocation(seaweed_program, "specular"), SPECULAR_COL[0], SPECULAR_COL[1], SPECULAR_COL[2], 20.0f);
+		seaweed_region_loc = pglGetUniformLocation(seaweed_program, "region");
+		pglUseProgram(0);
+		seaweed_cluster_scale_loc = BindLightUniforms(seaweed_program);
+
+		pglGenBuffers(1, &seaweed_vbo);
+		pglGenVertexArrays(1, &seaweed_vao);
+	}
+
+	// The seaweed mesh advances per vertex, the instance buffer per seaweed
+	pglBindVertexArray(seaweed_vao);
+	SetMeshArrays(meshes[MESH_SEAWEED]);
+	pglBindBuffer(GL_ARRAY_BUFFER, seaweed_vbo);
+	pglEnableVertexAttribArray(SA_POS_YAW);
+	pglVertexAttribPointer(SA_POS_YAW, 4, GL_FLOAT, GL_FALSE, sizeof(SeaweedInstance), (const void*)offsetof(SeaweedInstance, pos_yaw));
+	pglVertexAttribDivisor(SA_POS_YAW, 1);
+	pglEnableVertexAttribArray(SA_SIZE);
+	pglVertexAttribPointer(SA_SIZE, 2, GL_FLOAT, GL_FALSE, sizeof(SeaweedInstance), (const void*)offsetof(SeaweedInstance, size));
+	pglVertexAttribDivisor(SA_SIZE, 1);
+	pglEnableVertexAttribArray(SA_TINT);
+	pglVertexAttribPointer(SA_TINT, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(SeaweedInstance), (const void*)offsetof(SeaweedInstance, tint));
+	pglVertexAttribDivisor(SA_TINT, 1);
+	pglBindVertexArray(0);
+	pglBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: DrawSeaweedField
+//|
+//! \param None.
+//! \return None.
+//!
+//! Draws the seaweeds CullScenery() found in view in a single instanced draw call, or queues them
+//! one at a time without instancing support. The scenery atlas is bound by the caller.
+//|____________________________________________________________________
+
+void DrawSeaweedField()
+{
+	if (seaweed_visible.empty()) {
+		return;
+	}
+
+	if (seaweed_program == 0) {
+		for (size_t k = 0; k < seaweed_visible.size(); ++k) {
+			const SeaweedInstance& seaweed = seaweed_visible[k];
+			float tint[4] = { seaweed.tint[0] / 255.0f, seaweed.tint[1] / 255.0f, seaweed.tint[2] / 255.0f, 1.0f };
+
+			glPushMatrix();
+				glTranslatef(seaweed.pos_yaw[0], seaweed.pos_yaw[1], seaweed.pos_yaw[2]);
+				glRotatef(gmtl::Math::rad2Deg(seaweed.pos_yaw[3]), 0.0f, 1.0f, 0.0f);
+				DrawSeaweed(seaweed.size[0], seaweed.size[1], 0.0f, tint);
+			glPopMatrix();
+		}
+		return;
+	}
+
+	const float* uv = atlas_uv[AR_SEAWEED];
+
+	// Reallocating the buffer rather than overwriting it spares waiting for the previous frame's draw
+	pglBindBuffer(GL_ARRAY_BUFFER, seaweed_vbo);
+	pglBufferData(GL_ARRAY_BUFFER, seaweed_visible.size() * sizeof(SeaweedInstance), seaweed_visible.data(), GL_STREAM_DRAW);
+	pglBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	pglUseProgram(seaweed_program);
+	pglUniform4f(seaweed_region_loc, uv[0], uv[1], uv[2] - uv[0], uv[3] - uv[1]);
+	pglBindVertexArray(seaweed_vao);
+	pglDrawElementsInstanced(GL_TRIANGLES, (GLsizei)meshes[MESH_SEAWEED].indices.size(), GL_UNSIGNED_SHORT, NULL,
+		(GLsizei)seaweed_visible.size());
+	lod_stats.vertices += (int)(meshes[MESH_SEAWEED].indices.size() * seaweed_visible.size());
+	pglUseProgram(0);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: InitFleet
+//|
+//! \param count  [in] Number of turtles.
+//! \return None.
+//!
+//! Scatters the turtle fleet over the scenery, each turtle in one of the schools, and makes the fleet's
+//! instancing shader and buffers when the context supports instancing. Needs BuildMeshes() to have
+//! run to draw them.
+//|____________________________________________________________________
+
+void InitFleet(int count)
+{
+	static const char* const ATTRIBS[] = { "row0", "row1", "row2", "tint", NULL };      // In FleetAttrib order
+	uint32_t seed = 0x6d2b79f5;
+
+	// Uniform in [0, 1), fixed so every run lays the fleet out alike
+	auto random = [&seed]() {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		return (seed >> 8) / 16777216.0f;
+	};
+
+	for (int f = 0; f < FLEET_FLOAT_NB; ++f) {
+		fleet.floats[f].reserve(count);
+	}
+	fleet.tints.reserve(count);
+	fleet.schools.reserve(count);
+	fleet.handles.reserve(count);
+	for (int i = 0; i < count; ++i) {
+		gmtl::Point3f pos(SCENERY_ORIGIN[0] + random() * SB_SIZE, SCENERY_ORIGIN[1] - random() * SB_SIZE / 2,
+			SCENERY_ORIGIN[2] + random() * SB_SIZE);
+		int school = i % FLEET_SCHOOLS;
+
+		// Each school a shade of brown of its own
+		float shade = 0.7f + 0.4f * school / (FLEET_SCHOOLS - 1) + 0.1f * random();
+		GLubyte tint[4] = { GLubyte(colour_brown[0] * shade * 255), GLubyte(colour_brown[1] * shade * 255),
+			GLubyte(colour_brown[2] * shade * 255), 255 };
+
+		AddTurtle(pos, random() * 2 * gmtl::Math::PI, FLEET_SPEED * (0.5f + random()), FLEET_TURN * (2 * random() - 1),
+			random() * 2 * gmtl::Math::PI, school, tint);
+	}
+
+	// The shader takes its lights from the light uniform blocks
+	if (!has_instancing || lit_program == 0) {
+		return;
+	}
+	fleet_program = LinkProgram("fleet", FLEET_VERTEX_SHADER, LightingSource(FLEET_FRAGMENT_SHADER).c_str(), ATTRIBS, FA_ROW0);
+	if (fleet_program == 0) {
+		return;
+	}
+	pglUseProgram(fleet_program);
+	pglUniform4f(pglGetUniformLocation(fleet_program, "specular"), SPECULAR_COL[0], SPECULAR_COL[1], SPECULAR_COL[2], 20.0f);
+	pglUseProgram(0);
+	fleet_cluster_scale_loc = BindLightUniforms(fleet_program);
+
+	// Each batch's mesh advances per vertex, its instance buffer per part
+	pglGenBuffers(FLEET_BATCH_NB, fleet_vbos);
+	pglGenVertexArrays(FLEET_BATCH_NB, fleet_vaos);
+	for (int b = 0; b < FLEET_BATCH_NB; ++b) {
+		MeshID mesh = b == 0 ? MESH_CUBE : LOD_CHAINS[LOD_CANNON].meshes[b - 1];
+
+		pglBindVertexArray(fleet_vaos[b]);
+		SetMeshArrays(meshes[mesh]);
+		pglBindBuffer(GL_ARRAY_BUFFER, fleet_vbos[b]);
+		for (int r = 0; r < 3; ++r) {
+			pglEnableVertexAttribArray(FA_ROW0 + r);
+			pglVertexAttribPointer(FA_ROW0 + r, 4, GL_FLOAT, GL_FALSE, sizeof(FleetInstance),
+				(const void*)(offsetof(FleetInstance, rows) + sizeof(GLfloat) * 4 * r));
+			pglVertexAttribDivisor(FA_ROW0 + r, 1);
+		}
+		pglEnableVertexAttribArray(FA_TINT);
+		pglVertexAttribPointer(FA_TINT, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(FleetInstance), (const void*)offsetof(FleetInstance, tint));
+		pglVertexAttribDivisor(FA_TINT, 1);
+	}
+	pglBindVertexArray(0);
+	pglBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: AddTurtle
+//|
+//! \param pos    [in] Position.
+//! \param yaw    [in] Heading about Y, in radians.
+//! \param speed  [in] Swimming speed, in units per second.
+//! \param turn   [in] Yaw rate, in radians per second.
+//! \param phase  [in] Wing beat phase, in radians.
+//! \param school [in] School it flocks with, below FLEET_SCHOOLS.
+//! \param tint   [in] Shell colour.
+//! \return Handle of the new turtle, 0 when the fleet is full.
+//!
+//! Adds a turtle to the fleet, at the end of the component arrays, in a free slot if there is one.
+//|____________________________________________________________________
+
+TurtleHandle AddTurtle(const gmtl::Point3f& pos, float yaw, float speed, float turn, float phase, int school, const GLubyte tint[4])
+{
+	uint32_t slot;
+
+	if (!fleet.free_slots.empty()) {
+		slot = fleet.free_slots.back();
+		fleet.free_slots.pop_back();
+	}
+	else {
+		slot = (uint32_t)fleet.slots.size();
+		if (slot >= 1u << FLEET_SLOT_BITS) {
+			return 0;
+		}
+		fleet.slots.push_back(0);
+		fleet.generations.push_back(1);
+	}
+
+	const float values[FLEET_FLOAT_NB] = { 0, sinf(yaw / 2), 0, cosf(yaw / 2), pos[0], pos[1], pos[2], speed, turn, phase, 0, 0, 0, 0,
+		0, sinf(yaw / 2), 0, cosf(yaw / 2), pos[0], pos[1], pos[2] };
+	TurtleHandle handle = fleet.generations[slot] << FLEET_SLOT_BITS | slot;
+	uint32_t packed;
+
+	fleet.slots[slot] = (uint32_t)fleet.handles.size();
+	for (int f = 0; f < FLEET_FLOAT_NB; ++f) {
+		fleet.floats[f].push_back(values[f]);
+	}
+	memcpy(&packed, tint, sizeof(packed));
+	fleet.tints.push_back(packed);
+	fleet.schools.push_back((unsigned char)school);
+	fleet.handles.push_back(handle);
+	return handle;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: FindTurtle
+//|
+//! \param handle  [in] Turtle handle.
+//! \return Index of the turtle in the fleet's components, -1 if it was removed.
+//!
+//! The index changes as other turtles are removed; the handle does not.
+//|____________________________________________________________________
+
+int FindTurtle(TurtleHandle handle)
+{
+	uint32_t slot = handle & ((1u << FLEET_SLOT_BITS) - 1);
+
+	if (slot >= fleet.slots.size() || fleet.generations[slot] != handle >> FLEET_SLOT_BITS) {
+		return -1;
+	}
+	return (int)fleet.slots[slot];
+}
+
+//|____________________________________________________________________
+//|
+//| Function: RemoveTurtle
+//|
+//! \param handle  [in] Turtle handle.
+//! \return false if the turtle was already removed.
+//!
+//! Removes a turtle from the fleet. The last turtle moves into its place, so the components stay
+//! dense, and its slot is freed for the next AddTurtle().
+//|____________________________________________________________________
+
+bool RemoveTurtle(TurtleHandle handle)
+{
+	int index = FindTurtle(handle);
+
+	if (index < 0) {
+		return false;
+	}
+
+	size_t last = fleet.handles.size() - 1;
+	uint32_t slot = handle & ((1u << FLEET_SLOT_BITS) - 1);
+
+	if ((size_t)index != last) {
+		for (int f = 0; f < FLEET_FLOAT_NB; ++f) {
+			fleet.floats[f][index] = fleet.floats[f][last];
+		}
+		fleet.tints[index] = fleet.tints[last];
+		fleet.schools[index] = fleet.schools[last];
+		fleet.handles[index] = fleet.handles[last];
+		fleet.slots[fleet.handles[index] & ((1u << FLEET_SLOT_BITS) - 1)] = index;
+	}
+	for (int f = 0; f < FLEET_FLOAT_NB; ++f) {
+		fleet.floats[f].pop_back();
+	}
+	fleet.tints.pop_back();
+	fleet.schools.pop_back();
+	fleet.handles.pop_back();
+
+	// Generations wrap around without going through 0, so no handle is ever 0
+	fleet.generations[slot] = fleet.generations[slot] % ((1u << (32 - FLEET_SLOT_BITS)) - 1) + 1;
+	fleet.free_slots.push_back(slot);
+	return true;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: UpdateFleet
+//|
+//! \param seconds  [in] Time since the last update.
+//! \return None.
+//!
+//! Moves every turtle of the fleet on: each steers with its school, wanders at its own yaw rate
+//! and swims forward, beats its wings and swivels its cannon. Its pose before is kept, for
+//! ExtractFleet() to draw it in between. The turtles are hashed by position first, so steering
+//! finds each turtle's neighbours in the cells around it rather than among the whole fleet. Each
+//! pass runs in chunks of FLEET_JOB_TURTLES on the workers, through the pose kernels, and reads
+//! only what the pass before wrote.
+//|____________________________________________________________________
+
+void UpdateFleet(float seconds)
+{
+	double start_ms = GetTimeMs();
+	size_t count = fleet.handles.size();
+	int jobs = (int)((count + FLEET_JOB_TURTLES - 1) / FLEET_JOB_TURTLES);
+	std::atomic<int> neighbours(0);
+
+	std::fill(job_stats.begin(), job_stats.end(), JobThreadStats());
+	fleet.steps.resize(FLEET_WORK_FLOATS * count);
+	ResetSpatialHash(&fleet.hash, count, FLOCK_RADIUS);
+
+	// Where each turtle heads, and which bucket it falls in
+	ParallelFor(jobs, [count](int job) {
+		size_t first = (size_t)job * FLEET_JOB_TURTLES, n = std::min(count - first, (size_t)FLEET_JOB_TURTLES);
+		FleetArrays a = GetFleetArrays(first);
+
+		for (int c = 0; c < 7; ++c) {
+			memcpy(fleet.floats[FF_LAST_QX + c].data() + first, fleet.floats[FF_QX + c].data() + first, n * sizeof(float));
+		}
+		for (size_t i = 0; i < n; ++i) {
+			a.heading.x[i] = PLANE_FORWARD[0];
+			a.heading.y[i] = PLANE_FORWARD[1];
+			a.heading.z[i] = PLANE_FORWARD[2];
+			HashPoint(&fleet.hash, first + i, a.p.x[i], a.p.y[i], a.p.z[i]);
+		}
+		pose_kernels.rotate(a.q, a.heading, a.heading, n);
+	});
+	SortSpatialHash(&fleet.hash);
+	double hashed_ms = GetTimeMs();
+
+	ParallelFor(jobs, [seconds, &neighbours](int job) { neighbours += SteerTurtles(job, seconds); });
+	double steered_ms = GetTimeMs();
+
+	ParallelFor(jobs, [count, seconds](int job) {
+		size_t first = (size_t)job * FLEET_JOB_TURTLES, n = std::min(count - first, (size_t)FLEET_JOB_TURTLES);
+		FleetArrays a = GetFleetArrays(first);
+		float* wing_phase = fleet.floats[FF_WING_PHASE].data() + first;
+		float* wing_right = fleet.floats[FF_WING_RIGHT].data() + first;
+		float* wing_left = fleet.floats[FF_WING_LEFT].data() + first;
+		float* cannon_top = fleet.floats[FF_CANNON_TOP].data() + first;
+
+		// A yaw and a step per turtle, in the turtle's frame
+		for (size_t i = 0; i < n; ++i) {
+			float half = fleet.floats[FF_TURN][first + i] * seconds / 2;
+			float distance = fleet.floats[FF_SPEED][first + i] * seconds;
+
+			a.turn.x[i] = 0;
+			a.turn.y[i] = sinf(half);
+			a.turn.z[i] = 0;
+			a.turn.w[i] = cosf(half);
+			a.step.x[i] = PLANE_FORWARD[0] * distance;
+			a.step.y[i] = PLANE_FORWARD[1] * distance;
+			a.step.z[i] = PLANE_FORWARD[2] * distance;
+		}
+
+		// Steer in the world frame, steer * q, and yaw as the plane controls do, q * turn, then take
+		// the step in the world frame as the 's' and 'f' keys move the turtle
+		pose_kernels.quat_mul(a.steer, a.q, a.q, n);
+		pose_kernels.quat_mul(a.q, a.turn, a.q, n);
+		pose_kernels.normalize(a.q, n);
+		pose_kernels.rotate(a.q, a.step, a.step, n);
+		for (size_t i = 0; i < n; ++i) {
+			a.p.x[i] += a.step.x[i];
+			a.p.y[i] += a.step.y[i];
+			a.p.z[i] += a.step.z[i];
+		}
+
+		// Wings beat together, mirrored, while the cannon keeps turning
+		float beat = FLEET_WING_BEAT * seconds, swivel = FLEET_CANNON_TURN * seconds;
+		for (size_t i = 0; i < n; ++i) {
+			float phase = fmodf(wing_phase[i] + beat, 2 * gmtl::Math::PI);
+
+			wing_phase[i] = phase;
+			wing_right[i] = sinf(phase) * FLEET_WING_SWING;
+			wing_left[i] = -wing_right[i];
+			cannon_top[i] = fmodf(cannon_top[i] + swivel, 360.0f);
+		}
+	});
+
+	fleet_stats.update_ms = GetTimeMs() - start_ms;
+	fleet_stats.hash_ms = hashed_ms - start_ms;
+	fleet_stats.steer_ms = steered_ms - hashed_ms;
+	fleet_stats.neighbours = neighbours;
+	fleet_stats.threads = job_stats;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: GetFleetArrays
+//|
+//! \param first  [in] Index of the first turtle.
+//! \return The component and work arrays of UpdateFleet(), from that turtle on.
+//!
+//! Each work array is a run of fleet.steps as long as the fleet.
+//|____________________________________________________________________
+
+FleetArrays GetFleetArrays(size_t first)
+{
+	size_t count = fleet.handles.size();
+	std::vector<float>* f = fleet.floats;
+	float* work = fleet.steps.data() + first;
+	FleetArrays a = {
+		{ f[FF_QX].data() + first, f[FF_QY].data() + first, f[FF_QZ].data() + first, f[FF_QW].data() + first },
+		{ f[FF_PX].data() + first, f[FF_PY].data() + first, f[FF_PZ].data() + first },
+		{ work, work + count, work + 2 * count, work + 3 * count },
+		{ work + 4 * count, work + 5 * count, work + 6 * count, work + 7 * count },
+		{ work + 8 * count, work + 9 * count, work + 10 * count },
+		{ work + 11 * count, work + 12 * count, work + 13 * count }
+	};
+
+	return a;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: ResetSpatialHash
+//|
+//! \param hash   [out] Spatial hash.
+//! \param count  [in] Number of points.
+//! \param cell   [in] Cell size.
+//! \return None.
+//!
+//! Empties the hash for count points, with SPATIAL_HASH_LOAD buckets a point or more. The caller
+//! then hashes each point with HashPoint() and calls SortSpatialHash(). Keeps the storage of the
+//! arrays.
+//|____________________________________________________________________
+
+void ResetSpatialHash(SpatialHash* hash, size_t count, float cell)
+{
+	uint32_t buckets = 1;
+
+	while (buckets < count * SPATIAL_HASH_LOAD) {
+		buckets <<= 1;
+	}
+	hash->cell = cell;
+	hash->mask = buckets - 1;
+	hash->keys.resize(count);
+	hash->cells.resize(count);
+	hash->starts.assign(buckets + 1, 0);
+	hash->points.resize(count);
+	hash->sorted_cells.resize(count);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: HashPoint
+//|
+//! \param hash   [in/out] Spatial hash.
+//! \param point  [in] Index of the point.
+//! \param x      [in] Its position.
+//! \param y
+//! \param z
+//! \return None.
+//!
+//! Sets the bucket and the cell of a point. Points may be hashed from several threads at once.
+//|____________________________________________________________________
+
+void HashPoint(SpatialHash* hash, size_t point, float x, float y, float z)
+{
+	int cx = (int)floorf(x / hash->cell), cy = (int)floorf(y / hash->cell), cz = (int)floorf(z / hash->cell);
+
+	hash->keys[point] = SpatialHashBucket(*hash, cx, cy, cz);
+	hash->cells[point] = SpatialHashCell(cx, cy, cz);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: SpatialHashBucket
+//|
+//! \param hash  [in] Spatial hash.
+//! \param x     [in] Cell coordinates.
+//! \param y
+//! \param z
+//! \return Bucket of the cell.
+//!
+//! The row of the cell along X hashes to a bucket, and the cells of the row follow it.
+//|____________________________________________________________________
+
+uint32_t SpatialHashBucket(const SpatialHash& hash, int x, int y, int z)
+{
+	return (((uint32_t)y * 19349663u ^ (uint32_t)z * 83492791u) + (uint32_t)x) & hash.mask;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: SpatialHashCell
+//|
+//! \param x  [in] Cell coordinates.
+//! \param y
+//! \param z
+//! \return The low SPATIAL_HASH_CELL_BITS of each, X highest.
+//!
+//! Cells this packs alike are far enough apart that a distance check tells their points apart.
+//|____________________________________________________________________
+
+uint32_t SpatialHashCell(int x, int y, int z)
+{
+	const uint32_t LOW = (1u << SPATIAL_HASH_CELL_BITS) - 1;
+
+	return ((uint32_t)x & LOW) << (2 * SPATIAL_HASH_CELL_BITS) | ((uint32_t)y & LOW) << SPATIAL_HASH_CELL_BITS | ((uint32_t)z & LOW);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: SortSpatialHash
+//|
+//! \param hash  [in/out] Spatial hash, with the key of every point set.
+//! \return None.
+//!
+//! Sorts the points and their cells by bucket, a counting sort, and sets the start of each bucket.
+//|____________________________________________________________________
+
+void SortSpatialHash(SpatialHash* hash)
+{
+	size_t count = hash->keys.size();
+
+	// Bucket sizes, then the end of each bucket, then its start once its points are placed back to front
+	for (size_t i = 0; i < count; ++i) {
+		hash->starts[hash->keys[i]]++;
+	}
+	for (size_t b = 1; b < hash->starts.size(); ++b) {
+		hash->starts[b] += hash->starts[b - 1];
+	}
+	for (size_t i = count; i-- > 0;) {
+		uint32_t k = --hash->starts[hash->keys[i]];
+
+		hash->points[k] = (int)i;
+		hash->sorted_cells[k] = hash->cells[i];
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: FindNeighbours
+//|
+//! \param hash    [in]  Spatial hash of the points.
+//! \param p       [in]  Points.
+//! \param point   [in]  Point to find the neighbours of.
+//! \param radius  [in]  Distance to the neighbours, at most the cell size.
+//! \param found   [out] Neighbours.
+//! \param max     [in]  Room in found.
+//! \return Number of neighbours found, at most max.
+//!
+//! Finds the points within radius of the point, itself left out, among those of the 27 cells
+//! around it: the buckets of a row of three cells are searched in one go, and only the points of
+//! those cells have their distance checked.
+//|____________________________________________________________________
+
+int FindNeighbours(const SpatialHash& hash, const Vec3Arrays& p, int point, float radius, int* found, int max)
+{
+	const uint32_t LOW = (1u << SPATIAL_HASH_CELL_BITS) - 1, X_SHIFT = 2 * SPATIAL_HASH_CELL_BITS;
+	float x = p.x[point], y = p.y[point], z = p.z[point];
+	int cx = (int)floorf(x / hash.cell), cy = (int)floorf(y / hash.cell), cz = (int)floorf(z / hash.cell);
+	int count = 0;
+
+	for (int dz = -1; dz <= 1; ++dz) {
+		for (int dy = -1; dy <= 1; ++dy) {
+			uint32_t row = SpatialHashCell(cx - 1, cy + dy, cz + dz);
+			uint32_t bucket = SpatialHashBucket(hash, cx - 1, cy + dy, cz + dz);
+
+			// Three buckets, in two runs when they wrap around the end
+			for (uint32_t b = bucket; b < bucket + 3;) {
+				uint32_t first = b & hash.mask, last = std::min(first + (bucket + 3 - b), hash.mask + 1);
+
+				for (uint32_t k = hash.starts[first]; k < hash.starts[last]; ++k) {
+					uint32_t cell = hash.sorted_cells[k];
+
+					// Same Y and Z as the row, X one of the three
+					if ((cell & ~(LOW << X_SHIFT)) != (row & ~(LOW << X_SHIFT)) || (((cell >> X_SHIFT) - (row >> X_SHIFT)) & LOW) > 2) {
+						continue;
+					}
+
+					int other = hash.points[k];
+					float ox = p.x[other] - x, oy = p.y[other] - y, oz = p.z[other] - z;
+
+					if (other != point && ox * ox + oy * oy + oz * oz <= radius * radius) {
+						found[count++] = other;
+						if (count == max) {
+							return count;
+						}
+					}
+				}
+				b += last - first;
+			}
+		}
+	}
+	return count;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: SteerTurtles
+//|
+//! \param job      [in] Chunk of FLEET_JOB_TURTLES turtles to steer, in the spatial hash's order.
+//! \param seconds  [in] Time since the last update.
+//! \return Neighbours the turtles heeded, summed.
+//!
+//! Sets the flocking turn of the turtles from their neighbours: away from those closer than
+//! FLOCK_SEPARATION, along with the heading of their school and towards its middle, and back into
+//! the scenery when out of it. Each turtle turns towards the heading the rules add up to, no faster
+//! than FLOCK_TURN. Reads the positions, the headings and the spatial hash of the whole fleet, and
+//! writes only the chunk's turns. Taking the turtles in bucket order, each search mostly goes over
+//! buckets the one before went over, and each thread over a part of the scenery of its own.
+//|____________________________________________________________________
+
+int SteerTurtles(int job, float seconds)
+{
+	size_t count = fleet.handles.size(), first = (size_t)job * FLEET_JOB_TURTLES;
+	size_t last = std::min(count, first + FLEET_JOB_TURTLES);
+	FleetArrays a = GetFleetArrays(0);
+	const unsigned char* schools = fleet.schools.data();
+	const float low[3] = { SCENERY_ORIGIN[0], SCENERY_ORIGIN[1] - SB_SIZE / 2, SCENERY_ORIGIN[2] };
+	const float high[3] = { SCENERY_ORIGIN[0] + SB_SIZE, SCENERY_ORIGIN[1], SCENERY_ORIGIN[2] + SB_SIZE };
+	int neighbours[FLOCK_MAX_NEIGHBOURS], heeded = 0;
+
+	for (size_t k = first; k < last; ++k) {
+		int i = fleet.hash.points[k];
+		float p[3] = { a.p.x[i], a.p.y[i], a.p.z[i] }, h[3] = { a.heading.x[i], a.heading.y[i], a.heading.z[i] };
+		float away[3] = { 0, 0, 0 }, along[3] = { 0, 0, 0 }, middle[3] = { 0, 0, 0 }, back[3];
+		int found = FindNeighbours(fleet.hash, a.p, i, FLOCK_RADIUS, neighbours, FLOCK_MAX_NEIGHBOURS);
+		int mates = 0;
+
+		for (int n = 0; n < found; ++n) {
+			int j = neighbours[n];
+			float d[3] = { p[0] - a.p.x[j], p[1] - a.p.y[j], p[2] - a.p.z[j] };
+			float d2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+
+			// As hard as the heading at FLOCK_SEPARATION, harder closer
+			if (d2 < FLOCK_SEPARATION * FLOCK_SEPARATION) {
+				float push = FLOCK_SEPARATION / std::max(d2, 1e-4f);
+				for (int c = 0; c < 3; ++c) {
+					away[c] += d[c] * push;
+				}
+			}
+			if (schools[j] == schools[i]) {
+				along[0] += a.heading.x[j];
+				along[1] += a.heading.y[j];
+				along[2] += a.heading.z[j];
+				middle[0] += a.p.x[j];
+				middle[1] += a.p.y[j];
+				middle[2] += a.p.z[j];
+				mates++;
+			}
+		}
+		heeded += found;
+
+		// The heading the rules add up to
+		float want[3], back_len = 0;
+		for (int c = 0; c < 3; ++c) {
+			want[c] = h[c] + FLOCK_SEPARATE * away[c];
+			if (mates > 0) {
+				want[c] += FLOCK_ALIGN * (along[c] / mates - h[c]) + FLOCK_COHERE * (middle[c] / mates - p[c]) / FLOCK_RADIUS;
+			}
+			back[c] = p[c] < low[c] ? low[c] - p[c] : p[c] > high[c] ? high[c] - p[c] : 0;
+			back_len += back[c] * back[c];
+		}
+		if (back_len > 0) {
+			back_len = sqrtf(back_len);
+			for (int c = 0; c < 3; ++c) {
+				want[c] += FLOCK_CONTAIN * back[c] / back_len;
+			}
+		}
+
+		// Turn about heading x want, by their angle or FLOCK_TURN, whichever is less
+		float axis[3] = { h[1] * want[2] - h[2] * want[1], h[2] * want[0] - h[0] * want[2], h[0] * want[1] - h[1] * want[0] };
+		float sine = sqrtf(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+		float cosine = h[0] * want[0] + h[1] * want[1] + h[2] * want[2];
+		float half = std::min(atan2f(sine, cosine), FLOCK_TURN * seconds) / 2;
+		float scale = sine > 1e-6f ? sinf(half) / sine : 0;
+
+		a.steer.x[i] = axis[0] * scale;
+		a.steer.y[i] = axis[1] * scale;
+		a.steer.z[i] = axis[2] * scale;
+		a.steer.w[i] = scale != 0 ? cosf(half) : 1;
+	}
+	return heeded;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: TranslateRows
+//|
+//! \param m  [in/out] Model matrix, less its last row.
+//! \param x  [in] Translation.
+//! \param y
+//! \param z
+//! \return None.
+//!
+//! Multiplies the matrix by a translation on the right, as glTranslatef() does.
+//|____________________________________________________________________
+
+void TranslateRows(GLfloat m[3][4], float x, float y, float z)
+{
+	for (int r = 0; r < 3; ++r) {
+		m[r][3] += m[r][0] * x + m[r][1] * y + m[r][2] * z;
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: RotateRows
+//|
+//! \param m     [in/out] Model matrix, less its last row.
+//! \param c     [in] Cosine of the rotation angle.
+//! \param s     [in] Sine of the rotation angle.
+//! \param axis  [in] Rotation axis: 0 for X, 1 for Y, 2 for Z.
+//! \return None.
+//!
+//! Multiplies the matrix by a rotation on the right, as glRotatef() does about an axis. Taking the
+//! cosine and sine lets the callers share them between rotations by the same angle.
+//|____________________________________________________________________
+
+void RotateRows(GLfloat m[3][4], float c, float s, int axis)
+{
+	int a = (axis + 1) % 3, b = (axis + 2) % 3;
+
+	for (int r = 0; r < 3; ++r) {
+		float ma = m[r][a], mb = m[r][b];
+
+		m[r][a] = c * ma + s * mb;
+		m[r][b] = c * mb - s * ma;
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: PoseFleetParts
+//|
+//! \param snap  [in] Simulation state drawn.
+//! \param k     [in] Turtle in view, in fleet_visible.
+//! \return None.
+//!
+//! Writes the parts of a turtle into fleet_instances: its nodes are posed from its world matrix
+//! and sub-part angles as InitSceneGraph() and PoseTurtleParts() pose the player's turtle, then
+//! each part is offset and scaled within its node.
+//|____________________________________________________________________
+
+void PoseFleetParts(const SimSnapshot& snap, int k)
+{
+	const FleetVisible& visible = fleet_visible[k];
+	const std::vector<float>* f = snap.fleet;
+	const float* world = &fleet_matrices[16 * (size_t)visible.turtle];
+	int i = visible.turtle;
+	GLfloat nodes[SCENE_NODE_NB][3][4];
+
+	for (int r = 0; r < 3; ++r) {
+		for (int c = 0; c < 4; ++c) {
+			nodes[NODE_TURTLE][r][c] = world[c * 4 + r];
+		}
+	}
+
+	// Head and eyes are fixed on the shell
+	memcpy(nodes[NODE_HEAD], nodes[NODE_TURTLE], sizeof(nodes[NODE_HEAD]));
+	TranslateRows(nodes[NODE_HEAD], HEAD_POS[0], HEAD_POS[1], HEAD_POS[2]);
+	memcpy(nodes[NODE_LEFT_EYE], nodes[NODE_HEAD], sizeof(nodes[NODE_LEFT_EYE]));
+	TranslateRows(nodes[NODE_LEFT_EYE], -EYE_POS[0], EYE_POS[1], EYE_POS[2]);
+	memcpy(nodes[NODE_RIGHT_EYE], nodes[NODE_HEAD], sizeof(nodes[NODE_RIGHT_EYE]));
+	TranslateRows(nodes[NODE_RIGHT_EYE], EYE_POS[0], EYE_POS[1], EYE_POS[2]);
+
+	// Wings at each corner of the shell, about Z, the right ones and the left ones alike
+	const SceneNodeID WINGS[4] = { NODE_RIGHT_FRONT_WING, NODE_LEFT_FRONT_WING, NODE_RIGHT_BACK_WING, NODE_LEFT_BACK_WING };
+	float right = gmtl::Math::deg2Rad(f[FF_WING_RIGHT][i]), left = gmtl::Math::deg2Rad(f[FF_WING_LEFT][i]);
+	float wing_cos[2] = { cosf(right), cosf(left) }, wing_sin[2] = { sinf(right), sinf(left) };
+	for (int w = 0; w < 4; ++w) {
+		GLfloat(*node)[4] = nodes[WINGS[w]];
+
+		memcpy(node, nodes[NODE_TURTLE], sizeof(nodes[NODE_TURTLE]));
+		TranslateRows(node, w % 2 == 0 ? WING_POS[0] : -WING_POS[0], WING_POS[1], w < 2 ? WING_POS[2] : -WING_POS[2]);
+		RotateRows(node, wing_cos[w % 2], wing_sin[w % 2], 2);
+	}
+
+	// Cannon base on top, about Y, and the cannon on the base, turned down by -90 degrees about X
+	float top = gmtl::Math::deg2Rad(f[FF_CANNON_TOP][i]), cannon = gmtl::Math::deg2Rad(f[FF_CANNON][i]);
+	memcpy(nodes[NODE_CANNON_BASE], nodes[NODE_TURTLE], sizeof(nodes[NODE_CANNON_BASE]));
+	TranslateRows(nodes[NODE_CANNON_BASE], 0, P_HEIGHT, 0);
+	RotateRows(nodes[NODE_CANNON_BASE], cosf(top), sinf(top), 1);
+	memcpy(nodes[NODE_CANNON], nodes[NODE_CANNON_BASE], sizeof(nodes[NODE_CANNON]));
+	TranslateRows(nodes[NODE_CANNON], 0, WING_LENGTH, 0);
+	RotateRows(nodes[NODE_CANNON], cosf(cannon), sinf(cannon), 1);
+	RotateRows(nodes[NODE_CANNON], 0, -1, 0);
+
+	// Cubes in turtle order, the cannon in the batch of its level
+	FleetInstance* cubes = &fleet_instances[0][(FLEET_PART_NB - 1) * (size_t)k];
+	for (int p = 0; p < FLEET_PART_NB; ++p) {
+		const FleetPart& part = FLEET_PARTS[p];
+		FleetInstance* instance;
+
+		if (p < FLEET_PART_NB - 1) {
+			instance = cubes + p;
+		}
+		else if (visible.cannon >= 0) {
+			instance = &fleet_instances[1 + fleet_lods[i]][visible.cannon];
+		}
+		else {
+			break;
+		}
+
+		// The node's matrix, translated by the offset then scaled
+		const GLfloat(*node)[4] = nodes[part.node];
+		for (int r = 0; r < 3; ++r) {
+			instance->rows[r][0] = node[r][0] * part.scale[0];
+			instance->rows[r][1] = node[r][1] * part.scale[1];
+			instance->rows[r][2] = node[r][2] * part.scale[2];
+			instance->rows[r][3] = node[r][3] + node[r][0] * part.offset[0] + node[r][1] * part.offset[1] + node[r][2] * part.offset[2];
+		}
+		if (part.colour != NULL) {
+			for (int c = 0; c < 4; ++c) {
+				instance->tint[c] = GLubyte(part.colour[c] * 255);
+			}
+		}
+		else {
+			memcpy(instance->tint, &snap.fleet_tints[i], sizeof(instance->tint));
+		}
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: ExtractFleet
+//|
+//! \param snap     [in] Simulation state to draw.
+//! \param frustum  [in] World space view frustum.
+//! \param eye      [in] Camera position.
+//! \param alpha    [in] How far the frame is from the tick before to the snapshot's, 0 to 1.
+//! \return None.
+//!
+//! Places every turtle of the snapshot alpha of the way from its pose before the tick to its pose
+//! after, in fleet_matrices. Then finds the turtles whose bounds, FLEET_CULL_RADIUS around them,
+//! reach into the frustum, and picks the level of detail of their cannons, and poses their parts
+//! into fleet_instances for DrawFleet(). The two passes over the turtles run in jobs of
+//! FLEET_JOB_TURTLES on the worker threads.
+//|____________________________________________________________________
+
+void ExtractFleet(const SimSnapshot& snap, const Frustum& frustum, const gmtl::Point3f& eye, float alpha)
+{
+	double start_ms = GetTimeMs();
+	const std::vector<float>* f = snap.fleet;
+	size_t total = f[FF_QX].size();
+	float cannon_size = 2.0f * FLEET_PARTS[FLEET_PART_NB - 1].scale[0] * lod_pixels_per_unit;
+	int cannons[LOD_LEVELS] = { 0 };
+
+	// Levels of detail stay with the index, so a removed turtle hands its level on to the one moved
+	// into its place, at worst a frame's pop
+	fleet_lods.resize(total);
+	fleet_poses.resize(7 * total);
+	fleet_matrices.resize(16 * total);
+	ParallelFor((int)((total + FLEET_JOB_TURTLES - 1) / FLEET_JOB_TURTLES), [total, alpha, f](int job) {
+		size_t first = (size_t)job * FLEET_JOB_TURTLES, n = std::min(total - first, (size_t)FLEET_JOB_TURTLES);
+		float* work = fleet_poses.data() + first;
+		QuatArrays q = { work, work + total, work + 2 * total, work + 3 * total };
+		Vec3Arrays p = { work + 4 * total, work + 5 * total, work + 6 * total };
+
+		// Lerped rotations, normalised, turn the same way slerp would over a tick's small angles
+		for (size_t i = 0; i < n; ++i) {
+			size_t t = first + i;
+			float last[4] = { f[FF_LAST_QX][t], f[FF_LAST_QY][t], f[FF_LAST_QZ][t], f[FF_LAST_QW][t] };
+			float now[4] = { f[FF_QX][t], f[FF_QY][t], f[FF_QZ][t], f[FF_QW][t] };
+			float dot = last[0] * now[0] + last[1] * now[1] + last[2] * now[2] + last[3] * now[3];
+			float to = dot < 0 ? -alpha : alpha;
+
+			q.x[i] = last[0] * (1 - alpha) + now[0] * to;
+			q.y[i] = last[1] * (1 - alpha) + now[1] * to;
+			q.z[i] = last[2] * (1 - alpha) + now[2] * to;
+			q.w[i] = last[3] * (1 - alpha) + now[3] * to;
+			p.x[i] = f[FF_LAST_PX][t] + (f[FF_PX][t] - f[FF_LAST_PX][t]) * alpha;
+			p.y[i] = f[FF_LAST_PY][t] + (f[FF_PY][t] - f[FF_LAST_PY][t]) * alpha;
+			p.z[i] = f[FF_LAST_PZ][t] + (f[FF_PZ][t] - f[FF_LAST_PZ][t]) * alpha;
+		}
+		pose_kernels.normalize(q, n);
+		pose_kernels.to_matrix(q, p, fleet_matrices.data() + 16 * first, n);
+	});
+
+	fleet_visible.clear();
+	for (size_t i = 0; i < total; ++i) {
+		const float* world = &fleet_matrices[16 * i];
+		gmtl::Point3f centre(world[12], world[13], world[14]);
+		int p = 0;
+
+		while (p < 6 && gmtl::distance(frustum.planes[p], centre) >= -FLEET_CULL_RADIUS) {
+			++p;
+		}
+		if (p < 6) {
+			continue;
+		}
+
+		float dist = gmtl::length(gmtl::Vec3f(centre - eye));
+		int level = SelectLod(LOD_CANNON, cannon_size / std::max(dist, CAM_NEAR), fleet_lods[i]);
+		FleetVisible visible = { (int)i, LOD_CHAINS[LOD_CANNON].meshes[level] != MESH_NB ? cannons[level]++ : -1 };
+
+		fleet_lods[i] = (unsigned char)level;
+		fleet_visible.push_back(visible);
+	}
+
+	// Every part has its place in its batch already, so the jobs write without sharing
+	int count = (int)fleet_visible.size();
+	fleet_instances[0].resize((FLEET_PART_NB - 1) * (size_t)count);
+	for (int level = 0; level < LOD_LEVELS; ++level) {
+		fleet_instances[1 + level].resize(cannons[level]);
+	}
+	ParallelFor((count + FLEET_JOB_TURTLES - 1) / FLEET_JOB_TURTLES, [count, &snap](int job) {
+		for (int k = job * FLEET_JOB_TURTLES; k < std::min(count, (job + 1) * FLEET_JOB_TURTLES); ++k) {
+			PoseFleetParts(snap, k);
+		}
+	});
+
+	fleet_stats.drawn = count;
+	fleet_stats.extract_ms = GetTimeMs() - start_ms;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: DrawFleet
+//|
+//! \param None.
+//! \return None.
+//!
+//! Draws the parts ExtractFleet() posed with one instanced draw call per batch, or queues them one
+//! at a time without instancing support. Expects the modelview matrix to hold the view transform.
+//|____________________________________________________________________
+
+void DrawFleet()
+{
+	for (int b = 0; b < FLEET_BATCH_NB; ++b) {
+		const std::vector<FleetInstance>& instances = fleet_instances[b];
+		MeshID mesh = b == 0 ? MESH_CUBE : LOD_CHAINS[LOD_CANNON].meshes[b - 1];
+
+		if (instances.empty()) {
+			continue;
+		}
+
+		if (fleet_program == 0) {
+			for (size_t k = 0; k < instances.size(); ++k) {
+				const FleetInstance& instance = instances[k];
+				DrawState state = { 0, -1, { instance.tint[0] / 255.0f, instance.tint[1] / 255.0f, instance.tint[2] / 255.0f,
+					instance.tint[3] / 255.0f }, 20.0f, true, false };
+				GLfloat model[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+
+				for (int r = 0; r < 3; ++r) {
+					for (int c = 0; c < 4; ++c) {
+						model[c * 4 + r] = instance.rows[r][c];
+					}
+				}
+				glPushMatrix();
+					glMultMatrixf(model);
+					QueueMesh(mesh, state);
+				glPopMatrix();
+			}
+			continue;
+		}
+
+		// Reallocated, as the seaweed instances are
+		pglBindBuffer(GL_ARRAY_BUFFER, fleet_vbos[b]);
+		pglBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(FleetInstance), instances.data(), GL_STREAM_DRAW);
+		pglBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		pglUseProgram(fleet_program);
+		pglBindVertexArray(fleet_vaos[b]);
+		pglDrawElementsInstanced(meshes[mesh].mode, (GLsizei)meshes[mesh].indices.size(), GL_UNSIGNED_SHORT, NULL, (GLsizei)instances.size());
+		lod_stats.vertices += (int)(meshes[mesh].indices.size() * instances.size());
+	}
+	if (fleet_program != 0) {
+		pglBindVertexArray(0);
+		pglUseProgram(0);
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BenchFleet
+//|
+//! \param count  [in] Number of turtles of the largest fleet.
+//! \return 0 if the handles stayed right through the churn, 1 otherwise.
+//!
+//! Turtle fleet benchmark (--bench-fleet): times UpdateFleet(), FillSnapshot(), ExtractFleet() seen
+//! from above the scenery, and churn, a tenth of the fleet removed and added back a frame, for
+//! fleets of a hundredth, a tenth and all of count turtles. The times are per turtle, so they stay
+//! flat as long as the work grows linearly, but for flocking, which grows with the density of the
+//! fleet until every turtle heeds FLOCK_MAX_NEIGHBOURS. The churn must leave the components in
+//! their storage, every handle naming its turtle, and the removed handles naming none.
+//|____________________________________________________________________
+
+int BenchFleet(int count)
+{
+	gmtl::Point3f target(SCENERY_ORIGIN[0] + SB_SIZE / 2, SCENERY_ORIGIN[1] - SB_SIZE / 4, SCENERY_ORIGIN[2] + SB_SIZE / 2);
+	gmtl::Point3f eye(target[0], target[1] + SB_SIZE / 4, target[2] - SB_SIZE / 2);
+	float tan_half = tanf(gmtl::Math::deg2Rad(CAM_FOV) / 2);
+	gmtl::Matrix44f clip = LightProjection(tan_half, CAM_NEAR, CAM_FAR) * LightView(eye, target);
+	const int sizes[3] = { count / 100, count / 10, count };
+	Frustum frustum;
+	uint32_t seed = 0x2f6b1d9c;
+	int failures = 0;
+
+	MakeFrustum(clip.getData(), &frustum);
+	lod_pixels_per_unit = w_height / (2.0f * tan_half);
+
+	printf("Turtle fleet, %s pose kernels, %d worker threads\n", pose_kernels.name, (int)workers.size());
+	printf("%10s %10s %11s %10s %10s %10s\n", "Turtles", "Update ns", "Snapshot ns", "Extract ns", "In view", "Churn ns");
+	for (int s = 0; s < 3; ++s) {
+		int n = sizes[s];
+
+		if (n < 10 || (s > 0 && n == sizes[s - 1])) {
+			continue;
+		}
+		fleet = TurtleFleet();
+		InitFleet(n);
+
+		// Best time of BENCH_CONVERT_RUNS, over BENCH_FLEET_FRAMES frames each, in nanoseconds an operation
+		auto best_ns = [](int ops, const std::function<void()>& frame) {
+			double best = 1e30;
+			for (int i = 0; i < BENCH_CONVERT_RUNS; ++i) {
+				double start = GetTimeMs();
+				for (int f = 0; f < BENCH_FLEET_FRAMES; ++f) {
+					frame();
+				}
+				best = std::min(best, GetTimeMs() - start);
+			}
+			return best * 1e6 / BENCH_FLEET_FRAMES / ops;
+		};
+
+		SimSnapshot snap;
+		double update_ns = best_ns(n, []() { UpdateFleet(1.0f / 60); });
+		double snapshot_ns = best_ns(n, [&]() { FillSnapshot(&snap); });
+		double extract_ns = best_ns(n, [&]() { ExtractFleet(snap, frustum, eye, 1); });
+
+		// Removals of random turtles, each followed by an addition, counted as one operation each
+		std::vector<TurtleHandle> handles = fleet.handles;
+		std::vector<TurtleHandle> removed;
+		const float* storage = fleet.floats[FF_QX].data();
+		int churn = n / 10;
+		double churn_ns = best_ns(2 * churn, [&]() {
+			for (int k = 0; k < churn; ++k) {
+				seed ^= seed << 13;
+				seed ^= seed >> 17;
+				seed ^= seed << 5;
+
+				TurtleHandle& handle = handles[seed % handles.size()];
+				int index = FindTurtle(handle);
+				gmtl::Point3f pos(fleet.floats[FF_PX][index], fleet.floats[FF_PY][index], fleet.floats[FF_PZ][index]);
+				GLubyte tint[4];
+
+				int school = fleet.schools[index];
+
+				memcpy(tint, &fleet.tints[index], sizeof(tint));
+				if (removed.size() < handles.size()) {
+					removed.push_back(handle);
+				}
+				RemoveTurtle(handle);
+				handle = AddTurtle(pos, 0, FLEET_SPEED, FLEET_TURN, 0, school, tint);
+			}
+		});
+
+		bool right = fleet.floats[FF_QX].data() == storage && fleet.handles.size() == handles.size();
+		for (size_t k = 0; k < handles.size(); ++k) {
+			int index = FindTurtle(handles[k]);
+			right = right && index >= 0 && fleet.handles[index] == handles[k];
+		}
+		for (size_t k = 0; k < removed.size(); ++k) {
+			right = right && FindTurtle(removed[k]) < 0 && !RemoveTurtle(removed[k]);
+		}
+		printf("%10d %10.2f %11.2f %10.2f %10d %10.2f  %s\n", n, update_ns, snapshot_ns, extract_ns, fleet_stats.drawn, churn_ns,
+			right ? "ok" : "HANDLE MISMATCH");
+		failures += !right;
+	}
+	fleet = TurtleFleet();
+
+	return failures == 0 ? 0 : 1;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BenchFlock
+//|
+//! \param count  [in] Number of turtles.
+//! \return 0 if the spatial hash found the neighbours brute force finds, 1 otherwise.
+//!
+//! Flocking benchmark (--bench-flock): checks FindNeighbours() against a brute force search for
+//! BENCH_FLOCK_CHECKS turtles, then times BENCH_FLOCK_TICKS ticks of UpdateFleet() at 60 Hz, and
+//! shows how the work spread over the threads.
+//|____________________________________________________________________
+
+int BenchFlock(int count)
+{
+	std::vector<JobThreadStats> threads(workers.size() + 1);
+	double update_ms = 0, hash_ms = 0, steer_ms = 0, busy_ms = 0;
+	double heeded = 0;
+	int checks = std::min(count, BENCH_FLOCK_CHECKS);
+	bool right = true;
+
+	fleet = TurtleFleet();
+	InitFleet(count);
+
+	// A tick without time hashes the turtles and leaves them where they are
+	UpdateFleet(0);
+	FleetArrays a = GetFleetArrays(0);
+	std::vector<int> found(count), expected;
+	for (int c = 0; c < checks; ++c) {
+		int i = (int)((int64_t)c * count / checks);
+		int n = FindNeighbours(fleet.hash, a.p, i, FLOCK_RADIUS, found.data(), count);
+
+		expected.clear();
+		for (int j = 0; j < count; ++j) {
+			float dx = a.p.x[j] - a.p.x[i], dy = a.p.y[j] - a.p.y[i], dz = a.p.z[j] - a.p.z[i];
+			if (j != i && dx * dx + dy * dy + dz * dz <= FLOCK_RADIUS * FLOCK_RADIUS) {
+				expected.push_back(j);
+			}
+		}
+		std::sort(found.begin(), found.begin() + n);
+		right = right && n == (int)expected.size() && std::equal(expected.begin(), expected.end(), found.begin());
+	}
+
+	for (int t = 0; t < BENCH_FLOCK_TICKS; ++t) {
+		UpdateFleet(1.0f / 60);
+		update_ms += fleet_stats.update_ms;
+		hash_ms += fleet_stats.hash_ms;
+		steer_ms += fleet_stats.steer_ms;
+		heeded += fleet_stats.neighbours;
+		for (size_t k = 0; k < threads.size(); ++k) {
+			threads[k].iterations += fleet_stats.threads[k].iterations;
+			threads[k].stolen += fleet_stats.threads[k].stolen;
+			threads[k].busy_ms += fleet_stats.threads[k].busy_ms;
+			busy_ms += fleet_stats.threads[k].busy_ms;
+		}
+	}
+
+	printf("Flocking %d turtles in %d schools, %s pose kernels, %d worker threads\n", count, FLEET_SCHOOLS, pose_kernels.name,
+		(int)workers.size());
+	printf("Neighbours of %d turtles against brute force: %s\n", checks, right ? "ok" : "MISMATCH");
+	printf("%.3f ms a tick (hash %.3f, steering %.3f), %.1f neighbours a turtle, %s the %.1f ms of 60 Hz\n",
+		update_ms / BENCH_FLOCK_TICKS, hash_ms / BENCH_FLOCK_TICKS, steer_ms / BENCH_FLOCK_TICKS, heeded / BENCH_FLOCK_TICKS / count,
+		update_ms / BENCH_FLOCK_TICKS <= 1000.0 / 60 ? "within" : "over", 1000.0 / 60);
+	printf("%8s %10s %10s %10s %10s\n", "Thread", "Chunks", "Stolen", "Busy ms", "Share");
+	for (size_t k = 0; k < threads.size(); ++k) {
+		if (threads[k].iterations > 0) {
+			printf("%8s %10.1f %10.1f %10.3f %9.1f%%\n", k == 0 ? "main" : std::to_string(k).c_str(),
+				(double)threads[k].iterations / BENCH_FLOCK_TICKS, (double)threads[k].stolen / BENCH_FLOCK_TICKS,
+				threads[k].busy_ms / BENCH_FLOCK_TICKS, 100 * threads[k].busy_ms / std::max(busy_ms, 1e-9));
+		}
+	}
+	fleet = TurtleFleet();
+
+	return right ? 0 : 1;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: SetLight
+//|
+//! \param pos          [in] Light position.
+//! \param is_ambient   [in] Is ambient enabled?
+//! \param is_diffuse   [in] Is diffuse enabled?
+//! \param is_specular  [in] Is specular enabled?
+//! \return None.
+//!
+//! Set light properties, for the fixed-function pipeline and in the light uniform block. The
+//! position is relative to the current modelview matrix, which should be the view transform: the
+//! shadow maps are looked up through it.
+//|____________________________________________________________________
+
+void SetLight(const gmtl::Point4f& pos, const bool is_ambient, const bool is_diffuse, const bool is_specular)
+{
+	const GLfloat* ambient = is_ambient ? AMBIENT_LIGHT : NO_LIGHT;
+	const GLfloat* diffuse = is_diffuse ? DIFFUSE_LIGHT : NO_LIGHT;
+	const GLfloat* specular = is_specular ? SPECULAR_LIGHT : NO_LIGHT;
+
+	glLightfv(GL_LIGHT0, GL_POSITION, pos.mData);
+	glLightfv(GL_LIGHT0, GL_AMBIENT, ambient);
+	glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuse);
+	glLightfv(GL_LIGHT0, GL_SPECULAR, specular);
+
+	if (light_ubo != 0) {
+		LightBlock block;
+		GLfloat view[16];
+
+		// Eye space, as glLightfv() stores it
+		glGetFloatv(GL_MODELVIEW_MATRIX, view);
+		for (int r = 0; r < 4; ++r) {
+			block.position[r] = view[r] * pos[0] + view[4 + r] * pos[1] + view[8 + r] * pos[2] + view[12 + r] * pos[3];
+		}
+		memcpy(block.ambient, ambient, sizeof(block.ambient));
+		memcpy(block.diffuse, diffuse, sizeof(block.diffuse));
+		memcpy(block.specular, specular, sizeof(block.specular));
+
+		// Eye space to world space, then through the light's frustum into [0, 1] map coordinates
+		gmtl::Matrix44f view_matrix, bias;
+		for (int i = 0; i < 16; ++i) {
+			view_matrix(i % 4, i / 4) = view[i];
+		}
+		for (int a = 0; a < 3; ++a) {
+			bias(a, a) = 0.5f;
+			bias(a, 3) = 0.5f;
+		}
+		for (int id = 0; id < SHADOW_MAP_NB; ++id) {
+			gmtl::Matrix44f eye_to_map = bias * shadow_maps[id].projection * shadow_maps[id].view * InvertRigid(view_matrix);
+			memcpy(block.shadow_matrices[id], eye_to_map.getData(), sizeof(block.shadow_matrices[id]));
+		}
+
+		// Reallocated, as the seaweed instances are, so the previous frame's draws are not waited for
+		pglBindBuffer(GL_UNIFORM_BUFFER, light_ubo);
+		pglBufferData(GL_UNIFORM_BUFFER, sizeof(block), &block, GL_STREAM_DRAW);
+		pglBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: HasGLExtension
+//|
+//! \param name  [in] Extension name.
+//! \return true if the current GL context advertises the extension.
+//|____________________________________________________________________
+
+bool HasGLExtension(const char* name)
+{
+	const char* ext = (const char*)glGetString(GL_EXTENSIONS);
+	size_t len = strlen(name);
+
+	while (ext != NULL && (ext = strstr(ext, name)) != NULL) {
+		if (ext[len] == ' ' || ext[len] == '\0') {
+			return true;
+		}
+		ext += len;
+	}
+	return false;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: GetGLProcAddress
+//|
+//! \param name  [in] OpenGL function name.
+//! \return Address of the function, NULL if the implementation does not have it.
+//!
+//! Goes through EGL when headless, since GLUT is not initialised then.
+//|____________________________________________________________________
+
+void* GetGLProcAddress(const char* name)
+{
+#ifdef HAVE_EGL
+	if (headless) {
+		return (void*)eglGetProcAddress(name);
+	}
+#endif
+	return (void*)glutGetProcAddress(name);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: LoadGLExtensions
+//|
+//! \param None.
+//! \return None.
+//!
+//! Loads the OpenGL entry points that are not part of OpenGL 1.1 and checks which optional
+//! features the context supports. Needs a current GL context.
+//|____________________________________________________________________
+
+void LoadGLExtensions()
+{
+	pglCompressedTexImage2D = (CompressedTexImage2DProc)GetGLProcAddress("glCompressedTexImage2D");
+	has_s3tc = pglCompressedTexImage2D != NULL && HasGLExtension("GL_EXT_texture_compression_s3tc");
+
+	pglGenFramebuffers = (GenObjectsProc)GetGLProcAddress("glGenFramebuffers");
+	pglBindFramebuffer = (BindObjectProc)GetGLProcAddress("glBindFramebuffer");
+	pglGenRenderbuffers = (GenObjectsProc)GetGLProcAddress("glGenRenderbuffers");
+	pglBindRenderbuffer = (BindObjectProc)GetGLProcAddress("glBindRenderbuffer");
+	pglRenderbufferStorage = (RenderbufferStorageProc)GetGLProcAddress("glRenderbufferStorage");
+	pglFramebufferRenderbuffer = (FramebufferRenderbufferProc)GetGLProcAddress("glFramebufferRenderbuffer");
+	pglFramebufferTexture2D = (FramebufferTexture2DProc)GetGLProcAddress("glFramebufferTexture2D");
+	pglCheckFramebufferStatus = (CheckFramebufferStatusProc)GetGLProcAddress("glCheckFramebufferStatus");
+	has_fbo = pglGenFramebuffers != NULL && pglBindFramebuffer != NULL && pglGenRenderbuffers != NULL &&
+		pglBindRenderbuffer != NULL && pglRenderbufferStorage != NULL && pglFramebufferRenderbuffer != NULL &&
+		pglFramebufferTexture2D != NULL && pglCheckFramebufferStatus != NULL;
+
+	// Entry points can resolve even where the context does not support them: check the version as well
+	int gl_major = 0, gl_minor = 0;
+	sscanf((const char*)glGetString(GL_VERSION), "%d.%d", &gl_major, &gl_minor);
+
+	pglGenBuffers = (GenObjectsProc)GetGLProcAddress("glGenBuffers");
+	pglBindBuffer = (BindObjectProc)GetGLProcAddress("glBindBuffer");
+	pglBufferData = (BufferDataProc)GetGLProcAddress("glBufferData");
+	has_vbo = (gl_major > 1 || gl_minor >= 5) && pglGenBuffers != NULL && pglBindBuffer != NULL && pglBufferData != NULL;
+
+	pglGenVertexArrays = (GenObjectsProc)GetGLProcAddress("glGenVertexArrays");
+	pglBindVertexArray = (BindVertexArrayProc)GetGLProcAddress("glBindVertexArray");
+	has_vao = has_vbo && (gl_major >= 3 || HasGLExtension("GL_ARB_vertex_array_object")) &&
+		pglGenVertexArrays != NULL && pglBindVertexArray != NULL;
+
+	pglCreateShader = (CreateShaderProc)GetGLProcAddress("glCreateShader");
+	pglShaderSource = (ShaderSourceProc)GetGLProcAddress("glShaderSource");
+	pglCompileShader = (ObjectProc)GetGLProcAddress("glCompileShader");
+	pglGetShaderiv = (GetObjectivProc)GetGLProcAddress("glGetShaderiv");
+	pglGetShaderInfoLog = (GetInfoLogProc)GetGLProcAddress("glGetShaderInfoLog");
+	pglDeleteShader = (ObjectProc)GetGLProcAddress("glDeleteShader");
+	pglCreateProgram = (CreateProgramProc)GetGLProcAddress("glCreateProgram");
+	pglAttachShader = (AttachObjectProc)GetGLProcAddress("glAttachShader");
+	pglBindAttribLocation = (BindAttribLocationProc)GetGLProcAddress("glBindAttribLocation");
+	pglLinkProgram = (ObjectProc)GetGLProcAddress("glLinkProgram");
+	pglGetProgramiv = (GetObjectivProc)GetGLProcAddress("glGetProgramiv");
+	pglGetProgramInfoLog = (GetInfoLogProc)GetGLProcAddress("glGetProgramInfoLog");
+	pglUseProgram = (ObjectProc)GetGLProcAddress("glUseProgram");
+	pglGetUniformLocation = (GetUniformLocationProc)GetGLProcAddress("glGetUniformLocation");
+	pglUniform1i = (Uniform1iProc)GetGLProcAddress("glUniform1i");
+	pglUniform1f = (Uniform1fProc)GetGLProcAddress("glUniform1f");
+	pglUniform4f = (Uniform4fProc)GetGLProcAddress("glUniform4f");
+	pglEnableVertexAttribArray = (ObjectProc)GetGLProcAddress("glEnableVertexAttribArray");
+	pglVertexAttribPointer = (VertexAttribPointerProc)GetGLProcAddress("glVertexAttribPointer");
+	has_glsl = gl_major >= 2 && pglCreateShader != NULL && pglShaderSource != NULL && pglCompileShader != NULL &&
+		pglGetShaderiv != NULL && pglGetShaderInfoLog != NULL && pglDeleteShader != NULL && pglCreateProgram != NULL &&
+		pglAttachShader != NULL && pglBindAttribLocation != NULL && pglLinkProgram != NULL && pglGetProgramiv != NULL &&
+		pglGetProgramInfoLog != NULL && pglUseProgram != NULL && pglGetUniformLocation != NULL && pglUniform1i != NULL &&
+		pglUniform1f != NULL && pglUniform4f != NULL && pglEnableVertexAttribArray != NULL && pglVertexAttribPointer != NULL;
+
+	pglActiveTexture = (ActiveTextureProc)GetGLProcAddress("glActiveTexture");
+	has_float_textures = (gl_major >= 3 || (HasGLExtension("GL_ARB_texture_float") && HasGLExtension("GL_ARB_texture_rg"))) &&
+		pglActiveTexture != NULL;
+
+	pglBufferSubData = (BufferSubDataProc)GetGLProcAddress("glBufferSubData");
+	pglBindBufferBase = (BindBufferBaseProc)GetGLProcAddress("glBindBufferBase");
+	pglGetUniformBlockIndex = (GetUniformBlockIndexProc)GetGLProcAddress("glGetUniformBlockIndex");
+	pglUniformBlockBinding = (UniformBlockBindingProc)GetGLProcAddress("glUniformBlockBinding");
+	has_ubo = has_glsl && has_vbo && (gl_major > 3 || (gl_major == 3 && gl_minor >= 1) || HasGLExtension("GL_ARB_uniform_buffer_object")) &&
+		pglBufferSubData != NULL && pglBindBufferBase != NULL && pglGetUniformBlockIndex != NULL && pglUniformBlockBinding != NULL;
+
+	pglVertexAttribDivisor = (AttachObjectProc)GetGLProcAddress("glVertexAttribDivisor");
+	pglDrawElementsInstanced = (DrawElementsInstancedProc)GetGLProcAddress("glDrawElementsInstanced");
+	has_instancing = has_glsl && has_vao && (gl_major > 3 || (gl_major == 3 && gl_minor >= 3)) &&
+		pglVertexAttribDivisor != NULL && pglDrawElementsInstanced != NULL;
+
+	printf("OpenGL %s (%s), BC1 textures %s, meshes in %s\n", (const char*)glGetString(GL_VERSION),
+		(const char*)glGetString(GL_RENDERER), has_s3tc ? "supported" : "not supported",
+		has_vao ? "vertex array objects" : has_vbo ? "vertex buffers" : "client memory");
+}
+
+//|____________________________________________________________________
+//|
+//| Function: GetTimeMs
+//|
+//! \param None.
+//! \return Monotonic time in milliseconds.
+//!
+//! Wall-clock timer used for load and frame time reports.
+//|____________________________________________________________________
+
+double GetTimeMs()
+{
+	using namespace std::chrono;
+	return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+//|____________________________________________________________________
+//|
+//| Function: ParsePPMHeader
+//|
+//! \param buf     [in]  Start of the file contents.
+//! \param size    [in]  Number of bytes available at buf.
+//! \param w       [out] Width of the image in pixels.
+//! \param h       [out] Height of the image in pixels.
+//! \param offset  [out] Offset of the first raster byte from buf.
+//! \return NULL on success, otherwise a description of what is wrong with the file.
+//!
+//! Validates a binary (P6) Portable Pixmap header. Comments may appear between any of the header
+//! fields, exactly one whitespace character separates maxval from the raster, and the raster must
+//! be complete. Only maxval 255 is accepted since the raster is uploaded as GL_UNSIGNED_BYTE as is.
+//|____________________________________________________________________
+
+static const char* ParsePPMHeader(const unsigned char* buf, size_t size, unsigned int* w, unsigned int* h, size_t* offset)
+{
+	unsigned long fields[3];               // Width, height and maxval
+	size_t pos = 2;
+
+	if (size < 2 || buf[0] != 'P' || buf[1] != '6') {
+		return "not a binary PPM (P6) file";
+	}
+
+	for (int f = 0; f < 3; ++f) {
+		// Skip whitespace and comments preceding the field
+		for (;;) {
+			if (pos >= size) {
+				return "truncated header";
+			}
+			if (buf[pos] == '#') {
+				while (pos < size && buf[pos] != '\n' && buf[pos] != '\r') {
+					++pos;
+				}
+			}
+			else if (isspace(buf[pos])) {
+				++pos;
+			}
+			else {
+				break;
+			}
+		}
+
+		if (!isdigit(buf[pos])) {
+			return "malformed header field";
+		}
+		fields[f] = 0;
+		while (pos < size && isdigit(buf[pos])) {
+			fields[f] = fields[f] * 10 + (buf[pos++] - '0');
+			if (fields[f] > 65535) {
+				return "header field out of range";
+			}
+		}
+	}
+
+	// Exactly one whitespace character separates maxval from the raster
+	if (pos >= size || !isspace(buf[pos])) {
+		return "truncated header";
+	}
+	++pos;
+
+	if (fields[0] == 0 || fields[1] == 0) {
+		return "zero-sized image";
+	}
+	if (fields[2] != 255) {
+		return "unsupported maxval (only 255 is supported)";
+	}
+	if ((size - pos) / 3 / fields[0] < fields[1]) {
+		return "truncated raster";
+	}
+
+	*w = (unsigned int)fields[0];
+	*h = (unsigned int)fields[1];
+	*offset = pos;
+	return NULL;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: MapFile
+//|
+//! \param fname  [in]  Name of file to map.
+//! \param file   [out] Mapped file.
+//! \return true on success, false if the file cannot be opened or is empty.
+//!
+//! Memory-maps a whole file read-only (MapViewOfFile on Windows, mmap elsewhere). Release with
+//! UnmapFile().
+//|____________________________________________________________________
+
+bool MapFile(const char* fname, MappedFile* file)
+{
+	file->data = NULL;
+	file->size = 0;
+
+#ifdef _WIN32
+	HANDLE handle = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (handle == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	LARGE_INTEGER file_size;
+	HANDLE mapping = NULL;
+	if (GetFileSizeEx(handle, &file_size) && file_size.QuadPart > 0) {
+		mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	}
+	if (mapping != NULL) {
+		file->data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		file->size = file->data != NULL ? (size_t)file_size.QuadPart : 0;
+		CloseHandle(mapping);               // The view keeps the mapping alive
+	}
+	CloseHandle(handle);
+#else
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		void* base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (base != MAP_FAILED) {
+			// The advice values are not flags, so each is given on its own. Both are hints only: the
+			// mapping reads the same without them.
+			(void)posix_madvise(base, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+			(void)posix_madvise(base, (size_t)st.st_size, POSIX_MADV_WILLNEED);
+			file->data = (const unsigned char*)base;
+			file->size = (size_t)st.st_size;
+		}
+	}
+	close(fd);                              // The mapping keeps the file alive
+#endif
+
+	return file->data != NULL;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: UnmapFile
+//|
+//! \param file  [in/out] File previously mapped by MapFile().
+//! \return None.
+//!
+//! Releases a file mapping. Pointers into the mapping are no longer valid afterwards.
+//|____________________________________________________________________
+
+void UnmapFile(MappedFile* file)
+{
+	if (file->data != NULL) {
+#ifdef _WIN32
+		UnmapViewOfFile(file->data);
+#else
+		munmap((void*)file->data, file->size);
+#endif
+	}
+	file->data = NULL;
+	file->size = 0;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: MapPPM
+//|
+//! \param fname  [in]  Name of file to map.
+//! \param img    [out] Mapped image.
+//! \return true on success, false if the file cannot be opened or is not a valid P6 image.
+//!
+//! Memory-maps a PPM file and validates its header. The pixels stay inside the mapping, so no
+//! buffer is allocated and nothing is copied. Call UnmapPPM() when done with the pixels.
+//|____________________________________________________________________
+
+bool MapPPM(const char* fname, MappedPPM* img)
+{
+	const char* err;
+	size_t offset;
+
+	memset(img, 0, sizeof(*img));
+
+	if (!MapFile(fname, &img->file)) {
+		fprintf(stderr, "%s: cannot open image file\n", fname);
+		return false;
+	}
+
+	err = ParsePPMHeader(img->file.data, img->file.size, &img->width, &img->height, &offset);
+	if (err != NULL) {
+		fprintf(stderr, "%s: %s\n", fname, err);
+		UnmapPPM(img);
+		return false;
+	}
+
+	img->pixels = img->file.data + offset;
+	return true;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: UnmapPPM
+//|
+//! \param img  [in/out] Image previously mapped by MapPPM().
+//! \return None.
+//!
+//! Releases the file mapping. The image pixels are no longer valid afterwards.
+//|____________________________________________________________________
+
+void UnmapPPM(MappedPPM* img)
+{
+	UnmapFile(&img->file);
+	memset(img, 0, sizeof(*img));
+}
+
+//|____________________________________________________________________
+//|
+//| Function: StartWorkers
+//|
+//! \param count  [in] Number of worker threads.
+//! \return None.
+//!
+//! Starts the worker threads that run jobs queued with SubmitJob(), each with a queue of its own.
+//|____________________________________________________________________
+
+void StartWorkers(int count)
+{
+	for (int i = 0; i < count; ++i) {
+		worker_queues.emplace_back();
+	}
+	for (int i = 0; i < count; ++i) {
+		workers.push_back(std::thread([i]() {
+			job_thread = i + 1;
+			for (;;) {
+				std::function<void()> job;
+
+				if (TakeJob(i, &job)) {
+					job();
+					continue;
+				}
+
+				// Nothing to take: sleep until a job is queued, or quit once none is left
+				std::unique_lock<std::mutex> lock(worker_mutex);
+				worker_cv.wait(lock, []() { return workers_quit || worker_pending > 0; });
+				if (worker_pending == 0) {
+					return;
+				}
+			}
+		}));
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: StopWorkers
+//|
+//! \param None.
+//! \return None.
+//!
+//! Lets the worker threads finish the queued jobs and joins them. Registered with atexit() since
+//! glutMainLoop() never returns.
+//|____________________________________________________________________
+
+void StopWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lock(worker_mutex);
+		workers_quit = true;
+	}
+	worker_cv.notify_all();
+
+	for (size_t i = 0; i < workers.size(); ++i) {
+		workers[i].join();
+	}
+	workers.clear();
+	worker_queues.clear();
+}
+
+//|____________________________________________________________________
+//|
+//| Function: SubmitJob
+//|
+//! \param job  [in] Function to run on a worker thread.
+//! \return None.
+//!
+//! Queues a job for the worker threads: on a worker's own queue when a worker submits it, so the
+//! worker runs it next while its data is still in cache, and on the queues in turn otherwise.
+//! Runs it on the spot when there are no workers.
+//|____________________________________________________________________
+
+void SubmitJob(const std::function<void()>& job)
+{
+	if (worker_queues.empty()) {
+		job();
+		return;
+	}
+
+	JobQueue& queue = worker_queues[job_thread > 0 ? job_thread - 1 : worker_next_queue++ % worker_queues.size()];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.jobs.push_back(job);
+	}
+	{
+		std::lock_guard<std::mutex> lock(worker_mutex);
+		worker_pending++;
+	}
+	worker_cv.notify_one();
+}
+
+//|____________________________________________________________________
+//|
+//| Function: TakeJob
+//|
+//! \param worker  [in]  Index of the worker taking the job.
+//! \param job     [out] Job taken.
+//! \return false if every queue was empty.
+//!
+//! Takes the newest job of the worker's queue, or else steals the oldest job of the next queue
+//! that has one. The owner and the thieves take from opposite ends, so they seldom want the same
+//! job, and a thief takes the job its owner would have got to last.
+//|____________________________________________________________________
+
+bool TakeJob(int worker, std::function<void()>* job)
+{
+	int count = (int)worker_queues.size();
+
+	for (int k = 0; k < count; ++k) {
+		JobQueue& queue = worker_queues[(worker + k) % count];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+
+		if (queue.jobs.empty()) {
+			continue;
+		}
+		if (k == 0) {
+			*job = std::move(queue.jobs.back());
+			queue.jobs.pop_back();
+		}
+		else {
+			*job = std::move(queue.jobs.front());
+			queue.jobs.pop_front();
+		}
+		worker_pending--;
+		return true;
+	}
+	return false;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: ParallelFor
+//|
+//! \param count  [in] Number of iterations.
+//! \param body   [in] Function to run for each of 0 to count - 1.
+//! \return None.
+//!
+//! Runs the iterations on the worker threads and the calling thread, and returns once all have
+//! run. Each thread gets an even share of consecutive iterations and runs them in order; a thread
+//! out of iterations steals the back half of the largest share left, so the threads finish
+//! together however uneven the iterations, and a worker that starts late, busy with a longer job,
+//! only finds less to do. The calling thread runs only this loop's iterations, so the loop completes
+//! even while every worker is busy. The work of each thread adds up in job_stats.
+//|____________________________________________________________________
+
+void ParallelFor(int count, const std::function<void(int)>& body)
+{
+	// Shared with the helper jobs, which may only start after the loop is over
+	struct Loop {
+		std::function<void(int)> body;
+		std::vector<JobThreadStats>* stats;                 // The calling thread's job_stats
+		std::unique_ptr<std::atomic<uint64_t>[]> shares;    // Iterations left to each thread, first << 32 | end
+		int threads;
+		std::atomic<int> done;
+		std::mutex mutex;
+		std::condition_variable cv;
+	};
+	if (count <= 0) {
+		return;
+	}
+	std::shared_ptr<Loop> loop = std::make_shared<Loop>();
+
+	loop->body = body;
+	loop->stats = &job_stats;
+	job_stats.resize(std::max(job_stats.size(), workers.size() + 1));
+	loop->threads = std::min((int)workers.size(), count - 1) + 1;
+	loop->shares.reset(new std::atomic<uint64_t>[loop->threads]);
+	for (int t = 0; t < loop->threads; ++t) {
+		loop->shares[t] = (uint64_t)(count * (int64_t)t / loop->threads) << 32 | (uint64_t)(count * (int64_t)(t + 1) / loop->threads);
+	}
+	loop->done = 0;
+
+	auto run = [loop, count](int t) {
+		for (;;) {
+			uint64_t share = loop->shares[t];
+			int i = -1;
+			bool stolen = false;
+
+			// Next of our own share
+			while (share >> 32 < (share & 0xffffffff)) {
+				if (loop->shares[t].compare_exchange_weak(share, share + (1ull << 32))) {
+					i = (int)(share >> 32);
+					break;
+				}
+			}
+
+			// Else the back half of the largest share, of which we run the first and keep the rest
+			while (i < 0) {
+				int victim = -1;
+				uint32_t most = 0;
+				for (int v = 0; v < loop->threads; ++v) {
+					uint64_t left = loop->shares[v];
+					if ((uint32_t)left - (uint32_t)(left >> 32) > most) {
+						victim = v;
+						share = left;
+						most = (uint32_t)left - (uint32_t)(left >> 32);
+					}
+				}
+				if (victim < 0) {
+					return;                 // Every iteration is taken
+				}
+
+				uint32_t first = (uint32_t)(share >> 32), end = (uint32_t)share, middle = first + most / 2;
+				if (loop->shares[victim].compare_exchange_strong(share, (uint64_t)first << 32 | middle)) {
+					loop->shares[t] = (uint64_t)(middle + 1) << 32 | end;
+					i = (int)middle;
+					stolen = true;
+				}
+			}
+
+			double start_ms = GetTimeMs();
+			loop->body(i);
+			JobThreadStats& stats = (*loop->stats)[job_thread];
+			stats.busy_ms += GetTimeMs() - start_ms;
+			stats.iterations++;
+			stats.stolen += stolen;
+			if (++loop->done == count) {
+				std::lock_guard<std::mutex> lock(loop->mutex);
+				loop->cv.notify_all();
+			}
+		}
+	};
+
+	for (int t = 1; t < loop->threads; ++t) {
+		SubmitJob([run, t]() { run(t); });
+	}
+	run(0);
+
+	std::unique_lock<std::mutex> lock(loop->mutex);
+	loop->cv.wait(lock, [&loop, count]() { return loop->done == count; });
+}
+
+//|____________________________________________________________________
+//|
+//| Function: GetFileStamp
+//|
+//! \param fname  [in]  Name of file.
+//! \param size   [out] File size in bytes.
+//! \param mtime  [out] Last modification time, as precise as the platform keeps it (FILETIME ticks on
+//!                     Windows, nanoseconds on Linux, seconds elsewhere).
+//! \return true on success, false if the file does not exist.
+//!
+//! Identifies a version of a file; used to detect stale texture caches and changed assets.
+//|____________________________________________________________________
+
+bool GetFileStamp(const char* fname, uint64_t* size, int64_t* mtime)
+{
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+
+	if (!GetFileAttributesExA(fname, GetFileExInfoStandard, &attr)) {
+		return false;
+	}
+	*size = (uint64_t)attr.nFileSizeHigh << 32 | attr.nFileSizeLow;
+	*mtime = (int64_t)((uint64_t)attr.ftLastWriteTime.dwHighDateTime << 32 | attr.ftLastWriteTime.dwLowDateTime);
+#else
+	struct stat st;
+
+	if (stat(fname, &st) != 0) {
+		return false;
+	}
+	*size = (uint64_t)st.st_size;
+#ifdef __linux__
+	*mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+	*mtime = (int64_t)st.st_mtime;
+#endif
+#endif
+	return true;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: LoadTextureManifest
+//|
+//! \param fname  [in]  Name of the manifest file.
+//! \param descs  [out] Textures, indexed by TextureID.
+//! \return true on success, false (after reporting the line at fault) otherwise.
+//!
+//! Reads the texture manifest, a text file of directives, one per line ('#' starts a comment):
+//!
+//!   texture <id> [compress] [srgb] [filter=linear|nearest] [wrap=repeat|clamp]
+//!   source <image> [keyed]
+//!
+//! Every TextureSlot must be described once, followed by exactly its number of source images:
+//! cube map faces in the order +X, -X, +Y, -Y, +Z, -Z, atlas regions in AtlasRegion order.
+//|____________________________________________________________________
+
+bool LoadTextureManifest(const char* fname, TextureDesc descs[TEXTURE_NB])
+{
+	const char* space = " \t\r\n";
+	bool defined[TEXTURE_NB] = { false };
+	TextureDesc* desc = NULL;
+	char line[512];
+	int line_nb = 0;
+	bool ok = true;
+	FILE* fp;
+
+	if (!(fp = fopen(fname, "r"))) {
+		fprintf(stderr, "%s: cannot open texture manifest\n", fname);
+		return false;
+	}
+
+	while (ok && fgets(line, sizeof(line), fp)) {
+		char* word;
+
+		++line_nb;
+		if ((word = strchr(line, '#')) != NULL) {
+			*word = '\0';
+		}
+		if ((word = strtok(line, space)) == NULL) {
+			continue;
+		}
+
+		if (strcmp(word, "texture") == 0) {
+			const char* id_name = strtok(NULL, space);
+			int id = 0;
+
+			while (id < TEXTURE_NB && (id_name == NULL || strcmp(id_name, TEXTURE_SLOTS[id].name) != 0)) {
+				++id;
+			}
+			if (id == TEXTURE_NB || defined[id]) {
+				fprintf(stderr, "%s:%d: %s texture '%s'\n", fname, line_nb, id == TEXTURE_NB ? "unknown" : "duplicate",
+					id_name ? id_name : "");
+				ok = false;
+				break;
+			}
+
+			desc = &descs[id];
+			defined[id] = true;
+			desc->name = TEXTURE_SLOTS[id].name;
+			desc->kind = TEXTURE_SLOTS[id].kind;
+			desc->source_nb = 0;
+			desc->flags = 0;
+			desc->keyed_sources = 0;
+			desc->filter = GL_LINEAR;
+			desc->wrap = GL_REPEAT;
+
+			while (ok && (word = strtok(NULL, space)) != NULL) {
+				if (strcmp(word, "compress") == 0) {
+					desc->flags |= TF_COMPRESS;
+				}
+				else if (strcmp(word, "srgb") == 0) {
+					desc->flags |= TF_SRGB;
+				}
+				else if (strcmp(word, "filter=linear") == 0 || strcmp(word, "filter=nearest") == 0) {
+					desc->filter = word[7] == 'l' ? GL_LINEAR : GL_NEAREST;
+				}
+				else if (strcmp(word, "wrap=repeat") == 0 || strcmp(word, "wrap=clamp") == 0) {
+					desc->wrap = word[5] == 'r' ? GL_REPEAT : GL_CLAMP_TO_EDGE;
+				}
+				else {
+					fprintf(stderr, "%s:%d: unknown texture setting '%s'\n", fname, line_nb, word);
+					ok = false;
+				}
+			}
+		}
+		else if (strcmp(word, "source") == 0) {
+			const char* image = strtok(NULL, space);
+			const char* option = image ? strtok(NULL, space) : NULL;
+
+			if (desc == NULL || image == NULL || desc->source_nb == MAX_TEXTURE_SOURCES ||
+				(option != NULL && strcmp(option, "keyed") != 0)) {
+				fprintf(stderr, "%s:%d: expected 'source <image> [keyed]' within a texture with room for it\n", fname, line_nb);
+				ok = false;
+				break;
+			}
+			if (option != NULL) {
+				desc->keyed_sources |= 1u << desc->source_nb;
+			}
+			desc->sources[desc->source_nb++] = image;
+		}
+		else {
+			fprintf(stderr, "%s:%d: unknown directive '%s'\n", fname, line_nb, word);
+			ok = false;
+		}
+	}
+	fclose(fp);
+
+	for (int id = 0; ok && id < TEXTURE_NB; ++id) {
+		if (!defined[id] || descs[id].source_nb != TEXTURE_SLOTS[id].source_nb) {
+			fprintf(stderr, "%s: texture '%s' needs %d source images\n", fname, TEXTURE_SLOTS[id].name,
+				TEXTURE_SLOTS[id].source_nb);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: TextureSettingsHash
+//|
+//! \param desc  [in] Texture.
+//! \return FNV-1a hash of the settings that change the decoded texture (sampler settings excluded).
+//|____________________________________________________________________
+
+uint32_t TextureSettingsHash(const TextureDesc& desc)
+{
+	uint32_t hash = 2166136261u;
+	auto mix = [&hash](const void* data, size_t size) {
+		for (size_t i = 0; i < size; ++i) {
+			hash = (hash ^ ((const unsigned char*)data)[i]) * 16777619u;
+		}
+	};
+
+	mix(&desc.kind, sizeof(desc.kind));
+	mix(&desc.flags, sizeof(desc.flags));
+	mix(&desc.keyed_sources, sizeof(desc.keyed_sources));
+	for (int i = 0; i < desc.source_nb; ++i) {
+		mix(desc.sources[i].c_str(), desc.sources[i].size() + 1);
+	}
+	return hash;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: TextureLayers
+//|
+//! \param id  [in] Texture.
+//! \return Number of images the texture is uploaded as: six for a cube map, one otherwise.
+//|____________________________________________________________________
+
+int TextureLayers(TextureID id)
+{
+	return texture_descs[id].kind == TK_CUBE ? 6 : 1;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: TextureTarget
+//|
+//! \param id  [in] Texture.
+//! \return Target the texture is bound to.
+//|____________________________________________________________________
+
+GLenum TextureTarget(TextureID id)
+{
+	return texture_descs[id].kind == TK_CUBE ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: TextureLayerName
+//|
+//! \param id     [in] Texture.
+//! \param layer  [in] Cube map face, 0 otherwise.
+//! \return Name of the texture image in reports and cache file names.
+//!
+//! Cube map faces are named after their source image so each face keeps its own cache file.
+//|____________________________________________________________________
+
+std::string TextureLayerName(TextureID id, int layer)
+{
+	if (texture_descs[id].kind != TK_CUBE) {
+		return texture_descs[id].name;
+	}
+
+	std::string name(texture_descs[id].sources[layer]);
+	size_t dot = name.find_last_of('.');
+	if (dot != std::string::npos) {
+		name.erase(dot);
+	}
+	return name;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: GetTextureStamp
+//|
+//! \param id     [in]  Texture.
+//! \param layer  [in]  Cube map face, 0 otherwise.
+//! \param size   [out] Total size of the image's source files.
+//! \param mtime  [out] Latest modification time of the image's source files.
+//! \return true on success, false if a source image does not exist.
+//!
+//! Identifies a version of a texture image's sources; used to detect stale texture caches.
+//|____________________________________________________________________
+
+bool GetTextureStamp(TextureID id, int layer, uint64_t* size, int64_t* mtime)
+{
+	const TextureDesc& desc = texture_descs[id];
+	int first = desc.kind == TK_CUBE ? layer : 0;
+	int last = desc.kind == TK_CUBE ? layer + 1 : desc.source_nb;
+
+	*size = 0;
+	*mtime = 0;
+
+	for (int i = first; i < last; ++i) {
+		uint64_t source_size;
+		int64_t source_mtime;
+
+		if (!GetFileStamp(desc.sources[i].c_str(), &source_size, &source_mtime)) {
+			return false;
+		}
+		*size += source_size;
+		*mtime = std::max(*mtime, source_mtime);
+	}
+	return true;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: TextureCachePath
+//|
+//! \param id     [in] Texture.
+//! \param layer  [in] Cube map face, 0 otherwise.
+//! \return Name of the texture cache file baked for the texture image.
+//|____________________________________________________________________
+
+std::string TextureCachePath(TextureID id, int layer)
+{
+	return TextureLayerName(id, layer) + ".tex";
+}
+
+//|____________________________________________________________________
+//|
+//| Function: ExpandRGBA_Scalar
+//|
+//! \param rgb    [in]  Packed RGB pixels.
+//! \param rgba   [out] RGBA pixels, alpha set to 255.
+//! \param count  [in]  Number of pixels.
+//! \return None.
+//!
+//! Expands RGB to RGBA so every texel is 4-byte aligned: GL takes the fast upload path and rows
+//! need no GL_UNPACK_ALIGNMENT of 1.
+//|____________________________________________________________________
+
+void ExpandRGBA_Scalar(const unsigned char* rgb, unsigned char* rgba, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		rgba[4 * i + 0] = rgb[3 * i + 0];
+		rgba[4 * i + 1] = rgb[3 * i + 1];
+		rgba[4 * i + 2] = rgb[3 * i + 2];
+		rgba[4 * i + 3] = 255;
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: AlphaKey_Scalar
+//|
+//! \param rgba   [in/out] RGBA pixels.
+//! \param count  [in] Number of pixels.
+//! \return None.
+//!
+//! Sets alpha to 0 where all three channels are within ALPHA_KEY_TOLERANCE of ALPHA_KEY, 255 elsewhere.
+//|____________________________________________________________________
+
+void AlphaKey_Scalar(unsigned char* rgba, size_t count)
+{
+	for (size_t i = 0; i < count; ++i, rgba += 4) {
+		int d = std::max(std::max(abs(rgba[0] - ALPHA_KEY[0]), abs(rgba[1] - ALPHA_KEY[1])), abs(rgba[2] - ALPHA_KEY[2]));
+		rgba[3] = (unsigned char)(d > ALPHA_KEY_TOLERANCE) * 255;
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: Downsample_Scalar
+//|
+//! \param src  [in]  Source level, linear RGBA with 16-bit channels.
+//! \param sw   [in]  Source width.
+//! \param sh   [in]  Source height.
+//! \param dst  [out] Destination level, (sw / 2) x (sh / 2) clamped to at least 1.
+//! \return None.
+//!
+//! Builds the next mip level with a 2x2 box filter. Odd edges drop their last row/column; a source
+//! one pixel wide or high reuses it.
+//|____________________________________________________________________
+
+void Downsample_Scalar(const uint16_t* src, unsigned int sw, unsigned int sh, uint16_t* dst)
+{
+	unsigned int dw = std::max(sw / 2, 1u);
+	unsigned int dh = std::max(sh / 2, 1u);
+
+	for (unsigned int y = 0; y < dh; ++y) {
+		const uint16_t* row0 = src + (size_t)std::min(2 * y, sh - 1) * sw * 4;
+		const uint16_t* row1 = src + (size_t)std::min(2 * y + 1, sh - 1) * sw * 4;
+
+		for (unsigned int x = 0; x < dw; ++x) {
+			unsigned int x0 = std::min(2 * x, sw - 1) * 4;
+			unsigned int x1 = std::min(2 * x + 1, sw - 1) * 4;
+
+			for (int c = 0; c < 4; ++c) {
+				*dst++ = (uint16_t)((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+			}
+		}
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+
+//|____________________________________________________________________
+//|
+//| Function: ExpandRGBA_SSSE3
+//|
+//! \param rgb    [in]  Packed RGB pixels.
+//! \param rgba   [out] RGBA pixels, alpha set to 255.
+//! \param count  [in]  Number of pixels.
+//! \return None.
+//!
+//! ExpandRGBA_Scalar() with one byte shuffle per 4 pixels. Loads are 16 bytes wide, so the last
+//! pixels that cannot fill one go through the scalar loop.
+//|____________________________________________________________________
+
+TARGET_SSSE3 void ExpandRGBA_SSSE3(const unsigned char* rgb, unsigned char* rgba, size_t count)
+{
+	const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+	size_t i = 0;
+
+	for (; i + 6 <= count; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(rgb + 3 * i));
+		_mm_storeu_si128((__m128i*)(rgba + 4 * i), _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha));
+	}
+	ExpandRGBA_Scalar(rgb + 3 * i, rgba + 4 * i, count - i);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: AlphaKey_SSE2
+//|
+//! \param rgba   [in/out] RGBA pixels.
+//! \param count  [in] Number of pixels.
+//! \return None.
+//!
+//! AlphaKey_Scalar() 4 pixels at a time. The saturated distance to the key minus the tolerance is
+//! zero in every colour channel exactly for keyed pixels; the tolerance has 255 in the alpha lane so
+//! the old alpha never counts.
+//|____________________________________________________________________
+
+TARGET_SSE2 void AlphaKey_SSE2(unsigned char* rgba, size_t count)
+{
+	const __m128i key = _mm_set1_epi32(ALPHA_KEY[0] | ALPHA_KEY[1] << 8 | ALPHA_KEY[2] << 16);
+	const __m128i tolerance = _mm_set1_epi32((int)(ALPHA_KEY_TOLERANCE * 0x010101u | 0xFF000000u));
+	const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(rgba + 4 * i));
+		__m128i d = _mm_or_si128(_mm_subs_epu8(v, key), _mm_subs_epu8(key, v));
+		__m128i keyed = _mm_cmpeq_epi32(_mm_subs_epu8(d, tolerance), _mm_setzero_si128());
+		v = _mm_or_si128(_mm_andnot_si128(alpha, v), _mm_andnot_si128(keyed, alpha));
+		_mm_storeu_si128((__m128i*)(rgba + 4 * i), v);
+	}
+	AlphaKey_Scalar(rgba + 4 * i, count - i);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: Downsample_SSE2
+//|
+//! \param src  [in]  Source level, linear RGBA with 16-bit channels.
+//! \param sw   [in]  Source width.
+//! \param sh   [in]  Source height.
+//! \param dst  [out] Destination level.
+//! \return None.
+//!
+//! Downsample_Scalar() 2 destination pixels at a time: the two rows are added, then the even and
+//! odd source pixels. LINEAR_BITS keeps the four-texel sum within 16 bits.
+//|____________________________________________________________________
+
+TARGET_SSE2 void Downsample_SSE2(const uint16_t* src, unsigned int sw, unsigned int sh, uint16_t* dst)
+{
+	unsigned int dw = sw / 2;
+	unsigned int dh = sh / 2;
+	const __m128i round = _mm_set1_epi16(2);
+
+	if (sw < 2 || sh < 2) {
+		Downsample_Scalar(src, sw, sh, dst);
+		return;
+	}
+
+	for (unsigned int y = 0; y < dh; ++y) {
+		const uint16_t* row0 = src + (size_t)2 * y * sw * 4;
+		const uint16_t* row1 = row0 + (size_t)sw * 4;
+		uint16_t* out = dst + (size_t)y * dw * 4;
+		unsigned int x = 0;
+
+		for (; x + 2 <= dw; x += 2) {
+			__m128i a = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(row0 + 8 * x)), _mm_loadu_si128((const __m128i*)(row1 + 8 * x)));
+			__m128i b = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(row0 + 8 * x + 8)), _mm_loadu_si128((const __m128i*)(row1 + 8 * x + 8)));
+			__m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b));
+			_mm_storeu_si128((__m128i*)(out + 4 * x), _mm_srli_epi16(_mm_add_epi16(sum, round), 2));
+		}
+		for (; x < dw; ++x) {
+			for (int c = 0; c < 4; ++c) {
+				out[4 * x + c] = (uint16_t)((row0[8 * x + c] + row0[8 * x + 4 + c] + row1[8 * x + c] + row1[8 * x + 4 + c] + 2) >> 2);
+			}
+		}
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: ExpandRGBA_AVX2
+//|
+//! \param rgb    [in]  Packed RGB pixels.
+//! \param rgba   [out] RGBA pixels, alpha set to 255.
+//! \param count  [in]  Number of pixels.
+//! \return None.
+//!
+//! ExpandRGBA_SSSE3() 8 pixels at a time: each 128-bit lane is loaded with 4 pixels, since AVX2
+//! byte shuffles do not cross lanes.
+//|____________________________________________________________________
+
+TARGET_AVX2 void ExpandRGBA_AVX2(const unsigned char* rgb, unsigned char* rgba, size_t count)
+{
+	const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+		0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+	size_t i = 0;
+
+	for (; i + 10 <= count; i += 8) {
+		__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(rgb + 3 * i))),
+			_mm_loadu_si128((const __m128i*)(rgb + 3 * i + 12)), 1);
+		_mm256_storeu_si256((__m256i*)(rgba + 4 * i), _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha));
+	}
+	// The non-VEX code of the tail, and whatever the caller runs next, stalls while the upper halves
+	// of the registers are dirty
+	_mm256_zeroupper();
+	ExpandRGBA_Scalar(rgb + 3 * i, rgba + 4 * i, count - i);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: AlphaKey_AVX2
+//|
+//! \param rgba   [in/out] RGBA pixels.
+//! \param count  [in] Number of pixels.
+//! \return None.
+//!
+//! AlphaKey_SSE2() 8 pixels at a time.
+//|____________________________________________________________________
+
+TARGET_AVX2 void AlphaKey_AVX2(unsigned char* rgba, size_t count)
+{
+	const __m256i key = _mm256_set1_epi32(ALPHA_KEY[0] | ALPHA_KEY[1] << 8 | ALPHA_KEY[2] << 16);
+	const __m256i tolerance = _mm256_set1_epi32((int)(ALPHA_KEY_TOLERANCE * 0x010101u | 0xFF000000u));
+	const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(rgba + 4 * i));
+		__m256i d = _mm256_or_si256(_mm256_subs_epu8(v, key), _mm256_subs_epu8(key, v));
+		__m256i keyed = _mm256_cmpeq_epi32(_mm256_subs_epu8(d, tolerance), _mm256_setzero_si256());
+		v = _mm256_or_si256(_mm256_andnot_si256(alpha, v), _mm256_andnot_si256(keyed, alpha));
+		_mm256_storeu_si256((__m256i*)(rgba + 4 * i), v);
+	}
+	_mm256_zeroupper();
+	AlphaKey_Scalar(rgba + 4 * i, count - i);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: Downsample_AVX2
+//|
+//! \param src  [in]  Source level, linear RGBA with 16-bit channels.
+//! \param sw   [in]  Source width.
+//! \param sh   [in]  Source height.
+//! \param dst  [out] Destination level.
+//! \return None.
+//!
+//! Downsample_SSE2() 4 destination pixels at a time. The in-lane unpacks leave the sums in the
+//! order 0, 2, 1, 3, which a 64-bit permute puts back.
+//|____________________________________________________________________
+
+TARGET_AVX2 void Downsample_AVX2(const uint16_t* src, unsigned int sw, unsigned int sh, uint16_t* dst)
+{
+	unsigned int dw = sw / 2;
+	unsigned int dh = sh / 2;
+	const __m256i round = _mm256_set1_epi16(2);
+
+	if (sw < 2 || sh < 2) {
+		Downsample_Scalar(src, sw, sh, dst);
+		return;
+	}
+
+	for (unsigned int y = 0; y < dh; ++y) {
+		const uint16_t* row0 = src + (size_t)2 * y * sw * 4;
+		const uint16_t* row1 = row0 + (size_t)sw * 4;
+		uint16_t* out = dst + (size_t)y * dw * 4;
+		unsigned int x = 0;
+
+		for (; x + 4 <= dw; x += 4) {
+			__m256i a = _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(row0 + 8 * x)), _mm256_loadu_si256((const __m256i*)(row1 + 8 * x)));
+			__m256i b = _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(row0 + 8 * x + 16)), _mm256_loadu_si256((const __m256i*)(row1 + 8 * x + 16)));
+			__m256i sum = _mm256_add_epi16(_mm256_unpacklo_epi64(a, b), _mm256_unpackhi_epi64(a, b));
+			sum = _mm256_permute4x64_epi64(sum, _MM_SHUFFLE(3, 1, 2, 0));
+			_mm256_storeu_si256((__m256i*)(out + 4 * x), _mm256_srli_epi16(_mm256_add_epi16(sum, round), 2));
+		}
+		for (; x < dw; ++x) {
+			for (int c = 0; c < 4; ++c) {
+				out[4 * x + c] = (uint16_t)((row0[8 * x + c] + row0[8 * x + 4 + c] + row1[8 * x + c] + row1[8 * x + 4 + c] + 2) >> 2);
+			}
+		}
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: GetCPUFeatures
+//|
+//! \param has_ssse3  [out] Whether the CPU runs SSSE3.
+//! \param has_avx2   [out] Whether the CPU runs AVX2, and the OS saves the YMM registers.
+//! \return None.
+//!
+//! SSE2 needs no check: every x86-64 CPU has it.
+//|____________________________________________________________________
+
+void GetCPUFeatures(bool* has_ssse3, bool* has_avx2)
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	*has_ssse3 = (info[2] & (1 << 9)) != 0;
+	bool has_ymm = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;   // OSXSAVE, AVX, OS saves YMM
+	__cpuidex(info, 7, 0);
+	*has_avx2 = has_ymm && (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	*has_ssse3 = __builtin_cpu_supports("ssse3");
+	*has_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // HAVE_X86_SIMD
+
+//|____________________________________________________________________
+//|
+//| Function: InitPixelConversion
+//|
+//! \param None.
+//! \return None.
+//!
+//! Builds the linear light tables and selects the pixel conversion kernels for the running CPU.
+//! Must run before the worker threads start.
+//|____________________________________________________________________
+
+void InitPixelConversion()
+{
+	for (int i = 0; i < 256; ++i) {
+		double c = i / 255.0;
+		double linear = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+		srgb_to_linear[i] = (uint16_t)(linear * LINEAR_MAX + 0.5);
+		unorm_to_linear[i] = (uint16_t)(i * LINEAR_MAX / 255.0 + 0.5);
+	}
+	for (int i = 0; i <= LINEAR_MAX; ++i) {
+		double linear = i / (double)LINEAR_MAX;
+		double c = linear <= 0.0031308 ? linear * 12.92 : 1.055 * pow(linear, 1 / 2.4) - 0.055;
+		linear_to_srgb[i] = (unsigned char)(c * 255 + 0.5);
+		linear_to_unorm[i] = (unsigned char)(linear * 255 + 0.5);
+	}
+
+	pixel_kernels.name = "scalar";
+	pixel_kernels.expand_rgba = ExpandRGBA_Scalar;
+	pixel_kernels.alpha_key = AlphaKey_Scalar;
+	pixel_kernels.downsample = Downsample_Scalar;
+
+#ifdef HAVE_X86_SIMD
+	bool has_ssse3, has_avx2;
+
+	GetCPUFeatures(&has_ssse3, &has_avx2);
+	if (has_avx2) {
+		pixel_kernels.name = "AVX2";
+		pixel_kernels.expand_rgba = ExpandRGBA_AVX2;
+		pixel_kernels.alpha_key = AlphaKey_AVX2;
+		pixel_kernels.downsample = Downsample_AVX2;
+	}
+	else if (has_ssse3) {
+		pixel_kernels.name = "SSSE3";
+		pixel_kernels.expand_rgba = ExpandRGBA_SSSE3;
+		pixel_kernels.alpha_key = AlphaKey_SSE2;
+		pixel_kernels.downsample = Downsample_SSE2;
+	}
+	else {
+		pixel_kernels.name = "SSE2";
+		pixel_kernels.alpha_key = AlphaKey_SSE2;
+		pixel_kernels.downsample = Downsample_SSE2;
+	}
+#endif
+}
+
+//|____________________________________________________________________
+//|
+//| Function: ToLinear
+//|
+//! \param rgba   [in]  RGBA pixels.
+//! \param count  [in]  Number of pixels.
+//! \param lut    [in]  Colour table: srgb_to_linear or unorm_to_linear.
+//! \param dst    [out] RGBA pixels with LINEAR_BITS channels.
+//! \return None.
+//!
+//! Alpha is always converted with unorm_to_linear.
+//|____________________________________________________________________
+
+void ToLinear(const unsigned char* rgba, size_t count, const uint16_t* lut, uint16_t* dst)
+{
+	for (size_t i = 0; i < 4 * count; i += 4) {
+		dst[i + 0] = lut[rgba[i + 0]];
+		dst[i + 1] = lut[rgba[i + 1]];
+		dst[i + 2] = lut[rgba[i + 2]];
+		dst[i + 3] = unorm_to_linear[rgba[i + 3]];
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: FromLinear
+//|
+//! \param src    [in]  RGBA pixels with LINEAR_BITS channels.
+//! \param count  [in]  Number of pixels.
+//! \param lut    [in]  Colour table: linear_to_srgb or linear_to_unorm.
+//! \param rgba   [out] RGBA pixels.
+//! \return None.
+//!
+//! Inverse of ToLinear().
+//|____________________________________________________________________
+
+void FromLinear(const uint16_t* src, size_t count, const unsigned char* lut, unsigned char* rgba)
+{
+	for (size_t i = 0; i < 4 * count; i += 4) {
+		rgba[i + 0] = lut[src[i + 0]];
+		rgba[i + 1] = lut[src[i + 1]];
+		rgba[i + 2] = lut[src[i + 2]];
+		rgba[i + 3] = linear_to_unorm[src[i + 3]];
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: ConvertSourceImage
+//|
+//! \param img     [in]  Source image.
+//! \param keyed   [in]  Generate alpha from ALPHA_KEY, else opaque.
+//! \param dst     [out] First RGBA pixel of the destination.
+//! \param stride  [in]  Destination row length in pixels.
+//! \return None.
+//!
+//! Conversion stage run on every source image after loading. Contiguous images are converted in a
+//! single pass, others one row at a time.
+//|____________________________________________________________________
+
+void ConvertSourceImage(const MappedPPM& img, bool keyed, unsigned char* dst, size_t stride)
+{
+	size_t rows = stride == img.width ? 1 : img.height;
+	size_t count = stride == img.width ? (size_t)img.width * img.height : img.width;
+
+	for (size_t y = 0; y < rows; ++y) {
+		unsigned char* row = dst + y * stride * 4;
+
+		pixel_kernels.expand_rgba(img.pixels + y * img.width * 3, row, count);
+		if (keyed) {
+			pixel_kernels.alpha_key(row, count);
+		}
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BenchConvert
+//|
+//! \param None.
+//! \return 0 if every kernel matches the scalar one, 1 otherwise.
+//!
+//! Conversion throughput benchmark (--bench-convert): times each stage, scalar loop against the
+//! kernels selected for this CPU, on a BENCH_CONVERT_SIZE square noise image, and checks their
+//! outputs are identical. Throughput is counted in source megabytes per second.
+//|____________________________________________________________________
+
+int BenchConvert()
+{
+	const size_t count = (size_t)BENCH_CONVERT_SIZE * BENCH_CONVERT_SIZE;
+	const size_t half = count / 4;
+	std::vector<unsigned char> rgb(count * 3), rgba(count * 4), rgba_ref(count * 4), out(count * 4);
+	std::vector<uint16_t> linear(count * 4), mip(half * 4), mip_ref(half * 4);
+	uint32_t seed = 0x12345678;
+	int mismatches = 0;
+
+	for (size_t i = 0; i < rgb.size(); ++i) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		rgb[i] = (unsigned char)(seed >> 24);
+	}
+
+	// Best time of BENCH_CONVERT_RUNS in milliseconds
+	auto best_ms = [](const std::function<void()>& run) {
+		double best = 1e30;
+		for (int i = 0; i < BENCH_CONVERT_RUNS; ++i) {
+			double start = GetTimeMs();
+			run();
+			best = std::min(best, GetTimeMs() - start);
+		}
+		return best;
+	};
+	auto report = [&](const char* stage, double bytes, double scalar_ms, double simd_ms, bool same) {
+		double mb = bytes / (1024.0 * 1024.0);
+		printf("%-16s %12.0f %12.0f %8.2fx  %s\n", stage, mb * 1000 / scalar_ms, mb * 1000 / simd_ms, scalar_ms / simd_ms,
+			same ? "ok" : "MISMATCH");
+		mismatches += !same;
+	};
+
+	printf("Pixel conversion, %ux%u pixels, %s kernels\n", BENCH_CONVERT_SIZE, BENCH_CONVERT_SIZE, pixel_kernels.name);
+	printf("%-16s %12s %12s %9s\n", "Stage", "Scalar MB/s", "Kernel MB/s", "Speedup");
+
+	double scalar_ms = best_ms([&]() { ExpandRGBA_Scalar(rgb.data(), rgba_ref.data(), count); });
+	double simd_ms = best_ms([&]() { pixel_kernels.expand_rgba(rgb.data(), rgba.data(), count); });
+	report("RGB to RGBA", (double)rgb.size(), scalar_ms, simd_ms, rgba == rgba_ref);
+
+	scalar_ms = best_ms([&]() { AlphaKey_Scalar(rgba_ref.data(), count); });
+	simd_ms = best_ms([&]() { pixel_kernels.alpha_key(rgba.data(), count); });
+	report("Alpha key", (double)rgba.size(), scalar_ms, simd_ms, rgba == rgba_ref);
+
+	ToLinear(rgba.data(), count, srgb_to_linear, linear.data());
+	scalar_ms = best_ms([&]() { Downsample_Scalar(linear.data(), BENCH_CONVERT_SIZE, BENCH_CONVERT_SIZE, mip_ref.data()); });
+	simd_ms = best_ms([&]() { pixel_kernels.downsample(linear.data(), BENCH_CONVERT_SIZE, BENCH_CONVERT_SIZE, mip.data()); });
+	report("Box downsample", linear.size() * 2.0, scalar_ms, simd_ms, mip == mip_ref);
+
+	// Table lookups: no kernels, reported for scale
+	scalar_ms = best_ms([&]() { ToLinear(rgba.data(), count, srgb_to_linear, linear.data()); });
+	simd_ms = best_ms([&]() { FromLinear(linear.data(), count, linear_to_srgb, out.data()); });
+	printf("%-16s %12.0f\n%-16s %12.0f\n", "sRGB to linear", rgba.size() / (1024.0 * 1024.0) * 1000 / scalar_ms,
+		"Linear to sRGB", linear.size() * 2 / (1024.0 * 1024.0) * 1000 / simd_ms);
+	if (out != rgba) {
+		printf("sRGB round trip: MISMATCH\n");
+		++mismatches;
+	}
+
+	return mismatches == 0 ? 0 : 1;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BenchBVH
+//|
+//! \param count  [in] Number of objects.
+//! \return 0 if every query matches a linear scan, 1 otherwise.
+//!
+//! Scenery index benchmark (--bench-bvh): builds a BVH over count random boxes spread over a
+//! BENCH_BVH_SIZE cube, refits it after moving every box, and times frustum, ray and sphere queries
+//! against a linear scan of the boxes, checking both find the same boxes.
+//|____________________________________________________________________
+
+int BenchBVH(int count)
+{
+	std::vector<gmtl::AABoxf> bounds(count);
+	std::vector<int> found, expected;
+	BVH bvh;
+	uint32_t seed = 0x12345678;
+	int mismatches = 0;
+
+	// Uniform in [0, 1)
+	auto random = [&seed]() {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		return (seed >> 8) / 16777216.0f;
+	};
+
+	for (int i = 0; i < count; ++i) {
+		gmtl::Point3f lo(random() * BENCH_BVH_SIZE, random() * BENCH_BVH_SIZE, random() * BENCH_BVH_SIZE);
+		bounds[i] = gmtl::AABoxf(lo, lo + gmtl::Vec3f(1 + random() * 20, 1 + random() * 20, 1 + random() * 20));
+	}
+
+	printf("Scenery index, %d objects\n", count);
+	double start = GetTimeMs();
+	BuildBVH(&bvh, bounds);
+	printf("Build   %10.1f ms, %d nodes\n", GetTimeMs() - start, (int)bvh.nodes.size());
+
+	// Move everything a little, as moving scenery would between frames
+	for (int i = 0; i < count; ++i) {
+		gmtl::Vec3f move((random() - 0.5f) * 10, (random() - 0.5f) * 10, (random() - 0.5f) * 10);
+		bounds[i] = gmtl::AABoxf(gmtl::Point3f(bounds[i].getMin() + move), gmtl::Point3f(bounds[i].getMax() + move));
+	}
+	start = GetTimeMs();
+	RefitBVH(&bvh, bounds);
+	printf("Refit   %10.1f ms\n", GetTimeMs() - start);
+
+	// The same queries, BVH against a linear scan. Results are compared in index order
+	printf("%-16s %12s %12s %9s %12s\n", "Query", "Linear us", "BVH us", "Speedup", "Results");
+	auto compare = [&](const char* query, const std::function<void(int)>& linear, const std::function<void(int)>& indexed) {
+		double linear_ms = 0, bvh_ms = 0;
+		size_t results = 0;
+		bool same = true;
+
+		for (int q = 0; q < BENCH_BVH_QUERIES; ++q) {
+			double start = GetTimeMs();
+			linear(q);
+			linear_ms += GetTimeMs() - start;
+			start = GetTimeMs();
+			indexed(q);
+			bvh_ms += GetTimeMs() - start;
+
+			std::sort(found.begin(), found.end());
+			same = same && found == expected;
+			results += found.size();
+		}
+		printf("%-16s %12.1f %12.1f %8.0fx %12.1f  %s\n", query, linear_ms * 1000 / BENCH_BVH_QUERIES, bvh_ms * 1000 / BENCH_BVH_QUERIES,
+			linear_ms / bvh_ms, (double)results / BENCH_BVH_QUERIES, same ? "ok" : "MISMATCH");
+		mismatches += !same;
+	};
+
+	// Frusta looking horizontally from random points, with the camera's field of view and a 500 unit range
+	std::vector<Frustum> frusta(BENCH_BVH_QUERIES);
+	for (int q = 0; q < BENCH_BVH_QUERIES; ++q) {
+		float f = 1.0f / tanf(gmtl::Math::deg2Rad(CAM_FOV) / 2), aspect = 4.0f / 3.0f, n = CAM_NEAR, fr = 500.0f;
+		float yaw = random() * 2 * gmtl::Math::PI, c = cosf(yaw), s = sinf(yaw);
+		float eye[3] = { random() * BENCH_BVH_SIZE, random() * BENCH_BVH_SIZE, random() * BENCH_BVH_SIZE };
+		GLfloat view[16] = { c, 0, s, 0, 0, 1, 0, 0, -s, 0, c, 0,
+			-(c * eye[0] - s * eye[2]), -eye[1], -(s * eye[0] + c * eye[2]), 1 };
+		GLfloat proj[16] = { f / aspect, 0, 0, 0, 0, f, 0, 0, 0, 0, (fr + n) / (n - fr), -1, 0, 0, 2 * fr * n / (n - fr), 0 };
+		GLfloat clip[16];
+
+		for (int col = 0; col < 4; ++col) {
+			for (int r = 0; r < 4; ++r) {
+				clip[col * 4 + r] = proj[r] * view[col * 4] + proj[4 + r] * view[col * 4 + 1] + proj[8 + r] * view[col * 4 + 2] +
+					proj[12 + r] * view[col * 4 + 3];
+			}
+		}
+		MakeFrustum(clip, &frusta[q]);
+	}
+	compare("Frustum", [&](int q) {
+		expected.clear();
+		for (int i = 0; i < count; ++i) {
+			unsigned int planes = 0x3f;
+			if (ClassifyBox(frusta[q], bounds[i], &planes)) {
+				expected.push_back(i);
+			}
+		}
+	}, [&](int q) { QueryBVHFrustum(bvh, bounds, frusta[q], &found); });
+
+	// Rays in random directions from random points; the nearest hit is the result
+	std::vector<gmtl::Rayf> rays(BENCH_BVH_QUERIES);
+	for (int q = 0; q < BENCH_BVH_QUERIES; ++q) {
+		gmtl::Vec3f dir(random() - 0.5f, random() - 0.5f, random() - 0.5f);
+		gmtl::normalize(dir);
+		rays[q] = gmtl::Rayf(gmtl::Point3f(random() * BENCH_BVH_SIZE, random() * BENCH_BVH_SIZE, random() * BENCH_BVH_SIZE), dir);
+	}
+	compare("Ray", [&](int q) {
+		float inv_dir[3] = { 1.0f / rays[q].getDir()[0], 1.0f / rays[q].getDir()[1], 1.0f / rays[q].getDir()[2] };
+		float max_t = FLT_MAX, t;
+		int hit = -1;
+
+		for (int i = 0; i < count; ++i) {
+			if (RayHitsBox(bounds[i], rays[q], inv_dir, max_t, &t) && (hit < 0 || t < max_t)) {
+				max_t = t;
+				hit = i;
+			}
+		}
+		expected.assign(hit >= 0 ? 1 : 0, hit);
+	}, [&](int q) {
+		float t;
+		int hit = QueryBVHRay(bvh, bounds, rays[q], FLT_MAX, &t);
+		found.assign(hit >= 0 ? 1 : 0, hit);
+	});
+
+	// Spheres of radius 100 around random points
+	std::vector<gmtl::Spheref> spheres(BENCH_BVH_QUERIES);
+	for (int q = 0; q < BENCH_BVH_QUERIES; ++q) {
+		spheres[q] = gmtl::Spheref(gmtl::Point3f(random() * BENCH_BVH_SIZE, random() * BENCH_BVH_SIZE, random() * BENCH_BVH_SIZE), 100.0f);
+	}
+	compare("Sphere", [&](int q) {
+		expected.clear();
+		for (int i = 0; i < count; ++i) {
+			if (SphereHitsBox(bounds[i], spheres[q])) {
+				expected.push_back(i);
+			}
+		}
+	}, [&](int q) { QueryBVHSphere(bvh, bounds, spheres[q], &found); });
+
+	return mismatches == 0 ? 0 : 1;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: QuatMul_Scalar
+//|
+//! \param a      [in]  Left quaternions.
+//! \param b      [in]  Right quaternions.
+//! \param out    [out] a * b, as gmtl multiplies them. May be a or b.
+//! \param count  [in]  Number of quaternions.
+//! \return None.
+//|____________________________________________________________________
+
+void QuatMul_Scalar(const QuatArrays& a, const QuatArrays& b, const QuatArrays& out, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		float ax = a.x[i], ay = a.y[i], az = a.z[i], aw = a.w[i];
+		float bx = b.x[i], by = b.y[i], bz = b.z[i], bw = b.w[i];
+
+		out.x[i] = aw * bx + ax * bw + ay * bz - az * by;
+		out.y[i] = aw * by + ay * bw + az * bx - ax * bz;
+		out.z[i] = aw * bz + az * bw + ax * by - ay * bx;
+		out.w[i] = aw * bw - ax * bx - ay * by - az * bz;
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: QuatRotate_Scalar
+//|
+//! \param q      [in]  Unit quaternions.
+//! \param v      [in]  Vectors.
+//! \param out    [out] The vectors rotated by the quaternions, as q * v * conj(q). May be v.
+//! \param count  [in]  Number of vectors.
+//! \return None.
+//!
+//! Rotates as v + 2w (u x v) + 2u x (u x v), u the vector part of q, which saves the two quaternion
+//! products.
+//|____________________________________________________________________
+
+void QuatRotate_Scalar(const QuatArrays& q, const Vec3Arrays& v, const Vec3Arrays& out, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		float qx = q.x[i], qy = q.y[i], qz = q.z[i], qw = q.w[i];
+		float vx = v.x[i], vy = v.y[i], vz = v.z[i];
+		float tx = 2 * (qy * vz - qz * vy), ty = 2 * (qz * vx - qx * vz), tz = 2 * (qx * vy - qy * vx);
+
+		out.x[i] = vx + qw * tx + (qy * tz - qz * ty);
+		out.y[i] = vy + qw * ty + (qz * tx - qx * tz);
+		out.z[i] = vz + qw * tz + (qx * ty - qy * tx);
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: QuatToMatrix_Scalar
+//|
+//! \param q         [in]  Unit quaternions.
+//! \param t         [in]  Translations.
+//! \param matrices  [out] 16 floats per pose: translation times rotation, column major as
+//!                        glLoadMatrixf() takes it.
+//! \param count     [in]  Number of poses.
+//! \return None.
+//|____________________________________________________________________
+
+void QuatToMatrix_Scalar(const QuatArrays& q, const Vec3Arrays& t, float* matrices, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		float x = q.x[i], y = q.y[i], z = q.z[i], w = q.w[i];
+		float* m = matrices + 16 * i;
+
+		m[0] = 1 - 2 * (y * y + z * z);
+		m[1] = 2 * (x * y + z * w);
+		m[2] = 2 * (x * z - y * w);
+		m[3] = 0;
+		m[4] = 2 * (x * y - z * w);
+		m[5] = 1 - 2 * (x * x + z * z);
+		m[6] = 2 * (y * z + x * w);
+		m[7] = 0;
+		m[8] = 2 * (x * z + y * w);
+		m[9] = 2 * (y * z - x * w);
+		m[10] = 1 - 2 * (x * x + y * y);
+		m[11] = 0;
+		m[12] = t.x[i];
+		m[13] = t.y[i];
+		m[14] = t.z[i];
+		m[15] = 1;
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: QuatNormalize_Scalar
+//|
+//! \param q      [in/out] Quaternions, not zero.
+//! \param count  [in] Number of quaternions.
+//! \return None.
+//|____________________________________________________________________
+
+void QuatNormalize_Scalar(const QuatArrays& q, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		float length = sqrtf(q.x[i] * q.x[i] + q.y[i] * q.y[i] + q.z[i] * q.z[i] + q.w[i] * q.w[i]);
+
+		q.x[i] /= length;
+		q.y[i] /= length;
+		q.z[i] /= length;
+		q.w[i] /= length;
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+
+//|____________________________________________________________________
+//|
+//| Function: QuatMul_SSE2
+//|
+//! \param a      [in]  Left quaternions.
+//! \param b      [in]  Right quaternions.
+//! \param out    [out] a * b. May be a or b.
+//! \param count  [in]  Number of quaternions.
+//! \return None.
+//!
+//! QuatMul_Scalar() 4 quaternions at a time, each lane one quaternion, with the same operations in
+//! the same order.
+//|____________________________________________________________________
+
+TARGET_SSE2 void QuatMul_SSE2(const QuatArrays& a, const QuatArrays& b, const QuatArrays& out, size_t count)
+{
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		__m128 ax = _mm_loadu_ps(a.x + i), ay = _mm_loadu_ps(a.y + i), az = _mm_loadu_ps(a.z + i), aw = _mm_loadu_ps(a.w + i);
+		__m128 bx = _mm_loadu_ps(b.x + i), by = _mm_loadu_ps(b.y + i), bz = _mm_loadu_ps(b.z + i), bw = _mm_loadu_ps(b.w + i);
+
+		_mm_storeu_ps(out.x + i, _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(aw, bx), _mm_mul_ps(ax, bw)), _mm_mul_ps(ay, bz)), _mm_mul_ps(az, by)));
+		_mm_storeu_ps(out.y + i, _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(aw, by), _mm_mul_ps(ay, bw)), _mm_mul_ps(az, bx)), _mm_mul_ps(ax, bz)));
+		_mm_storeu_ps(out.z + i, _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(aw, bz), _mm_mul_ps(az, bw)), _mm_mul_ps(ax, by)), _mm_mul_ps(ay, bx)));
+		_mm_storeu_ps(out.w + i, _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(_mm_mul_ps(aw, bw), _mm_mul_ps(ax, bx)), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz)));
+	}
+
+	QuatArrays ta = { a.x + i, a.y + i, a.z + i, a.w + i }, tb = { b.x + i, b.y + i, b.z + i, b.w + i };
+	QuatArrays tout = { out.x + i, out.y + i, out.z + i, out.w + i };
+	QuatMul_Scalar(ta, tb, tout, count - i);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: QuatRotate_SSE2
+//|
+//! \param q      [in]  Unit quaternions.
+//! \param v      [in]  Vectors.
+//! \param out    [out] The rotated vectors. May be v.
+//! \param count  [in]  Number of vectors.
+//! \return None.
+//!
+//! QuatRotate_Scalar() 4 vectors at a time.
+//|____________________________________________________________________
+
+TARGET_SSE2 void QuatRotate_SSE2(const QuatArrays& q, const Vec3Arrays& v, const Vec3Arrays& out, size_t count)
+{
+	const __m128 two = _mm_set1_ps(2.0f);
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		__m128 qx = _mm_loadu_ps(q.x + i), qy = _mm_loadu_ps(q.y + i), qz = _mm_loadu_ps(q.z + i), qw = _mm_loadu_ps(q.w + i);
+		__m128 vx = _mm_loadu_ps(v.x + i), vy = _mm_loadu_ps(v.y + i), vz = _mm_loadu_ps(v.z + i);
+		__m128 tx = _mm_mul_ps(two, _mm_sub_ps(_mm_mul_ps(qy, vz), _mm_mul_ps(qz, vy)));
+		__m128 ty = _mm_mul_ps(two, _mm_sub_ps(_mm_mul_ps(qz, vx), _mm_mul_ps(qx, vz)));
+		__m128 tz = _mm_mul_ps(two, _mm_sub_ps(_mm_mul_ps(qx, vy), _mm_mul_ps(qy, vx)));
+
+		_mm_storeu_ps(out.x + i, _mm_add_ps(_mm_add_ps(vx, _mm_mul_ps(qw, tx)), _mm_sub_ps(_mm_mul_ps(qy, tz), _mm_mul_ps(qz, ty))));
+		_mm_storeu_ps(out.y + i, _mm_add_ps(_mm_add_ps(vy, _mm_mul_ps(qw, ty)), _mm_sub_ps(_mm_mul_ps(qz, tx), _mm_mul_ps(qx, tz))));
+		_mm_storeu_ps(out.z + i, _mm_add_ps(_mm_add_ps(vz, _mm_mul_ps(qw, tz)), _mm_sub_ps(_mm_mul_ps(qx, ty), _mm_mul_ps(qy, tx))));
+	}
+
+	QuatArrays tq = { q.x + i, q.y + i, q.z + i, q.w + i };
+	Vec3Arrays tv = { v.x + i, v.y + i, v.z + i }, tout = { out.x + i, out.y + i, out.z + i };
+	QuatRotate_Scalar(tq, tv, tout, count - i);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: QuatToMatrix_SSE2
+//|
+//! \param q         [in]  Unit quaternions.
+//! \param t         [in]  Translations.
+//! \param matrices  [out] 16 floats per pose, column major.
+//! \param count     [in]  Number of poses.
+//! \return None.
+//!
+//! QuatToMatrix_Scalar() 4 poses at a time. The matrix elements are computed a pose per lane, then
+//! each column is transposed out to the 4 matrices.
+//|____________________________________________________________________
+
+TARGET_SSE2 void QuatToMatrix_SSE2(const QuatArrays& q, const Vec3Arrays& t, float* matrices, size_t count)
+{
+	const __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f), zero = _mm_setzero_ps();
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		__m128 x = _mm_loadu_ps(q.x + i), y = _mm_loadu_ps(q.y + i), z = _mm_loadu_ps(q.z + i), w = _mm_loadu_ps(q.w + i);
+		__m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+		__m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+		__m128 xw = _mm_mul_ps(x, w), yw = _mm_mul_ps(y, w), zw = _mm_mul_ps(z, w);
+		__m128 col[4][4] = {
+			{ _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), _mm_mul_ps(two, _mm_add_ps(xy, zw)), _mm_mul_ps(two, _mm_sub_ps(xz, yw)), zero },
+			{ _mm_mul_ps(two, _mm_sub_ps(xy, zw)), _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), _mm_mul_ps(two, _mm_add_ps(yz, xw)), zero },
+			{ _mm_mul_ps(two, _mm_add_ps(xz, yw)), _mm_mul_ps(two, _mm_sub_ps(yz, xw)), _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), zero },
+			{ _mm_loadu_ps(t.x + i), _mm_loadu_ps(t.y + i), _mm_loadu_ps(t.z + i), one }
+		};
+		float* m = matrices + 16 * i;
+
+		for (int c = 0; c < 4; ++c) {
+			_MM_TRANSPOSE4_PS(col[c][0], col[c][1], col[c][2], col[c][3]);
+			for (int pose = 0; pose < 4; ++pose) {
+				_mm_storeu_ps(m + 16 * pose + 4 * c, col[c][pose]);
+			}
+		}
+	}
+
+	QuatArrays tq = { q.x + i, q.y + i, q.z + i, q.w + i };
+	Vec3Arrays tt = { t.x + i, t.y + i, t.z + i };
+	QuatToMatrix_Scalar(tq, tt, matrices + 16 * i, count - i);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: QuatNormalize_SSE2
+//|
+//! \param q      [in/out] Quaternions, not zero.
+//! \param count  [in] Number of quaternions.
+//! \return None.
+//!
+//! QuatNormalize_Scalar() 4 quaternions at a time. A full square root and division rather than the
+//! reciprocal square root estimate, so the result matches the scalar kernel exactly.
+//|____________________________________________________________________
+
+TARGET_SSE2 void QuatNormalize_SSE2(const QuatArrays& q, size_t count)
+{
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		__m128 x = _mm_loadu_ps(q.x + i), y = _mm_loadu_ps(q.y + i), z = _mm_loadu_ps(q.z + i), w = _mm_loadu_ps(q.w + i);
+		__m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)), _mm_mul_ps(w, w)));
+
+		_mm_storeu_ps(q.x + i, _mm_div_ps(x, length));
+		_mm_storeu_ps(q.y + i, _mm_div_ps(y, length));
+		_mm_storeu_ps(q.z + i, _mm_div_ps(z, length));
+		_mm_storeu_ps(q.w + i, _mm_div_ps(w, length));
+	}
+
+	QuatArrays tq = { q.x + i, q.y + i, q.z + i, q.w + i };
+	QuatNormalize_Scalar(tq, count - i);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: QuatMul_AVX2
+//|
+//! \param a      [in]  Left quaternions.
+//! \param b      [in]  Right quaternions.
+//! \param out    [out] a * b. May be a or b.
+//! \param count  [in]  Number of quaternions.
+//! \return None.
+//!
+//! QuatMul_SSE2() 8 quaternions at a time.
+//|____________________________________________________________________
+
+TARGET_AVX2 void QuatMul_AVX2(const QuatArrays& a, const QuatArrays& b, const QuatArrays& out, size_t count)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		__m256 ax = _mm256_loadu_ps(a.x + i), ay = _mm256_loadu_ps(a.y + i), az = _mm256_loadu_ps(a.z + i), aw = _mm256_loadu_ps(a.w + i);
+		__m256 bx = _mm256_loadu_ps(b.x + i), by = _mm256_loadu_ps(b.y + i), bz = _mm256_loadu_ps(b.z + i), bw = _mm256_loadu_ps(b.w + i);
+
+		_mm256_storeu_ps(out.x + i, _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(aw, bx), _mm256_mul_ps(ax, bw)), _mm256_mul_ps(ay, bz)),
+			_mm256_mul_ps(az, by)));
+		_mm256_storeu_ps(out.y + i, _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(aw, by), _mm256_mul_ps(ay, bw)), _mm256_mul_ps(az, bx)),
+			_mm256_mul_ps(ax, bz)));
+		_mm256_storeu_ps(out.z + i, _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(aw, bz), _mm256_mul_ps(az, bw)), _mm256_mul_ps(ax, by)),
+			_mm256_mul_ps(ay, bx)));
+		_mm256_storeu_ps(out.w + i, _mm256_sub_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_mul_ps(aw, bw), _mm256_mul_ps(ax, bx)), _mm256_mul_ps(ay, by)),
+			_mm256_mul_ps(az, bz)));
+	}
+
+	QuatArrays ta = { a.x + i, a.y + i, a.z + i, a.w + i }, tb = { b.x + i, b.y + i, b.z + i, b.w + i };
+	QuatArrays tout = { out.x + i, out.y + i, out.z + i, out.w + i };
+	_mm256_zeroupper();
+	QuatMul_SSE2(ta, tb, tout, count - i);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: QuatRotate_AVX2
+//|
+//! \param q      [in]  Unit quaternions.
+//! \param v      [in]  Vectors.
+//! \param out    [out] The rotated vectors. May be v.
+//! \param count  [in]  Number of vectors.
+//! \return None.
+//!
+//! QuatRotate_SSE2() 8 vectors at a time.
+//|____________________________________________________________________
+
+TARGET_AVX2 void QuatRotate_AVX2(const QuatArrays& q, const Vec3Arrays& v, const Vec3Arrays& out, size_t count)
+{
+	const __m256 two = _mm256_set1_ps(2.0f);
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		__m256 qx = _mm256_loadu_ps(q.x + i), qy = _mm256_loadu_ps(q.y + i), qz = _mm256_loadu_ps(q.z + i), qw = _mm256_loadu_ps(q.w + i);
+		__m256 vx = _mm256_loadu_ps(v.x + i), vy = _mm256_loadu_ps(v.y + i), vz = _mm256_loadu_ps(v.z + i);
+		__m256 tx = _mm256_mul_ps(two, _mm256_sub_ps(_mm256_mul_ps(qy, vz), _mm256_mul_ps(qz, vy)));
+		__m256 ty = _mm256_mul_ps(two, _mm256_sub_ps(_mm256_mul_ps(qz, vx), _mm256_mul_ps(qx, vz)));
+		__m256 tz = _mm256_mul_ps(two, _mm256_sub_ps(_mm256_mul_ps(qx, vy), _mm256_mul_ps(qy, vx)));
+
+		_mm256_storeu_ps(out.x + i, _mm256_add_ps(_mm256_add_ps(vx, _mm256_mul_ps(qw, tx)), _mm256_sub_ps(_mm256_mul_ps(qy, tz), _mm256_mul_ps(qz, ty))));
+		_mm256_storeu_ps(out.y + i, _mm256_add_ps(_mm256_add_ps(vy, _mm256_mul_ps(qw, ty)), _mm256_sub_ps(_mm256_mul_ps(qz, tx), _mm256_mul_ps(qx, tz))));
+		_mm256_storeu_ps(out.z + i, _mm256_add_ps(_mm256_add_ps(vz, _mm256_mul_ps(qw, tz)), _mm256_sub_ps(_mm256_mul_ps(qx, ty), _mm256_mul_ps(qy, tx))));
+	}
+
+	QuatArrays tq = { q.x + i, q.y + i, q.z + i, q.w + i };
+	Vec3Arrays tv = { v.x + i, v.y + i, v.z + i }, tout = { out.x + i, out.y + i, out.z + i };
+	_mm256_zeroupper();
+	QuatRotate_SSE2(tq, tv, tout, count - i);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: QuatToMatrix_AVX2
+//|
+//! \param q         [in]  Unit quaternions.
+//! \param t         [in]  Translations.
+//! \param matrices  [out] 16 floats per pose, column major.
+//! \param count     [in]  Number of poses.
+//! \return None.
+//!
+//! QuatToMatrix_SSE2() 8 poses at a time. The transposes stay within 128-bit lanes, leaving a column
+//! of pose p in the low half of a register and of pose p + 4 in its high half; pairs of those are
+//! recombined so each store writes two columns of one matrix.
+//|____________________________________________________________________
+
+TARGET_AVX2 void QuatToMatrix_AVX2(const QuatArrays& q, const Vec3Arrays& t, float* matrices, size_t count)
+{
+	const __m256 one = _mm256_set1_ps(1.0f), two = _mm256_set1_ps(2.0f), zero = _mm256_setzero_ps();
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		__m256 x = _mm256_loadu_ps(q.x + i), y = _mm256_loadu_ps(q.y + i), z = _mm256_loadu_ps(q.z + i), w = _mm256_loadu_ps(q.w + i);
+		__m256 xx = _mm256_mul_ps(x, x), yy = _mm256_mul_ps(y, y), zz = _mm256_mul_ps(z, z);
+		__m256 xy = _mm256_mul_ps(x, y), xz = _mm256_mul_ps(x, z), yz = _mm256_mul_ps(y, z);
+		__m256 xw = _mm256_mul_ps(x, w), yw = _mm256_mul_ps(y, w), zw = _mm256_mul_ps(z, w);
+		__m256 col[4][4] = {
+			{ _mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(yy, zz))), _mm256_mul_ps(two, _mm256_add_ps(xy, zw)),
+				_mm256_mul_ps(two, _mm256_sub_ps(xz, yw)), zero },
+			{ _mm256_mul_ps(two, _mm256_sub_ps(xy, zw)), _mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, zz))),
+				_mm256_mul_ps(two, _mm256_add_ps(yz, xw)), zero },
+			{ _mm256_mul_ps(two, _mm256_add_ps(xz, yw)), _mm256_mul_ps(two, _mm256_sub_ps(yz, xw)),
+				_mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, yy))), zero },
+			{ _mm256_loadu_ps(t.x + i), _mm256_loadu_ps(t.y + i), _mm256_loadu_ps(t.z + i), one }
+		};
+		float* m = matrices + 16 * i;
+
+		__m256 pose[4][4];
+
+		for (int c = 0; c < 4; ++c) {
+			__m256 t0 = _mm256_unpacklo_ps(col[c][0], col[c][1]), t1 = _mm256_unpackhi_ps(col[c][0], col[c][1]);
+			__m256 t2 = _mm256_unpacklo_ps(col[c][2], col[c][3]), t3 = _mm256_unpackhi_ps(col[c][2], col[c][3]);
+
+			pose[c][0] = _mm256_shuffle_ps(t0, t2, 0x44);
+			pose[c][1] = _mm256_shuffle_ps(t0, t2, 0xee);
+			pose[c][2] = _mm256_shuffle_ps(t1, t3, 0x44);
+			pose[c][3] = _mm256_shuffle_ps(t1, t3, 0xee);
+		}
+
+		// Two columns of a matrix per store
+		for (int c = 0; c < 4; c += 2) {
+			for (int p = 0; p < 4; ++p) {
+				_mm256_storeu_ps(m + 16 * p + 4 * c, _mm256_permute2f128_ps(pose[c][p], pose[c + 1][p], 0x20));
+				_mm256_storeu_ps(m + 16 * (p + 4) + 4 * c, _mm256_permute2f128_ps(pose[c][p], pose[c + 1][p], 0x31));
+			}
+		}
+	}
+
+	QuatArrays tq = { q.x + i, q.y + i, q.z + i, q.w + i };
+	Vec3Arrays tt = { t.x + i, t.y + i, t.z + i };
+	_mm256_zeroupper();
+	QuatToMatrix_SSE2(tq, tt, matrices + 16 * i, count - i);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: QuatNormalize_AVX2
+//|
+//! \param q      [in/out] Quaternions, not zero.
+//! \param count  [in] Number of quaternions.
+//! \return None.
+//!
+//! QuatNormalize_SSE2() 8 quaternions at a time.
+//|____________________________________________________________________
+
+TARGET_AVX2 void QuatNormalize_AVX2(const QuatArrays& q, size_t count)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		__m256 x = _mm256_loadu_ps(q.x + i), y = _mm256_loadu_ps(q.y + i), z = _mm256_loadu_ps(q.z + i), w = _mm256_loadu_ps(q.w + i);
+		__m256 length = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)),
+			_mm256_mul_ps(z, z)), _mm256_mul_ps(w, w)));
+
+		_mm256_storeu_ps(q.x + i, _mm256_div_ps(x, length));
+		_mm256_storeu_ps(q.y + i, _mm256_div_ps(y, length));
+		_mm256_storeu_ps(q.z + i, _mm256_div_ps(z, length));
+		_mm256_storeu_ps(q.w + i, _mm256_div_ps(w, length));
+	}
+
+	QuatArrays tq = { q.x + i, q.y + i, q.z + i, q.w + i };
+	_mm256_zeroupper();
+	QuatNormalize_SSE2(tq, count - i);
+}
+
+#endif // HAVE_X86_SIMD
+
+//|____________________________________________________________________
+//|
+//| Function: InitPoseKernels
+//|
+//! \param None.
+//! \return None.
+//!
+//! Selects the pose kernels for the running CPU.
+//|____________________________________________________________________
+
+void InitPoseKernels()
+{
+	pose_kernels.name = "scalar";
+	pose_kernels.quat_mul = QuatMul_Scalar;
+	pose_kernels.rotate = QuatRotate_Scalar;
+	pose_kernels.to_matrix = QuatToMatrix_Scalar;
+	pose_kernels.normalize = QuatNormalize_Scalar;
+
+#ifdef HAVE_X86_SIMD
+	bool has_ssse3, has_avx2;
+
+	GetCPUFeatures(&has_ssse3, &has_avx2);
+	if (has_avx2) {
+		pose_kernels.name = "AVX2";
+		pose_kernels.quat_mul = QuatMul_AVX2;
+		pose_kernels.rotate = QuatRotate_AVX2;
+		pose_kernels.to_matrix = QuatToMatrix_AVX2;
+		pose_kernels.normalize = QuatNormalize_AVX2;
+	}
+	else {
+		pose_kernels.name = "SSE2";
+		pose_kernels.quat_mul = QuatMul_SSE2;
+		pose_kernels.rotate = QuatRotate_SSE2;
+		pose_kernels.to_matrix = QuatToMatrix_SSE2;
+		pose_kernels.normalize = QuatNormalize_SSE2;
+	}
+#endif
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BenchQuat
+//|
+//! \param count  [in] Number of poses.
+//! \return 0 if the kernels agree with gmtl, 1 otherwise.
+//!
+//! Pose kernel benchmark (--bench-quat): times quaternion products, vector rotations, pose matrices
+//! and normalization over count random poses, one gmtl operation at a time as KeyboardFunc() and
+//! PoseTurtle() do them, then with the scalar kernels and with the kernels selected for this CPU.
+//! The kernels' results must match gmtl's to within BENCH_QUAT_TOLERANCE.
+//|____________________________________________________________________
+
+int BenchQuat(int count)
+{
+	std::vector<float> soa(11 * (size_t)count), matrices(16 * (size_t)count), matrices_ref(16 * (size_t)count);
+	std::vector<gmtl::Quatf> quats(count), rots(count), quats_ref(count);
+	std::vector<gmtl::Vec3f> vecs(count), vecs_ref(count);
+	uint32_t seed = 0x12345678;
+	int mismatches = 0;
+
+	// Uniform in [-1, 1)
+	auto random = [&seed]() {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		return (seed >> 8) / 8388608.0f - 1.0f;
+	};
+
+	// Unit quaternions to transform, small rotations as the plane controls make, and vectors
+	for (int i = 0; i < count; ++i) {
+		quats[i].set(random(), random(), random(), random());
+		gmtl::normalize(quats[i]);
+		float half = random() * gmtl::Math::deg2Rad(PLANE_ROTATION / 2);
+		gmtl::Vec3f axis(random(), random(), random());
+		gmtl::normalize(axis);
+		rots[i].set(axis[0] * sinf(half), axis[1] * sinf(half), axis[2] * sinf(half), cosf(half));
+		vecs[i] = gmtl::Vec3f(random() * 10, random() * 10, random() * 10);
+	}
+
+	// The same data laid out for the kernels, one array per component
+	float* base = soa.data();
+	QuatArrays q = { base, base + count, base + 2 * count, base + 3 * count };
+	QuatArrays r = { base + 4 * count, base + 5 * count, base + 6 * count, base + 7 * count };
+	Vec3Arrays v = { base + 8 * count, base + 9 * count, base + 10 * count };
+	auto load = [&]() {
+		for (int i = 0; i < count; ++i) {
+			q.x[i] = quats[i][0];
+			q.y[i] = quats[i][1];
+			q.z[i] = quats[i][2];
+			q.w[i] = quats[i][3];
+			r.x[i] = rots[i][0];
+			r.y[i] = rots[i][1];
+			r.z[i] = rots[i][2];
+			r.w[i] = rots[i][3];
+			v.x[i] = vecs[i][0];
+			v.y[i] = vecs[i][1];
+			v.z[i] = vecs[i][2];
+		}
+	};
+	std::vector<float> out(7 * (size_t)count);
+	QuatArrays out_q = { out.data(), out.data() + count, out.data() + 2 * count, out.data() + 3 * count };
+	Vec3Arrays out_v = { out.data() + 4 * count, out.data() + 5 * count, out.data() + 6 * count };
+
+	// Best time of BENCH_CONVERT_RUNS, over BENCH_QUAT_CALLS calls each, in nanoseconds a pose
+	auto best_ns = [count](const std::function<void()>& run) {
+		double best = 1e30;
+		for (int i = 0; i < BENCH_CONVERT_RUNS; ++i) {
+			double start = GetTimeMs();
+			for (int call = 0; call < BENCH_QUAT_CALLS; ++call) {
+				run();
+			}
+			best = std::min(best, GetTimeMs() - start);
+		}
+		return best * 1e6 / BENCH_QUAT_CALLS / count;
+	};
+	auto report = [&](const char* kernel, double gmtl_ns, double scalar_ns, double simd_ns, float error) {
+		bool same = error <= BENCH_QUAT_TOLERANCE;
+		printf("%-16s %10.2f %10.2f %10.2f %8.2fx %10.1e  %s\n", kernel, gmtl_ns, scalar_ns, simd_ns, gmtl_ns / simd_ns, error,
+			same ? "ok" : "MISMATCH");
+		mismatches += !same;
+	};
+	auto quat_error = [&]() {
+		float error = 0;
+		for (int i = 0; i < count; ++i) {
+			error = std::max(error, std::max(std::max(fabsf(out_q.x[i] - quats_ref[i][0]), fabsf(out_q.y[i] - quats_ref[i][1])),
+				std::max(fabsf(out_q.z[i] - quats_ref[i][2]), fabsf(out_q.w[i] - quats_ref[i][3]))));
+		}
+		return error;
+	};
+
+	printf("Pose kernels, %d poses, %s kernels\n", count, pose_kernels.name);
+	printf("%-16s %10s %10s %10s %9s %10s\n", "Kernel", "gmtl ns", "Scalar ns", "Kernel ns", "Speedup", "Max error");
+	load();
+
+	// Roll, pitch or yaw of every pose, as SimulationTick() turns plane_q
+	double gmtl_ns = best_ns([&]() {
+		for (int i = 0; i < count; ++i) {
+			quats_ref[i] = quats[i] * rots[i];
+		}
+	});
+	double scalar_ns = best_ns([&]() { QuatMul_Scalar(q, r, out_q, count); });
+	double simd_ns = best_ns([&]() { pose_kernels.quat_mul(q, r, out_q, count); });
+	report("Quat multiply", gmtl_ns, scalar_ns, simd_ns, quat_error());
+	std::vector<gmtl::Quatf> products = quats_ref;
+
+	// Forward vector of every pose, as plane_q * v * makeConj(plane_q)
+	gmtl_ns = best_ns([&]() {
+		for (int i = 0; i < count; ++i) {
+			gmtl::Quatf v_q = quats[i] * gmtl::Quatf(vecs[i][0], vecs[i][1], vecs[i][2], 0) * gmtl::makeConj(quats[i]);
+			vecs_ref[i] = gmtl::Vec3f(v_q[0], v_q[1], v_q[2]);
+		}
+	});
+	scalar_ns = best_ns([&]() { QuatRotate_Scalar(q, v, out_v, count); });
+	simd_ns = best_ns([&]() { pose_kernels.rotate(q, v, out_v, count); });
+	float error = 0;
+	for (int i = 0; i < count; ++i) {
+		error = std::max(error, std::max(fabsf(out_v.x[i] - vecs_ref[i][0]), std::max(fabsf(out_v.y[i] - vecs_ref[i][1]),
+			fabsf(out_v.z[i] - vecs_ref[i][2]))));
+	}
+	report("Vector rotate", gmtl_ns, scalar_ns, simd_ns, error);
+
+	// Node matrix of every pose, as PoseTurtle() makes it, translated by the vectors
+	gmtl_ns = best_ns([&]() {
+		for (int i = 0; i < count; ++i) {
+			gmtl::Matrix44f m = gmtl::makeTrans<gmtl::Matrix44f>(vecs[i]) * gmtl::makeRot<gmtl::Matrix44f>(quats[i]);
+			memcpy(&matrices_ref[16 * (size_t)i], m.getData(), sizeof(float) * 16);
+		}
+	});
+	scalar_ns = best_ns([&]() { QuatToMatrix_Scalar(q, v, matrices.data(), count); });
+	simd_ns = best_ns([&]() { pose_kernels.to_matrix(q, v, matrices.data(), count); });
+	error = 0;
+	for (size_t k = 0; k < matrices.size(); ++k) {
+		error = std::max(error, fabsf(matrices[k] - matrices_ref[k]));
+	}
+	report("Quat to matrix", gmtl_ns, scalar_ns, simd_ns, error);
+
+	// Renormalizing the products, as drift builds up. Every call starts from a copy of them
+	std::vector<float> unnormalized(out.begin(), out.begin() + 4 * (size_t)count);
+	gmtl_ns = best_ns([&]() {
+		for (int i = 0; i < count; ++i) {
+			quats_ref[i] = products[i];
+			gmtl::normalize(quats_ref[i]);
+		}
+	});
+	scalar_ns = best_ns([&]() {
+		std::copy(unnormalized.begin(), unnormalized.end(), out.begin());
+		QuatNormalize_Scalar(out_q, count);
+	});
+	simd_ns = best_ns([&]() {
+		std::copy(unnormalized.begin(), unnormalized.end(), out.begin());
+		pose_kernels.normalize(out_q, count);
+	});
+	report("Normalize", gmtl_ns, scalar_ns, simd_ns, quat_error());
+
+	return mismatches == 0 ? 0 : 1;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BuildMipChain
+//|
+//! \param tex         [in/out] Texture whose RGBA level 0 is set; receives the remaining levels.
+//! \param max_levels  [in] Maximum number of levels, level 0 included.
+//! \param srgb        [in] Filter in linear light (level 0 is sRGB encoded).
+//! \return None.
+//!
+//! Generates the mip chain down to 1x1, or down to max_levels, into a single allocation (tex->mips).
+//! Levels are filtered from the previous level kept at LINEAR_BITS, so the rounding of each 8-bit
+//! level does not accumulate down the chain.
+//|____________________________________________________________________
+
+void BuildMipChain(DecodedTexture* tex, int max_levels, bool srgb)
+{
+	unsigned int w = tex->level[0].width;
+	unsigned int h = tex->level[0].height;
+	size_t total = 0;
+
+	tex->levels = 1;
+	while ((w > 1 || h > 1) && tex->levels < std::min(max_levels, MAX_MIP_LEVELS)) {
+		w = std::max(w / 2, 1u);
+		h = std::max(h / 2, 1u);
+		tex->level[tex->levels].width = w;
+		tex->level[tex->levels].height = h;
+		tex->level[tex->levels].size = (size_t)w * h * 4;
+		total += tex->level[tex->levels].size;
+		++tex->levels;
+	}
+
+	tex->mips = (unsigned char*)malloc(std::max(total, (size_t)1));
+	uint16_t* prev = (uint16_t*)malloc((size_t)tex->level[0].width * tex->level[0].height * 8);
+	uint16_t* next = (uint16_t*)malloc(std::max((size_t)tex->level[std::min(tex->levels - 1, 1)].width *
+		tex->level[std::min(tex->levels - 1, 1)].height * 8, (size_t)1));
+	if (tex->mips == NULL || prev == NULL || next == NULL) {
+		perror("cannot allocate memory for mip levels\n");
+		exit(EXIT_FAILURE);
+	}
+
+	ToLinear(tex->level[0].pixels, (size_t)tex->level[0].width * tex->level[0].height,
+		srgb ? srgb_to_linear : unorm_to_linear, prev);
+
+	unsigned char* dst = tex->mips;
+	for (int i = 1; i < tex->levels; ++i) {
+		pixel_kernels.downsample(prev, tex->level[i - 1].width, tex->level[i - 1].height, next);
+		FromLinear(next, (size_t)tex->level[i].width * tex->level[i].height, srgb ? linear_to_srgb : linear_to_unorm, dst);
+		tex->level[i].pixels = dst;
+		dst += tex->level[i].size;
+		std::swap(prev, next);
+	}
+
+	free(prev);
+	free(next);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: ReleaseDecodedTexture
+//|
+//! \param tex  [in/out] Decoded texture.
+//! \return None.
+//!
+//! Releases the mapping, the composed image and the generated mip levels of a decoded texture.
+//|____________________________________________________________________
+
+void ReleaseDecodedTexture(DecodedTexture* tex)
+{
+	UnmapFile(&tex->file);
+	free(tex->image);
+	free(tex->mips);
+	tex->image = NULL;
+	tex->mips = NULL;
+	tex->levels = 0;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: LayoutAtlas
+//|
+//! \param img      [in]  Images to pack.
+//! \param count    [in]  Number of images.
+//! \param regions  [out] Rectangle of each image in the atlas, gutter excluded.
+//! \param w        [out] Atlas width.
+//! \param h        [out] Atlas height.
+//! \return None.
+//!
+//! Shelf packer: the images go tallest first into rows of a power-of-two wide atlas. Cells include
+//! the gutter and start on a multiple of 4 pixels so BC1 blocks never straddle two regions.
+//|____________________________________________________________________
+
+void LayoutAtlas(const MappedPPM* img, int count, TexCacheRegion* regions, unsigned int* w, unsigned int* h)
+{
+	int order[MAX_TEXTURE_SOURCES];
+	unsigned int cell_w[MAX_TEXTURE_SOURCES];
+	unsigned int cell_h[MAX_TEXTURE_SOURCES];
+	double area = 0;
+	unsigned int widest = 0;
+	unsigned int x = 0, y = 0, row_h = 0;
+
+	for (int i = 0; i < count; ++i) {
+		order[i] = i;
+		cell_w[i] = (img[i].width + 2 * ATLAS_GUTTER + 3) & ~3u;
+		cell_h[i] = (img[i].height + 2 * ATLAS_GUTTER + 3) & ~3u;
+		area += (double)cell_w[i] * cell_h[i];
+		widest = std::max(widest, cell_w[i]);
+	}
+	std::sort(order, order + count, [&](int a, int b) { return cell_h[a] > cell_h[b]; });
+
+	*w = 1;
+	while (*w < widest || (double)*w * *w < area) {
+		*w *= 2;
+	}
+
+	for (int k = 0; k < count; ++k) {
+		int i = order[k];
+		if (x + cell_w[i] > *w) {
+			y += row_h;
+			x = 0;
+			row_h = 0;
+		}
+		regions[i].x = x + ATLAS_GUTTER;
+		regions[i].y = y + ATLAS_GUTTER;
+		regions[i].width = img[i].width;
+		regions[i].height = img[i].height;
+		x += cell_w[i];
+		row_h = std::max(row_h, cell_h[i]);
+	}
+	*h = y + row_h;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: ComposeAtlas
+//|
+//! \param id   [in]  Atlas texture.
+//! \param tex  [out] Decoded texture with the packed level 0 and its regions.
+//! \return true on success.
+//!
+//! Maps every source image of an atlas, packs them with LayoutAtlas() and converts each one into its
+//! region, extending its edges across the gutter.
+//|____________________________________________________________________
+
+bool ComposeAtlas(TextureID id, DecodedTexture* tex)
+{
+	const TextureDesc& desc = texture_descs[id];
+	MappedPPM img[MAX_TEXTURE_SOURCES];
+	unsigned int w, h;
+	bool ok = true;
+
+	for (int i = 0; i < desc.source_nb; ++i) {
+		ok = MapPPM(desc.sources[i].c_str(), &img[i]) && ok;
+	}
+
+	if (ok) {
+		LayoutAtlas(img, desc.source_nb, tex->region, &w, &h);
+		tex->regions = desc.source_nb;
+
+		if (!(tex->image = (unsigned char*)calloc((size_t)w * h, 4))) {
+			perror("cannot allocate memory for texture atlas\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (int i = 0; i < desc.source_nb; ++i) {
+			const TexCacheRegion& r = tex->region[i];
+			unsigned char* first = tex->image + ((size_t)r.y * w + r.x) * 4;
+
+			ConvertSourceImage(img[i], (desc.keyed_sources & 1u << i) != 0, first, w);
+
+			// Gutter: edge pixels to the sides, then edge rows (gutter included) above and below
+			for (unsigned int y = 0; y < r.height; ++y) {
+				unsigned char* row = first + (size_t)y * w * 4;
+				for (int x = 1; x <= ATLAS_GUTTER; ++x) {
+					memcpy(row - x * 4, row, 4);
+					memcpy(row + (r.width - 1 + x) * 4, row + (r.width - 1) * 4, 4);
+				}
+			}
+			for (int y = 1; y <= ATLAS_GUTTER; ++y) {
+				size_t row_size = (size_t)(r.width + 2 * ATLAS_GUTTER) * 4;
+				memcpy(first - ((size_t)y * w + ATLAS_GUTTER) * 4, first - ATLAS_GUTTER * 4, row_size);
+				memcpy(first + ((size_t)(r.height - 1 + y) * w - ATLAS_GUTTER) * 4,
+					first + ((size_t)(r.height - 1) * w - ATLAS_GUTTER) * 4, row_size);
+			}
+		}
+
+		tex->format = GL_RGBA;
+		tex->level[0].width = w;
+		tex->level[0].height = h;
+		tex->level[0].pixels = tex->image;
+		tex->level[0].size = (size_t)w * h * 4;
+		BuildMipChain(tex, ATLAS_MIP_LEVELS, (desc.flags & TF_SRGB) != 0);
+	}
+
+	for (int i = 0; i < desc.source_nb; ++i) {
+		tex->mapped_bytes += img[i].file.size;
+		UnmapPPM(&img[i]);
+	}
+	return ok;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: DecodeSourceTexture
+//|
+//! \param id     [in]  Texture to decode.
+//! \param layer  [in]  Cube map face, 0 otherwise.
+//! \param tex    [out] Decoded texture image.
+//! \return true on success.
+//!
+//! Builds a texture image from its source images: a single PPM or cube map face is converted to
+//! RGBA straight from its mapping, an atlas is composed. The mip chain is then generated.
+//|____________________________________________________________________
+
+bool DecodeSourceTexture(TextureID id, int layer, DecodedTexture* tex)
+{
+	const TextureDesc& desc = texture_descs[id];
+	int source = desc.kind == TK_CUBE ? layer : 0;
+	MappedPPM img;
+
+	if (desc.kind == TK_ATLAS) {
+		return ComposeAtlas(id, tex);
+	}
+
+	if (!MapPPM(desc.sources[source].c_str(), &img)) {
+		return false;
+	}
+
+	if (!(tex->image = (unsigned char*)malloc((size_t)img.width * img.height * 4))) {
+		perror("cannot allocate memory for texture\n");
+		exit(EXIT_FAILURE);
+	}
+	ConvertSourceImage(img, (desc.keyed_sources & 1u << source) != 0, tex->image, img.width);
+
+	tex->format = GL_RGBA;
+	tex->level[0].width = img.width;
+	tex->level[0].height = img.height;
+	tex->level[0].pixels = tex->image;
+	tex->level[0].size = (size_t)img.width * img.height * 4;
+	tex->mapped_bytes = img.file.size;
+	UnmapPPM(&img);
+
+	BuildMipChain(tex, MAX_MIP_LEVELS, (desc.flags & TF_SRGB) != 0);
+	return true;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: LoadTextureCache
+//|
+//! \param id     [in]  Texture to load.
+//! \param layer  [in]  Cube map face, 0 otherwise.
+//! \param tex    [out] Decoded texture image; its levels point into the mapped cache file.
+//! \return true if a fresh cache was loaded, false if it is missing, stale or invalid.
+//!
+//! A cache is stale when it was baked by another version of this program or with other texture
+//! settings, or when its source images have changed since (size or modification time). A cache
+//! without its source images is still used.
+//|____________________________________________________________________
+
+bool LoadTextureCache(TextureID id, int layer, DecodedTexture* tex)
+{
+	std::string path = TextureCachePath(id, layer);
+	const TexCacheHeader* header;
+	const TexCacheLevel* levels;
+	const TexCacheRegion* regions;
+	uint64_t source_size;
+	int64_t source_mtime;
+	const char* stale = NULL;
+
+	if (!MapFile(path.c_str(), &tex->file)) {
+		return false;
+	}
+
+	header = (const TexCacheHeader*)tex->file.data;
+	levels = (const TexCacheLevel*)(header + 1);
+
+	if (tex->file.size < sizeof(TexCacheHeader) || memcmp(header->magic, TEXCACHE_MAGIC, 4) != 0) {
+		stale = "not a texture cache";
+	}
+	else if (header->version != TEXCACHE_VERSION) {
+		stale = "baked by another version";
+	}
+	else if (header->format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT && !has_s3tc) {
+		stale = "BC1 textures are not supported by this GL";
+	}
+	else if ((header->format != GL_RGBA && header->format != GL_COMPRESSED_RGB_S3TC_DXT1_EXT) ||
+		header->levels < 1 || header->levels > (uint32_t)MAX_MIP_LEVELS || header->regions > (uint32_t)MAX_TEXTURE_SOURCES ||
+		tex->file.size < sizeof(TexCacheHeader) + header->levels * sizeof(TexCacheLevel) + header->regions * sizeof(TexCacheRegion)) {
+		stale = "corrupt header";
+	}
+	else if (header->regions != (texture_descs[id].kind == TK_ATLAS ? (uint32_t)texture_descs[id].source_nb : 0)) {
+		stale = "atlas layout has changed";
+	}
+	else if (header->settings != TextureSettingsHash(texture_descs[id])) {
+		stale = "texture settings have changed";
+	}
+	else if (GetTextureStamp(id, layer, &source_size, &source_mtime) &&
+		(source_size != header->source_size || source_mtime != header->source_mtime)) {
+		stale = "source image has changed";
+	}
+	else {
+		for (uint32_t i = 0; i < header->levels && stale == NULL; ++i) {
+			if (levels[i].offset % TEXCACHE_ALIGN != 0 || levels[i].offset > tex->file.size ||
+				levels[i].size > tex->file.size - levels[i].offset ||
+				levels[i].size != TextureLevelSize(header->format, levels[i].width, levels[i].height)) {
+				stale = "truncated level data";
+			}
+			tex->level[i].width = levels[i].width;
+			tex->level[i].height = levels[i].height;
+			tex->level[i].pixels = tex->file.data + levels[i].offset;
+			tex->level[i].size = (size_t)levels[i].size;
+		}
+
+		regions = (const TexCacheRegion*)(levels + header->levels);
+		for (uint32_t i = 0; i < header->regions; ++i) {
+			tex->region[i] = regions[i];
+		}
+	}
+
+	if (stale != NULL) {
+		fprintf(stderr, "%s: %s, falling back to the source images\n", path.c_str(), stale);
+		UnmapFile(&tex->file);
+		return false;
+	}
+
+	tex->format = header->format;
+	tex->levels = (int)header->levels;
+	tex->regions = (int)header->regions;
+	tex->mapped_bytes = tex->file.size;
+	return true;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: WriteTextureCache
+//|
+//! \param id     [in] Texture that was decoded.
+//! \param layer  [in] Cube map face, 0 otherwise.
+//! \param tex    [in] Decoded texture image with its full mip chain.
+//! \return true on success.
+//!
+//! Writes a texture cache file: header, level table, region table, then every level on a
+//! TEXCACHE_ALIGN boundary.
+//! The file is written under a temporary name and renamed, so readers never see a partial cache.
+//|____________________________________________________________________
+
+bool WriteTextureCache(TextureID id, int layer, const DecodedTexture& tex)
+{
+	std::string path = TextureCachePath(id, layer);
+	std::string tmp_path = path + ".tmp";
+	static const unsigned char zeros[TEXCACHE_ALIGN] = { 0 };
+	TexCacheHeader header;
+	TexCacheLevel levels[MAX_MIP_LEVELS];
+	uint64_t offset;
+	FILE* fp;
+	bool ok;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TEXCACHE_MAGIC, 4);
+	header.version = TEXCACHE_VERSION;
+	header.format = tex.format;
+	header.width = tex.level[0].width;
+	header.height = tex.level[0].height;
+	header.levels = (uint32_t)tex.levels;
+	header.regions = (uint32_t)tex.regions;
+	header.settings = TextureSettingsHash(texture_descs[id]);
+	if (!GetTextureStamp(id, layer, &header.source_size, &header.source_mtime)) {
+		return false;
+	}
+
+	const size_t tables = sizeof(TexCacheHeader) + tex.levels * sizeof(TexCacheLevel) + tex.regions * sizeof(TexCacheRegion);
+	offset = tables;
+	for (int i = 0; i < tex.levels; ++i) {
+		offset = (offset + TEXCACHE_ALIGN - 1) / TEXCACHE_ALIGN * TEXCACHE_ALIGN;
+		levels[i].width = tex.level[i].width;
+		levels[i].height = tex.level[i].height;
+		levels[i].offset = offset;
+		levels[i].size = tex.level[i].size;
+		offset += tex.level[i].size;
+	}
+
+	if (!(fp = fopen(tmp_path.c_str(), "wb"))) {
+		return false;
+	}
+
+	ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+		fwrite(levels, sizeof(TexCacheLevel), tex.levels, fp) == (size_t)tex.levels &&
+		fwrite(tex.region, sizeof(TexCacheRegion), tex.regions, fp) == (size_t)tex.regions;
+	offset = tables;
+	for (int i = 0; i < tex.levels && ok; ++i) {
+		size_t pad = (size_t)(levels[i].offset - offset);
+		ok = fwrite(zeros, 1, pad, fp) == pad && fwrite(tex.level[i].pixels, 1, tex.level[i].size, fp) == tex.level[i].size;
+		offset = levels[i].offset + levels[i].size;
+	}
+	ok = (fclose(fp) == 0) && ok;
+
+	remove(path.c_str());
+	if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+		remove(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: TextureLevelSize
+//|
+//! \param format  [in] GL pixel format (GL_RGBA or a BC1 format).
+//! \param w       [in] Level width.
+//! \param h       [in] Level height.
+//! \return Size of the level in bytes.
+//!
+//! BC1 stores every 4x4 block in 8 bytes, partial blocks included.
+//|____________________________________________________________________
+
+size_t TextureLevelSize(GLenum format, unsigned int w, unsigned int h)
+{
+	if (format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT) {
+		return (size_t)((w + 3) / 4) * ((h + 3) / 4) * 8;
+	}
+	return (size_t)w * h * 4;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: DecodeBC1Block
+//|
+//! \param block  [in]  8-byte BC1 block.
+//! \param rgb    [out] 4x4 decoded pixels, row by row.
+//! \return None.
+//!
+//! Decodes a BC1 block in four-colour mode (the only mode EncodeBC1Block produces).
+//|____________________________________________________________________
+
+void DecodeBC1Block(const unsigned char block[8], unsigned char rgb[16][3])
+{
+	unsigned char palette[4][3];
+	unsigned int c[2] = { (unsigned int)(block[0] | block[1] << 8), (unsigned int)(block[2] | block[3] << 8) };
+	uint32_t indices = block[4] | block[5] << 8 | block[6] << 16 | (uint32_t)block[7] << 24;
+
+	for (int e = 0; e < 2; ++e) {
+		palette[e][0] = (unsigned char)(((c[e] >> 11) & 31) * 255 / 31);
+		palette[e][1] = (unsigned char)(((c[e] >> 5) & 63) * 255 / 63);
+		palette[e][2] = (unsigned char)((c[e] & 31) * 255 / 31);
+	}
+	for (int k = 0; k < 3; ++k) {
+		palette[2][k] = (unsigned char)((2 * palette[0][k] + palette[1][k]) / 3);
+		palette[3][k] = (unsigned char)((palette[0][k] + 2 * palette[1][k]) / 3);
+	}
+
+	for (int i = 0; i < 16; ++i) {
+		memcpy(rgb[i], palette[(indices >> (2 * i)) & 3], 3);
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: EncodeBC1Block
+//|
+//! \param rgb    [in]  4x4 pixels, row by row.
+//! \param block  [out] 8-byte BC1 block.
+//! \return None.
+//!
+//! Encodes a block in four-colour mode. The endpoints are the extremes of the pixels projected on
+//! the block's principal colour axis (found by power iteration on the colour covariance); every
+//! pixel then takes the nearest of the four palette entries.
+//|____________________________________________________________________
+
+void EncodeBC1Block(const unsigned char rgb[16][3], unsigned char block[8])
+{
+	float mean[3] = { 0, 0, 0 };
+	float cov[6] = { 0, 0, 0, 0, 0, 0 };
+	float axis[3] = { 1, 1, 1 };
+	float lo = 1e30f, hi = -1e30f;
+	int lo_i = 0, hi_i = 0;
+	unsigned int c[2];
+	unsigned char palette[4][3];
+	uint32_t indices = 0;
+
+	for (int i = 0; i < 16; ++i) {
+		for (int k = 0; k < 3; ++k) {
+			mean[k] += rgb[i][k] / 16.0f;
+		}
+	}
+	for (int i = 0; i < 16; ++i) {
+		float d[3] = { rgb[i][0] - mean[0], rgb[i][1] - mean[1], rgb[i][2] - mean[2] };
+		cov[0] += d[0] * d[0]; cov[1] += d[0] * d[1]; cov[2] += d[0] * d[2];
+		cov[3] += d[1] * d[1]; cov[4] += d[1] * d[2]; cov[5] += d[2] * d[2];
+	}
+	for (int iter = 0; iter < 4; ++iter) {
+		float next[3] = {
+			cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2],
+			cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2],
+			cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2] };
+		float len = sqrtf(next[0] * next[0] + next[1] * next[1] + next[2] * next[2]);
+		if (len < 1e-6f) {
+			break;                          // Flat block: any axis will do
+		}
+		for (int k = 0; k < 3; ++k) {
+			axis[k] = next[k] / len;
+		}
+	}
+
+	for (int i = 0; i < 16; ++i) {
+		float t = rgb[i][0] * axis[0] + rgb[i][1] * axis[1] + rgb[i][2] * axis[2];
+		if (t < lo) { lo = t; lo_i = i; }
+		if (t > hi) { hi = t; hi_i = i; }
+	}
+
+	// Quantize the endpoints to RGB565; four-colour mode needs c0 > c1
+	for (int e = 0; e < 2; ++e) {
+		const unsigned char* p = rgb[e == 0 ? hi_i : lo_i];
+		c[e] = ((p[0] * 31 + 127) / 255) << 11 | ((p[1] * 63 + 127) / 255) << 5 | ((p[2] * 31 + 127) / 255);
+	}
+	if (c[0] < c[1]) {
+		std::swap(c[0], c[1]);
+	}
+
+	block[0] = (unsigned char)c[0]; block[1] = (unsigned char)(c[0] >> 8);
+	block[2] = (unsigned char)c[1]; block[3] = (unsigned char)(c[1] >> 8);
+
+	if (c[0] != c[1]) {
+		block[4] = 0xE4; block[5] = 0; block[6] = 0; block[7] = 0;    // Decode the palette through index order 0..3
+		unsigned char decoded[16][3];
+		DecodeBC1Block(block, decoded);
+		for (int j = 0; j < 4; ++j) {
+			memcpy(palette[j], decoded[j], 3);
+		}
+
+		for (int i = 0; i < 16; ++i) {
+			int best = 0, best_err = INT_MAX;
+			for (int j = 0; j < 4; ++j) {
+				int dr = rgb[i][0] - palette[j][0], dg = rgb[i][1] - palette[j][1], db = rgb[i][2] - palette[j][2];
+				int err = dr * dr + dg * dg + db * db;
+				if (err < best_err) {
+					best_err = err;
+					best = j;
+				}
+			}
+			indices |= (uint32_t)best << (2 * i);
+		}
+	}
+
+	block[4] = (unsigned char)indices; block[5] = (unsigned char)(indices >> 8);
+	block[6] = (unsigned char)(indices >> 16); block[7] = (unsigned char)(indices >> 24);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: CompressTextureBC1
+//|
+//! \param tex  [in/out] Decoded RGB texture with its mip chain; becomes a BC1 texture.
+//! \return Peak signal-to-noise ratio of level 0 after compression, in dB.
+//!
+//! Encodes every mip level to BC1 into a new allocation that replaces tex->mips. Edge blocks of
+//! levels that are not a multiple of 4 repeat their last row/column.
+//|____________________________________________________________________
+
+double CompressTextureBC1(DecodedTexture* tex)
+{
+	size_t total = 0;
+	double sq_err = 0;
+	unsigned char* blocks;
+	unsigned char* dst;
+
+	for (int i = 0; i < tex->levels; ++i) {
+		total += TextureLevelSize(GL_COMPRESSED_RGB_S3TC_DXT1_EXT, tex->level[i].width, tex->level[i].height);
+	}
+	if (!(blocks = (unsigned char*)malloc(total))) {
+		perror("cannot allocate memory for compressed texture\n");
+		exit(EXIT_FAILURE);
+	}
+
+	dst = blocks;
+	for (int i = 0; i < tex->levels; ++i) {
+		TexLevel& lv = tex->level[i];
+
+		for (unsigned int by = 0; by < lv.height; by += 4) {
+			for (unsigned int bx = 0; bx < lv.width; bx += 4) {
+				unsigned char rgb[16][3];
+				unsigned char decoded[16][3];
+
+				for (int p = 0; p < 16; ++p) {
+					unsigned int x = std::min(bx + (p & 3), lv.width - 1);
+					unsigned int y = std::min(by + (p >> 2), lv.height - 1);
+					memcpy(rgb[p], lv.pixels + ((size_t)y * lv.width + x) * 4, 3);
+				}
+				EncodeBC1Block(rgb, dst);
+
+				if (i == 0) {
+					DecodeBC1Block(dst, decoded);
+					for (int p = 0; p < 16; ++p) {
+						if (bx + (p & 3) < lv.width && by + (p >> 2) < lv.height) {
+							for (int k = 0; k < 3; ++k) {
+								double d = (double)rgb[p][k] - decoded[p][k];
+								sq_err += d * d;
+							}
+						}
+					}
+				}
+				dst += 8;
+			}
+		}
+	}
+
+	// Swap the RGBA levels for the compressed ones
+	dst = blocks;
+	for (int i = 0; i < tex->levels; ++i) {
+		tex->level[i].pixels = dst;
+		tex->level[i].size = TextureLevelSize(GL_COMPRESSED_RGB_S3TC_DXT1_EXT, tex->level[i].width, tex->level[i].height);
+		dst += tex->level[i].size;
+	}
+	free(tex->mips);
+	tex->mips = blocks;
+	tex->format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+
+	double mse = sq_err / ((double)tex->level[0].width * tex->level[0].height * 3);
+	return mse > 0 ? 10.0 * log10(255.0 * 255.0 / mse) : 99.0;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: BakeTextures
+//|
+//! \param None.
+//! \return Number of textures that failed to bake.
+//!
+//! Offline bake step (--bake): decodes every source image, builds its mip chain, compresses it to
+//! BC1 when its TextureDesc says so and writes the texture cache that InitGL loads on later runs.
+//! Prints a size and quality report per texture to help decide which textures to compress.
+//|____________________________________________________________________
+
+int BakeTextures()
+{
+	int failed = 0;
+	double source_total = 0, baked_total = 0;
+
+	printf("%-14s %-6s %10s %10s %7s %9s\n", "Texture", "Format", "Source MB", "Baked MB", "Ratio", "PSNR dB");
+
+	for (int id = 0; id < TEXTURE_NB; ++id) {
+		for (int layer = 0; layer < TextureLayers((TextureID)id); ++layer) {
+			DecodedTexture tex;
+			std::string name = TextureLayerName((TextureID)id, layer);
+			std::string path = TextureCachePath((TextureID)id, layer);
+			double source_mb = 0, baked_mb = 0, psnr = 0;
+
+			memset(&tex, 0, sizeof(tex));
+			if (!DecodeSourceTexture((TextureID)id, layer, &tex)) {
+				fprintf(stderr, "%s: cannot bake %s\n", name.c_str(), path.c_str());
+				++failed;
+				continue;
+			}
+
+			for (int i = 0; i < tex.levels; ++i) {
+				source_mb += tex.level[i].size / (1024.0 * 1024.0);
+			}
+			if (texture_descs[id].flags & TF_COMPRESS) {
+				psnr = CompressTextureBC1(&tex);
+			}
+			for (int i = 0; i < tex.levels; ++i) {
+				baked_mb += tex.level[i].size / (1024.0 * 1024.0);
+			}
+
+			if (WriteTextureCache((TextureID)id, layer, tex)) {
+				printf("%-14s %-6s %10.2f %10.2f %6.1fx ", name.c_str(), (texture_descs[id].flags & TF_COMPRESS) ? "BC1" : "RGBA",
+					source_mb, baked_mb, source_mb / baked_mb);
+				if (texture_descs[id].flags & TF_COMPRESS) {
+					printf("%9.2f\n", psnr);
+				}
+				else {
+					printf("%9s\n", "lossless");
+				}
+				source_total += source_mb;
+				baked_total += baked_mb;
+			}
+			else {
+				fprintf(stderr, "%s: cannot write %s\n", name.c_str(), path.c_str());
+				++failed;
+			}
+			ReleaseDecodedTexture(&tex);
+		}
+	}
+
+	printf("%-14s %-6s %10.2f %10.2f %6.1fx\n", "Total", "", source_total, baked_total,
+		baked_total > 0 ? source_total / baked_total : 0.0);
+	return failed;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: DecodeTexture
+//|
+//! \param id          [in] Texture to decode.
+//! \param layer       [in] Cube map face, 0 otherwise.
+//! \param generation  [in] texture_generation of the request.
+//! \return None.
+//!
+//! Worker job: loads a texture image from its cache, or from its PPM when the cache is missing or stale,
+//! and faults the mapped pages in so that the file I/O happens here rather than inside glTexImage2D
+//! on the GL thread. The result is queued for upload.
+//|____________________________________________________________________
+
+void DecodeTexture(TextureID id, int layer, int generation)
+{
+	DecodedTexture tex;
+	double start_ms = GetTimeMs();
+
+	memset(&tex, 0, sizeof(tex));
+	tex.id = id;
+	tex.layer = layer;
+	tex.generation = generation;
+	tex.from_cache = LoadTextureCache(id, layer, &tex);
+	tex.ok = tex.from_cache || DecodeSourceTexture(id, layer, &tex);
+	if (tex.ok) {
+		volatile unsigned char sink = 0;
+		for (size_t i = 0; i < tex.file.size; i += 4096) {
+			sink ^= tex.file.data[i];
+		}
+	}
+	tex.decode_ms = GetTimeMs() - start_ms;
+
+	std::lock_guard<std::mutex> lock(decoded_mutex);
+	decoded_textures.push_back(tex);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: RequestTextureDecode
+//|
+//! \param id     [in] Texture.
+//! \param layer  [in] Cube map face, 0 otherwise.
+//! \return None.
+//!
+//! Queues a decode of a texture image on the workers and records the version of its sources. A
+//! decode already in flight for the same image is dropped when it completes.
+//|____________________________________________________________________
+
+void RequestTextureDecode(TextureID id, int layer)
+{
+	AssetStamp& stamp = texture_stamps[id][layer];
+	int generation = ++texture_generation[id][layer];
+
+	if (!GetTextureStamp(id, layer, &stamp.size, &stamp.mtime)) {
+		stamp.size = 0;
+		stamp.mtime = 0;
+	}
+
+	SubmitJob([id, layer, generation]() { DecodeTexture(id, layer, generation); });
+	++textures_pending;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: ApplyTextureSampler
+//|
+//! \param id  [in] Texture, bound to its target.
+//! \return None.
+//!
+//! Sets the filter and wrap modes from the texture's manifest entry. Minification is mipmapped once
+//! levels have been uploaded.
+//|____________________________________________________________________
+
+void ApplyTextureSampler(TextureID id)
+{
+	const TextureDesc& desc = texture_descs[id];
+	GLenum target = TextureTarget(id);
+	GLenum min_filter = desc.filter;
+
+	if (texture_levels[id] > 1) {
+		min_filter = desc.filter == GL_NEAREST ? GL_NEAREST_MIPMAP_NEAREST : GL_LINEAR_MIPMAP_LINEAR;
+	}
+
+	glTexParameteri(target, GL_TEXTURE_MAG_FILTER, desc.filter);
+	glTexParameteri(target, GL_TEXTURE_MIN_FILTER, min_filter);
+	glTexParameteri(target, GL_TEXTURE_WRAP_S, desc.wrap);
+	glTexParameteri(target, GL_TEXTURE_WRAP_T, desc.wrap);
+	if (target == GL_TEXTURE_CUBE_MAP) {
+		glTexParameteri(target, GL_TEXTURE_WRAP_R, desc.wrap);
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: UploadTexture
+//|
+//! \param tex  [in/out] Decoded texture; it is released.
+//! \return None.
+//!
+//! Replaces the placeholder of a texture image (a cube map face, or the whole texture otherwise)
+//! with its decoded mip chain. Must run on the GL thread.
+//|____________________________________________________________________
+
+void UploadTexture(DecodedTexture& tex)
+{
+	std::string name = TextureLayerName(tex.id, tex.layer);
+	GLenum target = TextureTarget(tex.id);
+	GLenum image_target = target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + tex.layer : target;
+
+	if (tex.generation != texture_generation[tex.id][tex.layer]) {
+		ReleaseDecodedTexture(&tex);        // Superseded by a later request
+		return;
+	}
+	if (!tex.ok) {
+		fprintf(stderr, "%s: keeping the current texture\n", name.c_str());
+		return;
+	}
+
+	glBindTexture(target, textures[tex.id]);
+	for (int i = 0; i < tex.levels; ++i) {
+		if (tex.format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT) {
+			pglCompressedTexImage2D(image_target, i, tex.format, tex.level[i].width, tex.level[i].height, 0,
+				(GLsizei)tex.level[i].size, tex.level[i].pixels);
+		}
+		else {
+			glTexImage2D(image_target, i, GL_RGBA8, tex.level[i].width, tex.level[i].height, 0, tex.format, GL_UNSIGNED_BYTE, tex.level[i].pixels);
+		}
+	}
+	glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, tex.levels - 1);
+	texture_levels[tex.id] = tex.levels;
+	ApplyTextureSampler(tex.id);
+
+	// Atlas regions in texture coordinates
+	for (int i = 0; i < tex.regions; ++i) {
+		atlas_uv[i][0] = tex.region[i].x / (float)tex.level[0].width;
+		atlas_uv[i][1] = tex.region[i].y / (float)tex.level[0].height;
+		atlas_uv[i][2] = (tex.region[i].x + tex.region[i].width) / (float)tex.level[0].width;
+		atlas_uv[i][3] = (tex.region[i].y + tex.region[i].height) / (float)tex.level[0].height;
+	}
+
+	printf("Loaded %s from %s (%ux%u, %d levels, %s): %.2f MB mapped, decoded in %.2f ms\n", name.c_str(),
+		tex.from_cache ? "cache" : "source", tex.level[0].width, tex.level[0].height, tex.levels,
+		tex.format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? "BC1" : "RGBA", tex.mapped_bytes / (1024.0 * 1024.0), tex.decode_ms);
+
+	ReleaseDecodedTexture(&tex);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: StartAssetWatch
+//|
+//! \param None.
+//! \return None.
+//!
+//! Watches the working directory, where the manifest and images live, for files being written,
+//! renamed or deleted: with inotify on Linux, a change notification on Windows. Elsewhere, or if
+//! the watch cannot be set up, PollAssetWatch() falls back to checking every file each time.
+//|____________________________________________________________________
+
+void StartAssetWatch()
+{
+#if defined(_WIN32)
+	asset_watch = FindFirstChangeNotificationA(".", FALSE,
+		FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE);
+	if (asset_watch == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "cannot watch the texture directory, polling it instead\n");
+	}
+#elif defined(__linux__)
+	if ((asset_watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 ||
+		inotify_add_watch(asset_watch, ".", IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) {
+		perror("cannot watch the texture directory, polling it instead");
+		if (asset_watch >= 0) {
+			close(asset_watch);
+			asset_watch = -1;
+		}
+	}
+#endif
+}
+
+//|____________________________________________________________________
+//|
+//| Function: PollAssetWatch
+//|
+//! \param None.
+//! \return true if files may have changed since the last call.
+//!
+//! Never blocks. Which files changed is left to CheckTextureAssets().
+//|____________________________________________________________________
+
+bool PollAssetWatch()
+{
+#if defined(_WIN32)
+	if (asset_watch != INVALID_HANDLE_VALUE) {
+		if (WaitForSingleObject(asset_watch, 0) != WAIT_OBJECT_0) {
+			return false;
+		}
+		FindNextChangeNotification(asset_watch);
+		return true;
+	}
+#elif defined(__linux__)
+	if (asset_watch >= 0) {
+		char events[4096];
+		bool changed = false;
+		ssize_t n;
+
+		while ((n = read(asset_watch, events, sizeof(events))) > 0) {
+			changed = true;
+		}
+		if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			perror("texture directory watch");
+		}
+		return changed;
+	}
+#endif
+	return true;
+}
+
+//|____________________________________________________________________
+//|
+//| Function: CheckTextureAssets
+//|
+//! \param None.
+//! \return None.
+//!
+//! Hot reload: reloads the manifest if it changed, then re-decodes every texture image whose
+//! settings or source images changed. The new images replace the old ones as their decodes
+//! complete. Runs on the GL thread while no decode is pending, since workers read texture_descs.
+//|____________________________________________________________________
+
+void CheckTextureAssets()
+{
+	AssetStamp stamp = { 0, 0 };
+
+	if (!GetFileStamp(TEXTURE_MANIFEST, &stamp.size, &stamp.mtime)) {
+		stamp.size = 0;
+		stamp.mtime = 0;
+	}
+	if (stamp.size != manifest_stamp.size || stamp.mtime != manifest_stamp.mtime) {
+		TextureDesc descs[TEXTURE_NB];
+
+		manifest_stamp = stamp;
+		if (LoadTextureManifest(TEXTURE_MANIFEST, descs)) {
+			printf("Reloaded %s\n", TEXTURE_MANIFEST);
+			for (int id = 0; id < TEXTURE_NB; ++id) {
+				bool redecode = TextureSettingsHash(descs[id]) != TextureSettingsHash(texture_descs[id]);
+
+				texture_descs[id] = descs[id];
+				glBindTexture(TextureTarget((TextureID)id), textures[id]);
+				ApplyTextureSampler((TextureID)id);
+				for (int layer = 0; redecode && layer < TextureLayers((TextureID)id); ++layer) {
+					RequestTextureDecode((TextureID)id, layer);
+				}
+			}
+			glutPostRedisplay();
+		}
+		else {
+			fprintf(stderr, "%s: keeping the current textures\n", TEXTURE_MANIFEST);
+		}
+	}
+
+	for (int id = 0; id < TEXTURE_NB; ++id) {
+		for (int layer = 0; layer < TextureLayers((TextureID)id); ++layer) {
+			const AssetStamp& last = texture_stamps[id][layer];
+
+			if (!GetTextureStamp((TextureID)id, layer, &stamp.size, &stamp.mtime)) {
+				stamp.size = 0;
+				stamp.mtime = 0;
+			}
+			if (stamp.size != last.size || stamp.mtime != last.mtime) {
+				printf("Reloading %s\n", TextureLayerName((TextureID)id, layer).c_str());
+				RequestTextureDecode((TextureID)id, layer);
+			}
+		}
+	}
+}
+
+//|____________________________________________________________________
+//|
+//| Function: UploadDecodedTextures
+//|
+//! \param None.
+//! \return Number of decodes taken off the queue.
+//!
+//! Uploads the textures whose decode has finished, in completion order. Must run on the GL thread.
+//|____________________________________________________________________
+
+int UploadDecodedTextures()
+{
+	std::deque<DecodedTexture> done;
+
+	{
+		std::lock_guard<std::mutex> lock(decoded_mutex);
+		done.swap(decoded_textures);
+	}
+
+	for (size_t i = 0; i < done.size(); ++i) {
+		if (done[i].decode_ms > textures_slowest_ms) {
+			textures_slowest_ms = done[i].decode_ms;
+		}
+		UploadTexture(done[i]);
+		--textures_pending;
+	}
+
+	if (textures_pending == 0 && !textures_loaded) {
+		textures_loaded = true;
+		printf("Loaded %d textures in %.2f ms (slowest decode %.2f ms)\n", TEXTURE_NB,
+			GetTimeMs() - textures_start_ms, textures_slowest_ms);
+	}
+	return (int)done.size();
+}
+
+//|____________________________________________________________________
+//|
+//| Function: TextureTimerFunc
+//|
+//! \param value  [in] Unused.
+//! \return None.
+//!
+//! GLUT timer callback: uploads the finished decodes and checks the watched assets for changes.
+//! Re-arms itself, faster while decodes are pending.
+//|____________________________________________________________________
+
+void TextureTimerFunc(int value)
+{
+	if (UploadDecodedTextures() > 0) {
+		glutPostRedisplay();
+	}
+
+	// Changes are checked once the decodes in flight are done
+	if (PollAssetWatch()) {
+		assets_dirty = true;
+	}
+	if (assets_dirty && textures_pending == 0) {
+		assets_dirty = false;
+		CheckTextureAssets();
+	}
+
+	glutTimerFunc(textures_pending > 0 ? TEXTURE_POLL_MS : ASSET_POLL_MS, TextureTimerFunc, value);
 }
 
 //|____________________________________________________________________
@@ -1363,50 +9556,243 @@ void SetLight(const gmtl::Point4f& pos, const bool is_ambient, const bool is_dif
 //! \param mallocflag  [in] 1 if memory not pre-allocated, 0 if data already points to allocated memory that can hold the image.
 //! \return None.
 //!
-//! A very minimal Portable Pixelformat image file loader. Note that if new memory is allocated, free() should be used 
-//! to deallocate when it is no longer needed.
+//! Copying PPM loader for callers that need their own buffer; built on MapPPM(). Note that if new
+//! memory is allocated, free() should be used to deallocate when it is no longer needed.
 //|____________________________________________________________________
 
 void LoadPPM(const char* fname, unsigned int* w, unsigned int* h, unsigned char** data, const int mallocflag)
+{
+	MappedPPM img;
+
+	if (!MapPPM(fname, &img)) {
+		exit(EXIT_FAILURE);
+	}
+
+	*w = img.width;
+	*h = img.height;
+
+	if (mallocflag)
+		if (!(*data = (unsigned char*)malloc((size_t)img.width * img.height * 3)))
+		{
+			perror("cannot allocate memory for image data\n");
+			exit(EXIT_FAILURE);
+		}
+
+	memcpy(*data, img.pixels, (size_t)img.width * img.height * 3);
+
+	UnmapPPM(&img);
+}
+
+//|____________________________________________________________________
+//|
+//| Function: WritePPM
+//|
+//! \param fname  [in] Name of file.
+//! \param w      [in] Width in pixels.
+//! \param h      [in] Height in pixels.
+//! \param rgb    [in] RGB pixels, bottom row first as glReadPixels() returns them.
+//! \return true on success.
+//!
+//! Writes a binary (P6) PPM image.
+//|____________________________________________________________________
+
+bool WritePPM(const char* fname, int w, int h, const unsigned char* rgb)
 {
 	FILE* fp;
-	char P, num;
-	int max;
-	char s[1000];
+	bool ok;
 
-	if (!(fp = fopen(fname, "rb")))
-	{
-		perror("cannot open image file\n");
-		exit(0);
+	if (!(fp = fopen(fname, "wb"))) {
+		return false;
 	}
 
-	fscanf(fp, "%c%c\n", &P, &num);
-	if ((P != 'P') || (num != '6'))
-	{
-		perror("unknown file format for image\n");
-		exit(0);
+	ok = fprintf(fp, "P6\n%d %d\n255\n", w, h) > 0;
+	for (int y = h - 1; ok && y >= 0; --y) {
+		ok = fwrite(rgb + (size_t)y * w * 3, 3, w, fp) == (size_t)w;
 	}
+	return fclose(fp) == 0 && ok;
+}
 
-	do
-	{
-		fgets(s, 999, fp);
-	} while (s[0] == '#');
+//|____________________________________________________________________
+//|
+//| Function: CreateHeadlessContext
+//|
+//! \param None.
+//! \return true if a GL context is current.
+//!
+//! Creates an OpenGL context with no window and no surface (EGL_KHR_surfaceless_context), on the
+//! Mesa surfaceless platform when available so no display server is needed, e.g. llvmpipe on a
+//! render box. Everything is drawn into a framebuffer object.
+//|____________________________________________________________________
 
+bool CreateHeadlessContext()
+{
+#ifdef HAVE_EGL
+	const EGLint config_attribs[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	EGLDisplay display = EGL_NO_DISPLAY;
+	EGLConfig config;
+	EGLContext context;
+	EGLint major, minor, config_nb;
+
+	if (get_platform_display != NULL) {
+		display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	}
+	if (display == EGL_NO_DISPLAY) {
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
 
-	sscanf(s, "%d%d", w, h);
-	fgets(s, 999, fp);
-	sscanf(s, "%d", &max);
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+		fprintf(stderr, "headless: cannot initialise EGL\n");
+		return false;
+	}
+	if (!eglBindAPI(EGL_OPENGL_API) || !eglChooseConfig(display, config_attribs, &config, 1, &config_nb) || config_nb < 1) {
+		fprintf(stderr, "headless: EGL %d.%d has no OpenGL configuration\n", major, minor);
+		return false;
+	}
+	if ((context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL)) == EGL_NO_CONTEXT ||
+		!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+		fprintf(stderr, "headless: cannot make a surfaceless OpenGL context current (EGL error 0x%x)\n", eglGetError());
+		return false;
+	}
+	return true;
+#else
+	fprintf(stderr, "headless: not supported on this platform (needs EGL)\n");
+	return false;
+#endif
+}
 
-	if (mallocflag)
-		if (!(*data = (unsigned char*)malloc(*w * *h * 3)))
-		{
-			perror("cannot allocate memory for image data\n");
-			exit(0);
-		}
+//|____________________________________________________________________
+//|
+//| Function: RunHeadless
+//|
+//! \param frames       [in] Number of frames to render.
+//! \param width        [in] Framebuffer width.
+//! \param height       [in] Framebuffer height.
+//! \param dump_prefix  [in] Frames are written to <dump_prefix>NNNN.ppm; NULL for none.
+//! \return Exit status.
+//!
+//! Headless mode (--headless): renders the DrawScene() frame into an offscreen framebuffer as fast
+//! as possible, free of vsync and window system overhead, and prints the frame rate. Textures are
+//! fully loaded first. One untimed frame warms the driver up; the frames are timed up to glFinish().
+//|____________________________________________________________________
 
-	fread(*data, 3, *w * *h, fp);
+int RunHeadless(int frames, int width, int height, const char* dump_prefix)
+{
+	GLuint fbo, rbo[2];
+	std::vector<unsigned char> pixels;
+	char fname[1024];
 
-	fclose(fp);
+	headless = true;
+	if (!CreateHeadlessContext()) {
+		return EXIT_FAILURE;
+	}
+
+	InitGL();
+	if (!has_fbo) {
+		fprintf(stderr, "headless: framebuffer objects are not supported\n");
+		return EXIT_FAILURE;
+	}
+
+	// Colour and depth renderbuffers in place of the window
+	pglGenFramebuffers(1, &fbo);
+	pglGenRenderbuffers(2, rbo);
+	pglBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	pglBindRenderbuffer(GL_RENDERBUFFER, rbo[0]);
+	pglRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	pglFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rbo[0]);
+	pglBindRenderbuffer(GL_RENDERBUFFER, rbo[1]);
+	pglRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+	pglFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, rbo[1]);
+	if (pglCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		fprintf(stderr, "headless: cannot create a %dx%d framebuffer\n", width, height);
+		return EXIT_FAILURE;
+	}
+	ReshapeFunc(width, height);
+
+	while (textures_pending > 0) {
+		UploadDecodedTextures();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	if (dump_prefix != NULL) {
+		pixels.resize((size_t)width * height * 3);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	}
+
+	StartSimulation();
+	DrawScene();
+	glFinish();
+
+	long start_ticks = LatestSnapshot().tick;
+	double start_ms = GetTimeMs();
+	for (int i = 0; i < frames; ++i) {
+		DrawScene();
+
+		if (dump_prefix != NULL) {
+			glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+			snprintf(fname, sizeof(fname), "%s%04d.ppm", dump_prefix, i);
+			if (!WritePPM(fname, width, height, pixels.data())) {
+				fprintf(stderr, "headless: cannot write %s\n", fname);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	glFinish();
+	double elapsed_ms = GetTimeMs() - start_ms;
+
+	// The simulation's statistics are only safe to read once its thread is done
+	StopSimulation();
+
+	printf("Rendered %d frames at %dx%d in %.1f ms: %.1f FPS, %.3f ms per frame%s\n", frames, width, height,
+		elapsed_ms, frames * 1000.0 / elapsed_ms, elapsed_ms / frames, dump_prefix != NULL ? " (PPM dumps included)" : "");
+	printf("Scenery per frame: %d objects drawn, %d culled\n", cull_stats.visible, cull_stats.culled);
+	printf("Levels of detail per frame (full/reduced/lowest):");
+	for (int chain = 0; chain < LOD_CHAIN_NB; ++chain) {
+		const int* objects = lod_stats.objects[chain];
+		printf("%s %s %d/%d/%d", chain > 0 ? "," : "", LOD_CHAINS[chain].name, objects[0], objects[1], objects[2]);
+	}
+	printf("; %d vertices\n", lod_stats.vertices);
+	printf("Render queue per frame: %d draws, %d state calls asked for, %d made unsorted, %d made sorted\n",
+		render_stats.draws, render_stats.requested, render_stats.unsorted, render_stats.issued);
+	printf("Lighting: %s, %d materials\n", lit_program != 0 ? "per pixel" : "fixed-function, per vertex", render_stats.materials);
+	if (clustered_lighting) {
+		printf("Point lights per frame: %d of %d in view, %d cluster entries (%d dropped), at most %d a cluster, binned in %.3f ms\n",
+			cluster_stats.lights, (int)point_lights.size(), cluster_stats.indices, cluster_stats.dropped, cluster_stats.most,
+			cluster_stats.bin_ms);
+	} else if (lit_program != 0) {
+		printf("Point lights: none, %s\n", point_light_request == 0 ? "as asked" : "no float textures for their clusters");
+	}
+	if (lit_program != 0) {
+		printf("Shadow maps: static %dx%d rendered %d times, turtle %dx%d %d times, in %d frames (%.3f ms issuing them)\n",
+			SHADOW_MAP_SIZES[SHADOW_STATIC], SHADOW_MAP_SIZES[SHADOW_STATIC], shadow_stats.renders[SHADOW_STATIC],
+			SHADOW_MAP_SIZES[SHADOW_TURTLE], SHADOW_MAP_SIZES[SHADOW_TURTLE], shadow_stats.renders[SHADOW_TURTLE], shadow_stats.frames,
+			shadow_stats.render_ms);
+	}
+	printf("Simulation thread: %ld ticks of %.1f ms, %.2f a frame\n", sim_ticks - start_ticks, SIM_TICK * 1000.0,
+		(double)(sim_ticks - start_ticks) / frames);
+	printf("Scene graph per frame: %d of %d world matrices recomputed\n", scene_updates, (int)SCENE_NODE_NB);
+	printf("Turtle fleet per frame: %d of %d turtles in view, %s, updated in %.3f ms a tick, extracted in %.3f ms\n", fleet_stats.drawn,
+		(int)fleet.handles.size(), fleet_program != 0 ? "instanced" : "queued part by part", fleet_stats.update_ms, fleet_stats.extract_ms);
+
+	// Work of the threads in the last fleet tick
+	int threads = 0, chunks = 0, stolen = 0;
+	double least_ms = 0, most_ms = 0;
+	for (size_t k = 0; k < fleet_stats.threads.size(); ++k) {
+		const JobThreadStats& stats = fleet_stats.threads[k];
+
+		if (stats.iterations > 0) {
+			least_ms = threads == 0 ? stats.busy_ms : std::min(least_ms, stats.busy_ms);
+			most_ms = std::max(most_ms, stats.busy_ms);
+			chunks += stats.iterations;
+			stolen += stats.stolen;
+			threads++;
+		}
+	}
+	printf("Fleet flocking: hash %.3f ms, steering %.3f ms, %.1f neighbours a turtle; %d threads busy %.3f to %.3f ms, %d of %d chunks stolen\n",
+		fleet_stats.hash_ms, fleet_stats.steer_ms, fleet.handles.empty() ? 0.0 : (double)fleet_stats.neighbours / fleet.handles.size(),
+		threads, least_ms, most_ms, stolen, chunks);
+	return EXIT_SUCCESS;
 }
 
 //|____________________________________________________________________
@@ -1425,21 +9811,151 @@ int main(int argc, char** argv)
 	// current time as random seed for generating seaweeds
 	std::srand(std::time(nullptr));
 	InitTransforms();
+	InitPixelConversion();
+	InitPoseKernels();
+
+	// Textures and their settings
+	if (!LoadTextureManifest(TEXTURE_MANIFEST, texture_descs)) {
+		exit(EXIT_FAILURE);
+	}
+	GetFileStamp(TEXTURE_MANIFEST, &manifest_stamp.size, &manifest_stamp.mtime);
+
+	// Seaweed field size: --seaweeds <count>, ahead of the other arguments
+	if (argc > 1 && strcmp(argv[1], "--seaweeds") == 0) {
+		seaweed_request = argc > 2 ? atoi(argv[2]) : 0;
+		if (seaweed_request < 1) {
+			fprintf(stderr, "usage: %s --seaweeds <count> [...]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+		argv[2] = argv[0];
+		argc -= 2;
+		argv += 2;
+	}
+
+	// Point lights: --lights <count>, after --seaweeds
+	if (argc > 1 && strcmp(argv[1], "--lights") == 0) {
+		point_light_request = argc > 2 ? atoi(argv[2]) : -1;
+		if (point_light_request < 0 || point_light_request > MAX_POINT_LIGHTS) {
+			fprintf(stderr, "usage: %s [--seaweeds <count>] --lights <0 to %d> [...]\n", argv[0], MAX_POINT_LIGHTS);
+			return EXIT_FAILURE;
+		}
+		argv[2] = argv[0];
+		argc -= 2;
+		argv += 2;
+	}
+
+	// Turtle fleet size: --turtles <count>, after --lights
+	if (argc > 1 && strcmp(argv[1], "--turtles") == 0) {
+		fleet_request = argc > 2 ? atoi(argv[2]) : -1;
+		if (fleet_request < 0 || fleet_request > 1 << FLEET_SLOT_BITS) {
+			fprintf(stderr, "usage: %s [--seaweeds <count>] [--lights <count>] --turtles <0 to %d> [...]\n", argv[0], 1 << FLEET_SLOT_BITS);
+			return EXIT_FAILURE;
+		}
+		argv[2] = argv[0];
+		argc -= 2;
+		argv += 2;
+	}
+
+	// Offline bake step: write the texture caches and quit
+	if (argc > 1 && strcmp(argv[1], "--bake") == 0) {
+		return BakeTextures() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	// Pixel conversion benchmark
+	if (argc > 1 && strcmp(argv[1], "--bench-convert") == 0) {
+		return BenchConvert() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	// Scenery index benchmark: --bench-bvh [<object count>]
+	if (argc > 1 && strcmp(argv[1], "--bench-bvh") == 0) {
+		int count = argc > 2 ? atoi(argv[2]) : BENCH_BVH_COUNT;
+
+		if (count < 1) {
+			fprintf(stderr, "usage: %s --bench-bvh [<object count>]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+		return BenchBVH(count) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	// Pose kernel benchmark: --bench-quat [<pose count>]
+	if (argc > 1 && strcmp(argv[1], "--bench-quat") == 0) {
+		int count = argc > 2 ? atoi(argv[2]) : BENCH_QUAT_COUNT;
+
+		if (count < 1) {
+			fprintf(stderr, "usage: %s --bench-quat [<pose count>]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+		return BenchQuat(count) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	// Texture decoding is file-bound, so give every texture image its own worker
+	int texture_images = 0;
+	for (int id = 0; id < TEXTURE_NB; ++id) {
+		texture_images += TextureLayers((TextureID)id);
+	}
+	StartWorkers(std::max((int)std::thread::hardware_concurrency(), texture_images));
+	atexit(StopWorkers);
+
+	// Turtle fleet benchmark, on the workers as in a frame: --bench-fleet [<turtle count>]
+	if (argc > 1 && strcmp(argv[1], "--bench-fleet") == 0) {
+		int count = argc > 2 ? atoi(argv[2]) : BENCH_FLEET_COUNT;
+
+		if (count < 10 || count > 1 << FLEET_SLOT_BITS) {
+			fprintf(stderr, "usage: %s --bench-fleet [<turtle count, 10 to %d>]\n", argv[0], 1 << FLEET_SLOT_BITS);
+			return EXIT_FAILURE;
+		}
+		return BenchFleet(count) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	// Flocking benchmark, likewise: --bench-flock [<turtle count>]
+	if (argc > 1 && strcmp(argv[1], "--bench-flock") == 0) {
+		int count = argc > 2 ? atoi(argv[2]) : BENCH_FLOCK_COUNT;
+
+		if (count < 1 || count > 1 << FLEET_SLOT_BITS) {
+			fprintf(stderr, "usage: %s --bench-flock [<turtle count, 1 to %d>]\n", argv[0], 1 << FLEET_SLOT_BITS);
+			return EXIT_FAILURE;
+		}
+		return BenchFlock(count) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	// Headless throughput run: --headless <frames> [<width>x<height>] [<ppm prefix>]
+	if (argc > 1 && strcmp(argv[1], "--headless") == 0) {
+		int frames = argc > 2 ? atoi(argv[2]) : 0;
+		int width = w_width, height = w_height;
+
+		if (frames < 1 || (argc > 3 && (sscanf(argv[3], "%dx%d", &width, &height) != 2 || width < 1 || height < 1))) {
+			fprintf(stderr, "usage: %s --headless <frames> [<width>x<height>] [<ppm prefix>]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+		return RunHeadless(frames, width, height, argc > 4 ? argv[4] : NULL);
+	}
 
 	glutInit(&argc, argv);
 
 	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);     // Uses GLUT_DOUBLE to enable double buffering
 	glutInitWindowSize(w_width, w_height);
 
-	glutCreateWindow("Plane Episode 3");
+	glutCreateWindow(WINDOW_TITLE);
 
 	glutDisplayFunc(DisplayFunc);
 	glutKeyboardFunc(KeyboardFunc);
+	glutKeyboardUpFunc(KeyboardUpFunc);
+	glutIgnoreKeyRepeat(1);                 // Held keys are tracked from their press to their release
 	glutMouseFunc(MouseFunc);
 	glutMotionFunc(MotionFunc);
 	glutReshapeFunc(ReshapeFunc);
 
 	InitGL();
+	StartSimulation();
+
+	// The fleet swims on its own, so frames keep coming while it has turtles
+	if (!fleet.handles.empty()) {
+		glutIdleFunc(IdleFunc);
+	}
+
+	// Uploads decoded textures, then watches the assets for hot reload
+	StartAssetWatch();
+	glutTimerFunc(TEXTURE_POLL_MS, TextureTimerFunc, 0);
 
 	glutMainLoop();
 